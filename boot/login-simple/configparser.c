@@ -429,6 +429,12 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	    "vmm.ignore_tsc_invariant");
 	ss (uintnum, &name, &src, &len, "vmm.unsafe_nested_virtualization",
 	    "vmm.unsafe_nested_virtualization");
+	ss (uintnum, &name, &src, &len, "vmm.storage_crypt_split_min",
+	    "vmm.storage_crypt_split_min");
+	ss (uintnum, &name, &src, &len, "vmm.storage_cache_size",
+	    "vmm.storage_cache_size");
+	ss (uintnum, &name, &src, &len, "vmm.io_str_coalesce",
+	    "vmm.io_str_coalesce");
 	ss (mac_addr, &name, &src, &len, "vmm.tty_mac_address",
 	    "vmm.tty_mac_address");
 	ss (uintnum, &name, &src, &len, "vmm.tty_syslog.enable",
@@ -596,6 +602,9 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	CONF (vmm.no_intr_intercept);
 	CONF (vmm.ignore_tsc_invariant);
 	CONF (vmm.unsafe_nested_virtualization);
+	CONF (vmm.storage_crypt_split_min);
+	CONF (vmm.storage_cache_size);
+	CONF (vmm.io_str_coalesce);
 	CONF (vmm.tty_mac_address);
 	CONF (vmm.tty_syslog.enable);
 	CONF (vmm.tty_syslog.src_ipaddr);
@@ -34,7 +34,9 @@
 	.globl	mpumul_64_64
 	.globl	mpudiv_128_32
 	.globl	ipchecksum
-	.globl	crc32
+	.globl	ipchecksum_lodsq
+	.globl	crc32_bitwise
+	.globl	crc32c_sse42
 
 # 32bit/64bit comon routine
 # input: eax=0 esi=buf edi=len len>0
@@ -65,7 +67,9 @@ crc32_common:
 # void mpumul_64_64 (u64 m1, u64 m2, u64 ans[2]);
 # u32 mpudiv_128_32 (u64 d1[2], u32 d2, u64 quotient[2]);
 # u16 ipchecksum (void *buf, u32 len);
-# u32 crc32 (void *buf, u32 len);
+# u16 ipchecksum_lodsq (void *buf, u32 len);
+# u32 crc32_bitwise (void *buf, u32 len);
+# u32 crc32c_sse42 (void *buf, u32 len);
 
 .if longmode
 	.code64
@@ -91,7 +95,13 @@ mpudiv_128_32:
 	mov	%rdx,%rax	# return rdx
 	ret
 	.align	16
+ipchecksum_lodsq:
+	xor	%r8d,%r8d	# lodsq loop
+	jmp	4f
+	.align	16
 ipchecksum:
+	mov	$1,%r8d		# unrolled loop
+4:
 	mov	%esi,%ecx	# len (32bit) -> rcx
 	mov	%rdi,%rsi	# buf -> rsi
 	mov	$-1,%rdi
@@ -124,6 +134,31 @@ ipchecksum:
 	shl	$32,%rdi
 1:
 	not	%rdi
+	test	%r8d,%r8d
+	je	5f
+	test	$3,%ecx
+	je	3f
+2:
+	lodsq
+	add	%rax,%rdx
+	adc	$0,%rdx
+	sub	$1,%ecx
+	test	$3,%ecx
+	jne	2b
+3:
+	shr	$2,%ecx		# 32 bytes per loop
+	je	1f
+2:
+	add	0(%rsi),%rdx
+	adc	8(%rsi),%rdx
+	adc	16(%rsi),%rdx
+	adc	24(%rsi),%rdx
+	adc	$0,%rdx
+	add	$32,%rsi
+	sub	$1,%ecx
+	jne	2b
+	jmp	1f
+5:
 	test	%ecx,%ecx
 	je	1f
 2:
@@ -150,12 +185,34 @@ ipchecksum:
 	je	1b
 	ret
 	.align	16
-crc32:
+crc32_bitwise:
 	xchg	%rsi,%rdi
 	xor	%eax,%eax
 	test	%edi,%edi
 	jne	crc32_common
 	ret
+	.align	16
+crc32c_sse42:
+	mov	$-1,%eax
+	mov	%esi,%ecx
+	shr	$3,%ecx
+	je	1f
+2:
+	crc32q	(%rdi),%rax
+	add	$8,%rdi
+	sub	$1,%ecx
+	jne	2b
+1:
+	and	$7,%esi
+	je	1f
+2:
+	crc32b	(%rdi),%eax
+	add	$1,%rdi
+	sub	$1,%esi
+	jne	2b
+1:
+	not	%eax
+	ret
 .else
 	.code32
 	# 0=ret 4=m1l 8=m1h 12=m2l 16=m2h 20=ans[]
@@ -211,6 +268,7 @@ mpudiv_128_32:
 	pop	%edi
 	ret
 	.align	16
+ipchecksum_lodsq:		# the same as ipchecksum in 32bit
 ipchecksum:
 	push	%edi
 	push	%esi
@@ -266,7 +324,7 @@ ipchecksum:
 	pop	%edi
 	ret
 	.align	16
-crc32:
+crc32_bitwise:
 	push	%edi
 	push	%esi
 	xor	%eax,%eax
@@ -279,4 +337,30 @@ crc32:
 	pop	%esi
 	pop	%edi
 	ret
+	.align	16
+crc32c_sse42:
+	push	%esi
+	mov	$-1,%eax
+	mov	12(%esp),%ecx	# len -> ecx
+	mov	8(%esp),%esi	# buf -> esi
+	mov	%ecx,%edx
+	shr	$2,%ecx
+	je	1f
+2:
+	crc32l	(%esi),%eax
+	add	$4,%esi
+	sub	$1,%ecx
+	jne	2b
+1:
+	and	$3,%edx
+	je	1f
+2:
+	crc32b	(%esi),%eax
+	add	$1,%esi
+	sub	$1,%edx
+	jne	2b
+1:
+	not	%eax
+	pop	%esi
+	ret
 .endif
@@ -825,6 +825,22 @@ asm_lock_incl (u32 *d)
 	asm volatile ("lock incl %0" : "+m" (*d));
 }
 
+static inline void
+asm_lock_decl (u32 *d)
+{
+	asm volatile ("lock decl %0" : "+m" (*d));
+}
+
+/* index of the least significant set bit; src must not be 0 */
+static inline ulong
+asm_bsf (ulong src)
+{
+	ulong ret;
+
+	asm ("bsf %1,%0" : "=r" (ret) : "rm" (src) : "cc");
+	return ret;
+}
+
 /*
   if (*dest == *cmp) {
       *dest = eq;
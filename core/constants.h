@@ -35,6 +35,7 @@
 #define CPUID_1_EBX_NUMOFLP_1		0x00010000
 #define CPUID_1_ECX_VMX_BIT		0x20
 #define CPUID_1_ECX_PCID_BIT		0x20000
+#define CPUID_1_ECX_SSE4_2_BIT		0x100000
 #define CPUID_1_ECX_X2APIC_BIT		0x200000
 #define CPUID_1_EDX_PSE_BIT		0x8
 #define CPUID_1_EDX_TSC_BIT		0x10
@@ -46,7 +47,9 @@
 #define CPUID_1_EDX_PAT_BIT		0x10000
 #define CPUID_4_EAX_NUMOFTHREADS_MASK	0x03FFC000
 #define CPUID_4_EAX_NUMOFCORES_MASK	0xFC000000
+#define CPUID_7_EBX_ERMS_BIT		0x200
 #define CPUID_7_EBX_INVPCID_BIT		0x400
+#define CPUID_7_EDX_FSRM_BIT		0x10
 #define CPUID_EXT_0			0x80000000
 #define CPUID_EXT_1			0x80000001
 #define CPUID_EXT_1_ECX_SVM_BIT		0x4
@@ -131,6 +134,8 @@
 #define MSR_IA32_VMX_EPT_VPID_CAP	0x48C
 #define MSR_IA32_VMX_EPT_VPID_CAP_PAGEWALK_LENGTH_4_BIT	0x40
 #define MSR_IA32_VMX_EPT_VPID_CAP_EPTSTRUCT_WB_BIT	0x4000
+#define MSR_IA32_VMX_EPT_VPID_CAP_PAGE1GB_BIT	0x20000
+#define MSR_IA32_VMX_EPT_VPID_CAP_AD_BIT	0x200000
 #define MSR_IA32_VMX_EPT_VPID_CAP_INVEPT_BIT	0x100000
 #define MSR_IA32_VMX_EPT_VPID_CAP_INVEPT_ALL_CONTEXT_BIT	0x4000000
 #define MSR_IA32_VMX_EPT_VPID_CAP_INVVPID_BIT	0x100000000ULL
@@ -390,12 +395,17 @@
 #define VMCS_GUEST_ACTIVITY_STATE_SHUTDOWN	0x2
 #define VMCS_GUEST_ACTIVITY_STATE_WAIT_FOR_SIPI	0x3
 #define VMCS_EPT_POINTER_EPT_WB		0x6
+#define VMCS_EPT_POINTER_EPT_AD		0x40
 #define VMCS_EPT_PAGEWALK_LENGTH_4	0x18
 
 #define VMXON_REGION_SIZE		0x1000
 #define VMCS_REGION_SIZE		0x1000
 #define ACCESS_RIGHTS_MASK		0xF0FF
 #define ACCESS_RIGHTS_UNUSABLE_BIT	0x10000
+#define ACCESS_RIGHTS_DATA_W_BIT	0x2
+#define ACCESS_RIGHTS_DATA_E_BIT	0x4
+#define ACCESS_RIGHTS_CODE_BIT		0x8
+#define ACCESS_RIGHTS_S_BIT		0x10
 #define ACCESS_RIGHTS_P_BIT		0x80
 #define ACCESS_RIGHTS_L_BIT		0x2000
 #define ACCESS_RIGHTS_D_B_BIT		0x4000
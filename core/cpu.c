@@ -27,6 +27,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "ap.h"
 #include "cpu.h"
 #include "pcpu.h"
 
@@ -35,3 +36,9 @@ get_cpu_id (void)
 {
 	return currentcpu->cpunum;
 }
+
+int
+get_num_of_processors (void)
+{
+	return num_of_processors + 1;
+}
@@ -29,6 +29,7 @@
 
 #include "asm.h"
 #include "comphappy.h"
+#include "config.h"
 #include "constants.h"
 #include "cpu_emul.h"
 #include "cpu_interpreter.h"
@@ -54,6 +55,8 @@
 #define PREFIX_REX_MIN		0x40
 #define PREFIX_REX_MAX		0x4F
 
+#define IO_STR_BATCH		512 /* bytes of string I/O at once */
+
 #define OPCODE_0x0F			0x0F
 #define OPCODE_0x0F_MOV_TO_CR		0x22
 #define OPCODE_0x0F_MOV_FROM_CR		0x20
@@ -1440,11 +1443,169 @@ rcxz:
 	return VMMERR_SUCCESS;
 }
 
+static enum vmmerr
+io_str_elem (struct op *op, enum sreg seg, ulong off, u8 *data, u32 len,
+	     bool wr)
+{
+	if (wr) {
+		switch (len) {
+		case 1:
+			LGUESTSEG_WRITE_B (op, seg, off, *data);
+			break;
+		case 2:
+			LGUESTSEG_WRITE_W (op, seg, off, *(u16 *)data);
+			break;
+		case 4:
+			LGUESTSEG_WRITE_L (op, seg, off, *(u32 *)data);
+			break;
+		}
+	} else {
+		switch (len) {
+		case 1:
+			LGUESTSEG_READ_B (op, seg, off, data);
+			break;
+		case 2:
+			LGUESTSEG_READ_W (op, seg, off, (u16 *)data);
+			break;
+		case 4:
+			LGUESTSEG_READ_L (op, seg, off, (u32 *)data);
+			break;
+		}
+	}
+	return VMMERR_SUCCESS;
+}
+
+/* Check that an INS destination element is writable without
+   writing it: the segment type and limit, then the page of the first
+   and the last byte.  Nothing is read from the port if this fails. */
+static enum vmmerr
+io_str_elem_write_ok (struct op *op, enum sreg seg, ulong off, u32 len)
+{
+	ulong acr, base, limit, last, upper, rflags;
+
+	current->vmctl.read_sreg_base (seg, &base);
+	last = off + len - 1;
+	if (!op->longmode) {
+		current->vmctl.read_sreg_acr (seg, &acr);
+		current->vmctl.read_sreg_limit (seg, &limit);
+		if (acr & ACCESS_RIGHTS_UNUSABLE_BIT)
+			return VMMERR_INVALID_GUESTSEG;
+		if (!(acr & ACCESS_RIGHTS_P_BIT))
+			return VMMERR_GUESTSEG_NOT_PRESENT;
+		/* writable data segment in protected mode */
+		current->vmctl.read_flags (&rflags);
+		if (op->mode == CPUMODE_PROTECTED &&
+		    !(rflags & RFLAGS_VM_BIT) &&
+		    (!(acr & ACCESS_RIGHTS_S_BIT) ||
+		     (acr & ACCESS_RIGHTS_CODE_BIT) ||
+		     !(acr & ACCESS_RIGHTS_DATA_W_BIT)))
+			return VMMERR_INVALID_GUESTSEG;
+		if (acr & ACCESS_RIGHTS_DATA_E_BIT) {
+			/* expand-down */
+			upper = (acr & ACCESS_RIGHTS_D_B_BIT) ? 0xFFFFFFFF :
+				0xFFFF;
+			if (off <= limit || last > upper || last < off)
+				return VMMERR_INVALID_GUESTSEG;
+		} else {
+			if (last > limit || last < off)
+				return VMMERR_INVALID_GUESTSEG;
+		}
+		RIE (write_linearaddr_ok_b ((u32)(base + off)));
+		RIE (write_linearaddr_ok_b ((u32)(base + last)));
+		return VMMERR_SUCCESS;
+	}
+	RIE (write_linearaddr_ok_b (base + off));
+	RIE (write_linearaddr_ok_b (base + last));
+	return VMMERR_SUCCESS;
+}
+
+/* Handle up to IO_STR_BATCH bytes of REP INS/OUTS with one call of
+   the string I/O handler of the port.  For INS, the destination is
+   checked first so that a page fault is raised before any data is
+   read from the port.  If the port has no handler any more, *done is
+   left false and the caller emulates the instruction as usual. */
+static enum vmmerr
+io_str_coalesce (struct op *op, enum iotype type, u32 len, bool wr,
+		 bool *done)
+{
+	u8 buf[IO_STR_BATCH];
+	iofunc_str_t func_str;
+	ulong rdx, rcx, rflags, reg, off, cnt, mask;
+	enum general_reg regn;
+	enum sreg seg;
+	u32 i, n;
+	long step;
+
+	*done = false;
+	current->vmctl.read_general_reg (GENERAL_REG_RDX, &rdx);
+	func_str = get_iofunc_str (rdx & 0xFFFF);
+	if (!func_str)
+		return VMMERR_SUCCESS;
+	current->vmctl.read_general_reg (GENERAL_REG_RCX, &rcx);
+	if (op->reptype == REPTYPE_16BIT)
+		cnt = rcx & 0xFFFF;
+	else if (op->reptype == REPTYPE_32BIT)
+		cnt = rcx & 0xFFFFFFFF;
+	else
+		cnt = rcx;
+	if (cnt < 2)
+		return VMMERR_SUCCESS;
+	n = IO_STR_BATCH / len;
+	if (n > cnt)
+		n = cnt;
+	if (op->addrtype == ADDRTYPE_16BIT)
+		mask = 0xFFFF;
+	else if (op->addrtype == ADDRTYPE_32BIT)
+		mask = 0xFFFFFFFF;
+	else
+		mask = ~0UL;
+	current->vmctl.read_flags (&rflags);
+	step = (rflags & RFLAGS_DF_BIT) ? -(long)len : (long)len;
+	if (wr) {
+		seg = SREG_ES;
+		regn = GENERAL_REG_RDI;
+	} else {
+		seg = op->prefix.seg == SREG_DEFAULT ? SREG_DS :
+			op->prefix.seg;
+		regn = GENERAL_REG_RSI;
+	}
+	current->vmctl.read_general_reg (regn, &reg);
+	for (i = 0; i < n; i++) {
+		off = (reg + i * step) & mask;
+		if (wr)
+			RIE (io_str_elem_write_ok (op, seg, off, len));
+		else
+			RIE (io_str_elem (op, seg, off, &buf[i * len], len,
+					  false));
+	}
+	n = call_io_str (func_str, type, rdx, buf, n);
+	if (!n)
+		return VMMERR_SUCCESS;
+	for (i = 0; wr && i < n; i++) {
+		off = (reg + i * step) & mask;
+		RIE (io_str_elem (op, seg, off, &buf[i * len], len, true));
+	}
+	reg = (reg & ~mask) | ((reg + n * step) & mask);
+	current->vmctl.write_general_reg (regn, reg);
+	if (op->reptype == REPTYPE_16BIT)
+		(*(u16 *)&rcx) = cnt - n;
+	else if (op->reptype == REPTYPE_32BIT)
+		(*(u32 *)&rcx) = cnt - n;
+	else
+		rcx = cnt - n;
+	current->vmctl.write_general_reg (GENERAL_REG_RCX, rcx);
+	if (cnt == n)
+		UPDATE_IP (op);
+	*done = true;
+	return VMMERR_SUCCESS;
+}
+
 static enum vmmerr
 io_str (struct op *op, enum iotype type, u32 len)
 {
 	struct execinst_io_data d;
-	bool wr;
+	enum vmmerr err;
+	bool wr, done;
 
 	d.type = type;
 	switch (type) {
@@ -1461,6 +1622,12 @@ io_str (struct op *op, enum iotype type, u32 len)
 	default:
 		return VMMERR_AVOID_COMPILER_WARNING;
 	}
+	if (config.vmm.io_str_coalesce &&
+	    (op->prefix.repe || op->prefix.repne)) {
+		err = io_str_coalesce (op, type, len, wr, &done);
+		if (err || done)
+			return err;
+	}
 	return string_instruction (op, !wr, wr, len, &d, execinst_io);
 }
 
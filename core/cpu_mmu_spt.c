@@ -249,11 +249,9 @@ init_pcpu (void)
 static int
 init_vcpu (void)
 {
-	int i;
-
 	alloc_page (&current->spt.cr3tbl, &current->spt.cr3tbl_phys);
-	for (i = 0; i < NUM_OF_SPTTBL; i++)
-		alloc_page (&current->spt.tbl[i], &current->spt.tbl_phys[i]);
+	alloc_pages_batch (current->spt.tbl, current->spt.tbl_phys,
+			   NUM_OF_SPTTBL);
 	current->spt.cnt = 0;
 	memset (current->spt.cr3tbl, 0, PAGESIZE);
 	return 0;
@@ -1205,8 +1203,8 @@ init_vcpu (void)
 	struct sptlist *listspt;
 
 	alloc_page (&current->spt.cr3tbl, &current->spt.cr3tbl_phys);
-	for (i = 0; i < NUM_OF_SPTTBL; i++)
-		alloc_page (&current->spt.tbl[i], &current->spt.tbl_phys[i]);
+	alloc_pages_batch (current->spt.tbl, current->spt.tbl_phys,
+			   NUM_OF_SPTTBL);
 	current->spt.cnt = 0;
 	memset (current->spt.cr3tbl, 0, PAGESIZE);
 	for (i = 0; i < NUM_OF_SPTSHADOW1; i++) {
@@ -2500,8 +2498,7 @@ init_vcpu (void)
 	memset (cspt, 0, sizeof *cspt);
 	current->spt.data = cspt;
 	alloc_page (&cspt->cr3tbl, &cspt->cr3tbl_phys);
-	for (i = 0; i < NUM_OF_SPTTBL; i++)
-		alloc_page (&cspt->tbl[i], &cspt->tbl_phys[i]);
+	alloc_pages_batch (cspt->tbl, cspt->tbl_phys, NUM_OF_SPTTBL);
 	cspt->cnt = 0;
 	memset (cspt->cr3tbl, 0, PAGESIZE);
 	for (i = 0; i < NUM_OF_SPTSHADOW1; i++) {
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2026 BitVisor contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* CRC32 (IEEE 802.3) and CRC32C (Castagnoli).  CRC32 uses a
+ * slice-by-8 table once the tables are ready and the bitwise routine
+ * in arith.s before that.  CRC32C uses the SSE4.2 crc32 instruction if
+ * available and a slice-by-8 table otherwise, which is also used
+ * before the initialization.  Both work on general purpose registers only, so no
+ * guest XMM state needs to be saved. */
+
+#include "arith.h"
+#include "asm.h"
+#include "constants.h"
+#include "initfunc.h"
+#include "panic.h"
+#include "pcpu.h"
+#include "printf.h"
+#include "time.h"
+
+#define CRC32_POLY	0xEDB88320
+#define CRC32C_POLY	0x82F63B78
+
+typedef asmlinkage u32 crc_func_t (void *buf, u32 len);
+
+static u32 crc32_table[8][256];
+static u32 crc32c_table[8][256];
+static crc_func_t *crc32_func = crc32_bitwise;
+static bool crc32c_table_ready;
+static crc_func_t crc32c_slice8;
+static crc_func_t *crc32c_func = crc32c_slice8;
+
+static void
+crc_slice8_init (u32 table[8][256], u32 poly)
+{
+	u32 crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? poly : 0);
+		table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			table[j][i] = (table[j - 1][i] >> 8) ^
+				table[0][table[j - 1][i] & 0xFF];
+}
+
+static u32
+crc_slice8 (u32 table[8][256], void *buf, u32 len)
+{
+	u8 *p = buf;
+	u32 crc = ~0U, lo, hi;
+
+	while (len > 0 && ((ulong)p & 7)) {
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+		len--;
+	}
+	while (len >= 8) {
+		lo = *(u32 *)(void *)p ^ crc;
+		hi = *(u32 *)(void *)(p + 4);
+		crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+			table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+			table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+			table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+	return ~crc;
+}
+
+static asmlinkage u32
+crc32_slice8 (void *buf, u32 len)
+{
+	return crc_slice8 (crc32_table, buf, len);
+}
+
+/* Called before crc_init_global() only on the bootstrap processor,
+ * so the table is built here if it is not ready yet */
+static asmlinkage u32
+crc32c_slice8 (void *buf, u32 len)
+{
+	if (!crc32c_table_ready) {
+		crc_slice8_init (crc32c_table, CRC32C_POLY);
+		crc32c_table_ready = true;
+	}
+	return crc_slice8 (crc32c_table, buf, len);
+}
+
+asmlinkage u32
+crc32 (void *buf, u32 len)
+{
+	return crc32_func (buf, len);
+}
+
+asmlinkage u32
+crc32c (void *buf, u32 len)
+{
+	return crc32c_func (buf, len);
+}
+
+#ifdef ENABLE_ASSERT
+static u32
+crc32c_bitwise (void *buf, u32 len)
+{
+	u8 *p = buf;
+	u32 crc = ~0U;
+	int i;
+
+	while (len-- > 0) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+	}
+	return ~crc;
+}
+
+/* Compare with the bitwise routines at every alignment and length
+ * up to 64 bytes and at a few longer lengths */
+static void
+crc_selftest (void)
+{
+	static u8 buf[1024 + 8];
+	static const u32 lens[] = { 0, 1, 7, 8, 9, 63, 64, 65, 255, 1024 };
+	u32 i, j, len;
+
+	if (crc32 ("123456789", 9) != 0xCBF43926)
+		panic ("crc32 self test failed");
+	if (crc32c ("123456789", 9) != 0xE3069283)
+		panic ("crc32c self test failed");
+	for (i = 0; i < sizeof buf; i++)
+		buf[i] = i * 0x9D + (i >> 3);
+	for (i = 0; i < 8; i++) {
+		for (len = 0; len <= 64; len++) {
+			if (crc32 (buf + i, len) != crc32_bitwise (buf + i, len))
+				panic ("crc32 self test failed: %u %u", i, len);
+			if (crc32c (buf + i, len) !=
+			    crc32c_bitwise (buf + i, len))
+				panic ("crc32c self test failed: %u %u", i,
+				       len);
+		}
+		for (j = 0; j < sizeof lens / sizeof lens[0]; j++) {
+			len = lens[j];
+			if (crc32 (buf + i, len) != crc32_bitwise (buf + i, len))
+				panic ("crc32 self test failed: %u %u", i, len);
+			if (crc32c (buf + i, len) !=
+			    crc32c_bitwise (buf + i, len))
+				panic ("crc32c self test failed: %u %u", i,
+				       len);
+			if (ipchecksum (buf + i, len) !=
+			    ipchecksum_lodsq (buf + i, len))
+				panic ("ipchecksum self test failed: %u %u",
+				       i, len);
+		}
+	}
+}
+#endif
+
+static void
+crc_init_global (void)
+{
+	u32 a, b, c, d;
+
+	crc_slice8_init (crc32_table, CRC32_POLY);
+	if (!crc32c_table_ready) {
+		crc_slice8_init (crc32c_table, CRC32C_POLY);
+		crc32c_table_ready = true;
+	}
+	crc32_func = crc32_slice8;
+	asm_cpuid (CPUID_1, 0, &a, &b, &c, &d);
+	if (c & CPUID_1_ECX_SSE4_2_BIT)
+		crc32c_func = crc32c_sse42;
+#ifdef ENABLE_ASSERT
+	crc_selftest ();
+#endif
+}
+
+#ifdef BENCHMARK
+#define CRC_BENCH_SIZE	4096
+#define CRC_BENCH_LOOPS	4096
+
+static asmlinkage u32
+crc_bench_ipchecksum (void *buf, u32 len)
+{
+	return ipchecksum (buf, len);
+}
+
+static asmlinkage u32
+crc_bench_ipchecksum_lodsq (void *buf, u32 len)
+{
+	return ipchecksum_lodsq (buf, len);
+}
+
+static void
+crc_bench_one (char *name, crc_func_t *func, u8 *buf)
+{
+	u64 start, time;
+	u32 r = 0;
+	int i;
+
+	start = get_time ();
+	for (i = 0; i < CRC_BENCH_LOOPS; i++)
+		r += func (buf, CRC_BENCH_SIZE);
+	time = get_time () - start;
+	printf ("%s: %llu MB/s (%08X)\n", name,
+		muldiv64 ((u64)CRC_BENCH_SIZE * CRC_BENCH_LOOPS, 1000000,
+			  time) >> 20, r);
+}
+
+static void
+crc_bench_pcpu (void)
+{
+	static u8 buf[CRC_BENCH_SIZE];
+	int i;
+
+	if (currentcpu->cpunum != 0)
+		return;
+	for (i = 0; i < CRC_BENCH_SIZE; i++)
+		buf[i] = i * 0x9D + (i >> 3);
+	crc_bench_one ("crc32 bitwise", crc32_bitwise, buf);
+	crc_bench_one ("crc32 slice-by-8", crc32_slice8, buf);
+	crc_bench_one ("crc32c slice-by-8", crc32c_slice8, buf);
+	if (crc32c_func == crc32c_sse42)
+		crc_bench_one ("crc32c sse4.2", crc32c_sse42, buf);
+	crc_bench_one ("ipchecksum", crc_bench_ipchecksum, buf);
+	crc_bench_one ("ipchecksum lodsq", crc_bench_ipchecksum_lodsq, buf);
+}
+
+INITFUNC ("pcpu40", crc_bench_pcpu);
+#endif
+
+INITFUNC ("global0", crc_init_global);
@@ -198,11 +198,13 @@ memdump_msghandler (int m, int c, struct msgbuf *buf, int bufcnt)
 static int
 memfree_msghandler (int m, int c)
 {
-	int n;
+	int n, cached;
 
 	if (m == 0) {
 		n = num_of_available_pages ();
-		printf ("%d pages (%d KiB) free\n", n, n * 4);
+		cached = num_of_cached_pages ();
+		printf ("%d pages (%d KiB) free, %d pages (%d KiB) cached\n",
+			n, n * 4, cached, cached * 4);
 	}
 	return 0;
 }
@@ -205,7 +205,7 @@ gmm_pass_init (void)
 	void *tmp;
 
 	alloc_page (&tmp, &phys_blank);
-	memset (tmp, 0, PAGESIZE);
+	memzero_page (tmp);
 	memcpy ((void *)&current->gmm, (void *)&func, sizeof func);
 	current->pte_addr_mask = get_pte_addr_mask ();
 }
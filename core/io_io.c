@@ -35,8 +35,31 @@
 #include "initfunc.h"
 #include "io_io.h"
 #include "io_iopass.h"
+#include "mm.h"
 #include "panic.h"
+#include "pcpu.h"
 #include "printf.h"
+#include "process.h"
+#include "spinlock.h"
+#include "string.h"
+#include "vmmcall_status.h"
+
+#define NUM_OF_IOFUNC_STR	4
+#define IO_IO_STATUS_TOP	8
+
+/* string I/O handlers, associated with I/O handlers rather than
+   ports since a handler usually covers many ports */
+static struct {
+	iofunc_t func;
+	iofunc_str_t func_str;
+} iofunc_str[NUM_OF_IOFUNC_STR];
+static int iofunc_str_num;
+static spinlock_t iofunc_str_lock;
+
+struct io_io_count_data {
+	u32 port;
+	u32 count;
+};
 
 enum ioact
 do_io_nothing (enum iotype type, u32 port, void *data)
@@ -78,6 +101,39 @@ set_iofunc (u32 port, iofunc_t func)
 	return old;
 }
 
+/* Register a handler called once for the elements of a string I/O
+   instruction handled by func in one exit */
+void
+set_iofunc_str (iofunc_t func, iofunc_str_t func_str)
+{
+	int i;
+
+	spinlock_lock (&iofunc_str_lock);
+	for (i = 0; i < iofunc_str_num; i++)
+		if (iofunc_str[i].func == func)
+			break;
+	if (i == NUM_OF_IOFUNC_STR)
+		panic ("set_iofunc_str: too many handlers");
+	iofunc_str[i].func = func;
+	iofunc_str[i].func_str = func_str;
+	if (i == iofunc_str_num)
+		iofunc_str_num++;
+	spinlock_unlock (&iofunc_str_lock);
+}
+
+iofunc_str_t
+get_iofunc_str (u32 port)
+{
+	iofunc_t func;
+	int i;
+
+	func = current->vcpu0->io.iofunc[port & 0xFFFF];
+	for (i = 0; i < iofunc_str_num; i++)
+		if (iofunc_str[i].func == func)
+			return iofunc_str[i].func_str;
+	return NULL;
+}
+
 static void
 io_io_init (void)
 {
@@ -92,7 +148,121 @@ enum ioact
 call_io (enum iotype type, u32 port, void *data)
 {
 	port &= 0xFFFF;
+	currentcpu->io_count[port]++;
 	return current->vcpu0->io.iofunc[port] (type, port, data);
 }
 
+u32
+call_io_str (iofunc_str_t func_str, enum iotype type, u32 port, void *data,
+	     u32 count)
+{
+	port &= 0xFFFF;
+	currentcpu->io_count[port]++;
+	return func_str (type, port, data, count);
+}
+
+static bool
+io_io_count_sum (struct pcpu *p, void *q)
+{
+	struct io_io_count_data *d = q;
+
+	if (p->io_count)
+		d->count += p->io_count[d->port];
+	return false;
+}
+
+static bool
+io_io_count_clear (struct pcpu *p, void *q)
+{
+	if (p->io_count)
+		memset (p->io_count, 0, NUM_OF_IOPORT * sizeof *p->io_count);
+	return false;
+}
+
+static char *
+io_io_status (void)
+{
+	static char buf[512];
+	struct io_io_count_data d;
+	u32 top[IO_IO_STATUS_TOP], count[IO_IO_STATUS_TOP], i;
+	int j, k, n = 0, len;
+
+	/* ports with the most exits on all the processors, in
+	   descending order */
+	for (i = 0; i < NUM_OF_IOPORT; i++) {
+		d.port = i;
+		d.count = 0;
+		pcpu_list_foreach (io_io_count_sum, &d);
+		if (!d.count)
+			continue;
+		for (j = n; j > 0 && count[j - 1] < d.count; j--);
+		if (j == IO_IO_STATUS_TOP)
+			continue;
+		if (n < IO_IO_STATUS_TOP)
+			n++;
+		for (k = n - 1; k > j; k--) {
+			top[k] = top[k - 1];
+			count[k] = count[k - 1];
+		}
+		top[j] = i;
+		count[j] = d.count;
+	}
+	len = snprintf (buf, sizeof buf, "I/O port exits:\n");
+	for (j = 0; j < n && len < sizeof buf; j++)
+		len += snprintf (buf + len, sizeof buf - len, " %04X: %u\n",
+				 top[j], count[j]);
+	return buf;
+}
+
+/* print the exit counts to the log and clear them if c is not 0, so
+   that they can be measured without the STATUS option */
+static int
+io_io_msghandler (int m, int c)
+{
+	if (m == MSG_INT) {
+		printf ("%s", io_io_status ());
+		if (c)
+			pcpu_list_foreach (io_io_count_clear, NULL);
+		return 0;
+	}
+	return -1;
+}
+
+static void
+io_io_init_global (void)
+{
+	spinlock_init (&iofunc_str_lock);
+	iofunc_str_num = 0;
+}
+
+/* counters per processor so that exits on different processors do
+   not share cache lines */
+static void
+io_io_init_pcpu (void)
+{
+	u32 *count;
+
+	count = alloc (NUM_OF_IOPORT * sizeof *count);
+	memset (count, 0, NUM_OF_IOPORT * sizeof *count);
+	currentcpu->io_count = count;
+}
+
+static void
+io_io_init_msg (void)
+{
+	msgregister ("ioexits", io_io_msghandler);
+}
+
+#ifdef VMMCALL_STATUS_ENABLE
+static void
+io_io_init_status (void)
+{
+	register_status_callback (io_io_status);
+}
+
+INITFUNC ("paral01", io_io_init_status);
+#endif
+INITFUNC ("global3", io_io_init_global);
+INITFUNC ("msg0", io_io_init_msg);
+INITFUNC ("pcpu1", io_io_init_pcpu);
 INITFUNC ("vcpu0", io_io_init);
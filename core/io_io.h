@@ -43,5 +43,8 @@ struct io_io_data {
 };
 
 enum ioact call_io (enum iotype type, u32 port, void *data);
+iofunc_str_t get_iofunc_str (u32 port);
+u32 call_io_str (iofunc_str_t func_str, enum iotype type, u32 port,
+		 void *data, u32 count);
 
 #endif
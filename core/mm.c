@@ -27,6 +27,8 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "ap.h"
+#include "arith.h"
 #include "asm.h"
 #include "assert.h"
 #include "callrealmode.h"
@@ -46,19 +48,22 @@
 #include "printf.h"
 #include "spinlock.h"
 #include "string.h"
+#include "time.h"
 #include "uefi.h"
+#include "vmmcall_status.h"
 
 #define VMMSIZE_ALL		(128 * 1024 * 1024)
 #define NUM_OF_PAGES		(VMMSIZE_ALL >> PAGESIZE_SHIFT)
 #define NUM_OF_ALLOCSIZE	13
 #define MAPMEM_ADDR_START	0xF0000000
 #define MAPMEM_ADDR_END		0xFF000000
-#define NUM_OF_ALLOCLIST	7
 #define ALLOCLIST_SIZE(n)	((1 << (n)) * 16)
 #define ALLOCLIST_DATABIT(n)	(PAGESIZE / ALLOCLIST_SIZE (n))
-#define ALLOCLIST_DATASIZE(n)	((ALLOCLIST_DATABIT (n) + 7) / 8)
+#define ALLOCLIST_WORDBIT	(sizeof (ulong) * 8)
+#define ALLOCLIST_DATASIZE(n)	((ALLOCLIST_DATABIT (n) + \
+				  ALLOCLIST_WORDBIT - 1) / ALLOCLIST_WORDBIT)
 #define ALLOCLIST_HEADERSIZE(n)	(sizeof (struct allocdata) + \
-				 ALLOCLIST_DATASIZE(n) - 1)
+				 (ALLOCLIST_DATASIZE(n) - 1) * sizeof (ulong))
 #define MAXNUM_OF_SYSMEMMAP	256
 #define NUM_OF_PANICMEM_PAGES	256
 
@@ -66,6 +71,7 @@
 #	define PDPE_ATTR		(PDE_P_BIT | PDE_RW_BIT | PDE_US_BIT)
 #	define MIN_HPHYS_LEN		(8UL * 1024 * 1024 * 1024)
 #	define PAGE1GB_HPHYS_LEN	(512UL * 1024 * 1024 * 1024)
+#	define MAX_HPHYS_LEN		(64UL * 1024 * 1024 * 1024)
 #	define HPHYS_ADDR		(1ULL << (12 + 9 + 9 + 9))
 #else
 #	define PDPE_ATTR		PDE_P_BIT
@@ -90,7 +96,8 @@ struct page {
 
 struct allocdata {
 	LIST1_DEFINE (struct allocdata);
-	u8 n, data[1];
+	u8 n;
+	ulong data[1];
 };
 
 struct sysmemmapdata {
@@ -98,21 +105,49 @@ struct sysmemmapdata {
 	struct sysmemmap m;
 };
 
+/* AVL tree node.  Nodes are ordered by (key1, key2). */
+struct mempool_node {
+	struct mempool_node *left, *right;
+	int height;
+	ulong key1, key2;
+};
+
+/* An extent is either allocated or free.  Allocated extents are in
+ * the alloc tree keyed by address, free extents are in the free
+ * tree keyed by (length, address).  Extents of a block are linked
+ * in address order for coalescing. */
 struct mempool_list {
-	LIST1_DEFINE (struct mempool_list);
+	LIST4_DEFINE (struct mempool_list, ext);
+	struct mempool_node node;
+	struct mempool_block_list *block;
 	int off, len;
+	bool free;
 };
 
 struct mempool_block_list {
 	LIST1_DEFINE (struct mempool_block_list);
-	LIST1_DEFINE_HEAD (struct mempool_list, alloc);
-	LIST1_DEFINE_HEAD (struct mempool_list, free);
+	LIST4_DEFINE_HEAD (ext, struct mempool_list, ext);
 	u8 *p;
 	int len;
 };
 
+/* Descriptors are carved from pages owned by the pool instead of
+ * being allocated one by one.  They are never placed in the pool
+ * memory itself because the memory may be shared with processes. */
+struct mempool_descpage {
+	struct mempool_descpage *next;
+	struct mempool_list desc[];
+};
+
+#define MEMPOOL_DESC_PER_PAGE \
+	((PAGESIZE - sizeof (struct mempool_descpage)) / \
+	 sizeof (struct mempool_list))
+
 struct mempool {
 	LIST1_DEFINE_HEAD (struct mempool_block_list, block);
+	struct mempool_node *alloc_tree, *free_tree;
+	struct mempool_descpage *descpage;
+	struct mempool_list *descfree;
 	int numpages;
 	int numkeeps;
 	bool clear;
@@ -535,50 +570,46 @@ u32 vmm_term_inf()
         return vmm_start_phys+VMMSIZE_ALL ;
 }
 
+/* mm_lock must be locked */
+/* the block is split until its size becomes allocsize[n] */
 static struct page *
-mm_page_alloc (int n)
+mm_page_alloc_sub (int n, bool *bad)
 {
-	int s;
-	virt_t virt;
+	int i;
 	struct page *p, *q;
-	enum page_type old_type;
 
-	ASSERT (n < NUM_OF_ALLOCSIZE);
-	s = allocsize[n];
-	spinlock_lock (&mm_lock);
-	while ((p = LIST1_POP (list1_freepage[n])) == NULL) {
-		spinlock_unlock (&mm_lock);
-		p = mm_page_alloc (n + 1);
-		spinlock_lock (&mm_lock);
-		virt = page_to_virt (p);
-		q = virt_to_page (virt ^ s);
-		p->allocsize = n;
-		p->type = PAGE_TYPE_FREE;
+	for (i = n; i < NUM_OF_ALLOCSIZE; i++) {
+		p = LIST1_POP (list1_freepage[i]);
+		if (p)
+			goto found;
+	}
+	return NULL;
+found:
+	while (i > n) {
+		i--;
+		q = virt_to_page (page_to_virt (p) ^ allocsize[i]);
+		p->allocsize = i;
+		q->allocsize = i;
 		q->type = PAGE_TYPE_FREE;
-		LIST1_ADD (list1_freepage[n], p);
-		LIST1_ADD (list1_freepage[n], q);
+		LIST1_ADD (list1_freepage[i], q);
 	}
 	/* p->type must be set before unlock, because the
 	 * mm_page_free() function may merge blocks if the type is
 	 * PAGE_TYPE_FREE. */
-	old_type = p->type;
+	if (p->type != PAGE_TYPE_FREE)
+		*bad = true;
 	p->type = PAGE_TYPE_ALLOCATED;
-	spinlock_unlock (&mm_lock);
-	/* The old_type must be PAGE_TYPE_FREE, or the memory will be
-	 * corrupted.  The ASSERT is called after unlock to avoid
-	 * deadlocks during panic. */
-	ASSERT (old_type == PAGE_TYPE_FREE);
 	return p;
 }
 
+/* mm_lock must be locked */
 static void
-mm_page_free (struct page *p)
+mm_page_free_sub (struct page *p)
 {
 	int s, n;
 	struct page *q, *tmp;
 	virt_t virt;
 
-	spinlock_lock (&mm_lock);
 	n = p->allocsize;
 	p->type = PAGE_TYPE_FREE;
 	LIST1_ADD (list1_freepage[n], p);
@@ -600,9 +631,97 @@ mm_page_free (struct page *p)
 		s = allocsize[n];
 		virt = page_to_virt (p);
 	}
+}
+
+/* small blocks are taken from the per-CPU page cache, which is
+ * refilled from the free lists in batches.  Returns NULL if out of
+ * memory. */
+static struct page *
+mm_page_alloc_try (int n)
+{
+	struct mm_pagecache *c;
+	struct page *p;
+	bool bad = false;
+
+	ASSERT (n < NUM_OF_ALLOCSIZE);
+	if (n < MM_PAGECACHE_ORDERS && currentcpu_available ()) {
+		c = &currentcpu->mm.pagecache[n];
+		if (c->count) {
+			STATUS_UPDATE (currentcpu->mm.stat.page_alloc_hit++);
+			return c->page[--c->count];
+		}
+		STATUS_UPDATE (currentcpu->mm.stat.page_alloc_miss++);
+		spinlock_lock (&mm_lock);
+		while (c->count < MM_PAGECACHE_BATCH) {
+			p = mm_page_alloc_sub (n, &bad);
+			if (!p)
+				break;
+			c->page[c->count++] = p;
+		}
+		spinlock_unlock (&mm_lock);
+		p = c->count ? c->page[--c->count] : NULL;
+	} else {
+		spinlock_lock (&mm_lock);
+		p = mm_page_alloc_sub (n, &bad);
+		spinlock_unlock (&mm_lock);
+	}
+	/* The old type must be PAGE_TYPE_FREE, or the memory will be
+	 * corrupted.  The ASSERT and panic are called after unlock to
+	 * avoid deadlocks during panic. */
+	ASSERT (!bad);
+	return p;
+}
+
+static struct page *
+mm_page_alloc (int n)
+{
+	struct page *p;
+
+	p = mm_page_alloc_try (n);
+	if (!p)
+		panic ("mm_page_alloc (%d): out of memory", n);
+	return p;
+}
+
+static void
+mm_page_free (struct page *p)
+{
+	struct mm_pagecache *c;
+	int n;
+
+	n = p->allocsize;
+	if (n < MM_PAGECACHE_ORDERS && currentcpu_available ()) {
+		c = &currentcpu->mm.pagecache[n];
+		if (c->count < MM_PAGECACHE_SIZE) {
+			STATUS_UPDATE (currentcpu->mm.stat.page_free_hit++);
+			c->page[c->count++] = p;
+			return;
+		}
+		STATUS_UPDATE (currentcpu->mm.stat.page_free_miss++);
+		spinlock_lock (&mm_lock);
+		while (c->count > MM_PAGECACHE_SIZE - MM_PAGECACHE_BATCH)
+			mm_page_free_sub (c->page[--c->count]);
+		mm_page_free_sub (p);
+		spinlock_unlock (&mm_lock);
+		return;
+	}
+	spinlock_lock (&mm_lock);
+	mm_page_free_sub (p);
 	spinlock_unlock (&mm_lock);
 }
 
+static bool
+mm_pagecache_count (struct pcpu *p, void *q)
+{
+	int *r = q;
+	int i;
+
+	for (i = 0; i < MM_PAGECACHE_ORDERS; i++)
+		*r += p->mm.pagecache[i].count *
+			(allocsize[i] >> PAGESIZE_SHIFT);
+	return false;
+}
+
 /* returns number of available pages */
 int
 num_of_available_pages (void)
@@ -622,6 +741,17 @@ num_of_available_pages (void)
 	return r;
 }
 
+/* returns number of free pages in the per-CPU page caches, which
+ * are not available to other processors */
+int
+num_of_cached_pages (void)
+{
+	int r = 0;
+
+	pcpu_list_foreach (mm_pagecache_count, &r);
+	return r;
+}
+
 static void
 create_vmm_pd (void)
 {
@@ -722,6 +852,30 @@ map_hphys_sub (pmap_t *m, u64 hphys_addr, u64 attr, u64 attrmask, ulong size,
 		panic ("map_hphys: hphys_len %llu is bad", hphys_len);
 }
 
+#ifdef __x86_64__
+/* Returns the length of the direct map covering all RAM reported by
+ * the BIOS.  Large memory without 1GiB pages costs a page directory
+ * per 1GiB for each cache type, so it is limited to MAX_HPHYS_LEN. */
+static u64
+map_hphys_len (void)
+{
+	u64 len = MIN_HPHYS_LEN, end;
+	int i;
+
+	for (i = 0; i < sysmemmaplen; i++) {
+		if (sysmemmap[i].m.type != SYSMEMMAP_TYPE_AVAILABLE)
+			continue;
+		end = sysmemmap[i].m.base + sysmemmap[i].m.len;
+		end = (end + PAGESIZE1G - 1) & ~(u64)(PAGESIZE1G - 1);
+		if (len < end)
+			len = end;
+	}
+	if (len > MAX_HPHYS_LEN)
+		len = MAX_HPHYS_LEN;
+	return len;
+}
+#endif
+
 static void
 map_hphys (void)
 {
@@ -748,6 +902,10 @@ map_hphys (void)
 		hphys_len = PAGE1GB_HPHYS_LEN;
 		size = PAGESIZE1G;
 		level = 3;
+#endif
+	} else {
+#ifdef __x86_64__
+		hphys_len = map_hphys_len ();
 #endif
 	}
 	for (i = 0; i < 8; i++) {
@@ -839,14 +997,16 @@ mm_init_global (void)
 	}
 	panicmem_start_page = ((u64)(virt_t)end + PAGESIZE - 1 -
 			       VMM_START_VIRT) >> PAGESIZE_SHIFT;
+	spinlock_lock (&mm_lock);
 	for (i = 0; i < NUM_OF_PAGES; i++) {
 		if ((u64)(virt_t)head <= pagestruct[i].virt &&
 		    pagestruct[i].virt < (u64)(virt_t)end)
 			continue;
 		if (i < panicmem_start_page + NUM_OF_PANICMEM_PAGES)
 			continue;
-		mm_page_free (&pagestruct[i]);
+		mm_page_free_sub (&pagestruct[i]);
 	}
+	spinlock_unlock (&mm_lock);
 	mapmem_lastvirt = MAPMEM_ADDR_START;
 	map_hphys ();
 	unmap_user_area ();	/* for detecting null pointer */
@@ -877,8 +1037,10 @@ mm_free_panicmem (void)
 	if (!s)
 		return;
 	panicmem_start_page = 0;
+	spinlock_lock (&mm_lock);
 	for (i = 0; i < NUM_OF_PANICMEM_PAGES; i++)
-		mm_page_free (&pagestruct[s + i]);
+		mm_page_free_sub (&pagestruct[s + i]);
+	spinlock_unlock (&mm_lock);
 }
 
 /* allocate n or more pages */
@@ -910,6 +1072,32 @@ alloc_page (void **virt, u64 *phys)
 	return alloc_pages (virt, phys, 1);
 }
 
+/* allocate n pages, one page for each element of virt[] and phys[],
+ * with one lock acquisition */
+int
+alloc_pages_batch (void **virt, u64 *phys, int n)
+{
+	struct page *p;
+	bool bad = false;
+	int i;
+
+	spinlock_lock (&mm_lock);
+	for (i = 0; i < n; i++) {
+		p = mm_page_alloc_sub (0, &bad);
+		if (!p)
+			break;
+		if (virt)
+			virt[i] = (void *)page_to_virt (p);
+		if (phys)
+			phys[i] = page_to_phys (p);
+	}
+	spinlock_unlock (&mm_lock);
+	ASSERT (!bad);
+	if (i < n)
+		panic ("alloc_pages_batch (%d) failed.", n);
+	return 0;
+}
+
 static struct allocdata *
 alloclist_new (int n)
 {
@@ -923,7 +1111,11 @@ alloclist_new (int n)
 	memset (r, 0, headlen);
 	r->n = n;
 	for (i = 0; i * ALLOCLIST_SIZE (n) < headlen; i++)
-		r->data[i / 8] |= 1 << (i % 8);
+		r->data[i / ALLOCLIST_WORDBIT] |= 1UL << (i % ALLOCLIST_WORDBIT);
+	/* mark bits after the last block as used */
+	for (i = ALLOCLIST_DATABIT (n);
+	     i < ALLOCLIST_DATASIZE (n) * ALLOCLIST_WORDBIT; i++)
+		r->data[i / ALLOCLIST_WORDBIT] |= 1UL << (i % ALLOCLIST_WORDBIT);
 	return r;
 }
 
@@ -934,19 +1126,15 @@ alloclist_alloc (struct allocdata *p, int n, void **r)
 
 	datalen = ALLOCLIST_DATASIZE (n);
 	for (i = 0; i < datalen; i++) {
-		if (p->data[i] != 0xFF)
+		if (~p->data[i])
 			goto found;
 	}
 	return false;
 found:
-	for (j = 0; j < 8; j++) {
-		if ((p->data[i] & (1 << j)) == 0)
-			break;
-	}
-	if (i * 8 + j >= ALLOCLIST_DATABIT (n))
-		return false;
-	p->data[i] |= (1 << j);
-	offset = (i * 8 + j) * ALLOCLIST_SIZE (n);
+	j = asm_bsf (~p->data[i]);
+	ASSERT (i * ALLOCLIST_WORDBIT + j < ALLOCLIST_DATABIT (n));
+	p->data[i] |= 1UL << j;
+	offset = (i * ALLOCLIST_WORDBIT + j) * ALLOCLIST_SIZE (n);
 	ASSERT (offset != 0);
 	ASSERT (offset < PAGESIZE);
 	*r = (u8 *)p + offset;
@@ -959,20 +1147,66 @@ alloclist_free (struct allocdata *p, int n, uint offset)
 	uint bit, i, j;
 
 	bit = offset / ALLOCLIST_SIZE (n);
-	i = bit / 8;
-	j = bit % 8;
-	ASSERT (p->data[i] & (1 << j));	/* double free check */
-	p->data[i] &= ~(1 << j);
+	i = bit / ALLOCLIST_WORDBIT;
+	j = bit % ALLOCLIST_WORDBIT;
+	ASSERT (p->data[i] & (1UL << j)); /* double free check */
+	p->data[i] &= ~(1UL << j);
+}
+
+static void
+mm_lock2_lock (void)
+{
+	if (spinlock_trylock (&mm_lock2)) {
+		if (currentcpu_available ())
+			STATUS_UPDATE (currentcpu->mm.stat.lock_contended++);
+		spinlock_lock (&mm_lock2);
+	}
+}
+
+/* mm_lock2 must be locked */
+static void *
+alloc_sub (int i)
+{
+	void *r;
+	struct allocdata *p;
+
+	for (;;) {
+		p = LIST1_POP (alloclist[i]);
+		if (p == NULL)
+			p = alloclist_new (i);
+		if (alloclist_alloc (p, i, &r))
+			break;
+		p->n |= 0x80;
+	}
+	LIST1_PUSH (alloclist[i], p);
+	return r;
+}
+
+/* mm_lock2 must be locked */
+static void
+free_sub (void *virt)
+{
+	struct allocdata *p;
+	uint offset;
+
+	offset = (virt_t)virt & PAGESIZE_MASK;
+	p = (struct allocdata *)((virt_t)virt & ~PAGESIZE_MASK);
+	if (p->n & 0x80) {
+		p->n &= ~0x80;
+		LIST1_PUSH (alloclist[p->n], p);
+	}
+	alloclist_free (p, p->n, offset);
 }
 
 /* allocate n bytes */
-/* FIXME: bad implementation */
+/* small blocks are taken from the per-CPU magazine, which is
+ * refilled from the global alloclist in batches */
 void *
 alloc (uint len)
 {
 	void *r;
 	int i;
-	struct allocdata *p;
+	struct mm_magazine *m;
 
 	for (i = 0; i < NUM_OF_ALLOCLIST; i++) {
 		if (len <= ALLOCLIST_SIZE (i))
@@ -982,18 +1216,23 @@ alloc (uint len)
 	alloc_pages (&r, NULL, (len + 4095) / 4096);
 	return r;
 found:
-	spinlock_lock (&mm_lock2);
-	for (;;) {
-		p = LIST1_POP (alloclist[i]);
-		if (p == NULL)
-			p = alloclist_new (i);
-		if (alloclist_alloc (p, i, &r))
-			break;
-		p->n |= 0x80;
+	if (!currentcpu_available ()) {
+		spinlock_lock (&mm_lock2);
+		r = alloc_sub (i);
+		spinlock_unlock (&mm_lock2);
+		return r;
 	}
-	LIST1_PUSH (alloclist[i], p);
-	spinlock_unlock (&mm_lock2);
-	return r;
+	m = &currentcpu->mm.mag[i];
+	if (m->count) {
+		STATUS_UPDATE (currentcpu->mm.stat.alloc_hit++);
+	} else {
+		STATUS_UPDATE (currentcpu->mm.stat.alloc_miss++);
+		mm_lock2_lock ();
+		while (m->count < MM_MAGAZINE_BATCH)
+			m->obj[m->count++] = alloc_sub (i);
+		spinlock_unlock (&mm_lock2);
+	}
+	return m->obj[--m->count];
 }
 
 /* allocate n bytes */
@@ -1013,11 +1252,35 @@ alloc2 (uint len, u64 *phys)
 	return r;
 }
 
+/* allocate n bytes like alloc2 but return NULL instead of panicking
+ * if there is no free block large enough, for sizes requested from
+ * outside the VMM */
+void *
+alloc2_try (uint len, u64 *phys)
+{
+	struct page *p;
+	int i;
+
+	if (len <= ALLOCLIST_SIZE (NUM_OF_ALLOCLIST - 1))
+		return alloc2 (len, phys);
+	for (i = 0; i < NUM_OF_ALLOCSIZE; i++)
+		if (allocsize[i] >= len)
+			goto found;
+	return NULL;
+found:
+	p = mm_page_alloc_try (i);
+	if (!p)
+		return NULL;
+	*phys = page_to_phys (p);
+	return (void *)page_to_virt (p);
+}
+
 /* free */
 void
 free (void *virt)
 {
 	struct allocdata *p;
+	struct mm_magazine *m;
 	uint offset;
 
 	offset = (virt_t)virt & PAGESIZE_MASK;
@@ -1025,14 +1288,24 @@ free (void *virt)
 		mm_page_free (virt_to_page ((virt_t)virt));
 		return;
 	}
-	spinlock_lock (&mm_lock2);
+	if (!currentcpu_available ()) {
+		spinlock_lock (&mm_lock2);
+		free_sub (virt);
+		spinlock_unlock (&mm_lock2);
+		return;
+	}
 	p = (struct allocdata *)((virt_t)virt & ~PAGESIZE_MASK);
-	if (p->n & 0x80) {
-		p->n &= ~0x80;
-		LIST1_PUSH (alloclist[p->n], p);
+	m = &currentcpu->mm.mag[p->n & ~0x80];
+	if (m->count < MM_MAGAZINE_SIZE) {
+		STATUS_UPDATE (currentcpu->mm.stat.free_hit++);
+	} else {
+		STATUS_UPDATE (currentcpu->mm.stat.free_miss++);
+		mm_lock2_lock ();
+		while (m->count > MM_MAGAZINE_SIZE - MM_MAGAZINE_BATCH)
+			free_sub (m->obj[--m->count]);
+		spinlock_unlock (&mm_lock2);
 	}
-	alloclist_free (p, p->n, offset);
-	spinlock_unlock (&mm_lock2);
+	m->obj[m->count++] = virt;
 }
 
 static bool
@@ -1120,6 +1393,221 @@ free_page_phys (phys_t phys)
 }
 
 /* mempool functions */
+static int
+mempool_node_height (struct mempool_node *n)
+{
+	return n ? n->height : 0;
+}
+
+static void
+mempool_node_update (struct mempool_node *n)
+{
+	int l, r;
+
+	l = mempool_node_height (n->left);
+	r = mempool_node_height (n->right);
+	n->height = (l > r ? l : r) + 1;
+}
+
+static int
+mempool_node_cmp (ulong key1, ulong key2, struct mempool_node *n)
+{
+	if (key1 != n->key1)
+		return key1 < n->key1 ? -1 : 1;
+	if (key2 != n->key2)
+		return key2 < n->key2 ? -1 : 1;
+	return 0;
+}
+
+static struct mempool_node *
+mempool_node_balance (struct mempool_node *n)
+{
+	struct mempool_node *p;
+	int diff;
+
+	mempool_node_update (n);
+	diff = mempool_node_height (n->left) - mempool_node_height (n->right);
+	if (diff > 1) {
+		if (mempool_node_height (n->left->left) <
+		    mempool_node_height (n->left->right)) {
+			p = n->left->right;
+			n->left->right = p->left;
+			p->left = n->left;
+			mempool_node_update (p->left);
+			n->left = p;
+		}
+		p = n->left;
+		n->left = p->right;
+		p->right = n;
+	} else if (diff < -1) {
+		if (mempool_node_height (n->right->right) <
+		    mempool_node_height (n->right->left)) {
+			p = n->right->left;
+			n->right->left = p->right;
+			p->right = n->right;
+			mempool_node_update (p->right);
+			n->right = p;
+		}
+		p = n->right;
+		n->right = p->left;
+		p->left = n;
+	} else {
+		return n;
+	}
+	mempool_node_update (n);
+	mempool_node_update (p);
+	return p;
+}
+
+static struct mempool_node *
+mempool_node_insert (struct mempool_node *root, struct mempool_node *n)
+{
+	if (!root) {
+		n->left = NULL;
+		n->right = NULL;
+		n->height = 1;
+		return n;
+	}
+	if (mempool_node_cmp (n->key1, n->key2, root) < 0)
+		root->left = mempool_node_insert (root->left, n);
+	else
+		root->right = mempool_node_insert (root->right, n);
+	return mempool_node_balance (root);
+}
+
+static struct mempool_node *
+mempool_node_remove_min (struct mempool_node *root,
+			 struct mempool_node **min)
+{
+	if (!root->left) {
+		*min = root;
+		return root->right;
+	}
+	root->left = mempool_node_remove_min (root->left, min);
+	return mempool_node_balance (root);
+}
+
+/* n must be in the tree */
+static struct mempool_node *
+mempool_node_delete (struct mempool_node *root, struct mempool_node *n)
+{
+	struct mempool_node *min;
+	int c;
+
+	c = mempool_node_cmp (n->key1, n->key2, root);
+	if (c < 0) {
+		root->left = mempool_node_delete (root->left, n);
+	} else if (c > 0) {
+		root->right = mempool_node_delete (root->right, n);
+	} else {
+		ASSERT (root == n);
+		if (!n->right)
+			return n->left;
+		n->right = mempool_node_remove_min (n->right, &min);
+		min->left = n->left;
+		min->right = n->right;
+		root = min;
+	}
+	return mempool_node_balance (root);
+}
+
+static struct mempool_node *
+mempool_node_find (struct mempool_node *root, ulong key1, ulong key2)
+{
+	int c;
+
+	while (root) {
+		c = mempool_node_cmp (key1, key2, root);
+		if (!c)
+			break;
+		root = c < 0 ? root->left : root->right;
+	}
+	return root;
+}
+
+/* find the smallest node that is not less than (key1, key2) */
+static struct mempool_node *
+mempool_node_lower_bound (struct mempool_node *root, ulong key1, ulong key2)
+{
+	struct mempool_node *r = NULL;
+
+	while (root) {
+		if (mempool_node_cmp (key1, key2, root) <= 0) {
+			r = root;
+			root = root->left;
+		} else {
+			root = root->right;
+		}
+	}
+	return r;
+}
+
+static struct mempool_list *
+mempool_node_to_list (struct mempool_node *n)
+{
+	return (struct mempool_list *)((u8 *)n -
+				       (ulong)&((struct mempool_list *)0)->node);
+}
+
+static ulong
+mempool_list_addr (struct mempool_list *q)
+{
+	return (ulong)&q->block->p[q->off];
+}
+
+static void
+mempool_alloc_tree_add (struct mempool *mp, struct mempool_list *q)
+{
+	q->free = false;
+	q->node.key1 = mempool_list_addr (q);
+	q->node.key2 = 0;
+	mp->alloc_tree = mempool_node_insert (mp->alloc_tree, &q->node);
+}
+
+static void
+mempool_free_tree_add (struct mempool *mp, struct mempool_list *q)
+{
+	q->free = true;
+	q->node.key1 = q->len;
+	q->node.key2 = mempool_list_addr (q);
+	mp->free_tree = mempool_node_insert (mp->free_tree, &q->node);
+}
+
+static void
+mempool_free_tree_del (struct mempool *mp, struct mempool_list *q)
+{
+	mp->free_tree = mempool_node_delete (mp->free_tree, &q->node);
+}
+
+/* unused descriptors are linked by extnext */
+static void
+mempool_desc_put (struct mempool *mp, struct mempool_list *q)
+{
+	q->extnext = mp->descfree;
+	mp->descfree = q;
+}
+
+static struct mempool_list *
+mempool_desc_get (struct mempool *mp)
+{
+	struct mempool_descpage *d;
+	struct mempool_list *q;
+	void *tmp;
+	int i;
+
+	if (!mp->descfree) {
+		alloc_page (&tmp, NULL);
+		d = tmp;
+		d->next = mp->descpage;
+		mp->descpage = d;
+		for (i = 0; i < MEMPOOL_DESC_PER_PAGE; i++)
+			mempool_desc_put (mp, &d->desc[i]);
+	}
+	q = mp->descfree;
+	mp->descfree = q->extnext;
+	return q;
+}
+
 struct mempool *
 mempool_new (int blocksize, int numkeeps, bool clear)
 {
@@ -1127,11 +1615,16 @@ mempool_new (int blocksize, int numkeeps, bool clear)
 
 	p = alloc (sizeof *p);
 	LIST1_HEAD_INIT (p->block);
+	p->alloc_tree = NULL;
+	p->free_tree = NULL;
+	p->descpage = NULL;
+	p->descfree = NULL;
 	p->numpages = 1;
 	while (PAGESIZE * p->numpages < blocksize)
 		p->numpages <<= 1;
 	p->numkeeps = numkeeps;
 	p->clear = clear;
+	p->keep = 0;
 	spinlock_init (&p->lock);
 	return p;
 }
@@ -1140,16 +1633,16 @@ void
 mempool_free (struct mempool *mp)
 {
 	struct mempool_block_list *p;
-	struct mempool_list *q;
+	struct mempool_descpage *d;
 
 	while ((p = LIST1_POP (mp->block)) != NULL) {
-		while ((q = LIST1_POP (p->alloc)) != NULL)
-			free (q);
-		while ((q = LIST1_POP (p->free)) != NULL)
-			free (q);
 		free_page (p->p);
 		free (p);
 	}
+	while ((d = mp->descpage) != NULL) {
+		mp->descpage = d->next;
+		free_page (d);
+	}
 	free (mp);
 }
 
@@ -1157,6 +1650,7 @@ void *
 mempool_allocmem (struct mempool *mp, uint len)
 {
 	struct mempool_block_list *p;
+	struct mempool_node *n;
 	struct mempool_list *q, *qq;
 	uint npages;
 	void *r, *tmp;
@@ -1164,42 +1658,46 @@ mempool_allocmem (struct mempool *mp, uint len)
 	if (len == 0)
 		return NULL;
 	spinlock_lock (&mp->lock);
-	LIST1_FOREACH (mp->block, p) {
-		LIST1_FOREACH (p->free, q) {
-			if (q->len >= len)
-				goto found;
-		}
+	n = mempool_node_lower_bound (mp->free_tree, len, 0);
+	if (n) {
+		q = mempool_node_to_list (n);
+		p = q->block;
+		mempool_free_tree_del (mp, q);
+		goto found;
 	}
 	npages = mp->numpages;
 	while (PAGESIZE * npages < len)
 		npages <<= 1;
 	p = alloc (sizeof *p);
-	LIST1_HEAD_INIT (p->alloc);
-	LIST1_HEAD_INIT (p->free);
+	LIST4_HEAD_INIT (p->ext, ext);
 	p->len = PAGESIZE * npages;
 	alloc_pages (&tmp, NULL, npages);
 	p->p = tmp;
 	if (mp->clear)
 		memset (p->p, 0, p->len);
-	q = alloc (sizeof *q);
+	q = mempool_desc_get (mp);
+	q->block = p;
 	q->off = 0;
 	q->len = p->len;
-	LIST1_ADD (p->free, q);
+	LIST4_ADD (p->ext, ext, q);
 	LIST1_ADD (mp->block, p);
 	mp->keep++;
 found:
 	if (q->len == p->len)
 		mp->keep--;
 	if (q->len == len) {
-		LIST1_DEL (p->free, q);
-		LIST1_ADD (p->alloc, q);
+		mempool_alloc_tree_add (mp, q);
 		r = &p->p[q->off];
 	} else {
-		qq = alloc (sizeof *qq);
+		qq = mempool_desc_get (mp);
+		qq->block = p;
 		qq->off = q->off;
 		qq->len = len;
 		q->off += len;
-		LIST1_ADD (p->alloc, qq);
+		q->len -= len;
+		LIST4_INSERT (p->ext, ext, q, qq);
+		mempool_alloc_tree_add (mp, qq);
+		mempool_free_tree_add (mp, q);
 		r = &p->p[qq->off];
 	}
 	spinlock_unlock (&mp->lock);
@@ -1210,58 +1708,45 @@ void
 mempool_freemem (struct mempool *mp, void *virt)
 {
 	struct mempool_block_list *p;
+	struct mempool_node *n;
 	struct mempool_list *q, *qq;
-	virt_t v = (virt_t)virt;
-	virt_t vv;
 
 	spinlock_lock (&mp->lock);
-	LIST1_FOREACH (mp->block, p) {
-		vv = (virt_t)p->p;
-		if (vv <= v && v < vv + p->len) {
-			LIST1_FOREACH (p->alloc, q) {
-				if (&p->p[q->off] == virt)
-					goto found;
-			}
-			break;
-		}
-	}
-	panic ("mempool_freemem: double free %p, %p", mp, virt);
-found:
-	LIST1_DEL (p->alloc, q);
-	LIST1_ADD (p->free, q);
-	LIST1_FOREACH (p->free, qq) {
-		if (qq->off + qq->len == q->off) {
-			qq->len += q->len;
-			LIST1_DEL (p->free, q);
-			free (q);
-			q = qq;
-			break;
-		}
-	}
-	LIST1_FOREACH (p->free, qq) {
-		if (q->off + q->len == qq->off) {
-			q->len += qq->len;
-			LIST1_DEL (p->free, qq);
-			free (qq);
-			break;
-		}
-	}
-	LIST1_FOREACH (p->free, q) {
-		if (q->len != p->len)
-			break;
+	n = mempool_node_find (mp->alloc_tree, (ulong)virt, 0);
+	if (!n)
+		panic ("mempool_freemem: double free %p, %p", mp, virt);
+	mp->alloc_tree = mempool_node_delete (mp->alloc_tree, n);
+	q = mempool_node_to_list (n);
+	p = q->block;
+	qq = LIST4_PREV (q, ext);
+	if (qq && qq->free) {
+		mempool_free_tree_del (mp, qq);
+		qq->len += q->len;
+		LIST4_DEL (p->ext, ext, q);
+		mempool_desc_put (mp, q);
+		q = qq;
+	}
+	qq = LIST4_NEXT (q, ext);
+	if (qq && qq->free) {
+		mempool_free_tree_del (mp, qq);
+		q->len += qq->len;
+		LIST4_DEL (p->ext, ext, qq);
+		mempool_desc_put (mp, qq);
+	}
+	if (q->len == p->len) {
 		if (mp->keep < mp->numkeeps) {
 			mp->keep++;
-			break;
+		} else {
+			LIST1_DEL (mp->block, p);
+			LIST4_DEL (p->ext, ext, q);
+			mempool_desc_put (mp, q);
+			free_page (p->p);
+			free (p);
+			spinlock_unlock (&mp->lock);
+			return;
 		}
-		LIST1_DEL (mp->block, p);
-		ASSERT (LIST1_POP (p->alloc) == NULL);
-		ASSERT (LIST1_POP (p->free) == q);
-		ASSERT (LIST1_POP (p->free) == NULL);
-		free (q);
-		free_page (p->p);
-		free (p);
-		break;
 	}
+	mempool_free_tree_add (mp, q);
 	spinlock_unlock (&mp->lock);
 }
 
@@ -1278,6 +1763,176 @@ phys_in_vmm (u64 phys)
 	return phys >= vmm_start_phys && phys < vmm_start_phys + VMMSIZE_ALL;
 }
 
+static bool
+mm_status_sum (struct pcpu *p, void *q)
+{
+	struct mm_stat *sum = q;
+
+	sum->alloc_hit += p->mm.stat.alloc_hit;
+	sum->alloc_miss += p->mm.stat.alloc_miss;
+	sum->free_hit += p->mm.stat.free_hit;
+	sum->free_miss += p->mm.stat.free_miss;
+	sum->lock_contended += p->mm.stat.lock_contended;
+	sum->page_alloc_hit += p->mm.stat.page_alloc_hit;
+	sum->page_alloc_miss += p->mm.stat.page_alloc_miss;
+	sum->page_free_hit += p->mm.stat.page_free_hit;
+	sum->page_free_miss += p->mm.stat.page_free_miss;
+	sum->mapmem_direct += p->mm.stat.mapmem_direct;
+	sum->mapmem_cache_hit += p->mm.stat.mapmem_cache_hit;
+	sum->mapmem_slow += p->mm.stat.mapmem_slow;
+	sum->unmapmem_slow += p->mm.stat.unmapmem_slow;
+	return false;
+}
+
+static char *
+mm_status (void)
+{
+	static char buf[1024];
+	struct mm_stat sum;
+
+	memset (&sum, 0, sizeof sum);
+	pcpu_list_foreach (mm_status_sum, &sum);
+	snprintf (buf, 1024,
+		  "mm:\n"
+		  " alloc hit: %u\n"
+		  " alloc miss: %u\n"
+		  " free hit: %u\n"
+		  " free miss: %u\n"
+		  " lock contended: %u\n"
+		  " page alloc hit: %u\n"
+		  " page alloc miss: %u\n"
+		  " page free hit: %u\n"
+		  " page free miss: %u\n"
+		  " mapmem direct: %u\n"
+		  " mapmem cache hit: %u\n"
+		  " mapmem slow: %u\n"
+		  " unmapmem slow: %u\n"
+		  " available pages: %d\n"
+		  " cached pages: %d\n"
+		  , sum.alloc_hit
+		  , sum.alloc_miss
+		  , sum.free_hit
+		  , sum.free_miss
+		  , sum.lock_contended
+		  , sum.page_alloc_hit
+		  , sum.page_alloc_miss
+		  , sum.page_free_hit
+		  , sum.page_free_miss
+		  , sum.mapmem_direct
+		  , sum.mapmem_cache_hit
+		  , sum.mapmem_slow
+		  , sum.unmapmem_slow
+		  , num_of_available_pages ()
+		  , num_of_cached_pages ());
+	return buf;
+}
+
+#ifdef BENCHMARK
+#define MM_BENCH_PAGES		256
+#define MM_BENCH_LOOPS		256
+
+static spinlock_t mm_bench_lock;
+static u64 mm_bench_maxtime;
+
+/* returns elapsed time in microseconds */
+static u64
+mm_bench_run (void **buf, bool batch)
+{
+	u64 start;
+	int i, j;
+
+	start = get_time ();
+	for (i = 0; i < MM_BENCH_LOOPS; i++) {
+		if (batch)
+			alloc_pages_batch (buf, NULL, MM_BENCH_PAGES);
+		else
+			for (j = 0; j < MM_BENCH_PAGES; j++)
+				alloc_page (&buf[j], NULL);
+		for (j = 0; j < MM_BENCH_PAGES; j++)
+			free_page (buf[j]);
+	}
+	return get_time () - start;
+}
+
+/* allocate and free in a pool that has n live extents with a free
+ * hole between each of them */
+static void
+mempool_bench (int n)
+{
+	struct mempool *mp;
+	void **buf;
+	u64 start, time;
+	int i, j;
+
+	mp = mempool_new (0, 1, false);
+	buf = alloc (n * 2 * sizeof *buf);
+	for (i = 0; i < n * 2; i++)
+		buf[i] = mempool_allocmem (mp, 16 + (i % 7) * 24);
+	for (i = 1; i < n * 2; i += 2)
+		mempool_freemem (mp, buf[i]);
+	start = get_time ();
+	for (i = 0; i < MM_BENCH_PAGES * MM_BENCH_LOOPS; i++) {
+		j = (i * 2 + 1) % (n * 2);
+		buf[j] = mempool_allocmem (mp, 16 + (i % 11) * 24);
+		mempool_freemem (mp, buf[j]);
+	}
+	time = get_time () - start;
+	printf ("mempool: %d live extents: %llu alloc+free/sec\n", n,
+		muldiv64 (MM_BENCH_PAGES * MM_BENCH_LOOPS, 1000000, time));
+	for (i = 0; i < n * 2; i += 2)
+		mempool_freemem (mp, buf[i]);
+	free (buf);
+	mempool_free (mp);
+}
+
+static void
+mm_bench_pcpu (void)
+{
+	void **buf;
+	u64 time, pages = MM_BENCH_PAGES * MM_BENCH_LOOPS;
+	bool bsp = currentcpu->cpunum == 0;
+	int ncpus;
+
+	buf = alloc (MM_BENCH_PAGES * sizeof *buf);
+	sync_all_processors ();
+	if (bsp) {
+		time = mm_bench_run (buf, false);
+		printf ("mm: alloc_page single-threaded: %llu pages/sec\n",
+			muldiv64 (pages, 1000000, time));
+		time = mm_bench_run (buf, true);
+		printf ("mm: alloc_pages_batch single-threaded:"
+			" %llu pages/sec\n", muldiv64 (pages, 1000000, time));
+		mempool_bench (16);
+		mempool_bench (256);
+		mempool_bench (4096);
+		spinlock_init (&mm_bench_lock);
+		mm_bench_maxtime = 0;
+	}
+	sync_all_processors ();
+	time = mm_bench_run (buf, false);
+	spinlock_lock (&mm_bench_lock);
+	if (mm_bench_maxtime < time)
+		mm_bench_maxtime = time;
+	spinlock_unlock (&mm_bench_lock);
+	sync_all_processors ();
+	if (bsp) {
+		ncpus = num_of_processors + 1;
+		printf ("mm: alloc_page %d processors: %llu pages/sec\n",
+			ncpus, muldiv64 (pages * ncpus, 1000000,
+					 mm_bench_maxtime));
+	}
+	free (buf);
+}
+
+INITFUNC ("pcpu40", mm_bench_pcpu);
+#endif
+
+static void
+mm_init_status (void)
+{
+	register_status_callback (mm_status);
+}
+
 void
 mm_force_unlock (void)
 {
@@ -1362,7 +2017,7 @@ mm_process_mapstack (virt_t virt, bool noalloc)
 		if (noalloc)
 			return -1;
 		alloc_page (&tmp, &phys);
-		memset (tmp, 0, PAGESIZE);
+		memzero_page (tmp);
 		pte = phys | PTE_P_BIT | PTE_RW_BIT | PTE_US_BIT;
 	} else {
 		pte &= ~PTE_AVAILABLE1_BIT;
@@ -1402,7 +2057,7 @@ mm_process_map_alloc (virt_t virt, uint len)
 	mm_process_unmap (virt, len);
 	for (v = virt; npages > 0; v += PAGESIZE, npages--) {
 		alloc_page (&tmp, &phys);
-		memset (tmp, 0, PAGESIZE);
+		memzero_page (tmp);
 		mm_process_mappage (v, phys | PTE_P_BIT | PTE_RW_BIT |
 				    PTE_US_BIT);
 	}
@@ -2225,6 +2880,7 @@ mapped_gphys_addr (u64 gphys, uint len, int flags)
 	return mapped_hphys_addr (hphys, len, flags);
 }
 
+/* mapmem_lock must be locked */
 static void *
 mapmem_alloc (pmap_t *m, uint offset, uint len)
 {
@@ -2234,7 +2890,6 @@ mapmem_alloc (pmap_t *m, uint offset, uint len)
 	int loopcount = 0;
 
 	n = (offset + len + PAGESIZE_MASK) >> PAGESIZE_SHIFT;
-	spinlock_lock (&mapmem_lock);
 	v = mapmem_lastvirt;
 retry:
 	for (i = 0; i < n; i++) {
@@ -2257,7 +2912,6 @@ retry:
 		pmap_write (m, PTE_P_BIT, 0xFFF);
 	}
 	mapmem_lastvirt = v + (n << PAGESIZE_SHIFT);
-	spinlock_unlock (&mapmem_lock);
 	return (void *)(v + offset);
 }
 
@@ -2302,33 +2956,206 @@ mapmem_domap (pmap_t *m, void *virt, int flags, u64 physaddr, uint len)
 	return false;
 }
 
-void
-unmapmem (void *virt, uint len)
+/* mapmem_lock must be locked */
+static void
+unmapmem_sub (pmap_t *m, void *virt, uint len)
 {
-	pmap_t m;
 	virt_t v;
-	ulong hostcr3;
 	uint n, i, offset;
 
-	if ((virt_t)virt < MAPMEM_ADDR_START ||
-	    (virt_t)virt >= MAPMEM_ADDR_END)
-		return;
-	spinlock_lock (&mapmem_lock);
-	asm_rdcr3 (&hostcr3);
-	pmap_open_vmm (&m, hostcr3, PMAP_LEVELS);
 	offset = (virt_t)virt & PAGESIZE_MASK;
 	n = (offset + len + PAGESIZE_MASK) >> PAGESIZE_SHIFT;
 	v = (virt_t)virt & ~PAGESIZE_MASK;
 	for (i = 0; i < n; i++) {
-		pmap_seek (&m, v + (i << PAGESIZE_SHIFT), 1);
-		if (pmap_read (&m) & PTE_P_BIT)
-			pmap_write (&m, 0, 0);
+		pmap_seek (m, v + (i << PAGESIZE_SHIFT), 1);
+		if (pmap_read (m) & PTE_P_BIT)
+			pmap_write (m, 0, 0);
 		asm_invlpg ((void *)(v + (i << PAGESIZE_SHIFT)));
 	}
+}
+
+static void
+unmapmem_slow (void *virt, uint len)
+{
+	pmap_t m;
+	ulong hostcr3;
+
+	if (currentcpu_available ())
+		STATUS_UPDATE (currentcpu->mm.stat.unmapmem_slow++);
+	spinlock_lock (&mapmem_lock);
+	asm_rdcr3 (&hostcr3);
+	pmap_open_vmm (&m, hostcr3, PMAP_LEVELS);
+	unmapmem_sub (&m, virt, len);
 	pmap_close (&m);
 	spinlock_unlock (&mapmem_lock);
 }
 
+struct mapmem_cache_find_data {
+	virt_t virt;
+	struct mm_mapcache *c;
+};
+
+static struct mm_mapcache *
+mapmem_cache_find_sub (struct pcpu *p, virt_t virt)
+{
+	int i;
+
+	for (i = 0; i < MM_MAPCACHE_SIZE; i++)
+		if (p->mm.mapcache[i].virt == virt)
+			return &p->mm.mapcache[i];
+	return NULL;
+}
+
+static bool
+mapmem_cache_find (struct pcpu *p, void *q)
+{
+	struct mapmem_cache_find_data *f = q;
+
+	f->c = mapmem_cache_find_sub (p, f->virt);
+	return !!f->c;
+}
+
+/* Drop a reference of a cached mapping.  The mapping may be owned by
+ * another processor if the thread has moved.  Returns false if virt
+ * is not a cached mapping. */
+static bool
+mapmem_cache_put (void *virt, uint len)
+{
+	struct mapmem_cache_find_data f;
+	uint offset;
+
+	offset = (virt_t)virt & PAGESIZE_MASK;
+	if (offset + len > PAGESIZE || !currentcpu_available ())
+		return false;
+	f.virt = (virt_t)virt & ~PAGESIZE_MASK;
+	f.c = mapmem_cache_find_sub (currentcpu, f.virt);
+	if (!f.c)
+		pcpu_list_foreach (mapmem_cache_find, &f);
+	if (!f.c)
+		return false;
+	asm_lock_decl (&f.c->ref);
+	return true;
+}
+
+static void *
+mapmem_cache_get (u64 phys, int flags)
+{
+	struct mm_mapcache *c = currentcpu->mm.mapcache;
+	int i;
+
+	for (i = 0; i < MM_MAPCACHE_SIZE; i++) {
+		if (c[i].virt && c[i].phys == phys && c[i].flags == flags) {
+			asm_lock_incl (&c[i].ref);
+			STATUS_UPDATE (currentcpu->mm.stat.mapmem_cache_hit++);
+			return (void *)c[i].virt;
+		}
+	}
+	return NULL;
+}
+
+/* Find an entry for a new mapping.  An unused entry is unmapped here
+ * at first, so that a virtual address is never reused for another
+ * page without going around the mapmem area. */
+static struct mm_mapcache *
+mapmem_cache_victim (void)
+{
+	struct mm_mapcache *c;
+	int i, hand;
+
+	hand = currentcpu->mm.mapcache_hand;
+	for (i = 0; i < MM_MAPCACHE_SIZE; i++) {
+		c = &currentcpu->mm.mapcache[hand];
+		hand = (hand + 1) % MM_MAPCACHE_SIZE;
+		if (c->virt && c->ref)
+			continue;
+		currentcpu->mm.mapcache_hand = hand;
+		if (c->virt) {
+			unmapmem_slow ((void *)c->virt, PAGESIZE);
+			c->virt = 0;
+		}
+		return c;
+	}
+	return NULL;
+}
+
+static void *
+mapmem_direct (int flags, u64 physaddr, uint len)
+{
+	if (flags & MAPMEM_HPHYS)
+		return mapped_hphys_addr (physaddr, len, flags);
+	else if (flags & MAPMEM_GPHYS)
+		return mapped_gphys_addr (physaddr, len, flags);
+	return NULL;
+}
+
+/* Page tables are allocated in mapmem_alloc() with mapmem_lock
+ * locked, so that mapmem_domap() can be called without the lock. */
+static void *
+mapmem_map (pmap_t *m, int flags, u64 physaddr, uint len)
+{
+	void *r;
+
+	if (currentcpu_available ())
+		STATUS_UPDATE (currentcpu->mm.stat.mapmem_slow++);
+	spinlock_lock (&mapmem_lock);
+	r = mapmem_alloc (m, physaddr & PAGESIZE_MASK, len);
+	spinlock_unlock (&mapmem_lock);
+	if (!mapmem_domap (m, r, flags, physaddr, len))
+		return r;
+	unmapmem_slow (r, len);
+	return NULL;
+}
+
+static void *
+mapmem_cached (int flags, u64 physaddr, uint len)
+{
+	struct mm_mapcache *c;
+	pmap_t m;
+	ulong hostcr3;
+	u64 hphys;
+	bool fakerom;
+	void *r;
+	uint offset;
+
+	offset = physaddr & PAGESIZE_MASK;
+	hphys = physaddr & ~PAGESIZE_MASK;
+	if (flags & MAPMEM_GPHYS) {
+		hphys = current->gmm.gp2hp (hphys, &fakerom);
+		if (fakerom && (flags & MAPMEM_WRITE))
+			return NULL;
+		hphys &= ~PAGESIZE_MASK;
+	}
+	flags = (flags & ~MAPMEM_GPHYS) | MAPMEM_HPHYS;
+	r = mapmem_cache_get (hphys, flags);
+	if (r)
+		return r + offset;
+	asm_rdcr3 (&hostcr3);
+	pmap_open_vmm (&m, hostcr3, PMAP_LEVELS);
+	r = mapmem_map (&m, flags, hphys, PAGESIZE);
+	pmap_close (&m);
+	if (!r)
+		return NULL;
+	c = mapmem_cache_victim ();
+	if (c) {
+		c->phys = hphys;
+		c->flags = flags;
+		c->ref = 1;
+		c->virt = (virt_t)r;
+	}
+	return r + offset;
+}
+
+void
+unmapmem (void *virt, uint len)
+{
+	if ((virt_t)virt < MAPMEM_ADDR_START ||
+	    (virt_t)virt >= MAPMEM_ADDR_END)
+		return;
+	if (mapmem_cache_put (virt, len))
+		return;
+	unmapmem_slow (virt, len);
+}
+
 void *
 mapmem (int flags, u64 physaddr, uint len)
 {
@@ -2336,29 +3163,47 @@ mapmem (int flags, u64 physaddr, uint len)
 	pmap_t m;
 	ulong hostcr3;
 
-	if (flags & MAPMEM_HPHYS) {
-		r = mapped_hphys_addr (physaddr, len, flags);
-		if (!r)
-			goto skip;
-		return r;
-	} else if (flags & MAPMEM_GPHYS) {
-		r = mapped_gphys_addr (physaddr, len, flags);
-		if (!r)
-			goto skip;
+	if (!(flags & (MAPMEM_HPHYS | MAPMEM_GPHYS)))
+		return NULL;
+	r = mapmem_direct (flags, physaddr, len);
+	if (r) {
+		if (currentcpu_available ())
+			STATUS_UPDATE (currentcpu->mm.stat.mapmem_direct++);
 		return r;
 	}
-	return NULL;
-skip:
+	if ((physaddr & PAGESIZE_MASK) + len <= PAGESIZE &&
+	    currentcpu_available ())
+		return mapmem_cached (flags, physaddr, len);
 	asm_rdcr3 (&hostcr3);
 	pmap_open_vmm (&m, hostcr3, PMAP_LEVELS);
-	r = mapmem_alloc (&m, physaddr & PAGESIZE_MASK, len);
-	if (!r)
-		goto ret;
-	if (!mapmem_domap (&m, r, flags, physaddr, len))
-		goto ret;
-	unmapmem (r, len);
-	r = NULL;
-ret:
+	r = mapmem_map (&m, flags, physaddr, len);
+	pmap_close (&m);
+	return r;
+}
+
+/* map host-physical pages, which need not be contiguous, to
+ * contiguous virtual addresses.  Unmap with unmapmem(). */
+void *
+mapmem_hphys_pages (u64 *pages, uint len, int flags)
+{
+	void *r;
+	pmap_t m;
+	ulong hostcr3;
+	uint i, n;
+
+	if (!len)
+		return NULL;
+	n = (len + PAGESIZE_MASK) >> PAGESIZE_SHIFT;
+	if (currentcpu_available ())
+		STATUS_UPDATE (currentcpu->mm.stat.mapmem_slow++);
+	asm_rdcr3 (&hostcr3);
+	pmap_open_vmm (&m, hostcr3, PMAP_LEVELS);
+	spinlock_lock (&mapmem_lock);
+	r = mapmem_alloc (&m, 0, len);
+	spinlock_unlock (&mapmem_lock);
+	for (i = 0; i < n; i++)
+		mapmem_domap (&m, (u8 *)r + (i << PAGESIZE_SHIFT),
+			      MAPMEM_HPHYS | flags, pages[i], PAGESIZE);
 	pmap_close (&m);
 	return r;
 }
@@ -2375,6 +3220,105 @@ mapmem_gphys (u64 physaddr, uint len, int flags)
 	return mapmem (MAPMEM_GPHYS | flags, physaddr, len);
 }
 
+/* translate a guest-physical area for device DMA */
+/* return value: false if the area is not contiguous in host-physical
+   memory or overlaps the VMM */
+bool
+gphys_to_hphys (u64 gphys, uint len, u64 *hphys)
+{
+	u64 p1, p2, hphys1;
+	bool fakerom = false;
+
+	if (!len)
+		return false;
+	*hphys = current->gmm.gp2hp (gphys, &fakerom);
+	if (fakerom)
+		return false;
+	hphys1 = *hphys & ~PAGESIZE_MASK;
+	p1 = gphys & ~PAGESIZE_MASK;
+	p2 = (gphys + len - 1) & ~PAGESIZE_MASK;
+	while (p1 != p2) {
+		p1 += PAGESIZE;
+		hphys1 += PAGESIZE;
+		if (hphys1 != current->gmm.gp2hp (p1, &fakerom))
+			return false;
+		if (fakerom)
+			return false;
+	}
+	return true;
+}
+
+/* Map n areas at once.  Virtual addresses for areas which are not in
+ * the direct map are allocated with one lock.  virt[i] is NULL if the
+ * area cannot be mapped. */
+void
+mapmem_batch (int flags, u64 *physaddr, uint *len, void **virt, int n)
+{
+	pmap_t m;
+	ulong hostcr3;
+	int i, nslow = 0;
+
+	for (i = 0; i < n; i++) {
+		virt[i] = mapmem_direct (flags, physaddr[i], len[i]);
+		if (!virt[i])
+			nslow++;
+	}
+	if (currentcpu_available ()) {
+		STATUS_UPDATE (currentcpu->mm.stat.mapmem_direct += n - nslow);
+		STATUS_UPDATE (currentcpu->mm.stat.mapmem_slow += nslow);
+	}
+	if (!nslow)
+		return;
+	asm_rdcr3 (&hostcr3);
+	pmap_open_vmm (&m, hostcr3, PMAP_LEVELS);
+	spinlock_lock (&mapmem_lock);
+	for (i = 0; i < n; i++)
+		if (!virt[i])
+			virt[i] = mapmem_alloc (&m, physaddr[i] & PAGESIZE_MASK,
+						len[i]);
+	spinlock_unlock (&mapmem_lock);
+	for (i = 0; i < n; i++) {
+		if ((virt_t)virt[i] < MAPMEM_ADDR_START ||
+		    (virt_t)virt[i] >= MAPMEM_ADDR_END)
+			continue;
+		if (mapmem_domap (&m, virt[i], flags, physaddr[i], len[i])) {
+			unmapmem_slow (virt[i], len[i]);
+			virt[i] = NULL;
+		}
+	}
+	pmap_close (&m);
+}
+
+void
+unmapmem_batch (void **virt, uint *len, int n)
+{
+	pmap_t m;
+	ulong hostcr3;
+	int i;
+	bool locked = false;
+
+	for (i = 0; i < n; i++) {
+		if ((virt_t)virt[i] < MAPMEM_ADDR_START ||
+		    (virt_t)virt[i] >= MAPMEM_ADDR_END)
+			continue;
+		if (mapmem_cache_put (virt[i], len[i]))
+			continue;
+		if (!locked) {
+			spinlock_lock (&mapmem_lock);
+			asm_rdcr3 (&hostcr3);
+			pmap_open_vmm (&m, hostcr3, PMAP_LEVELS);
+			locked = true;
+		}
+		if (currentcpu_available ())
+			STATUS_UPDATE (currentcpu->mm.stat.unmapmem_slow++);
+		unmapmem_sub (&m, virt[i], len[i]);
+	}
+	if (locked) {
+		pmap_close (&m);
+		spinlock_unlock (&mapmem_lock);
+	}
+}
+
 /* Flush all write back caches including other processors */
 void
 mm_flush_wb_cache (void)
@@ -2390,3 +3334,4 @@ mm_flush_wb_cache (void)
 
 INITFUNC ("global2", mm_init_global);
 INITFUNC ("ap0", unmap_user_area);
+INITFUNC ("paral01", mm_init_status);
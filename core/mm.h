@@ -45,6 +45,13 @@
 #endif
 
 #define VMM_START_VIRT			0x40000000
+#define NUM_OF_ALLOCLIST		7
+#define MM_MAGAZINE_SIZE		32
+#define MM_MAGAZINE_BATCH		16
+#define MM_PAGECACHE_ORDERS		2
+#define MM_PAGECACHE_SIZE		16
+#define MM_PAGECACHE_BATCH		8
+#define MM_MAPCACHE_SIZE		32
 
 enum pmap_type {
 	PMAP_TYPE_VMM,
@@ -62,6 +69,46 @@ typedef struct {
 	enum pmap_type type;
 } pmap_t;
 
+/* per-CPU cache of small blocks in front of the global alloclist */
+struct mm_magazine {
+	int count;
+	void *obj[MM_MAGAZINE_SIZE];
+};
+
+/* per-CPU cache of order 0 and 1 pages in front of the buddy lists */
+struct mm_pagecache {
+	int count;
+	struct page *page[MM_PAGECACHE_SIZE];
+};
+
+/* per-CPU cache of one-page mapmem() mappings.  unmapmem() only
+ * drops the reference and the PTE is cleared when the entry is
+ * reused. */
+struct mm_mapcache {
+	virt_t virt;		/* 0 if unused */
+	u64 phys;
+	int flags;
+	u32 ref;
+};
+
+struct mm_stat {
+	u32 alloc_hit, alloc_miss;
+	u32 free_hit, free_miss;
+	u32 lock_contended;
+	u32 page_alloc_hit, page_alloc_miss;
+	u32 page_free_hit, page_free_miss;
+	u32 mapmem_direct, mapmem_cache_hit, mapmem_slow;
+	u32 unmapmem_slow;
+};
+
+struct mm_pcpu_data {
+	struct mm_magazine mag[NUM_OF_ALLOCLIST];
+	struct mm_pagecache pagecache[MM_PAGECACHE_ORDERS];
+	struct mm_mapcache mapcache[MM_MAPCACHE_SIZE];
+	int mapcache_hand;
+	struct mm_stat stat;
+};
+
 struct uefi_mmio_space_struct {
 	u64 base, npages;
 };
@@ -75,6 +122,7 @@ phys_t sym_to_phys (void *sym);
 bool phys_in_vmm (u64 phys);
 virt_t phys_to_virt (phys_t phys);
 int num_of_available_pages (void);
+int num_of_cached_pages (void);
 u32 getsysmemmap (u32 n, u64 *base, u64 *len, u32 *type);
 u32 getfakesysmemmap (u32 n, u64 *base, u64 *len, u32 *type);
 void mm_flush_wb_cache (void);
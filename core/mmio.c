@@ -27,6 +27,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "arith.h"
 #include "asm.h"
 #include "assert.h"
 #include "constants.h"
@@ -37,9 +38,11 @@
 #include "mm.h"
 #include "mmio.h"
 #include "panic.h"
+#include "pcpu.h"
 #include "printf.h"
 #include "spinlock.h"
 #include "string.h"
+#include "time.h"
 #include "vmmerr.h"
 
 struct call_flush_tlb_data {
@@ -49,6 +52,59 @@ struct call_flush_tlb_data {
 	bool ret;
 };
 
+/* Return the position of the first handle whose range ends at or
+ * after gphys */
+static int
+mmio_index_search (struct mmio_index *idx, phys_t gphys)
+{
+	struct mmio_handle *h;
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = idx->n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		h = idx->handle[mid];
+		if (h->gphys + h->len - 1 < gphys)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void
+mmio_index_add (struct mmio_index *idx, struct mmio_handle *h)
+{
+	int i;
+
+	if (idx->n == idx->size) {
+		idx->size = idx->size ? idx->size * 2 : 16;
+		idx->handle = realloc (idx->handle,
+				       idx->size * sizeof *idx->handle);
+		ASSERT (idx->handle);
+	}
+	for (i = idx->n; i > 0 && idx->handle[i - 1]->gphys > h->gphys; i--)
+		idx->handle[i] = idx->handle[i - 1];
+	idx->handle[i] = h;
+	idx->n++;
+}
+
+static void
+mmio_index_del (struct mmio_index *idx, struct mmio_handle *h)
+{
+	int i;
+
+	for (i = mmio_index_search (idx, h->gphys); i < idx->n; i++) {
+		if (idx->handle[i] == h) {
+			idx->n--;
+			for (; i < idx->n; i++)
+				idx->handle[i] = idx->handle[i + 1];
+			return;
+		}
+	}
+}
+
 static int
 rangecheck (struct mmio_handle *h, phys_t gphys, uint len, phys_t *gphys2,
 	    uint *len2)
@@ -86,6 +142,26 @@ rangecheck (struct mmio_handle *h, phys_t gphys, uint len, phys_t *gphys2,
 	return 1;
 }
 
+/* Return 0 if no handles are in the gphys-len range, else return the
+ * end of the first handle found */
+static phys_t
+mmio_index_range (struct mmio_index *idx, phys_t gphys, uint len)
+{
+	struct mmio_handle *h;
+	int i;
+
+	if (!len)
+		return 0;
+	for (i = mmio_index_search (idx, gphys); i < idx->n; i++) {
+		h = idx->handle[i];
+		if (h->gphys >= gphys + len)
+			break;
+		if (rangecheck (h, gphys, len, NULL, NULL))
+			return h->gphys + h->len;
+	}
+	return 0;
+}
+
 static void
 mmio_gphys_access (phys_t gphysaddr, bool wr, void *buf, uint len, u32 flags)
 {
@@ -105,9 +181,9 @@ mmio_gphys_access (phys_t gphysaddr, bool wr, void *buf, uint len, u32 flags)
 int
 mmio_access_memory (phys_t gphysaddr, bool wr, void *buf, uint len, u32 f)
 {
-	struct mmio_list *p;
+	struct mmio_index *idx;
 	struct mmio_handle *h;
-	int i, j, r;
+	int i, r;
 	phys_t gphys2;
 	uint len2, tmp;
 	u8 *q;
@@ -123,54 +199,44 @@ mmio_access_memory (phys_t gphysaddr, bool wr, void *buf, uint len, u32 f)
 	} unlocked_handler;
 
 	unlocked_handler.found = false;
-	if (gphysaddr <= 0xFFFFFFFFULL)
-		i = gphysaddr >> 28;
-	else
-		i = 16;
-	if (gphysaddr + len - 1 <= 0xFFFFFFFFULL)
-		j = (gphysaddr + len - 1) >> 28;
-	else
-		j = 16;
+	idx = &current->vcpu0->mmio.index;
 	q = buf;
 	r = 0;
 	if (!len)
 		goto out;
-	for (; i <= j; i++) {
-		LIST1_FOREACH (current->vcpu0->mmio.mmio[i], p) {
-			h = p->handle;
-			if (h->gphys >= gphysaddr + len)
-				goto out;
-			if (rangecheck (h, gphysaddr, len, &gphys2, &len2)) {
-				r = 1;
-				tmp = gphys2 - gphysaddr;
-				mmio_gphys_access (gphysaddr, wr, q, tmp, f);
-				gphysaddr += tmp;
-				q += tmp;
-				len -= tmp;
-				if (h->unlocked_handler) {
-					if (unlocked_handler.found)
-						panic ("mmio_access_memory:"
-						       " two unlocked handlers"
-						       " in one access");
-					unlocked_handler.handler = h->handler;
-					unlocked_handler.data = h->data;
-					unlocked_handler.gphys = gphysaddr;
-					unlocked_handler.wr = wr;
-					unlocked_handler.buf = q;
-					unlocked_handler.len = len2;
-					unlocked_handler.flags = f;
-					unlocked_handler.found = true;
-				} else if (!h->handler (h->data, gphysaddr, wr,
-							q, len2, f)) {
-					mmio_gphys_access (gphysaddr, wr, q,
-							   len2, f);
-				}
-				gphysaddr += len2;
-				q += len2;
-				len -= len2;
-				if (!len)
-					goto out;
+	for (i = mmio_index_search (idx, gphysaddr); i < idx->n; i++) {
+		h = idx->handle[i];
+		if (h->gphys >= gphysaddr + len)
+			goto out;
+		if (rangecheck (h, gphysaddr, len, &gphys2, &len2)) {
+			r = 1;
+			tmp = gphys2 - gphysaddr;
+			mmio_gphys_access (gphysaddr, wr, q, tmp, f);
+			gphysaddr += tmp;
+			q += tmp;
+			len -= tmp;
+			if (h->unlocked_handler) {
+				if (unlocked_handler.found)
+					panic ("mmio_access_memory:"
+					       " two unlocked handlers"
+					       " in one access");
+				unlocked_handler.handler = h->handler;
+				unlocked_handler.data = h->data;
+				unlocked_handler.gphys = gphysaddr;
+				unlocked_handler.wr = wr;
+				unlocked_handler.buf = q;
+				unlocked_handler.len = len2;
+				unlocked_handler.flags = f;
+				unlocked_handler.found = true;
+			} else if (!h->handler (h->data, gphysaddr, wr, q,
+						len2, f)) {
+				mmio_gphys_access (gphysaddr, wr, q, len2, f);
 			}
+			gphysaddr += len2;
+			q += len2;
+			len -= len2;
+			if (!len)
+				goto out;
 		}
 	}
 out:
@@ -203,85 +269,35 @@ int
 mmio_access_page (phys_t gphysaddr, bool emulation)
 {
 	enum vmmerr e;
-	struct mmio_list *p;
-	struct mmio_handle *h;
-	int i;
 
 	gphysaddr &= ~PAGESIZE_MASK;
-	if (gphysaddr <= 0xFFFFFFFFULL)
-		i = gphysaddr >> 28;
-	else
-		i = 16;
-	LIST1_FOREACH (current->vcpu0->mmio.mmio[i], p) {
-		h = p->handle;
-		if (h->gphys >= gphysaddr + PAGESIZE)
-			break;
-		if (rangecheck (h, gphysaddr, PAGESIZE, NULL, NULL)) {
-			if (!emulation)
-				return 1;
-			e = cpu_interpreter ();
-			if (e == VMMERR_SUCCESS)
-				return 1;
-			panic ("Fatal error: MMIO access error %d", e);
-		}
+	if (mmio_index_range (&current->vcpu0->mmio.index, gphysaddr,
+			      PAGESIZE)) {
+		if (!emulation)
+			return 1;
+		e = cpu_interpreter ();
+		if (e == VMMERR_SUCCESS)
+			return 1;
+		panic ("Fatal error: MMIO access error %d", e);
 	}
 	return 0;
 }
 
+/* Remove handles which mmio_unregister() could not remove because
+ * the lock was held.  The exclusive lock must be held. */
 static void
-add (int i, void *handle)
+mmio_purge_unregistered (void)
 {
-	struct mmio_list *p, *d;
-	struct mmio_handle *h;
-	phys_t gphys;
-
-	h = handle;
-	gphys = h->gphys;
-	LIST1_FOREACH (current->vcpu0->mmio.mmio[i], d) {
-		h = d->handle;
-		if (h->gphys > gphys)
-			break;
-	}
-	p = alloc (sizeof *p);
-	ASSERT (p);
-	p->handle = handle;
-	LIST1_INSERT (current->vcpu0->mmio.mmio[i], d, p);
-}
-
-static void
-del (int i, void *handle)
-{
-	struct mmio_list *p;
-
-	LIST1_FOREACH (current->vcpu0->mmio.mmio[i], p) {
-		if (p->handle == handle)
-			goto found;
+	struct mmio_handle *p, *pn;
+
+	current->vcpu0->mmio.unregister_flag = false;
+	LIST1_FOREACH_DELETABLE (current->vcpu0->mmio.handle, p, pn) {
+		if (p->unregistered) {
+			LIST1_DEL (current->vcpu0->mmio.handle, p);
+			mmio_index_del (&current->vcpu0->mmio.index, p);
+			free (p);
+		}
 	}
-	return;
-found:
-	LIST1_DEL (current->vcpu0->mmio.mmio[i], p);
-	free (p);
-}
-
-static void
-scan (phys_t gphys, uint len, void (*func) (int i, void *data), void *data)
-{
-	int i, s, e;
-	phys_t end;
-
-	end = gphys + len - 1;
-	end |= 0x0FFFFFFFULL;
-	gphys &= ~0x0FFFFFFFULL;
-	if (gphys <= 0xFFFFFFFFULL)
-		s = gphys >> 28;
-	else
-		s = 16;
-	if (end <= 0xFFFFFFFFULL)
-		e = end >> 28;
-	else
-		e = 16;
-	for (i = s; i <= e; i++)
-		func (i, data);
 }
 
 static bool
@@ -337,13 +353,22 @@ static void *
 mmio_register_internal (phys_t gphys, uint len, mmio_handler_t handler,
 			void *data, bool unlocked_handler)
 {
+	struct mmio_index *idx;
 	struct mmio_handle *p;
+	int i;
 
+	if (!len)
+		return NULL;
 	rw_spinlock_lock_ex (&current->vcpu0->mmio.rwlock);
-	LIST1_FOREACH (current->vcpu0->mmio.handle, p) {
-		if (rangecheck (p, gphys, len, NULL, NULL))
-			goto fail;
-	}
+	/* Handles in the index must not overlap.  Handles being
+	 * unregistered are removed first, and the rest are treated
+	 * as registered. */
+	if (current->vcpu0->mmio.unregister_flag)
+		mmio_purge_unregistered ();
+	idx = &current->vcpu0->mmio.index;
+	i = mmio_index_search (idx, gphys);
+	if (i < idx->n && idx->handle[i]->gphys <= gphys + len - 1)
+		goto fail;
 	if (flush_tlb_entry (gphys, gphys + len - 1)) {
 		printf ("%s: flush_tlb_entry(0x%llX, 0x%llX) failed\n"
 			, __func__, gphys, gphys + len - 1);
@@ -358,7 +383,7 @@ mmio_register_internal (phys_t gphys, uint len, mmio_handler_t handler,
 	p->unregistered = false;
 	p->unlocked_handler = unlocked_handler;
 	LIST1_ADD (current->vcpu0->mmio.handle, p);
-	scan (gphys, len, add, p);
+	mmio_index_add (&current->vcpu0->mmio.index, p);
 ret:
 	rw_spinlock_unlock_ex (&current->vcpu0->mmio.rwlock);
 	return p;
@@ -392,7 +417,7 @@ mmio_unregister (void *handle)
 		return;
 	}
 	LIST1_DEL (current->vcpu0->mmio.handle, p);
-	scan (p->gphys, p->len, del, p);
+	mmio_index_del (&current->vcpu0->mmio.index, p);
 	free (p);
 	rw_spinlock_unlock_ex (&current->vcpu0->mmio.rwlock);
 }
@@ -407,20 +432,11 @@ mmio_lock (void)
 void
 mmio_unlock (void)
 {
-	struct mmio_handle *p;
-
 	if (!--current->mmio.lock_count)
 		rw_spinlock_unlock_sh (&current->vcpu0->mmio.rwlock);
 	if (current->vcpu0->mmio.unregister_flag &&
 	    !rw_spinlock_trylock_ex (&current->vcpu0->mmio.rwlock)) {
-		current->vcpu0->mmio.unregister_flag = false;
-		LIST1_FOREACH (current->vcpu0->mmio.handle, p) {
-			if (p->unregistered) {
-				LIST1_DEL (current->vcpu0->mmio.handle, p);
-				scan (p->gphys, p->len, del, p);
-				free (p);
-			}
-		}
+		mmio_purge_unregistered ();
 		rw_spinlock_unlock_ex (&current->vcpu0->mmio.rwlock);
 	}
 }
@@ -430,30 +446,7 @@ mmio_unlock (void)
 phys_t
 mmio_range (phys_t gphysaddr, uint len)
 {
-	struct mmio_list *p;
-	struct mmio_handle *h;
-	int i, j;
-
-	if (!len)
-		return 0;
-	if (gphysaddr <= 0xFFFFFFFFULL)
-		i = gphysaddr >> 28;
-	else
-		i = 16;
-	if (gphysaddr + len - 1 <= 0xFFFFFFFFULL)
-		j = (gphysaddr + len - 1) >> 28;
-	else
-		j = 16;
-	for (; i <= j; i++) {
-		LIST1_FOREACH (current->vcpu0->mmio.mmio[i], p) {
-			h = p->handle;
-			if (h->gphys >= gphysaddr + len)
-				return 0;
-			if (rangecheck (h, gphysaddr, len, NULL, NULL))
-				return h->gphys + h->len;
-		}
-	}
-	return 0;
+	return mmio_index_range (&current->vcpu0->mmio.index, gphysaddr, len);
 }
 
 static int
@@ -500,15 +493,73 @@ mmio_debug (void)
 	}
 }
 
+#ifdef BENCHMARK
+#define MMIO_BENCH_LOOKUPS	1048576
+
+/* n must be a power of 2.  Ranges are 4KiB each with a 12KiB gap,
+ * similar to MSI-X tables of many devices.  Half of the lookups
+ * hit. */
 static void
-mmio_init (void)
+mmio_bench (int n)
 {
-	int i;
+	struct mmio_index idx;
+	struct mmio_handle *h;
+	u64 start, time;
+	phys_t gphys;
+	int i, hit;
+
+	idx.handle = NULL;
+	idx.n = 0;
+	idx.size = 0;
+	h = alloc (n * sizeof *h);
+	memset (h, 0, n * sizeof *h);
+	start = get_time ();
+	for (i = 0; i < n; i++) {
+		/* an odd multiplier permutes 0..n-1 */
+		h[i].gphys = 0x100000000ULL +
+			(((u32)i * 0x9E3779B1U) & (n - 1)) * 0x4000ULL;
+		h[i].len = PAGESIZE;
+		mmio_index_add (&idx, &h[i]);
+	}
+	time = get_time () - start;
+	printf ("mmio: %d ranges: %llu registrations/sec", n,
+		muldiv64 (n, 1000000, time));
+	hit = 0;
+	start = get_time ();
+	for (i = 0; i < MMIO_BENCH_LOOKUPS; i++) {
+		gphys = 0x100000000ULL +
+			(((u32)i * 0x9E3779B1U) & (n * 2 - 1)) * 0x2000ULL;
+		if (mmio_index_range (&idx, gphys, PAGESIZE))
+			hit++;
+	}
+	time = get_time () - start;
+	printf (", %llu lookups/sec (%d hits)\n",
+		muldiv64 (MMIO_BENCH_LOOKUPS, 1000000, time), hit);
+	free (idx.handle);
+	free (h);
+}
+
+static void
+mmio_bench_pcpu (void)
+{
+	if (currentcpu->cpunum != 0)
+		return;
+	mmio_bench (16);
+	mmio_bench (256);
+	mmio_bench (4096);
+}
+
+INITFUNC ("pcpu40", mmio_bench_pcpu);
+#endif
 
+static void
+mmio_init (void)
+{
 	rw_spinlock_init (&current->mmio.rwlock);
 	LIST1_HEAD_INIT (current->mmio.handle);
-	for (i = 0; i < 17; i++)
-		LIST1_HEAD_INIT (current->mmio.mmio[i]);
+	current->mmio.index.handle = NULL;
+	current->mmio.index.n = 0;
+	current->mmio.index.size = 0;
 	current->mmio.unregister_flag = false;
 	current->mmio.lock_count = 0;
 }
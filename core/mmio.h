@@ -43,13 +43,16 @@ struct mmio_handle {
 	bool unlocked_handler;
 };
 
-struct mmio_list {
-	LIST1_DEFINE (struct mmio_list);
-	void *handle;
+/* Handles sorted by gphys.  Registered ranges never overlap, so the
+ * ends are sorted too and lookups can use binary search. */
+struct mmio_index {
+	struct mmio_handle **handle;
+	int n;
+	int size;
 };
 
 struct mmio_data {
-	LIST1_DEFINE_HEAD (struct mmio_list, mmio[17]);
+	struct mmio_index index;
 	LIST1_DEFINE_HEAD (struct mmio_handle, handle);
 	rw_spinlock_t rwlock;
 	bool unregister_flag;
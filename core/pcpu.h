@@ -33,11 +33,13 @@
 #include "asm.h"
 #include "cache.h"
 #include "desc.h"
+#include "mm.h"
 #include "panic.h"
 #include "seg.h"
 #include "spinlock.h"
 #include "svm.h"
 #include "thread.h"
+#include "timer.h"
 #include "types.h"
 #include "vt.h"
 
@@ -64,6 +66,8 @@ struct pcpu {
 	struct cache_pcpu_data cache;
 	struct panic_pcpu_data panic;
 	struct thread_pcpu_data thread;
+	struct mm_pcpu_data mm;
+	struct timer_pcpu_data timer;
 	enum fullvirtualize_type fullvirtualize;
 	int cpunum;
 	int pid;
@@ -75,6 +79,7 @@ struct pcpu {
 	bool use_invariant_tsc;
 	void (*release_process64_msrs) (void *release_process64_msrs_data);
 	void *release_process64_msrs_data;
+	u32 *io_count;		/* I/O exits per port (io_io.c) */
 };
 
 struct pcpu_gs {
@@ -29,24 +29,42 @@
 
 	.include "longmode.h"
 
+	# rep movsb/stosb is used from this size with ERMS only
+	.set	STRING_ERMS_MIN, 2048
+
+	# non-zero if the processor supports them, set by string_cpu.c
+	.data
+	.globl	string_erms
+	.globl	string_fsrm
+string_erms:
+	.byte	0			# enhanced rep movsb/stosb
+string_fsrm:
+	.byte	0			# fast short rep movsb
+
 	.text
 	.globl	memset
 	.globl	memcpy
 	.globl	strcmp
 	.globl	memcmp
 	.globl	strlen
+	.globl	memzero_page
+	.globl	memcpy_nt
 .if longmode
 	.set	memset, memset64
 	.set	memcpy, memcpy64
 	.set	strcmp, strcmp64
 	.set	memcmp, memcmp64
 	.set	strlen, strlen64
+	.set	memzero_page, memzero_page64
+	.set	memcpy_nt, memcpy_nt64
 .else
 	.set	memset, memset32
 	.set	memcpy, memcpy32
 	.set	strcmp, strcmp32
 	.set	memcmp, memcmp32
 	.set	strlen, strlen32
+	.set	memzero_page, memzero_page32
+	.set	memcpy_nt, memcpy32
 .endif
 
 	.code32
@@ -112,6 +130,27 @@ memcpy32:
 	pop	%esi
 	ret
 
+	# non-temporal stores do not fill the cache with the page
+	.align	64
+memzero_page32:
+	mov	4(%esp),%edx
+	xor	%eax,%eax
+	mov	$4096/32,%ecx
+1:
+	movnti	%eax,0(%edx)
+	movnti	%eax,4(%edx)
+	movnti	%eax,8(%edx)
+	movnti	%eax,12(%edx)
+	movnti	%eax,16(%edx)
+	movnti	%eax,20(%edx)
+	movnti	%eax,24(%edx)
+	movnti	%eax,28(%edx)
+	add	$32,%edx
+	sub	$1,%ecx
+	jne	1b
+	sfence
+	ret
+
 	.align	64
 strcmp32:
 	push	%esi
@@ -170,72 +209,251 @@ strlen32:
 	ret
 
 	.code64
+	# size classes: 0-16 and 17-64 bytes are done with overlapping
+	# 8-byte moves, 65 bytes or more with rep stosb/movsb if the
+	# processor supports FSRM (or ERMS for STRING_ERMS_MIN bytes or
+	# more), otherwise with a 32-byte loop below STRING_ERMS_MIN and
+	# rep stosq/movsq from there.
 	.align	64
 memset64:
-	mov	%esi,%eax
-	mov	%rdx,%rcx
-	cld
-	mov	%al,%ah
-	shr	%rcx
-	jc	1f
-	mov	%eax,%edx
-	shl	$16,%eax
-	mov	%dx,%ax
-	shr	%rcx
-	jc	2f
-	mov	%eax,%edx
-	shl	$32,%rax
-	or	%rdx,%rax
-	shr	%rcx
-	jc	3f
-	mov	%rdi,%rdx
-	rep	stosq
-	mov	%rdx,%rax
+	movzbl	%sil,%esi
+	mov	$0x0101010101010101,%rax
+	imul	%rsi,%rax
+	mov	%rdi,%r9
+	cmp	$16,%rdx
+	ja	4f
+	cmp	$8,%edx
+	jb	1f
+	mov	%rax,(%rdi)
+	mov	%rax,-8(%rdi,%rdx)
+	mov	%r9,%rax
 	ret
 1:
-	mov	%rdi,%rdx
-	rep	stosw
-	stosb
-	mov	%rdx,%rax
+	cmp	$4,%edx
+	jb	2f
+	mov	%eax,(%rdi)
+	mov	%eax,-4(%rdi,%rdx)
+	mov	%r9,%rax
 	ret
 2:
-	mov	%rdi,%rdx
-	rep	stosl
-	stosw
-	mov	%rdx,%rax
-	ret
+	test	%edx,%edx
+	je	3f
+	mov	%al,(%rdi)
+	cmp	$2,%edx
+	jb	3f
+	mov	%ax,-2(%rdi,%rdx)
 3:
-	mov	%rdi,%rdx
+	mov	%r9,%rax
+	ret
+4:
+	cmp	$64,%rdx
+	ja	5f
+	mov	%rax,(%rdi)
+	mov	%rax,8(%rdi)
+	mov	%rax,-16(%rdi,%rdx)
+	mov	%rax,-8(%rdi,%rdx)
+	cmp	$32,%edx
+	jbe	3b
+	mov	%rax,16(%rdi)
+	mov	%rax,24(%rdi)
+	mov	%rax,-32(%rdi,%rdx)
+	mov	%rax,-24(%rdi,%rdx)
+	mov	%r9,%rax
+	ret
+5:
+	cld
+	mov	%rdx,%rcx
+	cmpb	$0,string_fsrm(%rip)
+	jne	6f
+	cmp	$STRING_ERMS_MIN,%rdx
+	jb	7f
+	cmpb	$0,string_erms(%rip)
+	jne	6f
+	mov	%rax,-8(%rdi,%rdx)	# tail
+	shr	$3,%rcx
 	rep	stosq
-	stosl
-	mov	%rdx,%rax
+	mov	%r9,%rax
+	ret
+6:
+	rep	stosb
+	mov	%r9,%rax
+	ret
+7:
+	lea	-32(%rdi,%rdx),%rcx	# the last 32 bytes
+1:
+	mov	%rax,(%rdi)
+	mov	%rax,8(%rdi)
+	mov	%rax,16(%rdi)
+	mov	%rax,24(%rdi)
+	add	$32,%rdi
+	cmp	%rcx,%rdi
+	jb	1b
+	mov	%rax,(%rcx)
+	mov	%rax,8(%rcx)
+	mov	%rax,16(%rcx)
+	mov	%rax,24(%rcx)
+	mov	%r9,%rax
 	ret
 
 	.align	64
 memcpy64:
-	mov	%rdx,%rcx
-	cld
 	mov	%rdi,%rax
-	shr	%rcx
-	jc	1f
-	shr	%rcx
-	jc	2f
-	shr	%rcx
-	jc	3f
-	rep	movsq
+	cmp	$16,%rdx
+	ja	4f
+	cmp	$8,%edx
+	jb	1f
+	mov	(%rsi),%rcx
+	mov	-8(%rsi,%rdx),%r8
+	mov	%rcx,(%rdi)
+	mov	%r8,-8(%rdi,%rdx)
 	ret
 1:
-	rep	movsw
-	movsb
+	cmp	$4,%edx
+	jb	2f
+	mov	(%rsi),%ecx
+	mov	-4(%rsi,%rdx),%r8d
+	mov	%ecx,(%rdi)
+	mov	%r8d,-4(%rdi,%rdx)
 	ret
 2:
-	rep	movsl
-	movsw
-	ret
+	test	%edx,%edx
+	je	3f
+	movzbl	(%rsi),%ecx
+	cmp	$2,%edx
+	jb	1f
+	movzwl	-2(%rsi,%rdx),%r8d
+	mov	%r8w,-2(%rdi,%rdx)
+1:
+	mov	%cl,(%rdi)
 3:
+	ret
+4:
+	cmp	$64,%rdx
+	ja	5f
+	cmp	$32,%edx
+	ja	1f
+	mov	(%rsi),%rcx
+	mov	8(%rsi),%r8
+	mov	-16(%rsi,%rdx),%r9
+	mov	-8(%rsi,%rdx),%r10
+	mov	%rcx,(%rdi)
+	mov	%r8,8(%rdi)
+	mov	%r9,-16(%rdi,%rdx)
+	mov	%r10,-8(%rdi,%rdx)
+	ret
+1:
+	mov	(%rsi),%rcx
+	mov	8(%rsi),%r8
+	mov	16(%rsi),%r9
+	mov	24(%rsi),%r10
+	mov	%rcx,(%rdi)
+	mov	%r8,8(%rdi)
+	mov	%r9,16(%rdi)
+	mov	%r10,24(%rdi)
+	mov	-32(%rsi,%rdx),%rcx
+	mov	-24(%rsi,%rdx),%r8
+	mov	-16(%rsi,%rdx),%r9
+	mov	-8(%rsi,%rdx),%r10
+	mov	%rcx,-32(%rdi,%rdx)
+	mov	%r8,-24(%rdi,%rdx)
+	mov	%r9,-16(%rdi,%rdx)
+	mov	%r10,-8(%rdi,%rdx)
+	ret
+5:
+	cld
+	mov	%rdx,%rcx
+	cmpb	$0,string_fsrm(%rip)
+	jne	6f
+	cmp	$STRING_ERMS_MIN,%rdx
+	jb	7f
+	cmpb	$0,string_erms(%rip)
+	jne	6f
+	mov	-8(%rsi,%rdx),%r8	# tail
+	mov	%r8,-8(%rdi,%rdx)
+	shr	$3,%rcx
 	rep	movsq
-	movsl
 	ret
+6:
+	rep	movsb
+	ret
+7:
+	lea	-32(%rsi,%rdx),%r11	# the last 32 bytes
+	sub	%rsi,%rdi		# dst - src
+1:
+	mov	(%rsi),%rcx
+	mov	8(%rsi),%r8
+	mov	16(%rsi),%r9
+	mov	24(%rsi),%r10
+	mov	%rcx,(%rdi,%rsi)
+	mov	%r8,8(%rdi,%rsi)
+	mov	%r9,16(%rdi,%rsi)
+	mov	%r10,24(%rdi,%rsi)
+	add	$32,%rsi
+	cmp	%r11,%rsi
+	jb	1b
+	mov	(%r11),%rcx
+	mov	8(%r11),%r8
+	mov	16(%r11),%r9
+	mov	24(%r11),%r10
+	mov	%rcx,(%rdi,%r11)
+	mov	%r8,8(%rdi,%r11)
+	mov	%r9,16(%rdi,%r11)
+	mov	%r10,24(%rdi,%r11)
+	ret
+
+	# non-temporal stores do not fill the cache with the page
+	.align	64
+memzero_page64:
+	xor	%eax,%eax
+	mov	$4096/64,%ecx
+1:
+	movnti	%rax,0(%rdi)
+	movnti	%rax,8(%rdi)
+	movnti	%rax,16(%rdi)
+	movnti	%rax,24(%rdi)
+	movnti	%rax,32(%rdi)
+	movnti	%rax,40(%rdi)
+	movnti	%rax,48(%rdi)
+	movnti	%rax,56(%rdi)
+	add	$64,%rdi
+	sub	$1,%ecx
+	jne	1b
+	sfence
+	ret
+
+	# copy with non-temporal stores for buffers which are read by
+	# devices rather than processors.  8-byte aligned parts are
+	# stored with movnti and the rest with memcpy.
+	.align	64
+memcpy_nt64:
+	mov	%rdi,%rcx
+	neg	%rcx
+	and	$7,%ecx			# bytes before 8-byte alignment
+	cmp	%rcx,%rdx
+	jb	memcpy64
+	sub	%rcx,%rdx
+	cld
+	rep	movsb
+	mov	%rdx,%rcx
+	shr	$5,%rcx
+	je	2f
+1:
+	mov	(%rsi),%r8
+	mov	8(%rsi),%r9
+	mov	16(%rsi),%r10
+	mov	24(%rsi),%r11
+	movnti	%r8,(%rdi)
+	movnti	%r9,8(%rdi)
+	movnti	%r10,16(%rdi)
+	movnti	%r11,24(%rdi)
+	add	$32,%rsi
+	add	$32,%rdi
+	sub	$1,%rcx
+	jne	1b
+	sfence
+2:
+	and	$31,%edx
+	jmp	memcpy64
 
 	.align	64
 strcmp64:
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2026 BitVisor contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Select memcpy/memset implementations in string.s by processor
+ * features */
+
+#include "arith.h"
+#include "asm.h"
+#include "constants.h"
+#include "initfunc.h"
+#include "mm.h"
+#include "pcpu.h"
+#include "printf.h"
+#include "string.h"
+#include "time.h"
+
+extern u8 string_erms, string_fsrm;
+
+static void
+string_cpu_init_global (void)
+{
+	u32 a, b, c, d;
+
+	asm_cpuid (0, 0, &a, &b, &c, &d);
+	if (a < 7)
+		return;
+	asm_cpuid (7, 0, &a, &b, &c, &d);
+	if (b & CPUID_7_EBX_ERMS_BIT)
+		string_erms = 1;
+	if (d & CPUID_7_EDX_FSRM_BIT)
+		string_fsrm = 1;
+}
+
+INITFUNC ("global0", string_cpu_init_global);
+
+#ifdef BENCHMARK
+#define STRING_BENCH_BYTES	(16 * 1024 * 1024)
+#define STRING_BENCH_BUFSIZE	(64 * 1024)
+
+/* returns cycles per 100 bytes */
+static u32
+string_bench_cpb (u64 cycles, u32 bytes)
+{
+	u64 tmp[2];
+
+	mpumul_64_64 (cycles, 100, tmp);
+	mpudiv_128_32 (tmp, bytes, tmp);
+	return (u32)tmp[0];
+}
+
+static void
+string_bench_print (char *name, int size, u64 cycles, u32 bytes)
+{
+	u32 cpb = string_bench_cpb (cycles, bytes);
+
+	printf ("%s %6d: %u.%02u cycles/byte\n", name, size, cpb / 100,
+		cpb % 100);
+}
+
+static void
+string_bench_pcpu (void)
+{
+	static const int sizes[] = { 8, 16, 64, 256, 1514, 4096, 65536 };
+	int i, j, n, size;
+	u8 *src, *dst;
+	u64 start;
+
+	if (currentcpu->cpunum != 0)
+		return;
+	printf ("string: ERMS %d FSRM %d\n", string_erms, string_fsrm);
+	src = alloc (STRING_BENCH_BUFSIZE);
+	dst = alloc (STRING_BENCH_BUFSIZE);
+	memset (src, 0x5A, STRING_BENCH_BUFSIZE);
+	for (i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+		size = sizes[i];
+		n = STRING_BENCH_BYTES / size;
+		start = get_cpu_time_raw ();
+		for (j = 0; j < n; j++)
+			memcpy (dst, src, size);
+		string_bench_print ("memcpy", size,
+				    get_cpu_time_raw () - start, n * size);
+		start = get_cpu_time_raw ();
+		for (j = 0; j < n; j++)
+			memset (dst, j, size);
+		string_bench_print ("memset", size,
+				    get_cpu_time_raw () - start, n * size);
+		start = get_cpu_time_raw ();
+		for (j = 0; j < n; j++)
+			memcpy_nt (dst, src, size);
+		string_bench_print ("memcpy_nt", size,
+				    get_cpu_time_raw () - start, n * size);
+	}
+	n = STRING_BENCH_BYTES / PAGESIZE;
+	start = get_cpu_time_raw ();
+	for (j = 0; j < n; j++)
+		memzero_page (dst + (j & 15) * PAGESIZE);
+	string_bench_print ("memzero_page", PAGESIZE,
+			    get_cpu_time_raw () - start, n * PAGESIZE);
+	free (src);
+	free (dst);
+}
+
+INITFUNC ("pcpu40", string_bench_pcpu);
+#endif
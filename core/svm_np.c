@@ -27,46 +27,229 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "arith.h"
+#include "asm.h"
 #include "cache.h"
 #include "constants.h"
 #include "current.h"
+#include "initfunc.h"
 #include "mm.h"
 #include "panic.h"
+#include "pcpu.h"
 #include "printf.h"
 #include "string.h"
 #include "svm_np.h"
 #include "svm_paging.h"
+#include "time.h"
+#include "vcpu.h"
+#include "vmmcall_status.h"
 
-#define NUM_OF_NPTBL 1024
+#define NUM_OF_NPTBL		1024 /* allocated at first */
+#define MAX_NUM_OF_NPTBL	8192
+#define NPTBL_CHUNK		256
+#define NPTBL_BATCH		32
+#define NPTBL_RESERVE_PAGES	8192 /* free pages left for others */
+
+struct svm_np_tbl {
+	u64 *virt;
+	phys_t phys;
+	u64 *parent;		/* entry pointing this table, NULL if free */
+	u64 gphys;		/* start of the area covered by this table */
+	int level;
+	int next;		/* next free table */
+};
 
 struct svm_np {
-	int cnt;
+	int cnt;		/* number of tables in use */
+	int ntbl;		/* number of tables allocated */
+	int free;		/* first free table, -1 if none */
+	int hand;		/* clock hand for reclaiming */
 	int cleared;
+	bool filling;		/* mapping forcemap areas */
+	bool page1gb;
 	void *ncr3tbl;
 	phys_t ncr3tbl_phys;
-	void *tbl[NUM_OF_NPTBL];
-	phys_t tbl_phys[NUM_OF_NPTBL];
+	struct svm_np_tbl *tbl[MAX_NUM_OF_NPTBL / NPTBL_CHUNK];
 	struct {
 		int level;
 		phys_t gphys;
 		u64 *entry[PMAP_LEVELS];
 	} cur;
+	u32 stat_pagefault, stat_reclaim, stat_clear;
+	u32 stat_last_pagefault;
+	u64 stat_last_time;
 };
 
+static struct svm_np_tbl *
+np_tbl (struct svm_np *np, int i)
+{
+	return &np->tbl[i / NPTBL_CHUNK][i % NPTBL_CHUNK];
+}
+
+static void
+np_grow (struct svm_np *np)
+{
+	struct svm_np_tbl *t;
+	void *virt[NPTBL_BATCH];
+	u64 phys[NPTBL_BATCH];
+	int i, j;
+
+	t = alloc (sizeof *t * NPTBL_CHUNK);
+	for (i = 0; i < NPTBL_CHUNK; i += NPTBL_BATCH) {
+		alloc_pages_batch (virt, phys, NPTBL_BATCH);
+		for (j = 0; j < NPTBL_BATCH; j++) {
+			t[i + j].virt = virt[j];
+			t[i + j].phys = phys[j];
+			t[i + j].parent = NULL;
+			t[i + j].next = np->free;
+			np->free = np->ntbl + i + j;
+		}
+	}
+	np->tbl[np->ntbl / NPTBL_CHUNK] = t;
+	np->ntbl += NPTBL_CHUNK;
+}
+
+static void
+np_tbl_free (struct svm_np *np, int i)
+{
+	struct svm_np_tbl *t = np_tbl (np, i);
+
+	t->parent = NULL;
+	t->next = np->free;
+	np->free = i;
+	np->cnt--;
+}
+
+static void
+np_clear (struct svm_np *np)
+{
+	int i;
+
+	memset (np->ncr3tbl, 0, PAGESIZE);
+	for (i = 0; i < np->ntbl; i++)
+		if (np_tbl (np, i)->parent)
+			np_tbl_free (np, i);
+	np->cleared = 1;
+	STATUS_UPDATE (np->stat_clear++);
+}
+
+static bool
+np_forcemap_overlap (u64 start, u64 len)
+{
+	u32 n, nn;
+	u64 base, maplen;
+
+	n = 0;
+	for (nn = 1; nn; n = nn) {
+		nn = current->gmm.getforcemap (n, &base, &maplen);
+		if (maplen && base < start + len && start < base + maplen)
+			return true;
+	}
+	return false;
+}
+
+/* Reclaim a page directory and page tables under it.  Page
+ * directories are chosen by the clock algorithm with the accessed
+ * flags of the page-directory-pointer entries.  In 3-level paging
+ * the entries have no accessed flags and the first one found is
+ * taken. */
+static void
+np_reclaim (struct svm_np *np)
+{
+	struct svm_np_tbl *t, *c;
+	int i, n;
+
+	for (n = 0; n < np->ntbl * 2; n++) {
+		i = np->hand;
+		np->hand = (i + 1) % np->ntbl;
+		t = np_tbl (np, i);
+		if (!t->parent || t->level != 1)
+			continue;
+		if (PMAP_LEVELS != 3 && (*t->parent & PDE_A_BIT)) {
+			*t->parent &= ~PDE_A_BIT;
+			continue;
+		}
+		goto found;
+	}
+	np_clear (np);
+	goto flush;
+found:
+	*t->parent = 0;
+	for (n = 0; n < np->ntbl; n++) {
+		c = np_tbl (np, n);
+		if (c->parent && c->level == 0 && c->parent >= t->virt &&
+		    c->parent < t->virt + 512)
+			np_tbl_free (np, n);
+	}
+	np_tbl_free (np, i);
+	if (np_forcemap_overlap (t->gphys, PAGESIZE1G))
+		np->cleared = 1;
+	STATUS_UPDATE (np->stat_reclaim++);
+flush:
+	np->cur.level = PMAP_LEVELS;
+	svm_paging_flush_guest_tlb ();
+}
+
+/* Make n tables available.  Returns true if mappings are removed. */
+static bool
+np_reserve (struct svm_np *np, int n)
+{
+	bool removed = false;
+
+	while (np->ntbl - np->cnt < n) {
+		if (np->ntbl < MAX_NUM_OF_NPTBL &&
+		    (np->filling ||
+		     num_of_available_pages () > NPTBL_RESERVE_PAGES)) {
+			np_grow (np);
+			continue;
+		}
+		/* Forcemap areas mapped during filling must not be
+		 * reclaimed */
+		if (np->filling) {
+			np_clear (np);
+			np->cur.level = PMAP_LEVELS;
+			svm_paging_flush_guest_tlb ();
+		} else {
+			np_reclaim (np);
+		}
+		removed = true;
+	}
+	return removed;
+}
+
 void
 svm_np_init (void)
 {
 	struct svm_np *np;
+	u32 a, b, c, d;
 	int i;
 
 	np = alloc (sizeof (*np));
 	alloc_page (&np->ncr3tbl, &np->ncr3tbl_phys);
 	memset (np->ncr3tbl, 0, PAGESIZE);
 	np->cleared = 1;
-	for (i = 0; i < NUM_OF_NPTBL; i++)
-		alloc_page (&np->tbl[i], &np->tbl_phys[i]);
+	np->filling = false;
 	np->cnt = 0;
+	np->ntbl = 0;
+	np->free = -1;
+	np->hand = 0;
+	for (i = 0; i < NUM_OF_NPTBL; i += NPTBL_CHUNK)
+		np_grow (np);
 	np->cur.level = PMAP_LEVELS;
+	np->stat_pagefault = 0;
+	np->stat_reclaim = 0;
+	np->stat_clear = 0;
+	np->stat_last_pagefault = 0;
+	np->stat_last_time = 0;
+	np->page1gb = false;
+	if (PMAP_LEVELS == 4) {
+		asm_cpuid (CPUID_EXT_0, 0, &a, &b, &c, &d);
+		if (a >= CPUID_EXT_1) {
+			asm_cpuid (CPUID_EXT_1, 0, &a, &b, &c, &d);
+			if (d & CPUID_EXT_1_EDX_PAGE1GB_BIT)
+				np->page1gb = true;
+		}
+	}
 	current->u.svm.np = np;
 	current->u.svm.vi.vmcb->n_cr3 = np->ncr3tbl_phys;
 }
@@ -110,23 +293,26 @@ cur_move (struct svm_np *np, u64 gphys)
 static u64 *
 cur_fill (struct svm_np *np, u64 gphys, int level)
 {
-	int l;
+	struct svm_np_tbl *t;
+	int l, i;
 	u64 *p, e;
 
-	if (np->cnt + np->cur.level - level > NUM_OF_NPTBL) {
-		memset (np->ncr3tbl, 0, PAGESIZE);
-		np->cleared = 1;
-		np->cnt = 0;
-		svm_paging_flush_guest_tlb ();
-		np->cur.level = PMAP_LEVELS - 1;
-	}
+	while (np_reserve (np, np->cur.level - level))
+		cur_move (np, gphys);
 	l = np->cur.level;
 	for (p = np->cur.entry[l]; l > level; l--) {
-		e = np->tbl_phys[np->cnt] | PDE_P_BIT;
+		i = np->free;
+		t = np_tbl (np, i);
+		np->free = t->next;
+		np->cnt++;
+		t->parent = p;
+		t->level = l - 1;
+		t->gphys = gphys & ~((1ULL << (12 + 9 * l)) - 1);
+		e = t->phys | PDE_P_BIT;
 		if (PMAP_LEVELS != 3 || l != 2)
 			e |= PDE_RW_BIT | PDE_US_BIT | PDE_A_BIT;
 		*p = e;
-		p = np->tbl[np->cnt++];
+		p = t->virt;
 		memset (p, 0, PAGESIZE);
 		p += (gphys >> (9 * l + 3)) & 0x1FF;
 	}
@@ -177,6 +363,54 @@ svm_np_map_2mpage (struct svm_np *np, u64 gphys)
 	return false;
 }
 
+/* Map a 1GiB page if the guest-physical area is contiguous in
+ * host-physical memory and has no MMIO handlers. */
+static bool
+svm_np_map_1gpage (struct svm_np *np, u64 gphys)
+{
+	u64 base, hphys, h;
+	u32 hattr;
+	u64 *p;
+	int i;
+
+	if (!np->page1gb)
+		return true;
+	cur_move (np, gphys);
+	if (np->cur.level < 2)
+		return true;
+	base = gphys & ~PAGESIZE1G_MASK;
+	if (mmio_range (base, PAGESIZE1G))
+		return true;
+	if (!cache_gmtrr_type_equal (base, PAGESIZE1G_MASK))
+		return true;
+	hphys = current->gmm.gp2hp_2m (base);
+	if (hphys == GMM_GP2HP_2M_FAIL || (hphys & PAGESIZE1G_MASK))
+		return true;
+	for (i = 1; i < PAGESIZE1G / PAGESIZE2M; i++) {
+		h = current->gmm.gp2hp_2m (base + i * PAGESIZE2M);
+		if (h != hphys + i * PAGESIZE2M)
+			return true;
+	}
+	hattr = cache_get_gmtrr_attr (base) | PDE_P_BIT | PDE_RW_BIT |
+		PDE_US_BIT | PDE_A_BIT | PDE_D_BIT | PDE_PS_BIT |
+		PDE_AVAILABLE1_BIT;
+	p = cur_fill (np, gphys, 2);
+	*p = hphys | hattr;
+	return false;
+}
+
+static bool
+svm_np_map_largepage (struct svm_np *np, u64 gphys)
+{
+	if (!svm_np_map_1gpage (np, gphys))
+		return false;
+	if (np->cur.level > 0 &&
+	    !mmio_range (gphys & ~PAGESIZE2M_MASK, PAGESIZE2M) &&
+	    !svm_np_map_2mpage (np, gphys))
+		return false;
+	return true;
+}
+
 static int
 svm_np_level (struct svm_np *np, u64 gphys)
 {
@@ -192,6 +426,7 @@ svm_np_map_page_clear_cleared (struct svm_np *np)
 	phys_t next_phys;
 
 	np->cleared = 0;
+	np->filling = true;
 	n = 0;
 	for (nn = 1; nn; n = nn) {
 		nn = current->gmm.getforcemap (n, &base, &len);
@@ -201,9 +436,13 @@ svm_np_map_page_clear_cleared (struct svm_np *np)
 		base &= ~PAGESIZE_MASK;
 		while (len > 0) {
 			size = PAGESIZE;
-			if (svm_np_level (np, base) > 0 &&
-			    !mmio_range (base & ~PAGESIZE2M_MASK, PAGESIZE2M)
-			    && !svm_np_map_2mpage (np, base))
+			if (svm_np_level (np, base) > 1 &&
+			    !svm_np_map_1gpage (np, base))
+				size = (base | PAGESIZE1G_MASK) + 1 - base;
+			else if (svm_np_level (np, base) > 0 &&
+				 !mmio_range (base & ~PAGESIZE2M_MASK,
+					      PAGESIZE2M) &&
+				 !svm_np_map_2mpage (np, base))
 				size = (base | PAGESIZE2M_MASK) + 1 - base;
 			else if (!(next_phys = mmio_range (base, PAGESIZE)))
 				svm_np_map_page_sub (np, true, base);
@@ -216,6 +455,7 @@ svm_np_map_page_clear_cleared (struct svm_np *np)
 			len -= size;
 		}
 	}
+	np->filling = false;
 	if (np->cleared)
 		panic ("%s: error", __func__);
 }
@@ -236,10 +476,9 @@ svm_np_pagefault (bool write, u64 gphys)
 	struct svm_np *np;
 
 	np = current->u.svm.np;
+	STATUS_UPDATE (np->stat_pagefault++);
 	mmio_lock ();
-	if (svm_np_level (np, gphys) > 0 &&
-	    !mmio_range (gphys & ~PAGESIZE2M_MASK, PAGESIZE2M) &&
-	    !svm_np_map_2mpage (np, gphys))
+	if (!svm_np_map_largepage (np, gphys))
 		;
 	else if (!mmio_access_page (gphys, true))
 		svm_np_map_page (np, write, gphys);
@@ -263,9 +502,7 @@ svm_np_clear_all (void)
 	struct svm_np *np;
 
 	np = current->u.svm.np;
-	memset (np->ncr3tbl, 0, PAGESIZE);
-	np->cleared = 1;
-	np->cnt = 0;
+	np_clear (np);
 	np->cur.level = PMAP_LEVELS;
 	svm_paging_flush_guest_tlb ();
 }
@@ -274,21 +511,26 @@ bool
 svm_np_extern_mapsearch (struct vcpu *p, phys_t start, phys_t end)
 {
 	u64 *e, tmp1, tmp2, mask = p->pte_addr_mask;
-	unsigned int cnt, i, j, n = 512;
+	unsigned int i, j, n = 512;
+	struct svm_np_tbl *t;
 	struct svm_np *np;
+	u64 lmask;
 
 	np = p->u.svm.np;
-	cnt = np->cnt;
-	for (i = 0; i < cnt; i++) {
-		e = np->tbl[i];
+	for (i = 0; i < np->ntbl; i++) {
+		t = np_tbl (np, i);
+		if (!t->parent)
+			continue;
+		e = t->virt;
+		lmask = t->level == 2 ? PAGESIZE1G_MASK : PAGESIZE2M_MASK;
 		for (j = 0; j < n; j++) {
 			if (!(e[j] & PTE_P_BIT))
 				continue;
 			tmp1 = e[j] & mask;
 			tmp2 = tmp1 | 07777;
 			if (e[j] & PDE_AVAILABLE1_BIT) {
-				tmp1 &= ~07777777;
-				tmp2 |= 07777777;
+				tmp1 &= ~lmask;
+				tmp2 |= lmask;
 			}
 			if (start <= tmp2 && tmp1 <= end) {
 				if (p != current)
@@ -315,3 +557,56 @@ svm_np_map_1mb (void)
 		mmio_unlock ();
 	}
 }
+
+static bool
+svm_np_status_vcpu (struct vcpu *p, void *q)
+{
+	static char buf[1024];
+	struct svm_np *np;
+	char **ret = q;
+	int len;
+	u64 now;
+	u32 v;
+
+	np = p->u.svm.np;
+	if (!np)
+		return false;
+	if (!*ret) {
+		buf[0] = '\0';
+		*ret = buf;
+	}
+	len = strlen (buf);
+	now = get_time ();
+	v = np->stat_pagefault;
+	snprintf (buf + len, sizeof buf - len,
+		  "NP %p tables: %d/%d\n"
+		  " Page faults: %u (%llu/s)\n"
+		  " Reclaims: %u\n"
+		  " Clears: %u\n"
+		  , np, np->cnt, np->ntbl, v,
+		  muldiv64 (v - np->stat_last_pagefault, 1000000,
+			    now - np->stat_last_time),
+		  np->stat_reclaim, np->stat_clear);
+	np->stat_last_pagefault = v;
+	np->stat_last_time = now;
+	return false;
+}
+
+static char *
+svm_np_status (void)
+{
+	char *ret = NULL;
+
+	if (currentcpu->fullvirtualize != FULLVIRTUALIZE_SVM)
+		return "";
+	vcpu_list_foreach (svm_np_status_vcpu, &ret);
+	return ret ? ret : "";
+}
+
+static void
+svm_np_init_status (void)
+{
+	register_status_callback (svm_np_status);
+}
+
+INITFUNC ("paral01", svm_np_init_status);
@@ -40,16 +40,17 @@
 #include "string.h"
 #include "thread.h"
 #include "thread_switch.h"
+#include "timer.h"
+#include "vmmcall_status.h"
 
 #define MAXNUM_OF_THREADS	256
 #define CPUNUM_ANY		-1
+#define LOCK_DEFINE(l) thread_lock_t l
 #ifdef THREAD_1CPU
-#define LOCK_DEFINE(l) spinlock_t l
 #define LOCK_INIT(l) spinlock_init (l)
 #define LOCK_LOCK(l) spinlock_lock (l)
 #define LOCK_UNLOCK(l) spinlock_unlock (l)
 #else
-#define LOCK_DEFINE(l) ticketlock_t l
 #define LOCK_INIT(l) ticketlock_init (l)
 #define LOCK_LOCK(l) ticketlock_lock (l)
 #define LOCK_UNLOCK(l) ticketlock_unlock (l)
@@ -70,6 +71,8 @@ struct thread_context {
 
 struct thread_data {
 	LIST1_DEFINE (struct thread_data);
+	LIST4_DEFINE (struct thread_data, run);
+	struct pcpu *cpu;	/* run queue owner */
 	struct thread_context *context;
 	tid_t tid;
 	enum thread_state state;
@@ -83,9 +86,11 @@ struct thread_data {
 
 static struct thread_data td[MAXNUM_OF_THREADS];
 static LIST1_DEFINE_HEAD (struct thread_data, td_free);
-static LIST1_DEFINE_HEAD (struct thread_data, td_runnable);
+/* thread_lock protects td_free and thread states.  Run queues are
+ * protected by the per-CPU lock, which is held during thread_switch()
+ * and released by the next thread in switched(). */
 static LOCK_DEFINE (thread_lock);
-static void *old_stack;
+static char thread_status_buf[1024];
 
 static void
 thread_data_init (struct thread_data *d, struct thread_context *c, void *stack,
@@ -119,10 +124,101 @@ thread_gettid (void)
 	return currentcpu->thread.tid;
 }
 
+/* cpu->thread.lock must be locked */
+static void
+runq_add (struct pcpu *cpu, struct thread_data *d)
+{
+	d->cpu = cpu;
+	LIST4_ADD (cpu->thread.runnable, run, d);
+	cpu->thread.nrunnable++;
+	if (d->cpunum == CPUNUM_ANY)
+		cpu->thread.nany++;
+}
+
+/* cpu->thread.lock must be locked */
+static void
+runq_del (struct pcpu *cpu, struct thread_data *d)
+{
+	LIST4_DEL (cpu->thread.runnable, run, d);
+	cpu->thread.nrunnable--;
+	if (d->cpunum == CPUNUM_ANY)
+		cpu->thread.nany--;
+}
+
+struct thread_steal_data {
+	struct pcpu *self;
+	struct thread_data *d;
+};
+
+static bool
+thread_stealable_sub (struct pcpu *p, void *q)
+{
+	struct thread_steal_data *s = q;
+
+	if (p == s->self || p->thread.nany <= 0)
+		return false;
+	s->d = &td[0];		/* non-NULL means found */
+	return true;
+}
+
+/* checks without locks */
+static bool
+thread_stealable (void)
+{
+	struct thread_steal_data s;
+
+	s.self = currentcpu;
+	s.d = NULL;
+	pcpu_list_foreach (thread_stealable_sub, &s);
+	return !!s.d;
+}
+
+static bool
+thread_steal_sub (struct pcpu *p, void *q)
+{
+	struct thread_steal_data *s = q;
+	struct thread_data *d;
+
+	if (p == s->self || p->thread.nany <= 0)
+		return false;
+	LOCK_LOCK (&p->thread.lock);
+	LIST4_FOREACH (p->thread.runnable, run, d) {
+		if (d->cpunum == CPUNUM_ANY) {
+			runq_del (p, d);
+			s->d = d;
+			break;
+		}
+	}
+	LOCK_UNLOCK (&p->thread.lock);
+	return !!s->d;
+}
+
+/* take a CPUNUM_ANY thread from another processor */
+static struct thread_data *
+thread_steal (void)
+{
+	struct thread_steal_data s;
+
+	s.self = currentcpu;
+	s.d = NULL;
+	pcpu_list_foreach (thread_steal_sub, &s);
+	return s.d;
+}
+
 static void
 switched (void)
 {
-	LOCK_UNLOCK (&thread_lock);
+	struct thread_data *exited;
+
+	exited = currentcpu->thread.exited;
+	currentcpu->thread.exited = NULL;
+	LOCK_UNLOCK (&currentcpu->thread.lock);
+	if (exited) {
+		free (exited->stack);
+		LOCK_LOCK (&thread_lock);
+		LIST1_ADD (td_free, exited);
+		LOCK_UNLOCK (&thread_lock);
+	}
 }
 
 static bool
@@ -146,49 +242,54 @@ schedule_skip (bool start)
 void
 schedule (void)
 {
-	struct thread_data *d;
-	tid_t oldtid, newtid;
+	struct thread_pcpu_data *t = &currentcpu->thread;
+	struct thread_data *d, *old;
 
+	timer_wakeup_check ();
+	if (!t->nrunnable && !thread_stealable ())
+		return;
 	if (schedule_skip (true))
 		return;
-	LOCK_LOCK (&thread_lock);
-	if (old_stack) {
-		free (old_stack);
-		old_stack = NULL;
-	}
-	LIST1_FOREACH (td_runnable, d) {
-		if (d->cpunum == CPUNUM_ANY ||
-		    d->cpunum == currentcpu->cpunum)
-			goto found;
+	LOCK_LOCK (&t->lock);
+	d = LIST4_HEAD (t->runnable, run);
+	if (d) {
+		runq_del (currentcpu, d);
+	} else {
+		LOCK_UNLOCK (&t->lock);
+		d = thread_steal ();
+		if (!d) {
+			schedule_skip (false);
+			return;
+		}
+		STATUS_UPDATE (t->stat_steal++);
+		LOCK_LOCK (&t->lock);
 	}
-	LOCK_UNLOCK (&thread_lock);
-	schedule_skip (false);
-	return;
-found:
-	LIST1_DEL (td_runnable, d);
-	oldtid = currentcpu->thread.tid;
-	newtid = d->tid;
-	currentcpu->thread.tid = newtid;
-	thread_data_save_and_load (&td[oldtid], d);
-	switch (td[oldtid].state) {
+	old = &td[t->tid];
+	t->tid = d->tid;
+	thread_data_save_and_load (old, d);
+	old->cpu = currentcpu;
+	LOCK_LOCK (&thread_lock);
+	switch (old->state) {
 	case THREAD_EXIT:
-		old_stack = td[oldtid].stack;
-		LIST1_ADD (td_free, &td[oldtid]);
+		t->exited = old;
 		break;
 	case THREAD_RUN:
-		LIST1_ADD (td_runnable, &td[oldtid]);
+		runq_add (currentcpu, old);
 		break;
 	case THREAD_WILL_STOP:
-		td[oldtid].state = THREAD_STOP;
+		old->state = THREAD_STOP;
 		break;
 	case THREAD_STOP:
 	default:
+		LOCK_UNLOCK (&thread_lock);
 		panic ("schedule: bad state tid=%d state=%d",
-		       oldtid, td[oldtid].state);
+		       old->tid, old->state);
 	}
+	LOCK_UNLOCK (&thread_lock);
+	STATUS_UPDATE (t->stat_switch++);
 	if (d->cpunum != CPUNUM_ANY)
 		schedule_skip (false);
-	thread_switch (&td[oldtid].context, d->context, 0);
+	thread_switch (&old->context, d->context, 0);
 	switched ();
 }
 
@@ -201,23 +302,25 @@ thread_start1 (void (*func) (void *), void *arg)
 }
 
 static tid_t
-thread_new0 (struct thread_context *c, void *stack)
+thread_new0 (struct thread_context *c, void *stack, struct pcpu *cpu,
+	     int cpunum)
 {
 	struct thread_data *d;
-	tid_t r;
 
 	LOCK_LOCK (&thread_lock);
 	d = LIST1_POP (td_free);
-	ASSERT (d);
-	thread_data_init (d, c, stack, CPUNUM_ANY);
-	LIST1_ADD (td_runnable, d);
-	r = d->tid;
 	LOCK_UNLOCK (&thread_lock);
-	return r;
+	ASSERT (d);
+	thread_data_init (d, c, stack, cpunum);
+	LOCK_LOCK (&cpu->thread.lock);
+	runq_add (cpu, d);
+	LOCK_UNLOCK (&cpu->thread.lock);
+	return d->tid;
 }
 
-tid_t
-thread_new (void (*func) (void *), void *arg, int stacksize)
+static tid_t
+thread_new1 (void (*func) (void *), void *arg, int stacksize,
+	     struct pcpu *cpu, int cpunum)
 {
 	u8 *stack, *q;
 	struct thread_context c;
@@ -231,7 +334,43 @@ thread_new (void (*func) (void *), void *arg, int stacksize)
 	PUSH (func);
 	PUSH (c);
 #undef PUSH
-	return thread_new0 ((struct thread_context *)q, stack);
+	return thread_new0 ((struct thread_context *)q, stack, cpu, cpunum);
+}
+
+tid_t
+thread_new (void (*func) (void *), void *arg, int stacksize)
+{
+	return thread_new1 (func, arg, stacksize, currentcpu, CPUNUM_ANY);
+}
+
+struct thread_new_cpu_data {
+	int cpunum;
+	struct pcpu *cpu;
+};
+
+static bool
+thread_new_cpu_sub (struct pcpu *p, void *q)
+{
+	struct thread_new_cpu_data *s = q;
+
+	if (p->cpunum != s->cpunum)
+		return false;
+	s->cpu = p;
+	return true;
+}
+
+/* create a thread which runs only on the processor cpunum */
+tid_t
+thread_new_cpu (void (*func) (void *), void *arg, int stacksize, int cpunum)
+{
+	struct thread_new_cpu_data s;
+
+	s.cpunum = cpunum;
+	s.cpu = NULL;
+	pcpu_list_foreach (thread_new_cpu_sub, &s);
+	if (!s.cpu)
+		panic ("thread_new_cpu: no processor %d", cpunum);
+	return thread_new1 (func, arg, stacksize, s.cpu, cpunum);
 }
 
 static enum thread_state
@@ -249,6 +388,8 @@ thread_set_state (tid_t tid, enum thread_state state)
 void
 thread_wakeup (tid_t tid)
 {
+	struct pcpu *cpu;
+
 	switch (thread_set_state (tid, THREAD_RUN)) {
 	case THREAD_RUN:
 		printf ("WARNING: waking up runnable thread tid=%d\n", tid);
@@ -256,9 +397,13 @@ thread_wakeup (tid_t tid)
 	case THREAD_WILL_STOP:
 		break;
 	case THREAD_STOP:
-		LOCK_LOCK (&thread_lock);
-		LIST1_ADD (td_runnable, &td[tid]);
-		LOCK_UNLOCK (&thread_lock);
+		/* The stopped thread is added to the run queue of the
+		 * processor that stopped it, whose lock is held until
+		 * its context is saved. */
+		cpu = td[tid].cpu;
+		LOCK_LOCK (&cpu->thread.lock);
+		runq_add (cpu, &td[tid]);
+		LOCK_UNLOCK (&cpu->thread.lock);
 		break;
 	case THREAD_EXIT:
 	default:
@@ -315,9 +460,7 @@ thread_init_global (void)
 	int i;
 
 	LIST1_HEAD_INIT (td_free);
-	LIST1_HEAD_INIT (td_runnable);
 	LOCK_INIT (&thread_lock);
-	old_stack = NULL;
 	for (i = 0; i < MAXNUM_OF_THREADS; i++) {
 		td[i].tid = i;
 		td[i].state = THREAD_EXIT;
@@ -335,9 +478,42 @@ thread_init_pcpu (void)
 	ASSERT (d);
 	thread_data_init (d, NULL, NULL, currentcpu->cpunum);
 	d->boot = true;
+	d->cpu = currentcpu;
 	currentcpu->thread.tid = d->tid;
 	LOCK_UNLOCK (&thread_lock);
 }
 
+static bool
+thread_status_sub (struct pcpu *p, void *q)
+{
+	int *n = q;
+
+	*n += snprintf (thread_status_buf + *n, sizeof thread_status_buf - *n,
+			" cpu%d: switch %u steal %u runnable %d\n",
+			p->cpunum, p->thread.stat_switch,
+			p->thread.stat_steal, p->thread.nrunnable);
+	if (*n >= sizeof thread_status_buf)
+		return true;
+	return false;
+}
+
+static char *
+thread_status (void)
+{
+	int n;
+
+	n = snprintf (thread_status_buf, sizeof thread_status_buf,
+		      "thread:\n");
+	pcpu_list_foreach (thread_status_sub, &n);
+	return thread_status_buf;
+}
+
+static void
+thread_init_status (void)
+{
+	register_status_callback (thread_status);
+}
+
 INITFUNC ("global3", thread_init_global);
 INITFUNC ("pcpu0", thread_init_pcpu);
+INITFUNC ("paral01", thread_init_status);
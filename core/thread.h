@@ -31,9 +31,28 @@
 #define _CORE_THREAD_H
 
 #include <core/thread.h>
+#include "list.h"
+#include "spinlock.h"
 
+#ifdef THREAD_1CPU
+typedef spinlock_t thread_lock_t;
+#else
+typedef ticketlock_t thread_lock_t;
+#endif
+
+struct thread_data;
+
+/* Zero-filled data is a valid empty run queue, since pcpu is copied
+ * from pcpu_default. */
 struct thread_pcpu_data {
 	tid_t tid;
+	thread_lock_t lock;
+	LIST4_DEFINE_HEAD (runnable, struct thread_data, run);
+	/* read without the lock for checking emptiness */
+	volatile int nrunnable;	/* number of threads in runnable */
+	volatile int nany;	/* number of CPUNUM_ANY threads in runnable */
+	struct thread_data *exited;
+	u32 stat_switch, stat_steal;
 };
 
 #endif
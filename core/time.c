@@ -62,7 +62,8 @@ tsc_to_time (u64 tsc, u64 hz)
 	return tmp[0];
 }
 
-static u64
+/* returns the time stamp counter */
+u64
 get_cpu_time_raw (void)
 {
 	u32 tsc_l, tsc_h;
@@ -32,74 +32,159 @@
 #include "initfunc.h"
 #include "list.h"
 #include "mm.h"
+#include "pcpu.h"
 #include "spinlock.h"
 #include "thread.h"
 #include "time.h"
 #include "timer.h"
 #include "types.h"
 
-#define MAX_TIMER 128
+#define TIMER_ALLOC_NUM		64
+#define TIMER_TICK_SHIFT	10 /* 1 tick = 1024 usec */
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define TIMER_MAX_TICKS		(1ULL << (TIMER_WHEEL_BITS * \
+					  TIMER_WHEEL_LEVELS))
 
+/* timer_lock protects the free list and the timer thread state.
+ * Active timers are in a wheel of the processor which set them,
+ * protected by the wheel lock. */
 static spinlock_t timer_lock;
 
 struct timer_data {
 	LIST1_DEFINE (struct timer_data);
-	bool enable;
-	u64 settime;
-	u64 interval;
+	LIST4_DEFINE (struct timer_data, slot);
+	struct timer_pcpu_data *wheel;	/* NULL if disabled */
+	struct timer_slot *s;
+	u64 expire;		/* in usec */
 	void (*callback) (void *handle, void *data);
 	void *data;
 };
 
-static LIST1_DEFINE_HEAD (struct timer_data, list1_timer_on);
-static LIST1_DEFINE_HEAD (struct timer_data, list1_timer_off);
 static LIST1_DEFINE_HEAD (struct timer_data, list1_timer_free);
 static void timer_thread (void *thread_data);
 static bool timer_thread_run = false;
+static bool timer_thread_sleeping;
+static tid_t timer_thread_tid;
+static u64 timer_next_wakeup;	/* in usec, valid while sleeping */
 
 void *
 timer_new (void (*callback) (void *handle, void *data), void *data)
 {
 	struct timer_data *p;
+	int i;
 
 	spinlock_lock (&timer_lock);
 	p = LIST1_POP (list1_timer_free);
-	if (p == NULL)
-		return NULL;
-	p->enable = false;
+	spinlock_unlock (&timer_lock);
+	if (p == NULL) {
+		p = alloc (TIMER_ALLOC_NUM * sizeof (struct timer_data));
+		spinlock_lock (&timer_lock);
+		for (i = 1; i < TIMER_ALLOC_NUM; i++)
+			LIST1_PUSH (list1_timer_free, &p[i]);
+		spinlock_unlock (&timer_lock);
+	}
+	p->wheel = NULL;
 	p->callback = callback;
 	p->data = data;
-	LIST1_ADD (list1_timer_off, p);
-	spinlock_unlock (&timer_lock);
 	return p;
 }
 
+/* w->lock must be locked */
+/* The due list is sorted by the exact expiry time */
+static void
+timer_due_add (struct timer_pcpu_data *w, struct timer_data *p)
+{
+	struct timer_data *q;
+
+	LIST4_FOREACH (w->due.list, slot, q)
+		if (q->expire > p->expire)
+			break;
+	p->s = &w->due;
+	LIST4_INSERT (w->due.list, slot, q, p);
+}
+
+/* w->lock must be locked */
+static void
+timer_wheel_add (struct timer_pcpu_data *w, struct timer_data *p)
+{
+	u64 delta, tick;
+	int level;
+
+	tick = p->expire >> TIMER_TICK_SHIFT;
+	if (tick < w->curtick) {
+		timer_due_add (w, p);
+		return;
+	}
+	delta = tick - w->curtick;
+	if (delta >= TIMER_MAX_TICKS)
+		delta = TIMER_MAX_TICKS - 1;
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+		if (delta < 1ULL << (TIMER_WHEEL_BITS * (level + 1)))
+			break;
+	/* A timer too far in the future is placed at the last slot
+	 * and will be cascaded again. */
+	p->s = &w->wheel[level][((w->curtick + delta) >>
+				 (TIMER_WHEEL_BITS * level)) &
+				TIMER_WHEEL_MASK];
+	LIST4_ADD (p->s->list, slot, p);
+	w->ntimers++;
+}
+
+/* w->lock must be locked */
+static void
+timer_wheel_del (struct timer_pcpu_data *w, struct timer_data *p)
+{
+	if (p->s != &w->due)
+		w->ntimers--;
+	LIST4_DEL (p->s->list, slot, p);
+}
+
+/* Remove the timer from the wheel.  The wheel is looked up again
+ * after locking because the timer may be moved by another
+ * processor. */
+static void
+timer_disable (struct timer_data *p)
+{
+	struct timer_pcpu_data *w;
+
+	while ((w = p->wheel)) {
+		spinlock_lock (&w->lock);
+		if (p->wheel == w) {
+			timer_wheel_del (w, p);
+			p->wheel = NULL;
+			spinlock_unlock (&w->lock);
+			break;
+		}
+		spinlock_unlock (&w->lock);
+	}
+}
+
 void
 timer_set (void *handle, u64 interval_usec)
 {
-	struct timer_data *p, *d;
+	struct timer_data *p;
+	struct timer_pcpu_data *w;
 	u64 time;
 
-	spinlock_lock (&timer_lock);
-	time = get_time ();
 	p = handle;
-	if (!p->enable) {
-		LIST1_DEL (list1_timer_off, p);
-		p->enable = true;
-	} else {
-		LIST1_DEL (list1_timer_on, p);
-	}
-	p->settime = time;
-	p->interval = interval_usec;
-	LIST1_FOREACH (list1_timer_on, d)
-		if (d->interval > (time - d->settime) &&
-		    d->interval - (time - d->settime) > interval_usec)
-			break;
-	LIST1_INSERT (list1_timer_on, d, p);
+	timer_disable (p);
+	w = &currentcpu->timer;
+	spinlock_lock (&w->lock);
+	time = get_time ();
+	if (!w->ntimers)
+		w->curtick = time >> TIMER_TICK_SHIFT;
+	p->expire = time + interval_usec;
+	timer_wheel_add (w, p);
+	p->wheel = w;
+	spinlock_unlock (&w->lock);
+	spinlock_lock (&timer_lock);
 	if (!timer_thread_run) {
-		thread_new (timer_thread, NULL, VMM_STACKSIZE);
+		timer_thread_tid = thread_new (timer_thread, NULL,
+					       VMM_STACKSIZE);
 		timer_thread_run = true;
-		/* FIXME: Stop thread when no timers are active. */
+	} else if (timer_thread_sleeping && timer_next_wakeup > p->expire) {
+		/* timer_wakeup_check() wakes the thread up */
+		timer_next_wakeup = p->expire;
 	}
 	spinlock_unlock (&timer_lock);
 }
@@ -109,65 +194,198 @@ timer_free (void *handle)
 {
 	struct timer_data *p;
 
-	spinlock_lock (&timer_lock);
 	p = handle;
-	if (p->enable)
-		LIST1_DEL (list1_timer_on, p);
-	else
-		LIST1_DEL (list1_timer_off, p);
-	p->enable = false;
+	timer_disable (p);
+	spinlock_lock (&timer_lock);
 	LIST1_ADD (list1_timer_free, p);
 	spinlock_unlock (&timer_lock);
 }
 
+/* w->lock must be locked */
 static void
-timer_thread (void *thread_data)
+timer_wheel_cascade (struct timer_pcpu_data *w, int level)
 {
+	struct timer_slot *s;
+	struct timer_data *p;
+
+	s = &w->wheel[level][(w->curtick >> (TIMER_WHEEL_BITS * level)) &
+			     TIMER_WHEEL_MASK];
+	while ((p = LIST4_POP (s->list, slot))) {
+		w->ntimers--;
+		timer_wheel_add (w, p);
+	}
+}
+
+/* Move timers of ticks until now to the due list.  w->lock must be
+ * locked. */
+static void
+timer_wheel_advance (struct timer_pcpu_data *w, u64 now)
+{
+	struct timer_slot *s;
+	struct timer_data *p;
+	int level;
+
+	now >>= TIMER_TICK_SHIFT;
+	while (w->curtick <= now) {
+		if (!w->ntimers) {
+			w->curtick = now + 1;
+			break;
+		}
+		for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			if ((w->curtick >> (TIMER_WHEEL_BITS * (level - 1))) &
+			    TIMER_WHEEL_MASK)
+				break;
+			timer_wheel_cascade (w, level);
+		}
+		s = &w->wheel[0][w->curtick & TIMER_WHEEL_MASK];
+		while ((p = LIST4_POP (s->list, slot))) {
+			w->ntimers--;
+			timer_due_add (w, p);
+		}
+		w->curtick++;
+	}
+}
+
+struct timer_expired_data {
+	u64 now;
 	struct timer_data *p;
-	u64 time;
-	bool call;
 	void (*callback) (void *handle, void *data);
 	void *data;
+};
+
+static bool
+timer_expired_sub (struct pcpu *cpu, void *q)
+{
+	struct timer_expired_data *e = q;
+	struct timer_pcpu_data *w = &cpu->timer;
+	struct timer_data *p;
+
+	/* Check without the lock first */
+	p = LIST4_HEAD (w->due.list, slot);
+	if ((!p || p->expire > e->now) &&
+	    (!w->ntimers || w->curtick > e->now >> TIMER_TICK_SHIFT))
+		return false;
+	spinlock_lock (&w->lock);
+	if (w->curtick <= e->now >> TIMER_TICK_SHIFT)
+		timer_wheel_advance (w, e->now);
+	p = LIST4_HEAD (w->due.list, slot);
+	if (p && p->expire > e->now)
+		p = NULL;
+	if (p) {
+		LIST4_DEL (w->due.list, slot, p);
+		p->wheel = NULL;
+		e->p = p;
+		e->callback = p->callback;
+		e->data = p->data;
+	}
+	spinlock_unlock (&w->lock);
+	return !!p;
+}
+
+/* Find the earliest time when the thread has work to do: the
+ * first due timer, the earliest timer in the first level, or the
+ * earliest cascade of the upper levels. */
+static bool
+timer_next_sub (struct pcpu *cpu, void *q)
+{
+	u64 *next = q;
+	struct timer_pcpu_data *w = &cpu->timer;
+	struct timer_data *p;
+	u64 t, base, tick;
+	int i, level;
+
+	spinlock_lock (&w->lock);
+	p = LIST4_HEAD (w->due.list, slot);
+	if (p) {
+		t = p->expire;
+		goto found;
+	}
+	if (!w->ntimers)
+		goto out;
+	t = ~0ULL;
+	for (i = 0; i < TIMER_WHEEL_SIZE; i++)
+		LIST4_FOREACH (w->wheel[0][i].list, slot, p)
+			if (t > p->expire)
+				t = p->expire;
+	if (t != ~0ULL)
+		goto found;
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		base = w->curtick >> (TIMER_WHEEL_BITS * level);
+		for (i = 1; i <= TIMER_WHEEL_SIZE; i++) {
+			if (!LIST4_HEAD (w->wheel[level][(base + i) &
+							 TIMER_WHEEL_MASK].list,
+					 slot))
+				continue;
+			tick = (base + i) << (TIMER_WHEEL_BITS * level);
+			if (t > tick << TIMER_TICK_SHIFT)
+				t = tick << TIMER_TICK_SHIFT;
+			break;
+		}
+	}
+	if (t == ~0ULL)
+		goto out;
+found:
+	if (*next > t)
+		*next = t;
+out:
+	spinlock_unlock (&w->lock);
+	return false;
+}
+
+/* Called by schedule() to wake the timer thread up when the next
+ * timer expires, so that the thread does not poll. */
+void
+timer_wakeup_check (void)
+{
+	if (!timer_thread_sleeping)
+		return;
+	if (get_time () < timer_next_wakeup)
+		return;
+	spinlock_lock (&timer_lock);
+	if (timer_thread_sleeping) {
+		timer_thread_sleeping = false;
+		thread_wakeup (timer_thread_tid);
+	}
+	spinlock_unlock (&timer_lock);
+}
+
+static void
+timer_thread (void *thread_data)
+{
+	struct timer_expired_data e;
+	u64 next;
 
-	VAR_IS_INITIALIZED (callback);
-	VAR_IS_INITIALIZED (data);
 	for (;;) {
-		call = false;
-		spinlock_lock (&timer_lock);
-		p = LIST1_POP (list1_timer_on);
-		if (p) {
-			time = get_time ();
-			if (p->enable && (time - p->settime) >= p->interval) {
-				p->enable = false;
-				call = true;
-				callback = p->callback;
-				data = p->data;
-			}
-			if (p->enable)
-				LIST1_PUSH (list1_timer_on, p);
-			else
-				LIST1_ADD (list1_timer_off, p);
+		e.now = get_time ();
+		e.p = NULL;
+		pcpu_list_foreach (timer_expired_sub, &e);
+		if (e.p) {
+			e.callback (e.p, e.data);
+			continue;
 		}
+		/* Sleep until the next timer expires.  timer_set()
+		 * makes the wakeup time earlier if needed, so
+		 * calculate the time after marking it sleeping. */
+		spinlock_lock (&timer_lock);
+		thread_will_stop ();
+		timer_thread_sleeping = true;
+		timer_next_wakeup = ~0ULL;
 		spinlock_unlock (&timer_lock);
-		if (call)
-			callback (p, data);
-		else
-			schedule ();
+		next = ~0ULL;
+		pcpu_list_foreach (timer_next_sub, &next);
+		spinlock_lock (&timer_lock);
+		if (timer_next_wakeup > next)
+			timer_next_wakeup = next;
+		spinlock_unlock (&timer_lock);
+		schedule ();
 	}
 }
 
 static void
 timer_init_global (void)
 {
-	struct timer_data *p;
-	int i;
-
-	LIST1_HEAD_INIT (list1_timer_on);
-	LIST1_HEAD_INIT (list1_timer_off);
 	LIST1_HEAD_INIT (list1_timer_free);
-	p = alloc (MAX_TIMER * sizeof (struct timer_data));
-	for (i = 0; i < MAX_TIMER; i++)
-		LIST1_PUSH (list1_timer_free, &p[i]);
+	timer_thread_sleeping = false;
 	spinlock_init (&timer_lock);
 }
 
@@ -31,5 +31,29 @@
 #define _CORE_TIMER_H
 
 #include <core/timer.h>
+#include "list.h"
+#include "spinlock.h"
+
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS	4
+
+struct timer_data;
+
+struct timer_slot {
+	LIST4_DEFINE_HEAD (list, struct timer_data, slot);
+};
+
+/* Hierarchical timing wheel.  Zero-filled data is a valid empty
+ * wheel, since pcpu is copied from pcpu_default. */
+struct timer_pcpu_data {
+	spinlock_t lock;
+	u64 curtick;		/* next tick to be processed */
+	int ntimers;		/* number of timers in the wheel */
+	struct timer_slot due;	/* sorted by expiry time */
+	struct timer_slot wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+};
+
+void timer_wakeup_check (void);
 
 #endif
@@ -30,6 +30,8 @@
 #ifndef _CORE_VMMCALL_STATUS_H
 #define _CORE_VMMCALL_STATUS_H
 
+#include <core/vmmcall_status.h>
+
 #ifdef STATUS
 #define VMMCALL_STATUS_ENABLE
 #endif
@@ -40,6 +42,4 @@
 #define STATUS_UPDATE(a) do; while (0)
 #endif
 
-void register_status_callback (char *(*func) (void));
-
 #endif
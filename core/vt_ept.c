@@ -27,59 +27,239 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "arith.h"
 #include "asm.h"
 #include "constants.h"
 #include "convert.h"
 #include "current.h"
 #include "gmm_access.h"
+#include "initfunc.h"
 #include "mm.h"
 #include "panic.h"
+#include "pcpu.h"
+#include "printf.h"
 #include "string.h"
+#include "time.h"
+#include "vcpu.h"
+#include "vmmcall_status.h"
 #include "vt_ept.h"
 #include "vt_main.h"
 #include "vt_paging.h"
 #include "vt_regs.h"
 
-#define NUM_OF_EPTBL	1024
+#define NUM_OF_EPTBL		1024 /* allocated at first */
+#define MAX_NUM_OF_EPTBL	8192
+#define EPTBL_CHUNK		256
+#define EPTBL_BATCH		32
+#define EPTBL_RESERVE_PAGES	8192 /* free pages left for others */
 #define EPTE_READ	0x1
 #define EPTE_READEXEC	0x5
 #define EPTE_WRITE	0x2
 #define EPTE_LARGE	0x80
+#define EPTE_ACCESSED	0x100
 #define EPTE_ATTR_MASK	0xFFF
 #define EPTE_MT_SHIFT	3
 #define EPT_LEVELS	4
 
+struct vt_ept_tbl {
+	u64 *virt;
+	phys_t phys;
+	u64 *parent;		/* entry pointing this table, NULL if free */
+	u64 gphys;		/* start of the area covered by this table */
+	int level;
+	int next;		/* next free table */
+};
+
 struct vt_ept {
-	int cnt;
+	int cnt;		/* number of tables in use */
+	int ntbl;		/* number of tables allocated */
+	int free;		/* first free table, -1 if none */
+	int hand;		/* clock hand for reclaiming */
 	int cleared;
+	bool filling;		/* mapping forcemap areas */
+	bool ad;		/* accessed flags are enabled */
+	bool page1gb;
 	void *ncr3tbl;
 	phys_t ncr3tbl_phys;
-	void *tbl[NUM_OF_EPTBL];
-	phys_t tbl_phys[NUM_OF_EPTBL];
+	struct vt_ept_tbl *tbl[MAX_NUM_OF_EPTBL / EPTBL_CHUNK];
 	struct {
 		int level;
 		phys_t gphys;
 		u64 *entry[EPT_LEVELS];
 	} cur;
+	u32 stat_violation, stat_reclaim, stat_clear;
+	u32 stat_last_violation;
+	u64 stat_last_time;
 };
 
+static struct vt_ept_tbl *
+ept_tbl (struct vt_ept *ept, int i)
+{
+	return &ept->tbl[i / EPTBL_CHUNK][i % EPTBL_CHUNK];
+}
+
+static void
+ept_grow (struct vt_ept *ept)
+{
+	struct vt_ept_tbl *t;
+	void *virt[EPTBL_BATCH];
+	u64 phys[EPTBL_BATCH];
+	int i, j;
+
+	t = alloc (sizeof *t * EPTBL_CHUNK);
+	for (i = 0; i < EPTBL_CHUNK; i += EPTBL_BATCH) {
+		alloc_pages_batch (virt, phys, EPTBL_BATCH);
+		for (j = 0; j < EPTBL_BATCH; j++) {
+			t[i + j].virt = virt[j];
+			t[i + j].phys = phys[j];
+			t[i + j].parent = NULL;
+			t[i + j].next = ept->free;
+			ept->free = ept->ntbl + i + j;
+		}
+	}
+	ept->tbl[ept->ntbl / EPTBL_CHUNK] = t;
+	ept->ntbl += EPTBL_CHUNK;
+}
+
+static void
+ept_tbl_free (struct vt_ept *ept, int i)
+{
+	struct vt_ept_tbl *t = ept_tbl (ept, i);
+
+	t->parent = NULL;
+	t->next = ept->free;
+	ept->free = i;
+	ept->cnt--;
+}
+
+static void
+ept_clear (struct vt_ept *ept)
+{
+	int i;
+
+	memset (ept->ncr3tbl, 0, PAGESIZE);
+	for (i = 0; i < ept->ntbl; i++)
+		if (ept_tbl (ept, i)->parent)
+			ept_tbl_free (ept, i);
+	ept->cleared = 1;
+	STATUS_UPDATE (ept->stat_clear++);
+}
+
+static bool
+ept_forcemap_overlap (u64 start, u64 len)
+{
+	u32 n, nn;
+	u64 base, maplen;
+
+	n = 0;
+	for (nn = 1; nn; n = nn) {
+		nn = current->gmm.getforcemap (n, &base, &maplen);
+		if (maplen && base < start + len && start < base + maplen)
+			return true;
+	}
+	return false;
+}
+
+/* Reclaim a page directory and page tables under it.  Page
+ * directories are chosen by the clock algorithm with the accessed
+ * flags if available.  If no page directories are found, all the
+ * mappings are cleared. */
+static void
+ept_reclaim (struct vt_ept *ept)
+{
+	struct vt_ept_tbl *t, *c;
+	int i, n;
+
+	for (n = 0; n < ept->ntbl * 2; n++) {
+		i = ept->hand;
+		ept->hand = (i + 1) % ept->ntbl;
+		t = ept_tbl (ept, i);
+		if (!t->parent || t->level != 1)
+			continue;
+		if (ept->ad && (*t->parent & EPTE_ACCESSED)) {
+			*t->parent &= ~EPTE_ACCESSED;
+			continue;
+		}
+		goto found;
+	}
+	ept_clear (ept);
+	goto flush;
+found:
+	*t->parent = 0;
+	for (n = 0; n < ept->ntbl; n++) {
+		c = ept_tbl (ept, n);
+		if (c->parent && c->level == 0 && c->parent >= t->virt &&
+		    c->parent < t->virt + 512)
+			ept_tbl_free (ept, n);
+	}
+	ept_tbl_free (ept, i);
+	if (ept_forcemap_overlap (t->gphys, PAGESIZE1G))
+		ept->cleared = 1;
+	STATUS_UPDATE (ept->stat_reclaim++);
+flush:
+	ept->cur.level = EPT_LEVELS;
+	vt_paging_flush_guest_tlb ();
+}
+
+/* Make n tables available.  Returns true if mappings are removed. */
+static bool
+ept_reserve (struct vt_ept *ept, int n)
+{
+	bool removed = false;
+
+	while (ept->ntbl - ept->cnt < n) {
+		if (ept->ntbl < MAX_NUM_OF_EPTBL &&
+		    (ept->filling ||
+		     num_of_available_pages () > EPTBL_RESERVE_PAGES)) {
+			ept_grow (ept);
+			continue;
+		}
+		/* Forcemap areas mapped during filling must not be
+		 * reclaimed */
+		if (ept->filling) {
+			ept_clear (ept);
+			ept->cur.level = EPT_LEVELS;
+			vt_paging_flush_guest_tlb ();
+		} else {
+			ept_reclaim (ept);
+		}
+		removed = true;
+	}
+	return removed;
+}
+
 void
 vt_ept_init (void)
 {
 	struct vt_ept *ept;
+	u64 ept_vpid_cap;
 	int i;
 
 	ept = alloc (sizeof *ept);
 	alloc_page (&ept->ncr3tbl, &ept->ncr3tbl_phys);
 	memset (ept->ncr3tbl, 0, PAGESIZE);
 	ept->cleared = 1;
-	for (i = 0; i < NUM_OF_EPTBL; i++)
-		alloc_page (&ept->tbl[i], &ept->tbl_phys[i]);
+	ept->filling = false;
 	ept->cnt = 0;
+	ept->ntbl = 0;
+	ept->free = -1;
+	ept->hand = 0;
+	for (i = 0; i < NUM_OF_EPTBL; i += EPTBL_CHUNK)
+		ept_grow (ept);
 	ept->cur.level = EPT_LEVELS;
+	ept->stat_violation = 0;
+	ept->stat_reclaim = 0;
+	ept->stat_clear = 0;
+	ept->stat_last_violation = 0;
+	ept->stat_last_time = 0;
+	asm_rdmsr64 (MSR_IA32_VMX_EPT_VPID_CAP, &ept_vpid_cap);
+	ept->ad = !!(ept_vpid_cap & MSR_IA32_VMX_EPT_VPID_CAP_AD_BIT);
+	ept->page1gb = !!(ept_vpid_cap &
+			  MSR_IA32_VMX_EPT_VPID_CAP_PAGE1GB_BIT);
 	current->u.vt.ept = ept;
 	asm_vmwrite64 (VMCS_EPT_POINTER, ept->ncr3tbl_phys |
-		       VMCS_EPT_POINTER_EPT_WB | VMCS_EPT_PAGEWALK_LENGTH_4);
+		       VMCS_EPT_POINTER_EPT_WB | VMCS_EPT_PAGEWALK_LENGTH_4 |
+		       (ept->ad ? VMCS_EPT_POINTER_EPT_AD : 0));
 }
 
 static void
@@ -121,20 +301,23 @@ cur_move (struct vt_ept *ept, u64 gphys)
 static u64 *
 cur_fill (struct vt_ept *ept, u64 gphys, int level)
 {
-	int l;
+	struct vt_ept_tbl *t;
+	int l, i;
 	u64 *p;
 
-	if (ept->cnt + ept->cur.level - level > NUM_OF_EPTBL) {
-		memset (ept->ncr3tbl, 0, PAGESIZE);
-		ept->cleared = 1;
-		ept->cnt = 0;
-		vt_paging_flush_guest_tlb ();
-		ept->cur.level = EPT_LEVELS - 1;
-	}
+	while (ept_reserve (ept, ept->cur.level - level))
+		cur_move (ept, gphys);
 	l = ept->cur.level;
 	for (p = ept->cur.entry[l]; l > level; l--) {
-		*p = ept->tbl_phys[ept->cnt] | EPTE_READEXEC | EPTE_WRITE;
-		p = ept->tbl[ept->cnt++];
+		i = ept->free;
+		t = ept_tbl (ept, i);
+		ept->free = t->next;
+		ept->cnt++;
+		t->parent = p;
+		t->level = l - 1;
+		t->gphys = gphys & ~((1ULL << (12 + 9 * l)) - 1);
+		*p = t->phys | EPTE_READEXEC | EPTE_WRITE;
+		p = t->virt;
 		memset (p, 0, PAGESIZE);
 		p += (gphys >> (9 * l + 3)) & 0x1FF;
 	}
@@ -184,6 +367,53 @@ vt_ept_map_2mpage (struct vt_ept *ept, u64 gphys)
 	return false;
 }
 
+/* Map a 1GiB page if the guest-physical area is contiguous in
+ * host-physical memory and has no MMIO handlers. */
+static bool
+vt_ept_map_1gpage (struct vt_ept *ept, u64 gphys)
+{
+	u64 base, hphys, h;
+	u32 hattr;
+	u64 *p;
+	int i;
+
+	if (!ept->page1gb)
+		return true;
+	cur_move (ept, gphys);
+	if (ept->cur.level < 2)
+		return true;
+	base = gphys & ~PAGESIZE1G_MASK;
+	if (mmio_range (base, PAGESIZE1G))
+		return true;
+	if (!cache_gmtrr_type_equal (base, PAGESIZE1G_MASK))
+		return true;
+	hphys = current->gmm.gp2hp_2m (base);
+	if (hphys == GMM_GP2HP_2M_FAIL || (hphys & PAGESIZE1G_MASK))
+		return true;
+	for (i = 1; i < PAGESIZE1G / PAGESIZE2M; i++) {
+		h = current->gmm.gp2hp_2m (base + i * PAGESIZE2M);
+		if (h != hphys + i * PAGESIZE2M)
+			return true;
+	}
+	hattr = (cache_get_gmtrr_type (base) << EPTE_MT_SHIFT) |
+		EPTE_READEXEC | EPTE_WRITE | EPTE_LARGE;
+	p = cur_fill (ept, gphys, 2);
+	*p = hphys | hattr;
+	return false;
+}
+
+static bool
+vt_ept_map_largepage (struct vt_ept *ept, u64 gphys)
+{
+	if (!vt_ept_map_1gpage (ept, gphys))
+		return false;
+	if (ept->cur.level > 0 &&
+	    !mmio_range (gphys & ~PAGESIZE2M_MASK, PAGESIZE2M) &&
+	    !vt_ept_map_2mpage (ept, gphys))
+		return false;
+	return true;
+}
+
 static int
 vt_ept_level (struct vt_ept *ept, u64 gphys)
 {
@@ -199,6 +429,7 @@ vt_ept_map_page_clear_cleared (struct vt_ept *ept)
 	phys_t next_phys;
 
 	ept->cleared = 0;
+	ept->filling = true;
 	n = 0;
 	for (nn = 1; nn; n = nn) {
 		nn = current->gmm.getforcemap (n, &base, &len);
@@ -208,9 +439,13 @@ vt_ept_map_page_clear_cleared (struct vt_ept *ept)
 		base &= ~PAGESIZE_MASK;
 		while (len > 0) {
 			size = PAGESIZE;
-			if (vt_ept_level (ept, base) > 0 &&
-			    !mmio_range (base & ~PAGESIZE2M_MASK, PAGESIZE2M)
-			    && !vt_ept_map_2mpage (ept, base))
+			if (vt_ept_level (ept, base) > 1 &&
+			    !vt_ept_map_1gpage (ept, base))
+				size = (base | PAGESIZE1G_MASK) + 1 - base;
+			else if (vt_ept_level (ept, base) > 0 &&
+				 !mmio_range (base & ~PAGESIZE2M_MASK,
+					      PAGESIZE2M) &&
+				 !vt_ept_map_2mpage (ept, base))
 				size = (base | PAGESIZE2M_MASK) + 1 - base;
 			else if (!(next_phys = mmio_range (base, PAGESIZE)))
 				vt_ept_map_page_sub (ept, true, base);
@@ -223,6 +458,7 @@ vt_ept_map_page_clear_cleared (struct vt_ept *ept)
 			len -= size;
 		}
 	}
+	ept->filling = false;
 	if (ept->cleared)
 		panic ("%s: error", __func__);
 }
@@ -243,10 +479,9 @@ vt_ept_violation (bool write, u64 gphys)
 	struct vt_ept *ept;
 
 	ept = current->u.vt.ept;
+	STATUS_UPDATE (ept->stat_violation++);
 	mmio_lock ();
-	if (vt_ept_level (ept, gphys) > 0 &&
-	    !mmio_range (gphys & ~PAGESIZE2M_MASK, PAGESIZE2M) &&
-	    !vt_ept_map_2mpage (ept, gphys))
+	if (!vt_ept_map_largepage (ept, gphys))
 		;
 	else if (!mmio_access_page (gphys, true))
 		vt_ept_map_page (ept, write, gphys);
@@ -288,9 +523,7 @@ vt_ept_clear_all (void)
 	struct vt_ept *ept;
 
 	ept = current->u.vt.ept;
-	memset (ept->ncr3tbl, 0, PAGESIZE);
-	ept->cleared = 1;
-	ept->cnt = 0;
+	ept_clear (ept);
 	ept->cur.level = EPT_LEVELS;
 	vt_paging_flush_guest_tlb ();
 }
@@ -299,21 +532,26 @@ bool
 vt_ept_extern_mapsearch (struct vcpu *p, phys_t start, phys_t end)
 {
 	u64 *e, tmp1, tmp2, mask = p->pte_addr_mask;
-	unsigned int cnt, i, j, n = 512;
+	unsigned int i, j, n = 512;
+	struct vt_ept_tbl *t;
 	struct vt_ept *ept;
+	u64 lmask;
 
 	ept = p->u.vt.ept;
-	cnt = ept->cnt;
-	for (i = 0; i < cnt; i++) {
-		e = ept->tbl[i];
+	for (i = 0; i < ept->ntbl; i++) {
+		t = ept_tbl (ept, i);
+		if (!t->parent)
+			continue;
+		e = t->virt;
+		lmask = t->level == 2 ? PAGESIZE1G_MASK : PAGESIZE2M_MASK;
 		for (j = 0; j < n; j++) {
 			if (!(e[j] & EPTE_READ))
 				continue;
 			tmp1 = e[j] & mask;
 			tmp2 = tmp1 | 07777;
-			if (e[j] & EPTE_LARGE) {
-				tmp1 &= ~07777777;
-				tmp2 |= 07777777;
+			if (t->level > 0 && (e[j] & EPTE_LARGE)) {
+				tmp1 &= ~lmask;
+				tmp2 |= lmask;
 			}
 			if (start <= tmp2 && tmp1 <= end) {
 				if (p != current)
@@ -340,3 +578,56 @@ vt_ept_map_1mb (void)
 		mmio_unlock ();
 	}
 }
+
+static bool
+vt_ept_status_vcpu (struct vcpu *p, void *q)
+{
+	static char buf[1024];
+	struct vt_ept *ept;
+	char **ret = q;
+	int len;
+	u64 now;
+	u32 v;
+
+	ept = p->u.vt.ept;
+	if (!ept)
+		return false;
+	if (!*ret) {
+		buf[0] = '\0';
+		*ret = buf;
+	}
+	len = strlen (buf);
+	now = get_time ();
+	v = ept->stat_violation;
+	snprintf (buf + len, sizeof buf - len,
+		  "EPT %p tables: %d/%d\n"
+		  " Violations: %u (%llu/s)\n"
+		  " Reclaims: %u\n"
+		  " Clears: %u\n"
+		  , ept, ept->cnt, ept->ntbl, v,
+		  muldiv64 (v - ept->stat_last_violation, 1000000,
+			    now - ept->stat_last_time),
+		  ept->stat_reclaim, ept->stat_clear);
+	ept->stat_last_violation = v;
+	ept->stat_last_time = now;
+	return false;
+}
+
+static char *
+vt_ept_status (void)
+{
+	char *ret = NULL;
+
+	if (currentcpu->fullvirtualize != FULLVIRTUALIZE_VT)
+		return "";
+	vcpu_list_foreach (vt_ept_status_vcpu, &ret);
+	return ret ? ret : "";
+}
+
+static void
+vt_ept_init_status (void)
+{
+	register_status_callback (vt_ept_status);
+}
+
+INITFUNC ("paral01", vt_ept_init_status);
@@ -28,9 +28,12 @@
  */
 
 #include <core.h>
+#include <core/arith.h>
+#include <core/initfunc.h>
 #include <core/mmio.h>
 #include <core/thread.h>
 #include <core/time.h>
+#include <core/vmmcall_status.h>
 #include <storage.h>
 #include <storage_io.h>
 #include "ata.h"
@@ -47,6 +50,12 @@
 #define PxSSTS_DET_MASK		0xF
 #define PxSSTS_DET_MASK_NODEV	0x0
 #define NUM_OF_COMMAND_HEADER	32
+#define AHCI_COPY_BATCH		16
+#define AHCI_DMABUF_KEEP	(128 * 1024)
+#define AHCI_DMABUF_KEEP_NUM	4
+#define AHCI_PRD_MAXLEN		0x400000
+#define AHCI_LAT_BUCKETS	16
+#define AHCI_LAT_SHIFT		4	/* the first bucket is 0-15us */
 #define GLOBAL_CAP		0x00
 #define GLOBAL_CAP_SNCQ_BIT	0x40000000
 #define GLOBAL_CAP_NCS_MASK	0x1F00
@@ -142,6 +151,10 @@ struct command_table {
 	struct prdtbl prdt[1];	/* Physical Region Descriptor Table */
 } __attribute__ ((packed));
 
+/* PRDT entries in a page-sized command table */
+#define AHCI_PRDT_MAX \
+	((PAGESIZE - sizeof (struct command_table)) / sizeof (struct prdtbl) + 1)
+
 struct command_header {
 	/* DW 0 - Description Information */
 	unsigned int cfl : 5;	/* Command FIS Length */
@@ -199,13 +212,29 @@ struct ahci_port {
 		phys_t cmdtbl_p;
 		void *dmabuf;
 		phys_t dmabuf_p;
+		phys_t *dmabuf_pages;
 		u32 dmabuflen;
+		u32 dmabufsize;
 		u64 dmabuf_lba;
 		u32 dmabuf_nsec;
 		u32 dmabuf_ssiz;
 		int dmabuf_rwflag;
+		u32 dmabuf_cache_gen;
 		enum identify_type dmabuf_identify;
 	} my[NUM_OF_COMMAND_HEADER];
+	struct {
+		void *buf;
+		phys_t buf_p;
+		u32 size;
+	} dmabuf_keep[AHCI_DMABUF_KEEP_NUM];
+	int dmabuf_nkeep;
+	struct {		/* commands issued by the VMM itself */
+		spinlock_t lock;
+		u32 count, bytes_kb;
+		u32 last_count;
+		u64 last_time;
+		u32 hist[AHCI_LAT_BUCKETS];
+	} stat;
 };
 
 struct d2hrfis_0x34 {
@@ -281,6 +310,7 @@ struct ahci_command_list {
 };
 
 struct ahci_data {
+	LIST1_DEFINE (struct ahci_data);
 	spinlock_t locked_lock;
 	bool locked;
 	int waiting;
@@ -299,6 +329,9 @@ struct ahci_data {
 	u32 idp_index, idp_offset, idp_config;
 };
 
+static spinlock_t ahci_list_lock;
+static LIST1_DEFINE_HEAD (struct ahci_data, ahci_list);
+
 static void ahci_ae_bit_changed (struct ahci_data *ad);
 
 /************************************************************/
@@ -393,47 +426,136 @@ ahci_get_dmalen (struct command_table *cmdtbl, u16 prdtl, unsigned int *intr)
 	return totalsize;
 }
 
+/* Up to AHCI_DMABUF_KEEP_NUM shadow buffers up to AHCI_DMABUF_KEEP
+ * bytes are kept for the next commands of the port instead of being
+ * freed.  Returns false if out of memory. */
+static bool
+ahci_dmabuf_alloc (struct ahci_port *port, int cmdhdr_index, u32 size)
+{
+	int i, j;
+
+	ASSERT (!port->my[cmdhdr_index].dmabuf);
+	j = -1;
+	for (i = 0; i < port->dmabuf_nkeep; i++)
+		if (port->dmabuf_keep[i].size >= size &&
+		    (j < 0 || port->dmabuf_keep[i].size <
+		     port->dmabuf_keep[j].size))
+			j = i;
+	if (j >= 0) {
+		port->my[cmdhdr_index].dmabuf = port->dmabuf_keep[j].buf;
+		port->my[cmdhdr_index].dmabuf_p = port->dmabuf_keep[j].buf_p;
+		port->my[cmdhdr_index].dmabufsize = port->dmabuf_keep[j].size;
+		port->dmabuf_keep[j] =
+			port->dmabuf_keep[--port->dmabuf_nkeep];
+		return true;
+	}
+	port->my[cmdhdr_index].dmabuf =
+		alloc2_try (size, &port->my[cmdhdr_index].dmabuf_p);
+	if (!port->my[cmdhdr_index].dmabuf)
+		return false;
+	port->my[cmdhdr_index].dmabufsize = size;
+	return true;
+}
+
+static void
+ahci_dmabuf_free (struct ahci_port *port, int cmdhdr_index)
+{
+	void *dmabuf = port->my[cmdhdr_index].dmabuf;
+	u32 size = port->my[cmdhdr_index].dmabufsize;
+	int i, j;
+
+	if (!dmabuf)
+		return;
+	port->my[cmdhdr_index].dmabuf = NULL;
+	if (size > AHCI_DMABUF_KEEP) {
+		free (dmabuf);
+		return;
+	}
+	j = port->dmabuf_nkeep;
+	if (j == AHCI_DMABUF_KEEP_NUM) {
+		/* Replace the smallest one */
+		j = 0;
+		for (i = 1; i < port->dmabuf_nkeep; i++)
+			if (port->dmabuf_keep[i].size <
+			    port->dmabuf_keep[j].size)
+				j = i;
+		if (port->dmabuf_keep[j].size >= size) {
+			free (dmabuf);
+			return;
+		}
+		free (port->dmabuf_keep[j].buf);
+	} else {
+		port->dmabuf_nkeep++;
+	}
+	port->dmabuf_keep[j].buf = dmabuf;
+	port->dmabuf_keep[j].buf_p = port->my[cmdhdr_index].dmabuf_p;
+	port->dmabuf_keep[j].size = size;
+}
+
+/* Copy between guest buffers and the shadow buffer.  Sectors of
+ * read/write commands are encrypted or decrypted during the copy. */
 static void
 ahci_copy_dmabuf (struct ahci_port *port, int cmdhdr_index, bool wr,
 		  struct command_table *cmdtbl, u16 prdtl)
 {
-	u8 *mybuf = port->my[cmdhdr_index].dmabuf;
+	u8 *dmabuf = port->my[cmdhdr_index].dmabuf, *mybuf = dmabuf;
 	u32 dba, dbau, dbc;
-	phys_t db_phys;
-	void *gbuf;
-	int i;
+	u64 db_phys[AHCI_COPY_BATCH];
+	uint db_len[AHCI_COPY_BATCH];
+	void *gbuf[AHCI_COPY_BATCH];
+	struct storage_sg sg[AHCI_COPY_BATCH];
+	struct storage_access access;
+	bool crypt;
+	int i, j, n;
 	u32 remain;
 
 	ASSERT (mybuf);
 	remain = port->my[cmdhdr_index].dmabuflen;
-	if (wr) {
-		/* copy guest buffer to shadow buffer */
-		for (i = 0; i < prdtl; i++) {
-			dba = cmdtbl->prdt[i].dba;
-			dbau = cmdtbl->prdt[i].dbau;
-			dbc = (cmdtbl->prdt[i].dbc & 0x3FFFFE) + 2;
+	crypt = !!port->my[cmdhdr_index].dmabuf_rwflag;
+	if (crypt) {
+		access.rw = wr ? STORAGE_WRITE : STORAGE_READ;
+		access.lba = port->my[cmdhdr_index].dmabuf_lba;
+		access.count = port->my[cmdhdr_index].dmabuf_nsec;
+		access.sector_size = port->my[cmdhdr_index].dmabuf_ssiz;
+		access.cache_gen = wr ? 0 :
+			port->my[cmdhdr_index].dmabuf_cache_gen;
+	}
+	for (i = 0; i < prdtl; i += n) {
+		n = prdtl - i;
+		if (n > AHCI_COPY_BATCH)
+			n = AHCI_COPY_BATCH;
+		for (j = 0; j < n; j++) {
+			dba = cmdtbl->prdt[i + j].dba;
+			dbau = cmdtbl->prdt[i + j].dbau;
+			dbc = (cmdtbl->prdt[i + j].dbc & 0x3FFFFE) + 2;
 			ASSERT (remain >= dbc);
 			remain -= dbc;
-			db_phys = ahci_get_phys (dba & ~1, dbau);
-			gbuf = mapmem_gphys (db_phys, dbc, 0);
-			memcpy (mybuf, gbuf, dbc);
-			mybuf += dbc;
-			unmapmem (gbuf, dbc);
+			db_phys[j] = ahci_get_phys (dba & ~1, dbau);
+			db_len[j] = dbc;
 		}
-	} else {
-		/* copy shadow buffer to guest buffer */
-		for (i = 0; i < prdtl; i++) {
-			dba = cmdtbl->prdt[i].dba;
-			dbau = cmdtbl->prdt[i].dbau;
-			dbc = (cmdtbl->prdt[i].dbc & 0x3FFFFE) + 2;
-			ASSERT (remain >= dbc);
-			remain -= dbc;
-			db_phys = ahci_get_phys (dba & ~1, dbau);
-			gbuf = mapmem_gphys (db_phys, dbc, MAPMEM_WRITE);
-			memcpy (gbuf, mybuf, dbc);
-			mybuf += dbc;
-			unmapmem (gbuf, dbc);
+		mapmem_batch (MAPMEM_GPHYS | (wr ? 0 : MAPMEM_WRITE), db_phys,
+			      db_len, gbuf, n);
+		if (crypt) {
+			for (j = 0; j < n; j++) {
+				sg[j].buf = gbuf[j];
+				sg[j].len = db_len[j];
+			}
+			storage_handle_sectors_sg (port->storage_device,
+						   &access, dmabuf,
+						   mybuf - dmabuf, sg, n);
+			for (j = 0; j < n; j++)
+				mybuf += db_len[j];
+			unmapmem_batch (gbuf, db_len, n);
+			continue;
 		}
+		for (j = 0; j < n; j++) {
+			if (wr)	/* copy guest buffer to shadow buffer */
+				memcpy_nt (mybuf, gbuf[j], db_len[j]);
+			else	/* copy shadow buffer to guest buffer */
+				memcpy (gbuf[j], mybuf, db_len[j]);
+			mybuf += db_len[j];
+		}
+		unmapmem_batch (gbuf, db_len, n);
 	}
 	ASSERT (remain == 0);
 }
@@ -527,6 +649,7 @@ ahci_probe (struct ahci_data *ad, bool wrote_ghc, u32 value)
 	ad->enabled = true;
 	ad->hc_addr.num_ports = num_of_ports;
 	ad->hc_addr.ncq = !!(cap & GLOBAL_CAP_SNCQ_BIT);
+	ad->hc_addr.sg = true;
 	ad->ncs = ((cap & GLOBAL_CAP_NCS_MASK) >> GLOBAL_CAP_NCS_SHIFT) + 1;
 	ahci_ae_bit_changed (ad);
 	return true;
@@ -598,7 +721,7 @@ ahci_port_data_init (struct ahci_data *ad, int port_num)
 
 	port = &ad->port[port_num];
 	alloc_page (&virt, &phys);
-	memset (virt, 0, PAGESIZE);
+	memzero_page (virt);
 	port->mycmdlist = virt;
 	port->myclb = phys;
 	port->myclbu = phys >> 32;
@@ -608,6 +731,7 @@ ahci_port_data_init (struct ahci_data *ad, int port_num)
 		port->my[i].cmdtbl_p = phys;
 		port->my[i].dmabuf = NULL;
 	}
+	port->dmabuf_nkeep = 0;
 	port->storage_device = storage_new (STORAGE_TYPE_AHCI, ad->host_id,
 					    port_num, NULL, NULL);
 	port->atapi = false;
@@ -822,7 +946,6 @@ ahci_cmd_prehook (struct ahci_data *ad, struct ahci_port *port,
 	u8 *acmd;
 	union cmdfis *cfis;
 	ata_cmd_type_t type;
-	struct storage_access access;
 
 	cfis = &port->my[cmdhdr_index].cmdtbl->cfis;
 	acmd = port->my[cmdhdr_index].cmdtbl->acmd;
@@ -841,41 +964,17 @@ ahci_cmd_prehook (struct ahci_data *ad, struct ahci_port *port,
 							    type.rw, type.ext);
 		ASSERT (!port->my[cmdhdr_index].dmabuf_rwflag || !port->atapi);
 	}
-	if (!port->my[cmdhdr_index].dmabuf_rwflag)
-		return;
-	if (!port->mycmdlist->cmdhdr[cmdhdr_index].w) /* read */
-		return;
-	access.rw = 1;
-	access.lba = port->my[cmdhdr_index].dmabuf_lba;
-	access.count = port->my[cmdhdr_index].dmabuf_nsec;
-	access.sector_size = port->my[cmdhdr_index].dmabuf_ssiz;
-	storage_handle_sectors (port->storage_device, &access,
-				port->my[cmdhdr_index].dmabuf,
-				port->my[cmdhdr_index].dmabuf);
 }
 
 static void
 ahci_cmd_posthook (struct ahci_data *ad, struct ahci_port *port,
 		   int cmdhdr_index)
 {
-	struct storage_access access;
-
 	if (port->my[cmdhdr_index].dmabuf_identify) {
 		/* check atapi or not */
 		ahci_identity_check (ad, port, cmdhdr_index);
 		return;
 	}
-	if (!port->my[cmdhdr_index].dmabuf_rwflag)
-		return;
-	if (port->mycmdlist->cmdhdr[cmdhdr_index].w) /* write */
-		return;
-	access.rw = 0;
-	access.lba = port->my[cmdhdr_index].dmabuf_lba;
-	access.count = port->my[cmdhdr_index].dmabuf_nsec;
-	access.sector_size = port->my[cmdhdr_index].dmabuf_ssiz;
-	storage_handle_sectors (port->storage_device, &access,
-				port->my[cmdhdr_index].dmabuf,
-				port->my[cmdhdr_index].dmabuf);
 }
 
 /************************************************************/
@@ -892,10 +991,12 @@ ahci_cmd_cancel (struct ahci_port *port)
 		if (!(port->shadowbit & (1 << i)))
 			continue;
 		port->shadowbit &= ~(1 << i);
-		if (port->my[i].dmabuf) {
-			free (port->my[i].dmabuf);
-			port->my[i].dmabuf = NULL;
-		}
+		if (port->my[i].dmabuf && port->mycmdlist->cmdhdr[i].w &&
+		    port->my[i].dmabuf_rwflag)
+			storage_cache_write_done (port->storage_device,
+						  port->my[i].dmabuf_lba,
+						  port->my[i].dmabuf_nsec);
+		ahci_dmabuf_free (port, i);
 		if (!port->shadowbit)
 			break;
 	}
@@ -932,9 +1033,13 @@ ahci_cmd_complete (struct ahci_data *ad, struct ahci_port *port, u32 pxsact,
 			if (!(port->mycmdlist->cmdhdr[i].w)) /* read */
 				ahci_copy_dmabuf (port, i, false, cmdtbl,
 						  prdtl);
+			else if (port->my[i].dmabuf_rwflag)
+				storage_cache_write_done
+					(port->storage_device,
+					 port->my[i].dmabuf_lba,
+					 port->my[i].dmabuf_nsec);
 			unmapmem (cmdtbl, cmdtbl_size (prdtl));
-			free (port->my[i].dmabuf);
-			port->my[i].dmabuf = NULL;
+			ahci_dmabuf_free (port, i);
 		} else {
 			ASSERT (port->my[i].dmabuf == NULL);
 		}
@@ -943,6 +1048,69 @@ ahci_cmd_complete (struct ahci_data *ad, struct ahci_port *port, u32 pxsact,
 	unmapmem (cmdlist, sizeof *cmdlist);
 }
 
+/* fill PRDT entries of up to 4MiB each for a physically contiguous
+   buffer and return the number of the entries */
+static int
+ahci_fill_prdt (struct command_table *cmdtbl, phys_t phys, u32 len,
+		unsigned int intrflag)
+{
+	struct prdtbl *prdt;
+	u32 l;
+	int n;
+
+	prdt = &cmdtbl->prdt[0];
+	len = len >= 2 ? (len + 1) & ~1 : 2;
+	for (n = 0; len > 0; n++) {
+		if (n == AHCI_PRDT_MAX)
+			panic ("AHCI: buffer too large for PRDT");
+		l = len > AHCI_PRD_MAXLEN ? AHCI_PRD_MAXLEN : len;
+		prdt[n].dba = phys;
+		prdt[n].dbau = phys >> 32;
+		prdt[n].reserved1 = 0;
+		prdt[n].reserved2 = 0;
+		prdt[n].i = 0;
+		prdt[n].dbc = l - 1;
+		phys += l;
+		len -= l;
+	}
+	prdt[n - 1].i = intrflag;
+	return n;
+}
+
+/* fill PRDT entries for a buffer of separate pages, merging
+   physically contiguous ones, and return the number of the entries.
+   The caller checks that the pages fit in the command table. */
+static int
+ahci_fill_prdt_pages (struct command_table *cmdtbl, phys_t *pages, u32 len)
+{
+	struct prdtbl *prdt;
+	phys_t phys;
+	u32 l;
+	int n, i;
+
+	prdt = &cmdtbl->prdt[0];
+	len = (len + 1) & ~1;
+	for (n = 0, i = 0; len > 0; n++) {
+		if (n == AHCI_PRDT_MAX)
+			panic ("AHCI: too many pages for PRDT");
+		phys = pages[i];
+		l = 0;
+		do {
+			l += len - l > PAGESIZE ? PAGESIZE : len - l;
+			i++;
+		} while (l < len && l + PAGESIZE <= AHCI_PRD_MAXLEN &&
+			 pages[i] == phys + l);
+		prdt[n].dba = phys;
+		prdt[n].dbau = phys >> 32;
+		prdt[n].reserved1 = 0;
+		prdt[n].reserved2 = 0;
+		prdt[n].i = 0;
+		prdt[n].dbc = l - 1;
+		len -= l;
+	}
+	return n;
+}
+
 static void
 ahci_cmd_start (struct ahci_data *ad, struct ahci_port *pt, u32 pxci)
 {
@@ -973,24 +1141,29 @@ ahci_cmd_start (struct ahci_data *ad, struct ahci_port *pt, u32 pxci)
 			if (pt->my[i].dmabuf != NULL)
 				panic ("pt->my[i].dmabuf=%p is not NULL!",
 				       pt->my[i].dmabuf);
-			pt->my[i].dmabuf = alloc2 (totalsize,
-						   &pt->my[i].dmabuf_p);
+			if (!ahci_dmabuf_alloc (pt, i, totalsize))
+				panic ("AHCI: no memory for %u bytes",
+				       totalsize);
 			pt->my[i].dmabuflen = totalsize;
 			pt->mycmdlist->cmdhdr[i].ctba = pt->my[i].cmdtbl_p;
 			pt->mycmdlist->cmdhdr[i].ctbau =
 				pt->my[i].cmdtbl_p >> 32;
 			memcpy (pt->my[i].cmdtbl, cmdtbl, 0x80);
-			pt->my[i].cmdtbl->prdt[0].dba = pt->my[i].dmabuf_p;
-			pt->my[i].cmdtbl->prdt[0].dbau =
-				pt->my[i].dmabuf_p >> 32;
-			pt->my[i].cmdtbl->prdt[0].reserved1 = 0;
-			pt->my[i].cmdtbl->prdt[0].reserved2 = 0;
-			pt->my[i].cmdtbl->prdt[0].dbc = (totalsize - 2) | 1;
-			pt->my[i].cmdtbl->prdt[0].i = intrflag;
-			pt->mycmdlist->cmdhdr[i].prdtl = 1;
-			if (pt->mycmdlist->cmdhdr[i].w) /* write */
-				ahci_copy_dmabuf (pt, i, true, cmdtbl, prdtl);
+			pt->mycmdlist->cmdhdr[i].prdtl =
+				ahci_fill_prdt (pt->my[i].cmdtbl,
+						pt->my[i].dmabuf_p, totalsize,
+						intrflag);
 			ahci_cmd_prehook (ad, pt, i);
+			if (pt->mycmdlist->cmdhdr[i].w) { /* write */
+				if (pt->my[i].dmabuf_rwflag)
+					storage_cache_write_start
+						(pt->storage_device,
+						 pt->my[i].dmabuf_lba,
+						 pt->my[i].dmabuf_nsec);
+				ahci_copy_dmabuf (pt, i, true, cmdtbl, prdtl);
+			} else
+				pt->my[i].dmabuf_cache_gen =
+					storage_cache_gen ();
 			unmapmem (cmdtbl, cmdtbl_size (prdtl));
 		} else {
 			ASSERT (pt->my[i].dmabuf == NULL);
@@ -1194,17 +1367,43 @@ iohandler (core_io_t io, union mem *data, void *arg)
 /************************************************************/
 /* storage_io related functions */
 
+/* Returns false if a shadow buffer is needed and cannot be
+ * allocated, or if the pages of the buffer do not fit in the PRDT */
+static bool
+ahci_command_buf (struct ahci_port *port, int slot,
+		  struct storage_hc_dev_atacmd *cmd)
+{
+	port->my[slot].dmabuf_pages = NULL;
+	if (cmd->buf_pages) {
+		/* the PRDT is filled from the page list */
+		if ((cmd->buf_len + PAGESIZE - 1) / PAGESIZE > AHCI_PRDT_MAX)
+			return false;
+		port->my[slot].dmabuf = NULL;
+		port->my[slot].dmabuf_pages = cmd->buf_pages;
+		return true;
+	}
+	if (cmd->buf_phys && !(cmd->buf_phys & 0x7F) && !(cmd->buf_len & 1) &&
+	    cmd->buf_len >= 2) {
+		port->my[slot].dmabuf = NULL;
+		port->my[slot].dmabuf_p = cmd->buf_phys;
+		return true;
+	}
+	if (!ahci_dmabuf_alloc (port, slot, (cmd->buf_len + 0x7F) & ~0x7F))
+		return false;
+	if (cmd->write)
+		memcpy (port->my[slot].dmabuf, cmd->buf, cmd->buf_len);
+	return true;
+}
+
 static void
 ahci_command_fill (struct ahci_port *port, int slot,
 		   struct storage_hc_dev_atacmd *cmd)
 {
 	struct command_header *cmdhdr;
 	struct cmdfis_0x27 *cfis;
-	struct prdtbl *prdt;
 
 	cmdhdr = &port->mycmdlist->cmdhdr[slot];
 	memset (cmdhdr, 0, sizeof *cmdhdr);
-	cmdhdr->prdtl = 1;
 	cmdhdr->w = !!cmd->write;
 	cmdhdr->cfl = 5;
 	cmdhdr->ctba = port->my[slot].cmdtbl_p;
@@ -1228,27 +1427,30 @@ ahci_command_fill (struct ahci_port *port, int slot,
 		cfis->sector_count |= slot << 3;
 	cfis->sector_count_exp = cmd->sector_count_exp;
 	cfis->control = cmd->control;
-	if (cmd->buf_phys && !(cmd->buf_phys & 0x7F) && !(cmd->buf_len & 1) &&
-	    cmd->buf_len >= 2) {
-		port->my[slot].dmabuf = NULL;
-		port->my[slot].dmabuf_p = cmd->buf_phys;
-	} else {
-		port->my[slot].dmabuf = alloc2 ((cmd->buf_len + 0x7F) & ~0x7F,
-						&port->my[slot].dmabuf_p);
-		if (cmd->write)
-			memcpy (port->my[slot].dmabuf, cmd->buf, cmd->buf_len);
-	}
-	prdt = &port->my[slot].cmdtbl->prdt[0];
-	prdt[0].dba = port->my[slot].dmabuf_p;
-	prdt[0].dbau = port->my[slot].dmabuf_p >> 32;
-	if (cmd->buf_len >= 2) {
-		if (cmd->buf_len <= 0x400000)
-			prdt[0].dbc = (cmd->buf_len - 2) | 1;
-		else
-			prdt[0].dbc = 0x3FFFFF;
-	} else {
-		prdt[0].dbc = 0x1;
-	}
+	if (port->my[slot].dmabuf_pages)
+		cmdhdr->prdtl = ahci_fill_prdt_pages (port->my[slot].cmdtbl,
+						      port->my[slot].
+						      dmabuf_pages,
+						      cmd->buf_len);
+	else
+		cmdhdr->prdtl = ahci_fill_prdt (port->my[slot].cmdtbl,
+						port->my[slot].dmabuf_p,
+						cmd->buf_len, 0);
+}
+
+static void
+ahci_stat_update (struct ahci_port *port, u64 latency, int len)
+{
+	int i;
+
+	latency >>= AHCI_LAT_SHIFT;
+	for (i = 0; latency && i < AHCI_LAT_BUCKETS - 1; i++)
+		latency >>= 1;
+	spinlock_lock (&port->stat.lock);
+	port->stat.count++;
+	port->stat.bytes_kb += len >> 10;
+	port->stat.hist[i]++;
+	spinlock_unlock (&port->stat.lock);
 }
 
 static enum ahci_command_do_ret
@@ -1292,6 +1494,8 @@ ahci_command_do (struct ahci_data *ad, struct ahci_command_list *p,
 	}
 	if (p->cmd->ncq) {
 		slot = p->cmd->ncq;
+		if (slot > ad->ncs)
+			slot = ad->ncs;
 		if (pxci && !pxsact)
 			goto not_ready;
 	} else {
@@ -1311,6 +1515,10 @@ not_ready:
 		return COMMAND_SKIPPED;
 	}
 found:
+	if (!ahci_command_buf (port, slot, p->cmd)) {
+		p->cmd->timeout_ready = -1;
+		return COMMAND_FAILED;
+	}
 	if (!data->port[pno].queued++) {
 		if (pxsact || pxci) {
 			data->port[pno].fis = NULL;
@@ -1399,9 +1607,9 @@ ahci_command_completion (struct ahci_data *ad, struct ahci_command_list *p,
 	if (port->my[slot].dmabuf) {
 		if (!cmd->write)
 			memcpy (cmd->buf, port->my[slot].dmabuf, cmd->buf_len);
-		free (port->my[slot].dmabuf);
-		port->my[slot].dmabuf = NULL;
+		ahci_dmabuf_free (port, slot);
 	}
+	ahci_stat_update (port, time - p->start_time, cmd->buf_len);
 	fis = data->port[pno].fis;
 	if (fis) {
 		cmd->command_status = fis->rfis.fis_0x34.status;
@@ -1781,9 +1989,14 @@ ahci_new (struct pci_device *pci_device)
 	spinlock_init (&ad->locked_lock);
 	ad->locked = false;
 	ad->waiting = 0;
-	for (i = 0; i < NUM_OF_AHCI_PORTS; i++)
+	for (i = 0; i < NUM_OF_AHCI_PORTS; i++) {
 		ad->port[i].storage_device = NULL;
+		spinlock_init (&ad->port[i].stat.lock);
+	}
 	ad->host_id = ahci_host_id++;
+	spinlock_lock (&ahci_list_lock);
+	LIST1_ADD (ahci_list, ad);
+	spinlock_unlock (&ahci_list_lock);
 	pci_device->driver->options.use_base_address_mask_emulation = 1;
 	return ad;
 }
@@ -1835,3 +2048,62 @@ ahci_config_write (void *ahci_data, struct pci_device *pci_device,
 	}
 	return false;
 }
+
+/* Ports without commands issued by the VMM are not shown */
+static char *
+ahci_status (void)
+{
+	static char buf[4096];
+	struct ahci_data *ad;
+	struct ahci_port *port;
+	int i, j, len;
+	u64 now;
+	u32 count;
+
+	len = snprintf (buf, sizeof buf, "AHCI commands:\n");
+	spinlock_lock (&ahci_list_lock);
+	LIST1_FOREACH (ahci_list, ad) {
+		for (j = 0; j < NUM_OF_AHCI_PORTS && len < sizeof buf; j++) {
+			port = &ad->port[j];
+			spinlock_lock (&port->stat.lock);
+			now = get_time ();
+			count = port->stat.count;
+			if (!count) {
+				spinlock_unlock (&port->stat.lock);
+				continue;
+			}
+			len += snprintf (buf + len, sizeof buf - len,
+					 " %d:%d: %u (%llu/s) %u KiB\n"
+					 "  Latency histogram (%uus buckets,"
+					 " doubling):", ad->host_id, j, count,
+					 muldiv64 (count -
+						   port->stat.last_count,
+						   1000000, now -
+						   port->stat.last_time),
+					 port->stat.bytes_kb,
+					 1 << AHCI_LAT_SHIFT);
+			for (i = 0; i < AHCI_LAT_BUCKETS && len < sizeof buf;
+			     i++)
+				len += snprintf (buf + len, sizeof buf - len,
+						 " %u", port->stat.hist[i]);
+			if (len < sizeof buf)
+				len += snprintf (buf + len, sizeof buf - len,
+						 "\n");
+			port->stat.last_count = count;
+			port->stat.last_time = now;
+			spinlock_unlock (&port->stat.lock);
+		}
+	}
+	spinlock_unlock (&ahci_list_lock);
+	return buf;
+}
+
+static void
+ahci_init_status (void)
+{
+	spinlock_init (&ahci_list_lock);
+	LIST1_HEAD_INIT (ahci_list);
+	register_status_callback (ahci_status);
+}
+
+INITFUNC ("paral01", ahci_init_status);
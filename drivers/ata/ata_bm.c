@@ -52,6 +52,7 @@ static void ata_dma_handle_rw_sectors(struct ata_channel *channel, int rw)
 	access.lba = channel->lba;
 	access.count = channel->sector_count;
 	access.sector_size = ata_get_ata_device(channel)->storage_sector_size;
+	access.cache_gen = 0;
 	if (channel->atapi_device->atapi_flag != 0 && 
 			channel->atapi_device->dma_state != ATA_STATE_DMA_READY)
 		goto end;
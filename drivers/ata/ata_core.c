@@ -363,6 +363,7 @@ static int ata_handle_pio_data(struct ata_channel *channel, int rw)
 	access.lba = channel->lba;
 	access.count = 1;
 	access.sector_size = ata_get_ata_device(channel)->storage_sector_size;
+	access.cache_gen = 0;
 	storage_premap_handle_sectors (ata_get_storage_device(channel),
 				       &access, channel->pio_buf,
 				       channel->pio_buf,
@@ -117,7 +117,7 @@ ata_init_pio_buf (struct ata_channel *channel)
 	void *buf;
 
 	alloc_page (&buf, NULL);
-	memset (buf, 0, PAGESIZE);
+	memzero_page (buf);
 	channel->pio_buf = buf;
 	channel->pio_buf_premap = storage_premap_buf (buf, PAGESIZE);
 }
@@ -181,6 +181,7 @@ static void ata_new(struct pci_device *pci_device, bool ahci_flag)
 	host->hc_addr.type = STORAGE_HC_TYPE_ATA;
 	host->hc_addr.num_ports = 2;
 	host->hc_addr.ncq = false;
+	host->hc_addr.sg = false;
 	spinlock_init (&host->ata_cmd_lock);
 	LIST1_HEAD_INIT (host->ata_cmd_list);
 	host->ata_cmd_thread = false;
@@ -101,6 +101,9 @@ static int iotype_get_size(enum iotype iotype)
  * I/O handler
  **********************************************************************/
 #define MAX_HD 64
+#define CORE_IO_CHAIN_MAX	8	/* handlers per port */
+#define CORE_IO_NUM_CHAINS	256
+#define CORE_IO_NUM_PORTS	0x10000
 static int hd_num = 0;
 struct handler_descriptor {
 	u32 start, end;
@@ -112,52 +115,117 @@ struct handler_descriptor {
 } *handler_descriptor[MAX_HD] = { NULL };
 spinlock_t handler_descriptor_lock;
 
+/* Handlers of a port in calling order.  Chains are shared by ports
+ * with the same handlers and never modified after they are added, so
+ * a port only holds an index. */
+struct core_io_chain {
+	int n;
+	u8 hd[CORE_IO_CHAIN_MAX];
+};
+
+struct core_io_call {
+	core_io_handler_t handler;
+	void *arg;
+};
+
+static struct core_io_chain core_io_chains[CORE_IO_NUM_CHAINS];
+static int core_io_num_chains;	/* chain 0 is the empty chain */
+static u8 *core_io_port_chain;
+
 struct handler_descriptor *alloc_handler_descriptor()
 {
 	return alloc(sizeof(struct handler_descriptor));
 }
 
+/* CORE_IO_PRIO_HIGH handlers first, then the others in the order of
+ * registration */
+static void core_io_chain_build(u32 port, struct core_io_chain *chain)
+{
+	struct handler_descriptor *d;
+	int hd, high;
+
+	memset(chain, 0, sizeof *chain);
+	for (high = 1; high >= 0; high--) {
+		for (hd = 0; hd < MAX_HD; hd++) {
+			d = handler_descriptor[hd];
+			if (d == NULL || !d->enabled ||
+			    d->start > port || d->end < port ||
+			    (d->priority == CORE_IO_PRIO_HIGH) != high)
+				continue;
+			if (chain->n >= CORE_IO_CHAIN_MAX)
+				panic("too many I/O handlers for port %04x\n",
+				      port);
+			chain->hd[chain->n++] = hd;
+		}
+	}
+}
 
-static enum ioact core_iofunc(enum iotype iotype, u32 port, void *data)
+static int core_io_chain_add(struct core_io_chain *chain)
 {
-	int i, hd, ret = CORE_IO_RET_DEFAULT;
-	core_io_t io;
-	core_io_handler_t handler;
-	void *arg;
-	bool hooked = false;
+	int i;
 
-	io.port = port;
-	io.size = iotype_get_size(iotype);
-	io.dir = iotype_is_out(iotype);
+	for (i = 0; i < core_io_num_chains; i++)
+		if (!memcmp(&core_io_chains[i], chain, sizeof *chain))
+			return i;
+	if (core_io_num_chains >= CORE_IO_NUM_CHAINS)
+		return -1;
+	core_io_chains[core_io_num_chains] = *chain;
+	return core_io_num_chains++;
+}
 
-	spinlock_lock(&handler_descriptor_lock);
-	for (i = 0, hd = 0; i < hd_num; i++, hd++) {
-		while (handler_descriptor[hd] == NULL)
-			hd++;
-		if (hd > MAX_HD)
-			panic("hd overflow\n");
-
-		if (handler_descriptor[hd]->enabled != true ||
-		    handler_descriptor[hd]->start > port ||
-		    handler_descriptor[hd]->end < port)
-			continue;
+/* handler_descriptor_lock must be locked */
+static void core_io_update_chains(u32 start, u32 end)
+{
+	struct core_io_chain chain;
+	u32 port;
+	int i;
+	bool rebuilt = false;
+
+retry:
+	for (port = start; port <= end && port < CORE_IO_NUM_PORTS; port++) {
+		core_io_chain_build(port, &chain);
+		i = core_io_chain_add(&chain);
+		if (i < 0) {
+			if (rebuilt)
+				panic("too many distinct I/O handler chains\n");
+			/* drop chains no longer used and rebuild all */
+			rebuilt = true;
+			core_io_num_chains = 1;
+			memset(core_io_port_chain, 0, CORE_IO_NUM_PORTS);
+			start = 0;
+			end = CORE_IO_NUM_PORTS - 1;
+			goto retry;
+		}
+		core_io_port_chain[port] = i;
+	}
+}
 
-		handler = handler_descriptor[hd]->handler;
-		arg = handler_descriptor[hd]->arg;
+/* handler_descriptor_lock must be locked */
+static int core_io_get_calls(u32 port, struct core_io_call *call)
+{
+	struct core_io_chain *chain;
+	struct handler_descriptor *d;
+	int i;
 
-		spinlock_unlock(&handler_descriptor_lock);
-		ret = handler(io, data, arg);
-		spinlock_lock(&handler_descriptor_lock);
+	chain = &core_io_chains[core_io_port_chain[port]];
+	for (i = 0; i < chain->n; i++) {
+		d = handler_descriptor[chain->hd[i]];
+		call[i].handler = d->handler;
+		call[i].arg = d->arg;
+	}
+	return chain->n;
+}
 
-		hooked = true;
+static void core_io_do_calls(struct core_io_call *call, int n, core_io_t io,
+			     void *data)
+{
+	int i, ret = CORE_IO_RET_DEFAULT;
 
+	for (i = 0; i < n; i++) {
+		ret = call[i].handler(io, data, call[i].arg);
 		if (ret != CORE_IO_RET_NEXT)
 			break;
 	}
-	if (!hooked)
-		for (i = 0; i < io.size; i++)
-			set_iofunc (port + i, do_iopass_default);
-	spinlock_unlock(&handler_descriptor_lock);
 
 	switch (ret) {
 	case CORE_IO_RET_DEFAULT:
@@ -181,9 +249,56 @@ static enum ioact core_iofunc(enum iotype iotype, u32 port, void *data)
 		}
 		break;
 	}
+}
+
+static enum ioact core_iofunc(enum iotype iotype, u32 port, void *data)
+{
+	struct core_io_call call[CORE_IO_CHAIN_MAX];
+	core_io_t io;
+	int i, n;
+
+	io.port = port;
+	io.size = iotype_get_size(iotype);
+	io.dir = iotype_is_out(iotype);
+
+	spinlock_lock(&handler_descriptor_lock);
+	n = core_io_get_calls(port, call);
+	if (!n)
+		for (i = 0; i < io.size; i++)
+			set_iofunc (port + i, do_iopass_default);
+	spinlock_unlock(&handler_descriptor_lock);
+
+	core_io_do_calls(call, n, io, data);
 	return IOACT_CONT;
 }
 
+/* all the elements of a string I/O instruction with one lookup */
+static u32 core_iofunc_str(enum iotype iotype, u32 port, void *data,
+			   u32 count)
+{
+	struct core_io_call call[CORE_IO_CHAIN_MAX];
+	core_io_t io;
+	u32 i;
+	int n;
+
+	io.port = port;
+	io.size = iotype_get_size(iotype);
+	io.dir = iotype_is_out(iotype);
+
+	spinlock_lock(&handler_descriptor_lock);
+	n = core_io_get_calls(port, call);
+	if (!n)
+		for (i = 0; i < io.size; i++)
+			set_iofunc (port + i, do_iopass_default);
+	spinlock_unlock(&handler_descriptor_lock);
+	/* the caller emulates the instruction element by element */
+	if (!n)
+		return 0;
+	for (i = 0; i < count; i++)
+		core_io_do_calls(call, n, io, (u8 *)data + i * io.size);
+	return count;
+}
+
 /** 
  * @brief		core_io_register_handler
  * @param start		start port
@@ -222,9 +337,11 @@ int core_io_register_handler(ioport_t start, size_t num, core_io_handler_t handl
 		hd_num++;
 		break;
 	}
-	if (hd < MAX_HD && handler_descriptor[hd]->enabled)
+	if (hd < MAX_HD && handler_descriptor[hd]->enabled) {
+		core_io_update_chains(start, end);
 		for (i = 0; i < num; i++)
 			set_iofunc (start + i, core_iofunc);
+	}
 	spinlock_unlock(&handler_descriptor_lock);
 	if (hd >= MAX_HD)
 		goto oom;
@@ -247,12 +364,21 @@ int core_io_modify_handler(int hd, ioport_t start, size_t num)
 {
 	int i;
 	ioport_t end = start + num - 1;
+	u32 old_start, old_end;
+	bool old_enabled;
 
 	spinlock_lock(&handler_descriptor_lock);
 	if (0 <= hd && hd < MAX_HD && handler_descriptor[hd] != NULL) {
+		old_start = handler_descriptor[hd]->start;
+		old_end = handler_descriptor[hd]->end;
+		old_enabled = handler_descriptor[hd]->enabled;
 		handler_descriptor[hd]->start = start;
 		handler_descriptor[hd]->end = end;
 		handler_descriptor[hd]->enabled = end >= start ? true : false;
+		if (old_enabled)
+			core_io_update_chains(old_start, old_end);
+		if (handler_descriptor[hd]->enabled)
+			core_io_update_chains(start, end);
 	}
 	if (handler_descriptor[hd]->enabled)
 		for (i = 0; i < num; i++)
@@ -272,9 +398,13 @@ int core_io_unregister_handler(int hd)
 	printf("%s: port: %04x-%04x\n", __func__, handler_descriptor[hd]->start, handler_descriptor[hd]->end);
 	spinlock_lock(&handler_descriptor_lock);
 	if (0 <= hd && hd < MAX_HD && handler_descriptor[hd] != NULL) {
+		struct handler_descriptor *d = handler_descriptor[hd];
+
 		// free(handler_descriptor[hd]);
 		handler_descriptor[hd] = NULL;
 		hd_num--;
+		if (d->enabled)
+			core_io_update_chains(d->start, d->end);
 	}
 	spinlock_unlock(&handler_descriptor_lock);
 	return -1;
@@ -326,5 +456,9 @@ void panic_oom()
 void core_init()
 {
 	spinlock_init(&handler_descriptor_lock);
+	core_io_num_chains = 1;
+	core_io_port_chain = alloc(CORE_IO_NUM_PORTS);
+	memset(core_io_port_chain, 0, CORE_IO_NUM_PORTS);
+	set_iofunc_str(core_iofunc, core_iofunc_str);
 }
 CORE_INIT(core_init);
@@ -31,7 +31,9 @@
 
 #include <core.h>
 #include <core/mmio.h>
+#include <core/timer.h>
 #include <net/netapi.h>
+#include "netrx.h"
 #include "pci.h"
 #include "virtio_net.h"
 
@@ -125,6 +127,9 @@ struct bnx {
 	u32 rx_retr_consumer;
 	void **rx_buf;
 	bool rx_enabled;
+	struct netrx rx;
+	void *rx_timer;
+	bool rx_timer_armed;
 
 	struct netdata *nethandle;
 	net_recv_callback_t *recvphys_func;
@@ -152,6 +157,8 @@ struct bnx {
 #define BNXREG_RX_MACMODE	0x468
 #define BNXREG_HMBOX_TX_PROD	0x304
 #define BNXREG_STAT_MODE	0x3C00
+#define BNXREG_HCC_RX_TICKS	0x3C08
+#define BNXREG_HCC_RX_MAXFRAMES	0x3C10
 #define BNXREG_STAT_BLKADDR	0x3C38
 #define BNXREG_RXRCB_PROD_RINGADDR 0x2450
 #define BNXREG_RXRCB_PROD_LENFLAGS 0x2458
@@ -506,6 +513,21 @@ bnx_handle_status (struct bnx *bnx)
 	spinlock_unlock (&bnx->status_lock);
 }
 
+/* adapt the receive coalescing to the receive rate */
+static void
+bnx_moderate (struct bnx *bnx)
+{
+	static const u32 ticks[] = { 0, 20, 100 }; /* usec */
+	static const u32 frames[] = { 1, 8, 32 };
+
+	if (!netrx_moderate (&bnx->rx))
+		return;
+	spinlock_lock (&bnx->reg_lock);
+	bnx_mmiowrite32 (bnx, BNXREG_HCC_RX_TICKS, ticks[bnx->rx.level]);
+	bnx_mmiowrite32 (bnx, BNXREG_HCC_RX_MAXFRAMES, frames[bnx->rx.level]);
+	spinlock_unlock (&bnx->reg_lock);
+}
+
 static void
 bnx_handle_recv (struct bnx *bnx)
 {
@@ -518,7 +540,8 @@ bnx_handle_recv (struct bnx *bnx)
 	if (!bnx->rx_enabled)
 		return;
 
-	for (i = 0; i < 16; i++) {
+	netrx_poll_start (&bnx->rx);
+	for (i = 0; i < bnx->rx.budget; i++) {
 		if (bnx_ring_is_empty (bnx->rx_retr_producer,
 				       bnx->rx_retr_consumer))
 			break;
@@ -534,6 +557,9 @@ bnx_handle_recv (struct bnx *bnx)
 			buf = bnx->rx_buf[desc.index];
 			buf_len = desc.length;
 			bnx_call_recv (bnx, buf, buf_len);
+			netrx_packet (&bnx->rx, buf_len);
+		} else {
+			netrx_drop (&bnx->rx);
 		}
 		bnx_ring_update (&bnx->rx_retr_consumer,
 				 bnx->rx_retr_ring_len);
@@ -550,6 +576,13 @@ bnx_handle_recv (struct bnx *bnx)
 	bnx_mmiowrite32 (bnx, BNXREG_HMBOX_RX_CONS0, bnx->rx_retr_consumer);
 	bnx_mmiowrite32 (bnx, BNXREG_HMBOX_RX_PROD,  bnx->rx_prod_producer);
 	spinlock_unlock (&bnx->reg_lock);
+	if (netrx_poll_done (&bnx->rx, num) && !bnx->rx_timer_armed) {
+		/* Under load, the rest is received by polling so that
+		 * the current processor returns to the guest. */
+		bnx->rx_timer_armed = true;
+		timer_set (bnx->rx_timer, NETRX_POLL_USEC);
+	}
+	bnx_moderate (bnx);
 	if (num) {
 		printd (15, "Received %d packets ("
 			"Return Producer: %d, Consumer: %d / "
@@ -818,6 +851,18 @@ poll_physnic (void *handle)
 	bnx_handle_status (bnx);
 }
 
+static void
+bnx_rx_timer (void *handle, void *data)
+{
+	struct bnx *bnx = data;
+
+	spinlock_lock (&bnx->status_lock);
+	bnx->rx_timer_armed = false;
+	if (bnx->status_enabled)
+		bnx_handle_recv (bnx);
+	spinlock_unlock (&bnx->status_lock);
+}
+
 static struct nicfunc phys_func = {
 	.get_nic_info = getinfo_physnic,
 	.send = send_physnic,
@@ -988,6 +1033,8 @@ bnx_new (struct pci_device *pci_device)
 	spinlock_init (&bnx->rx_lock);
 	spinlock_init (&bnx->status_lock);
 	spinlock_init (&bnx->reg_lock);
+	netrx_init (&bnx->rx, "bnx", 0);
+	bnx->rx_timer = timer_new (bnx_rx_timer, bnx);
 	bnx_pci_init (bnx);
 	bnx_mmio_init (bnx);
 	bnx_ring_alloc (bnx);
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2026 BitVisor contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Budgeted receive processing and adaptive interrupt moderation
+ * shared by the NIC drivers.  The drivers own their rings and locks;
+ * this file only keeps the policy and the statistics. */
+
+#include <core.h>
+#include <core/initfunc.h>
+#include <core/time.h>
+#include <core/vmmcall_status.h>
+#include "netrx.h"
+
+#define NETRX_WINDOW_USEC	10000	/* moderation decision interval */
+#define NETRX_NORMAL_PKTS	100	/* packets per window */
+#define NETRX_BULK_PKTS		500
+#define NETRX_BULK_BYTES	500000	/* bytes per window */
+
+static struct netrx *netrx_list;
+static spinlock_t netrx_lock;
+
+void
+netrx_init (struct netrx *rx, char *name, int queue)
+{
+	memset (rx, 0, sizeof *rx);
+	rx->name = name;
+	rx->queue = queue;
+	rx->budget = NETRX_BUDGET;
+	rx->level = NETRX_LEVEL_LATENCY;
+	rx->window_start = get_time ();
+	spinlock_lock (&netrx_lock);
+	rx->next = netrx_list;
+	netrx_list = rx;
+	spinlock_unlock (&netrx_lock);
+}
+
+/* set rx->budget for a poll.  Timers expire in schedule() calls, so
+   a continuation poll may come much later than NETRX_POLL_USEC while
+   the ring keeps filling; the budget grows with the time elapsed. */
+void
+netrx_poll_start (struct netrx *rx)
+{
+	u64 elapsed;
+
+	rx->budget = NETRX_BUDGET;
+	if (!rx->polling)
+		return;
+	elapsed = get_time () - rx->poll_time;
+	if (elapsed >= (u64)NETRX_POLL_USEC * NETRX_BUDGET_MAX / NETRX_BUDGET)
+		rx->budget = NETRX_BUDGET_MAX;
+	else if (elapsed > NETRX_POLL_USEC)
+		rx->budget = (u32)elapsed * NETRX_BUDGET / NETRX_POLL_USEC;
+}
+
+/* account a poll which processed done packets */
+/* return value: true if the budget was exhausted and the queue
+   should be polled again instead of waiting for an interrupt */
+bool
+netrx_poll_done (struct netrx *rx, int done)
+{
+	rx->polls++;
+	rx->polling = done >= rx->budget;
+	if (rx->polling) {
+		rx->exhausted++;
+		rx->poll_time = get_time ();
+	}
+	return rx->polling;
+}
+
+/* choose a moderation level from the rate of the last window */
+/* return value: true if rx->level has been changed */
+bool
+netrx_moderate (struct netrx *rx)
+{
+	enum netrx_level level;
+	u64 now, elapsed, packets, bytes;
+
+	now = get_time ();
+	elapsed = now - rx->window_start;
+	if (elapsed < NETRX_WINDOW_USEC)
+		return false;
+	/* compare rates scaled to one window without dividing */
+	packets = (u64)rx->window_packets * NETRX_WINDOW_USEC;
+	bytes = (u64)rx->window_bytes * NETRX_WINDOW_USEC;
+	if (packets >= NETRX_BULK_PKTS * elapsed ||
+	    bytes >= NETRX_BULK_BYTES * elapsed)
+		level = NETRX_LEVEL_BULK;
+	else if (packets >= NETRX_NORMAL_PKTS * elapsed)
+		level = NETRX_LEVEL_NORMAL;
+	else
+		level = NETRX_LEVEL_LATENCY;
+	rx->window_start = now;
+	rx->window_packets = 0;
+	rx->window_bytes = 0;
+	if (rx->level == level)
+		return false;
+	rx->level = level;
+	return true;
+}
+
+static char *
+netrx_status (void)
+{
+	static char buf[1024];
+	static const char *levels[] = { "latency", "normal", "bulk" };
+	struct netrx *rx;
+	int len;
+
+	spinlock_lock (&netrx_lock);
+	len = snprintf (buf, sizeof buf, "NIC receive queues:\n");
+	for (rx = netrx_list; rx && len < sizeof buf; rx = rx->next)
+		len += snprintf (buf + len, sizeof buf - len,
+				 " %s q%d: %llu packets %llu bytes %u drops"
+				 " %u polls %u over budget %s%s\n",
+				 rx->name, rx->queue, rx->packets, rx->bytes,
+				 rx->drops, rx->polls, rx->exhausted,
+				 levels[rx->level],
+				 rx->polling ? " polling" : "");
+	spinlock_unlock (&netrx_lock);
+	return buf;
+}
+
+static void
+netrx_init_status (void)
+{
+	netrx_list = NULL;
+	spinlock_init (&netrx_lock);
+	register_status_callback (netrx_status);
+}
+
+INITFUNC ("paral01", netrx_init_status);
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026 BitVisor contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NETRX_H
+#define _NETRX_H
+
+#include <core/types.h>
+
+#define NETRX_BUDGET		64	/* packets per poll */
+#define NETRX_BUDGET_MAX	1024	/* packets per late poll */
+#define NETRX_POLL_USEC		50	/* polling interval under load */
+
+/* interrupt moderation levels chosen from the receive rate */
+enum netrx_level {
+	NETRX_LEVEL_LATENCY,	/* few packets: interrupt at once */
+	NETRX_LEVEL_NORMAL,
+	NETRX_LEVEL_BULK,	/* many or large packets: coalesce */
+};
+
+/* per receive queue state */
+struct netrx {
+	struct netrx *next;
+	char *name;
+	int queue;
+	int budget;
+	bool polling;
+	u64 poll_time;		/* when polling was requested */
+	enum netrx_level level;
+	u64 window_start;
+	u32 window_packets, window_bytes;
+	u64 packets, bytes;
+	u32 drops, polls, exhausted;
+};
+
+void netrx_init (struct netrx *rx, char *name, int queue);
+void netrx_poll_start (struct netrx *rx);
+bool netrx_poll_done (struct netrx *rx, int done);
+bool netrx_moderate (struct netrx *rx);
+
+static inline void
+netrx_packet (struct netrx *rx, unsigned int len)
+{
+	rx->packets++;
+	rx->bytes += len;
+	rx->window_packets++;
+	rx->window_bytes += len;
+}
+
+static inline void
+netrx_drop (struct netrx *rx)
+{
+	rx->drops++;
+}
+
+#endif
@@ -31,7 +31,9 @@
 #include <core/initfunc.h>
 #include <core/list.h>
 #include <core/mmio.h>
+#include <core/timer.h>
 #include <net/netapi.h>
+#include "netrx.h"
 #include "pci.h"
 #include "virtio_net.h"
 
@@ -57,6 +59,10 @@ u32 vmm_term_inf() ;
 #define TBUF_SIZE	PAGESIZE
 #define RBUF_SIZE	PAGESIZE
 #define SENDVIRT_MAXSIZE 1514
+#define TX_POST_MAX	32	/* guest descriptors per packet posted */
+#define TSLOT_GUEST	0x10000	/* posted from a guest descriptor */
+#define TSLOT_RS	0x20000	/* the guest requested status report */
+#define TSLOT_IDX_MASK	0xFFFF
 
 struct tdesc {
 	u64 addr;		/* buffer address */
@@ -181,6 +187,12 @@ struct desc_shadow {
 			struct tdesc *td;
 			phys_t td_phys;
 			void *tbuf[NUM_OF_TDESC];
+			phys_t tbuf_phys[NUM_OF_TDESC];
+			u32 tslot[NUM_OF_TDESC]; /* origin of descriptors */
+			u32 clean;	/* next descriptor to reclaim */
+			u32 post;	/* next guest descriptor to post */
+			u32 inflight;	/* posted guest descriptors */
+			bool copying;	/* copying a packet partially */
 		} t;
 		struct {
 			struct rdesc *rd;
@@ -216,6 +228,10 @@ struct data2 {
 	u32 regs_at_init[PCI_CONFIG_REGS32_NUM];
 	bool seize;
 	bool conceal;
+	bool zerocopy;
+	struct netrx rx[2];
+	void *rx_timer;
+	bool rx_timer_armed;
 	LIST1_DEFINE (struct data2);
 
 	void *virtio_net;
@@ -238,8 +254,10 @@ struct data {
 
 static LIST1_DEFINE_HEAD (struct data2, d2list);
 
-static void receive_physnic (struct desc_shadow *s, struct data2 *d2,
-			     uint off2);
+static void pro1000_receive (struct data2 *d2);
+static void tx_reset (struct desc_shadow *s);
+static void tx_reclaim (struct desc_shadow *s, struct data2 *d2, uint off2);
+static void tx_update (struct data2 *d2);
 
 static int
 iohandler (core_io_t io, union mem *data, void *arg)
@@ -283,6 +301,8 @@ write_mydesc (struct desc_shadow *s, struct data2 *d2, uint off2,
 		    TDESC_SIZE)
 			return;
 		*(u32 *)(void *)((u8 *)d2->d1[0].map + off2 + 0x08) = 0;
+		s->u.t.clean = 0;
+		tx_reset (s);
 		*(u32 *)(void *)((u8 *)d2->d1[0].map + off2 + 0x00) =
 			s->u.t.td_phys;
 		*(u32 *)(void *)((u8 *)d2->d1[0].map + off2 + 0x04) = 0;
@@ -328,6 +348,12 @@ send_physnic_sub (struct data2 *d2, UINT num_packets, void **packets,
 	t = *tail;
 	if (h == 0xFFFFFFFF)
 		return;
+	if (d2->zerocopy) {
+		/* guest descriptors may share the ring: reuse only
+		 * the descriptors written back */
+		tx_reclaim (s, d2, off2);
+		h = s->u.t.clean;
+	}
 	for (i = 0; i < num_packets; i++) {
 		nt = t + 1;
 		if (nt >= NUM_OF_TDESC)
@@ -343,13 +369,15 @@ send_physnic_sub (struct data2 *d2, UINT num_packets, void **packets,
 			continue;
 		}
 		memcpy (s->u.t.tbuf[t], packets[i], packet_sizes[i]);
+		s->u.t.tslot[t] = 0;
 		td = &s->u.t.td[t];
+		td->addr = s->u.t.tbuf_phys[t];
 		td->len = packet_sizes[i];
 		td->cso = 0;
 		td->cmd_eop = 1;
 		td->cmd_ifcs = 1;
 		td->cmd_ic = 0;
-		td->cmd_rs = 0;
+		td->cmd_rs = d2->zerocopy;
 		td->cmd_rsv = 0;
 		td->cmd_dext = 0;
 		td->cmd_vle = 0;
@@ -392,10 +420,9 @@ poll_physnic (void *handle)
 	struct data2 *d2 = handle;
 
 	spinlock_lock (&d2->lock);
-	if (d2->rdesc[0].initialized)
-		receive_physnic (&d2->rdesc[0], d2, 0x2800);
-	if (d2->rdesc[1].initialized)
-		receive_physnic (&d2->rdesc[1], d2, 0x2900);
+	if (d2->zerocopy)
+		tx_update (d2);
+	pro1000_receive (d2);
 	spinlock_unlock (&d2->lock);
 }
 
@@ -602,6 +629,7 @@ init_desc_transmit (struct desc_shadow *s, struct data2 *d2, uint off2)
 		for (i = 0; i < NUM_OF_TDESC; i++) {
 			alloc_page (&tmp1, &tmp2);
 			s->u.t.tbuf[i] = tmp1;
+			s->u.t.tbuf_phys[i] = tmp2;
 			s->u.t.td[i].addr = tmp2;
 		}
 	}
@@ -622,7 +650,7 @@ init_desc_receive (struct desc_shadow *s, struct data2 *d2, uint off2)
 		memset (s->u.r.rd, 0, RDESC_SIZE);
 		for (i = 0; i < NUM_OF_RDESC; i++) {
 			alloc_page (&tmp1, &tmp2);
-			memset (tmp1, 0, PAGESIZE);
+			memzero_page (tmp1);
 			s->u.r.rbuf[i] = tmp1;
 			s->u.r.rbuf_premap[i] = net_premap_recvbuf (d2->
 								    nethandle,
@@ -788,6 +816,25 @@ tse_set_next_header (struct data2 *d2)
 	d2->dext0_paylen -= d2->dext0_mss;
 }
 
+static void
+tdesc_context (struct data2 *d2, struct tdesc_dext0 *td0)
+{
+	d2->dext0_tucss = td0->tucss;
+	d2->dext0_tucso = td0->tucso;
+	d2->dext0_tucse = td0->tucse;
+	d2->dext0_ipcss = td0->ipcss;
+	d2->dext0_ipcso = td0->ipcso;
+	d2->dext0_ipcse = td0->ipcse;
+	if (td0->tucmd_tse) {
+		d2->dext0_mss = td0->mss;
+		d2->dext0_hdrlen = td0->hdrlen;
+		d2->dext0_paylen = td0->paylen;
+		d2->tse_first = true;
+	}
+	d2->dext0_ip = td0->tucmd_ip;
+	d2->dext0_tcp = td0->tucmd_tcp;
+}
+
 static int
 process_tdesc (struct data2 *d2, struct tdesc *td)
 {
@@ -805,20 +852,7 @@ process_tdesc (struct data2 *d2, struct tdesc *td)
 		td0 = (void *)td;
 		td1 = (void *)td;
 		if (td0->dtyp == 0) {
-			d2->dext0_tucss = td0->tucss;
-			d2->dext0_tucso = td0->tucso;
-			d2->dext0_tucse = td0->tucse;
-			d2->dext0_ipcss = td0->ipcss;
-			d2->dext0_ipcso = td0->ipcso;
-			d2->dext0_ipcse = td0->ipcse;
-			if (td0->tucmd_tse) {
-				d2->dext0_mss = td0->mss;
-				d2->dext0_hdrlen = td0->hdrlen;
-				d2->dext0_paylen = td0->paylen;
-				d2->tse_first = true;
-			}
-			d2->dext0_ip = td0->tucmd_ip;
-			d2->dext0_tcp = td0->tucmd_tcp;
+			tdesc_context (d2, td0);
 			fixme = 0;
 		} else if (td0->dtyp == 1) {
 			if (d2->len == 0) {
@@ -954,8 +988,214 @@ process_tdesc (struct data2 *d2, struct tdesc *td)
 	return 0;
 }
 
+/* Zero-copy transmission: guest descriptors are posted to the VMM
+ * ring with their buffer addresses translated, and completion is
+ * reported to the guest when the hardware writes back DD.  The guest
+ * descriptors are only read, except for setting DD. */
+
+/* forget guest descriptors posted to the ring */
 static void
-guest_is_transmitting (struct desc_shadow *s, struct data2 *d2)
+tx_reset (struct desc_shadow *s)
+{
+	memset (s->u.t.tslot, 0, sizeof s->u.t.tslot);
+	s->u.t.inflight = 0;
+	s->u.t.copying = false;
+	s->u.t.post = s->head;
+}
+
+/* release descriptors written back by the hardware and report
+ * completion of the guest descriptors posted with them */
+static void
+tx_reclaim (struct desc_shadow *s, struct data2 *d2, uint off2)
+{
+	volatile struct tdesc *td;
+	struct tdesc *gtd;
+	u32 c, t, slot, glen;
+
+	t = *(u32 *)(void *)((u8 *)d2->d1[0].map + off2 + 0x18);
+	if (t >= NUM_OF_TDESC)
+		return;
+	glen = s->len / 16;
+	for (c = s->u.t.clean; c != t; c = (c + 1) % NUM_OF_TDESC) {
+		td = &s->u.t.td[c];
+		if (!td->sta_dd)
+			break;
+		slot = s->u.t.tslot[c];
+		s->u.t.tslot[c] = 0;
+		if (!(slot & TSLOT_GUEST))
+			continue;
+		s->u.t.inflight--;
+		if (slot & TSLOT_RS) {
+			gtd = mapmem_gphys (s->base.ll + (slot & TSLOT_IDX_MASK) *
+					    16, sizeof *gtd, MAPMEM_WRITE);
+			if (gtd) {
+				gtd->sta_dd = 1;
+				unmapmem (gtd, sizeof *gtd);
+			}
+		}
+		s->head = (slot & TSLOT_IDX_MASK) + 1;
+		if (s->head >= glen)
+			s->head = 0;
+	}
+	s->u.t.clean = c;
+	if (!s->u.t.inflight)
+		s->head = s->u.t.post;
+}
+
+static bool
+tdesc_is_eop (struct tdesc *td)
+{
+	struct tdesc_dext1 *td1 = (void *)td;
+
+	if (!td->cmd_dext)
+		return td->cmd_eop;
+	if (td1->dtyp == 0)	/* context descriptor */
+		return false;
+	if (td1->dtyp == 1)
+		return td1->dcmd_eop;
+	return true;
+}
+
+/* translate the buffer address of a descriptor for the hardware */
+static bool
+tdesc_translate (struct tdesc *td)
+{
+	struct tdesc_dext1 *td1 = (void *)td;
+	u64 hphys;
+
+	if (!td->cmd_dext) {
+		if (!gphys_to_hphys (td->addr, td->len, &hphys))
+			return false;
+		td->addr = hphys;
+		return true;
+	}
+	if (td1->dtyp == 0)
+		return true;
+	if (td1->dtyp != 1)
+		return false;
+	if (!gphys_to_hphys (td1->addr, td1->dtalen, &hphys))
+		return false;
+	td1->addr = hphys;
+	return true;
+}
+
+/* copy guest descriptors until the end of a packet */
+static bool
+tx_copy (struct desc_shadow *s, struct data2 *d2, u32 glen)
+{
+	struct tdesc *gtd;
+	bool eop = false;
+
+	while (!eop && s->u.t.post != s->tail) {
+		gtd = mapmem_gphys (s->base.ll + s->u.t.post * 16,
+				    sizeof *gtd, MAPMEM_WRITE);
+		ASSERT (gtd);
+		eop = tdesc_is_eop (gtd);
+		process_tdesc (d2, gtd);
+		unmapmem (gtd, sizeof *gtd);
+		if (++s->u.t.post >= glen)
+			s->u.t.post = 0;
+	}
+	s->u.t.copying = !eop;
+	return eop;
+}
+
+/* post whole packets from the guest ring.  Packets which cannot be
+ * posted as they are take the copying path. */
+static void
+tx_post (struct desc_shadow *s, struct data2 *d2, uint off2)
+{
+	struct tdesc pkt[TX_POST_MAX], *gtd, *td;
+	u32 *tail, g, t, glen, nfree, idx[TX_POST_MAX];
+	int i, n;
+	bool eop, copied = false;
+
+	glen = s->len / 16;
+	if (!glen)
+		return;
+	tail = (void *)((u8 *)d2->d1[0].map + off2 + 0x18);
+	while (s->u.t.post != s->tail) {
+		if (s->u.t.copying) {
+			if (!tx_copy (s, d2, glen))
+				break;
+			copied = true;
+			continue;
+		}
+		g = s->u.t.post;
+		n = 0;
+		eop = false;
+		while (!eop && n < TX_POST_MAX && g != s->tail) {
+			gtd = mapmem_gphys (s->base.ll + g * 16, sizeof *gtd,
+					    0);
+			ASSERT (gtd);
+			pkt[n] = *gtd;
+			unmapmem (gtd, sizeof *gtd);
+			idx[n] = g;
+			eop = tdesc_is_eop (&pkt[n++]);
+			if (++g >= glen)
+				g = 0;
+		}
+		if (!eop && n < TX_POST_MAX)
+			break;	/* the rest is not ready */
+		for (i = 0; eop && i < n; i++)
+			if (!tdesc_translate (&pkt[i]))
+				eop = false;
+		if (!eop) {
+			tx_copy (s, d2, glen);
+			copied = true;
+			continue;
+		}
+		/* the copying path may have used the ring */
+		t = *tail;
+		if (t >= NUM_OF_TDESC)
+			break;
+		nfree = (s->u.t.clean + NUM_OF_TDESC - t - 1) % NUM_OF_TDESC;
+		if (n > nfree)
+			break;
+		for (i = 0; i < n; i++) {
+			if (pkt[i].cmd_dext &&
+			    ((struct tdesc_dext0 *)&pkt[i])->dtyp == 0)
+				tdesc_context (d2, (void *)&pkt[i]);
+			s->u.t.tslot[t] = TSLOT_GUEST | idx[i] |
+				(pkt[i].cmd_rs ? TSLOT_RS : 0);
+			s->u.t.inflight++;
+			td = &s->u.t.td[t];
+			*td = pkt[i];
+			td->cmd_rs = 1;
+			td->sta_dd = 0;
+			td->sta_ec = 0;
+			td->sta_lc = 0;
+			td->sta_rsv = 0;
+			if (++t >= NUM_OF_TDESC)
+				t = 0;
+		}
+		*tail = t;
+		s->u.t.post = g;
+	}
+	if (!s->u.t.inflight)
+		s->head = s->u.t.post;
+	if (copied)
+		*(u32 *)(void *)((u8 *)d2->d1[0].map + 0xC8) |= 0x1;
+}
+
+static void
+tx_update (struct data2 *d2)
+{
+	int i;
+
+	if (d2->d1->disable)	/* PCI config reg is disabled */
+		return;
+	for (i = 0; i < 2; i++) {
+		if (!d2->tdesc[i].initialized)
+			continue;
+		tx_reclaim (&d2->tdesc[i], d2, 0x3800 + i * 0x100);
+		if (d2->tctl & 2) /* EN: Transmit Enable */
+			tx_post (&d2->tdesc[i], d2, 0x3800 + i * 0x100);
+	}
+}
+
+static void
+guest_is_transmitting (struct desc_shadow *s, struct data2 *d2, uint off2)
 {
 	struct tdesc *td;
 	u32 i, j, l;
@@ -965,6 +1205,11 @@ guest_is_transmitting (struct desc_shadow *s, struct data2 *d2)
 		return;
 	if (!(d2->tctl & 2))	/* !EN: Transmit Enable */
 		return;
+	if (d2->zerocopy) {
+		tx_reclaim (s, d2, off2);
+		tx_post (s, d2, off2);
+		return;
+	}
 	i = s->head;
 	j = s->tail;
 	k = s->base.ll;
@@ -983,14 +1228,17 @@ guest_is_transmitting (struct desc_shadow *s, struct data2 *d2)
 	*(u32 *)(void *)((u8 *)d2->d1[0].map + 0xC8) |= 0x1; /* interrupt */
 }
 
-static void
-receive_physnic (struct desc_shadow *s, struct data2 *d2, uint off2)
+/* process at most rx->budget packets */
+/* return value: the number of descriptors processed */
+static int
+receive_physnic (struct desc_shadow *s, struct data2 *d2, uint off2,
+		 struct netrx *rx)
 {
 	u32 *head, *tail, h, t, nt;
 	void *pkt[16];
 	UINT pktsize[16];
 	long pkt_premap[16];
-	int i = 0, num = 16;
+	int i = 0, num = 16, done = 0;
 	struct rdesc *rd;
 
 	write_mydesc (s, d2, off2, false);
@@ -1004,16 +1252,17 @@ receive_physnic (struct desc_shadow *s, struct data2 *d2, uint off2)
 		nt = t + 1;
 		if (nt >= NUM_OF_RDESC)
 			nt = 0;
-		if (h == nt || i == num) {
+		if (h == nt || i == num || done == rx->budget) {
 			if (d2->recvphys_func)
 				d2->recvphys_func (d2, i, pkt, pktsize,
 						   d2->recvphys_param,
 						   pkt_premap);
-			if (h == nt)
+			if (h == nt || done == rx->budget)
 				break;
 			i = 0;
 		}
 		t = nt;
+		done++;
 		rd = &s->u.r.rd[t];
 		pkt[i] = s->u.r.rbuf[t];
 		pktsize[i] = rd->len;
@@ -1022,23 +1271,82 @@ receive_physnic (struct desc_shadow *s, struct data2 *d2, uint off2)
 			pktsize[i] -= 4;
 		if (!rd->status_eop) {
 			printf ("status EOP == 0!!\n");
+			netrx_drop (rx);
 			continue;
 		}
 		if (rd->err_ce) {
 			printf ("recv CRC error\n");
+			netrx_drop (rx);
 			continue;
 		}
 		if (rd->err_se) {
 			printf ("recv symbol error\n");
+			netrx_drop (rx);
 			continue;
 		}
 		if (rd->err_rxe) {
 			printf ("recv RX data error\n");
+			netrx_drop (rx);
 			continue;
 		}
+		netrx_packet (rx, pktsize[i]);
 		i++;
 	}
 	*tail = t;
+	return done;
+}
+
+/* adapt the interrupt throttling to the receive rate when the VMM
+ * owns the interrupts */
+static void
+pro1000_moderate (struct data2 *d2)
+{
+	/* 70000, 20000 and 4000 interrupts/s in 256ns units */
+	static const u32 itr[] = { 56, 195, 977 };
+
+	if (!d2->seize && !d2->virtio_net)
+		return;
+	if (netrx_moderate (&d2->rx[0]))
+		/* Interrupt Throttling Register */
+		*(u32 *)(void *)((u8 *)d2->d1[0].map + 0xC4) =
+			itr[d2->rx[0].level];
+}
+
+/* d2->lock must be locked */
+static void
+pro1000_receive (struct data2 *d2)
+{
+	bool more = false;
+	int i, done;
+
+	for (i = 0; i < 2; i++) {
+		if (!d2->rdesc[i].initialized)
+			continue;
+		netrx_poll_start (&d2->rx[i]);
+		done = receive_physnic (&d2->rdesc[i], d2, 0x2800 + i * 0x100,
+					&d2->rx[i]);
+		if (netrx_poll_done (&d2->rx[i], done))
+			more = true;
+	}
+	pro1000_moderate (d2);
+	/* Under load, the rest is received by polling so that the
+	 * current processor returns to the guest. */
+	if (more && !d2->rx_timer_armed) {
+		d2->rx_timer_armed = true;
+		timer_set (d2->rx_timer, NETRX_POLL_USEC);
+	}
+}
+
+static void
+pro1000_rx_timer (void *handle, void *data)
+{
+	struct data2 *d2 = data;
+
+	spinlock_lock (&d2->lock);
+	d2->rx_timer_armed = false;
+	if (!d2->d1->disable)
+		pro1000_receive (d2);
+	spinlock_unlock (&d2->lock);
 }
 
 static bool
@@ -1069,10 +1377,15 @@ handle_desc (uint off1, uint len1, bool wr, union mem *buf, bool recv,
 	} else if (rangecheck (off1, len1, off2 + 0x10, 4)) {
 		/* Transmit/Receive Descriptor Head */
 		init_desc (s, d2, off2, !recv);
-		if (wr)
+		if (wr) {
 			s->head = buf->dword & 0xFFFF;
-		else
+			if (!recv)
+				tx_reset (s);
+		} else {
+			if (!recv && d2->zerocopy)
+				tx_reclaim (s, d2, off2);
 			buf->dword = s->head;
+		}
 	} else if (rangecheck (off1, len1, off2 + 0x18, 4)) {
 		/* Transmit/Receive Descriptor Tail */
 		init_desc (s, d2, off2, !recv);
@@ -1081,7 +1394,7 @@ handle_desc (uint off1, uint len1, bool wr, union mem *buf, bool recv,
 		else
 			buf->dword = s->tail;
 		if (wr && !recv)
-			guest_is_transmitting (s, d2);
+			guest_is_transmitting (s, d2, off2);
 	} else {
 		return false;
 	}
@@ -1150,10 +1463,9 @@ mmhandler2 (struct data *d1, struct data2 *d2, phys_t gphys, bool wr,
 	}
 	if (rangecheck (gphys - d1->mapaddr, len, 0xC0, 4)) {
 		/* Interrupt Cause Read Register */
-		if (d2->rdesc[0].initialized)
-			receive_physnic (&d2->rdesc[0], d2, 0x2800);
-		if (d2->rdesc[1].initialized)
-			receive_physnic (&d2->rdesc[1], d2, 0x2900);
+		if (d2->zerocopy)
+			tx_update (d2);
+		pro1000_receive (d2);
 	}
 skip:
 	q = (union mem *)(void *)((u8 *)d1->map + (gphys - d1->mapaddr));
@@ -1461,7 +1773,7 @@ pro1000_msix_enable (void *param)
 
 static void 
 vpn_pro1000_new (struct pci_device *pci_device, bool option_tty,
-		 char *option_net, bool option_virtio)
+		 char *option_net, bool option_virtio, bool option_zerocopy)
 {
 	int i;
 	struct data2 *d2;
@@ -1493,11 +1805,21 @@ vpn_pro1000_new (struct pci_device *pci_device, bool option_tty,
 	d2 = alloc (sizeof *d2);
 	memset (d2, 0, sizeof *d2);
 	d2->nethandle = net_new_nic (option_net, option_tty);
+	if (option_zerocopy) {
+		/* guest frames are sent as they are only by net=pass */
+		if (option_virtio || !option_net || strcmp (option_net, "pass"))
+			printf ("vpn_pro1000: zerocopy ignored\n");
+		else
+			d2->zerocopy = true;
+	}
 	alloc_pages (&tmp, NULL, (BUFSIZE + PAGESIZE - 1) / PAGESIZE);
 	memset (tmp, 0, (BUFSIZE + PAGESIZE - 1) / PAGESIZE * PAGESIZE);
 	d2->buf = tmp;
 	d2->buf_premap = net_premap_recvbuf (d2->nethandle, tmp, BUFSIZE);
 	spinlock_init (&d2->lock);
+	netrx_init (&d2->rx[0], "pro1000", 0);
+	netrx_init (&d2->rx[1], "pro1000", 1);
+	d2->rx_timer = timer_new (pro1000_rx_timer, d2);
 	d = alloc (sizeof *d * 6);
 	for (i = 0; i < 6; i++) {
 		d[i].d = d2;
@@ -1601,6 +1923,7 @@ pro1000_new (struct pci_device *pci_device)
 	bool option_tty = false;
 	char *option_net;
 	bool option_virtio = false;
+	bool option_zerocopy = false;
 
 	if (pci_device->driver_options[0] &&
 	    pci_driver_option_get_bool (pci_device->driver_options[0], NULL)) {
@@ -1610,7 +1933,11 @@ pro1000_new (struct pci_device *pci_device)
 	if (pci_device->driver_options[2] &&
 	    pci_driver_option_get_bool (pci_device->driver_options[2], NULL))
 		option_virtio = true;
-	vpn_pro1000_new (pci_device, option_tty, option_net, option_virtio);
+	if (pci_device->driver_options[3] &&
+	    pci_driver_option_get_bool (pci_device->driver_options[3], NULL))
+		option_zerocopy = true;
+	vpn_pro1000_new (pci_device, option_tty, option_net, option_virtio,
+			 option_zerocopy);
 }
 
 static int
@@ -1673,7 +2000,7 @@ pro1000_config_write (struct pci_device *pci_device, u8 iosize,
 static struct pci_driver pro1000_driver = {
 	.name		= driver_name,
 	.longname	= driver_longname,
-	.driver_options	= "tty,net,virtio",
+	.driver_options	= "tty,net,virtio,zerocopy",
 	.device		= "class_code=020000,id="
 			/* 31608004.pdf */
 			  "8086:105e|" /* Dual port */
@@ -34,6 +34,59 @@
 #include "pci.h"
 #include "virtio_net.h"
 
+#define VIRTIO_NET_QUEUE_SIZE	1024 /* must be a power of 2 */
+#define VIRTIO_NET_QUEUE_MASK	(VIRTIO_NET_QUEUE_SIZE - 1)
+#define VIRTIO_NET_MAP_CACHE	64 /* must be a power of 2 */
+#define VIRTIO_NET_RECV_BATCH	32
+#define VIRTIO_NET_BUFSIZE	2048
+#define VIRTIO_NET_F_MAC	0x20
+#define VIRTIO_NET_F_MRG_RXBUF	0x8000
+#define VIRTIO_RING_F_EVENT_IDX	0x20000000
+#define VIRTIO_NET_FEATURES	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | \
+				 VIRTIO_RING_F_EVENT_IDX)
+#define VIRTIO_RING_AVAIL_END	(16 * VIRTIO_NET_QUEUE_SIZE + 4 + \
+				 2 * VIRTIO_NET_QUEUE_SIZE + 2)
+#define VIRTIO_RING_USED_OFFSET	((VIRTIO_RING_AVAIL_END + 4095) & ~4095)
+
+struct virtio_ring {
+	struct {
+		u64 addr;
+		u32 len;
+		u32 flags_next;	/* lower is flags, upper is next */
+	} desc[VIRTIO_NET_QUEUE_SIZE];
+	struct {
+		u16 flags;
+		u16 idx;
+		u16 ring[VIRTIO_NET_QUEUE_SIZE];
+		u16 used_event;
+		u8 padding[VIRTIO_RING_USED_OFFSET - VIRTIO_RING_AVAIL_END];
+	} avail;
+	struct {
+		u16 flags;
+		u16 idx;
+		struct {
+			u32 id;
+			u32 len;
+		} ring[VIRTIO_NET_QUEUE_SIZE];
+		u16 avail_event;
+	} used;
+};
+
+/* Guest pages are mapped once and kept until the queue is
+ * reconfigured or the device is reset. */
+struct virtio_net_map {
+	u64 phys;
+	u8 *virt;
+};
+
+/* The lock is held while the ring or the mapped guest pages are
+ * used, so that the iohandler does not unmap them meanwhile. */
+struct virtio_net_queue {
+	spinlock_t lock;
+	struct virtio_ring *ring;
+	struct virtio_net_map map[VIRTIO_NET_MAP_CACHE];
+};
+
 struct msix_table {
 	u32 addr;
 	u32 upper;
@@ -46,6 +99,9 @@ struct virtio_net {
 	u32 port;
 	u32 cmd;
 	u32 queue[2];
+	struct virtio_net_queue q[2];
+	u32 guest_features;
+	u8 *recvbuf;
 	bool ready;
 	u8 *macaddr;
 	net_recv_callback_t *recv_func;
@@ -73,28 +129,6 @@ struct virtio_net {
 	struct msix_table msix_table_entry[3];
 };
 
-struct virtio_ring {
-	struct {
-		u64 addr;
-		u32 len;
-		u32 flags_next;	/* lower is flags, upper is next */
-	} desc[0x100];
-	struct {
-		u16 flags;
-		u16 idx;
-		u16 ring[0x100];
-		u16 padding[0x6FE];
-	} avail;
-	struct {
-		u16 flags;
-		u16 idx;
-		struct {
-			u32 id;
-			u32 len;
-		} ring[0x100];
-	} used;
-};
-
 static void
 virtio_net_get_nic_info (void *handle, struct nicinfo *info)
 {
@@ -105,140 +139,309 @@ virtio_net_get_nic_info (void *handle, struct nicinfo *info)
 	memcpy (info->mac_address, vnet->macaddr, 6);
 }
 
+/* q->lock must be locked */
+static struct virtio_ring *
+virtio_net_ring (struct virtio_net *vnet, int n)
+{
+	struct virtio_net_queue *q = &vnet->q[n];
+
+	if (!q->ring && vnet->queue[n])
+		q->ring = mapmem_hphys ((u64)vnet->queue[n] << 12,
+					sizeof *q->ring, MAPMEM_WRITE);
+	return q->ring;
+}
+
+/* q->lock must be locked */
+static void
+virtio_net_unmap_queue (struct virtio_net *vnet, int n)
+{
+	struct virtio_net_queue *q = &vnet->q[n];
+	int i;
+
+	if (q->ring) {
+		unmapmem (q->ring, sizeof *q->ring);
+		q->ring = NULL;
+	}
+	for (i = 0; i < VIRTIO_NET_MAP_CACHE; i++) {
+		if (q->map[i].virt) {
+			unmapmem (q->map[i].virt, PAGESIZE);
+			q->map[i].virt = NULL;
+		}
+	}
+}
+
+static u8 *
+virtio_net_map_page (struct virtio_net_queue *q, u64 phys)
+{
+	struct virtio_net_map *m;
+	u64 page = phys & ~(u64)(PAGESIZE - 1);
+
+	m = &q->map[(u32)(page >> PAGESHIFT) & (VIRTIO_NET_MAP_CACHE - 1)];
+	if (!m->virt || m->phys != page) {
+		if (m->virt)
+			unmapmem (m->virt, PAGESIZE);
+		m->virt = mapmem_hphys (page, PAGESIZE, MAPMEM_WRITE);
+		m->phys = page;
+	}
+	return m->virt + (phys & (PAGESIZE - 1));
+}
+
+/* Copy between a guest buffer and buf */
+static void
+virtio_net_copy (struct virtio_net_queue *q, u64 phys, u8 *buf, u32 len,
+		 bool wr)
+{
+	u8 *p;
+	u32 n;
+
+	while (len > 0) {
+		n = PAGESIZE - (phys & (PAGESIZE - 1));
+		if (n > len)
+			n = len;
+		p = virtio_net_map_page (q, phys);
+		if (wr)
+			memcpy (p, buf, n);
+		else
+			memcpy (buf, p, n);
+		phys += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static u32
+virtio_net_hdrlen (struct virtio_net *vnet)
+{
+	if (vnet->guest_features & VIRTIO_NET_F_MRG_RXBUF)
+		return 12;	/* with num_buffers */
+	return 10;
+}
+
+/* Returns true if an interrupt is needed after the used index is
+ * changed from old_idx to new_idx. */
+static bool
+virtio_net_need_intr (struct virtio_net *vnet, struct virtio_ring *p,
+		      u16 new_idx, u16 old_idx)
+{
+	if (!(vnet->guest_features & VIRTIO_RING_F_EVENT_IDX))
+		return !(p->avail.flags & 1); /* No interrupt */
+	asm volatile ("mfence" : : : "memory");
+	return (u16)(new_idx - p->avail.used_event - 1) <
+		(u16)(new_idx - old_idx);
+}
+
 /* Send to guest */
 static void
 virtio_net_send (void *handle, unsigned int num_packets, void **packets,
 		 unsigned int *packet_sizes, bool print_ok)
 {
 	struct virtio_net *vnet = handle;
+	struct virtio_net_queue *q = &vnet->q[0];
 	struct virtio_ring *p;
-	u16 idx_a, idx_u, ring;
-	u32 len, desc_len, i, j;
+	u16 idx_a, idx_u, old_idx_u, ring;
+	u32 len, desc_len, i, j, count;
 	u32 ring_tmp;
-	u8 *buf_ring;
+	u64 addr;
 	u8 *buf;
-	int buflen;
-	bool intr = false;
+	unsigned int buflen;
+	u8 hdr[12];
+	u32 hdrlen;
 
 	if (!vnet->ready)
 		return;
-	p = mapmem_hphys ((u64)vnet->queue[0] << 12, sizeof *p, MAPMEM_WRITE);
-loop:
-	if (!num_packets--)
-		goto ret;
-	buf = *packets++;
-	buflen = *packet_sizes++;
+	hdrlen = virtio_net_hdrlen (vnet);
+	memset (hdr, 0, sizeof hdr);
+	hdr[10] = 1;		/* num_buffers if VIRTIO_NET_F_MRG_RXBUF */
+	spinlock_lock (&q->lock);
+	p = virtio_net_ring (vnet, 0);
+	if (!p)
+		goto out;
 	idx_a = p->avail.idx;
-	idx_u = p->used.idx;
-	if (idx_a == idx_u) {
-		u64 now = get_time ();
-
-		if (now - vnet->last_time >= 1000000 && print_ok)
-			printf ("%s: Receive ring buffer full\n", __func__);
-		vnet->last_time = now;
-		goto ret;
+	idx_u = old_idx_u = p->used.idx;
+	for (; num_packets > 0; num_packets--) {
+		buf = *packets++;
+		buflen = *packet_sizes++;
+		if (idx_a == idx_u && (idx_a = p->avail.idx) == idx_u) {
+			u64 now = get_time ();
+
+			if (now - vnet->last_time >= 1000000 && print_ok)
+				printf ("%s: Receive ring buffer full\n",
+					__func__);
+			vnet->last_time = now;
+			break;
+		}
+		asm volatile ("" : : : "memory");
+		ring = p->avail.ring[idx_u & VIRTIO_NET_QUEUE_MASK];
+		ring_tmp = ((u32)ring << 16) | 1;
+		len = 0;
+		for (count = 0; ring_tmp & 1; count++) {
+			if (count == VIRTIO_NET_QUEUE_SIZE)
+				break;	/* Looped chain */
+			ring_tmp >>= 16;
+			ring_tmp &= VIRTIO_NET_QUEUE_MASK;
+			desc_len = p->desc[ring_tmp].len;
+			addr = p->desc[ring_tmp].addr;
+			i = 0;
+			if (len < hdrlen) {
+				i = hdrlen - len;
+				if (i > desc_len)
+					i = desc_len;
+				virtio_net_copy (q, addr, &hdr[len], i, true);
+				len += i;
+			}
+			if (len >= hdrlen && i < desc_len) {
+				j = buflen - (len - hdrlen);
+				if (j > desc_len - i)
+					j = desc_len - i;
+				virtio_net_copy (q, addr + i,
+						 &buf[len - hdrlen], j, true);
+				len += j;
+			}
+			ring_tmp = p->desc[ring_tmp].flags_next;
+		}
+		if (0)
+			printf ("Receive %u bytes %02X:%02X:%02X:%02X:%02X:%02X"
+				" <- %02X:%02X:%02X:%02X:%02X:%02X\n", buflen,
+				buf[0], buf[1], buf[2], buf[3], buf[4], buf[5],
+				buf[6], buf[7], buf[8], buf[9], buf[10],
+				buf[11]);
+		p->used.ring[idx_u & VIRTIO_NET_QUEUE_MASK].id = ring;
+		p->used.ring[idx_u & VIRTIO_NET_QUEUE_MASK].len = len;
+		idx_u++;
 	}
-	idx_u &= 0xFF;
-	ring = p->avail.ring[idx_u];
+	if (idx_u == old_idx_u)
+		goto out;
+	/* Publish all the packets at once */
+	asm volatile ("" : : : "memory");
+	p->used.idx = idx_u;
+	if (virtio_net_need_intr (vnet, p, idx_u, old_idx_u)) {
+		vnet->intr = true;
+		vnet->intr_set (vnet->intr_param);
+	}
+out:
+	spinlock_unlock (&q->lock);
+}
+
+/* Copy a packet from a descriptor chain to buf.  Every descriptor and
+ * every data byte is read from guest memory once, so that what the
+ * receive callback validates cannot be changed by the guest
+ * afterwards.  Returns 0 if the packet is dropped because it does not
+ * fit in buf or the chain is too long. */
+static unsigned int
+virtio_net_recv_packet (struct virtio_net *vnet, struct virtio_ring *p,
+			u16 ring, u8 *buf, u32 *total_len)
+{
+	struct virtio_net_queue *q = &vnet->q[1];
+	u32 len, desc_len, hdrlen, i, n, count;
+	u32 ring_tmp;
+	u64 addr;
+	bool drop;
+
+	hdrlen = virtio_net_hdrlen (vnet);
 	ring_tmp = ((u32)ring << 16) | 1;
 	len = 0;
-	while (ring_tmp & 1) {
+	n = 0;			/* number of bytes in buf */
+	drop = false;
+	for (count = 0; ring_tmp & 1; count++) {
+		if (count == VIRTIO_NET_QUEUE_SIZE) {
+			/* Looped chain */
+			drop = true;
+			break;
+		}
 		ring_tmp >>= 16;
-		desc_len = p->desc[ring_tmp & 0xFF].len;
-		buf_ring = mapmem_hphys (p->desc[ring_tmp & 0xFF].addr,
-					 desc_len, 0);
+		ring_tmp &= VIRTIO_NET_QUEUE_MASK;
+		desc_len = p->desc[ring_tmp].len;
+		addr = p->desc[ring_tmp].addr;
+		ring_tmp = p->desc[ring_tmp].flags_next;
+		len += desc_len;
 		i = 0;
-		if (len < 10) {
-			i = 10 - len;
-			if (i > desc_len)
-				i = desc_len;
-			memset (buf_ring, 0, i);
-			len += i;
+		if (len - desc_len < hdrlen) {
+			i = hdrlen - (len - desc_len);
+			if (i >= desc_len)
+				continue;
 		}
-		if (len >= 10 && i < desc_len) {
-			j = buflen - (len - 10);
-			if (j > desc_len - i)
-				j = desc_len - i;
-			memcpy (&buf_ring[i], &buf[len - 10], j);
-			len += j;
+		addr += i;
+		desc_len -= i;
+		if (drop)
+			continue;
+		if (desc_len > VIRTIO_NET_BUFSIZE - n) {
+			drop = true;
+			continue;
 		}
-		unmapmem (buf_ring, desc_len);
-		ring_tmp = p->desc[ring_tmp & 0xFF].flags_next;
-	}
-	if (0)
-		printf ("Receive %u bytes %02X:%02X:%02X:%02X:%02X:%02X"
-			" <- %02X:%02X:%02X:%02X:%02X:%02X\n", buflen,
-			buf[0], buf[1], buf[2], buf[3], buf[4], buf[5],
-			buf[6], buf[7], buf[8], buf[9], buf[10], buf[11]);
-	p->used.ring[idx_u].id = ring;
-	p->used.ring[idx_u].len = len;
-	asm volatile ("" : : : "memory");
-	p->used.idx++;
-	intr = true;
-	goto loop;
-ret:
-	if (p->avail.flags & 1)	/* No interrupt */
-		intr = false;
-	unmapmem (p, sizeof *p);
-	if (intr) {
-		vnet->intr = true;
-		vnet->intr_set (vnet->intr_param);
+		virtio_net_copy (q, addr, &buf[n], desc_len, false);
+		n += desc_len;
 	}
+	*total_len = len;
+	if (drop)
+		return 0;
+	return n;
 }
 
 /* Receive from guest */
 static void
 virtio_net_recv (struct virtio_net *vnet)
 {
+	struct virtio_net_queue *q = &vnet->q[1];
 	struct virtio_ring *p;
-	u16 idx_a, idx_u, ring;
-	u32 len, desc_len;
-	u32 ring_tmp;
-	u8 buf[2048], *buf_ring;
-	bool intr = false;
-
-	p = mapmem_hphys ((u64)vnet->queue[1] << 12, sizeof *p, MAPMEM_WRITE);
-	idx_a = p->avail.idx;
-	while (idx_a != p->used.idx) {
-		idx_u = p->used.idx & 0xFF;
-		ring = p->avail.ring[idx_u];
-		ring_tmp = ((u32)ring << 16) | 1;
-		len = 0;
-		while (ring_tmp & 1) {
-			ring_tmp >>= 16;
-			desc_len = p->desc[ring_tmp & 0xFF].len;
-			buf_ring = mapmem_hphys (p->desc[ring_tmp & 0xFF].addr,
-						 desc_len, 0);
-			memcpy (&buf[len], buf_ring, desc_len);
-			unmapmem (buf_ring, desc_len);
-			len += desc_len;
-			ring_tmp = p->desc[ring_tmp & 0xFF].flags_next;
+	u16 idx_a, idx_u, old_idx_u, ring[VIRTIO_NET_RECV_BATCH];
+	u32 len[VIRTIO_NET_RECV_BATCH];
+	void *packets[VIRTIO_NET_RECV_BATCH];
+	unsigned int packet_sizes[VIRTIO_NET_RECV_BATCH];
+	unsigned int i, n, npackets;
+
+	spinlock_lock (&q->lock);
+	p = virtio_net_ring (vnet, 1);
+	if (!p)
+		goto out;
+	idx_u = old_idx_u = p->used.idx;
+	do {
+		/* Gather available packets and pass them at once */
+		npackets = 0;
+		for (n = 0; n < VIRTIO_NET_RECV_BATCH; n++) {
+			idx_a = p->avail.idx;
+			if (idx_a == (u16)(idx_u + n)) {
+				if (!(vnet->guest_features &
+				      VIRTIO_RING_F_EVENT_IDX))
+					break;
+				/* Ask for a notification of the next
+				 * packet and check again not to miss a
+				 * packet added before the avail_event is
+				 * updated */
+				p->used.avail_event = idx_a;
+				asm volatile ("mfence" : : : "memory");
+				if (p->avail.idx == idx_a)
+					break;
+			}
+			asm volatile ("" : : : "memory");
+			ring[n] = p->avail.ring[(idx_u + n) &
+						VIRTIO_NET_QUEUE_MASK];
+			packets[npackets] =
+				&vnet->recvbuf[npackets * VIRTIO_NET_BUFSIZE];
+			packet_sizes[npackets] = virtio_net_recv_packet
+				(vnet, p, ring[n], packets[npackets], &len[n]);
+			if (packet_sizes[npackets])
+				npackets++;
 		}
-		{
-			void *packet = &buf[10];
-			unsigned int packet_size = len - 10;
-			vnet->recv_func (vnet, 1, &packet, &packet_size,
+		if (npackets)
+			vnet->recv_func (vnet, npackets, packets, packet_sizes,
 					 vnet->recv_param, NULL);
+		for (i = 0; i < n; i++) {
+			p->used.ring[idx_u & VIRTIO_NET_QUEUE_MASK].id =
+				ring[i];
+			p->used.ring[idx_u & VIRTIO_NET_QUEUE_MASK].len =
+				len[i];
+			idx_u++;
 		}
-#if 0
-		printf ("Send %u bytes %02X:%02X:%02X:%02X:%02X:%02X"
-			" <- %02X:%02X:%02X:%02X:%02X:%02X\n", len - 10,
-			buf[10], buf[11], buf[12], buf[13], buf[14], buf[15],
-			buf[16], buf[17], buf[18], buf[19], buf[20], buf[21]);
-#endif
-		p->used.ring[idx_u].id = ring;
-		p->used.ring[idx_u].len = len;
 		asm volatile ("" : : : "memory");
-		p->used.idx++;
-		intr = true;
-	}
-	if (p->avail.flags & 1)	/* No interrupt */
-		intr = false;
-	unmapmem (p, sizeof *p);
-	if (intr) {
+		p->used.idx = idx_u;
+	} while (n == VIRTIO_NET_RECV_BATCH);
+	if (idx_u != old_idx_u &&
+	    virtio_net_need_intr (vnet, p, idx_u, old_idx_u)) {
 		vnet->intr2 = true;
 		vnet->intr_set (vnet->intr_param);
 	}
+out:
+	spinlock_unlock (&q->lock);
 }
 
 static void
@@ -255,6 +458,9 @@ static int
 virtio_net_iohandler (core_io_t io, union mem *data, void *arg)
 {
 	struct virtio_net *vnet = arg;
+	struct virtio_net_queue *q;
+	u32 features;
+	int i;
 
 #if 0
 	printf ("%s: io:%08x, data:%08x\n",
@@ -271,7 +477,12 @@ virtio_net_iohandler (core_io_t io, union mem *data, void *arg)
 		memset (data, 0, io.size);
 		switch (port) {
 		case 0x00:
-			data->byte = 0x20;	/* VIRTIO_NET_F_MAC */
+			features = VIRTIO_NET_FEATURES;
+			memcpy (data, &features, io.size > 4 ? 4 : io.size);
+			break;
+		case 0x04:
+			memcpy (data, &vnet->guest_features,
+				io.size > 4 ? 4 : io.size);
 			break;
 		case 0x08:
 			memcpy (data, &vnet->queue[vnet->selected_queue & 1],
@@ -279,7 +490,7 @@ virtio_net_iohandler (core_io_t io, union mem *data, void *arg)
 			break;
 		case 0x0C:
 			if (io.size > 1 && vnet->selected_queue < 2)
-				data->word = 0x100;
+				data->word = VIRTIO_NET_QUEUE_SIZE;
 			break;
 		case 0x0E:
 			if (io.size == 1)
@@ -343,9 +554,20 @@ virtio_net_iohandler (core_io_t io, union mem *data, void *arg)
 		}
 	} else {
 		switch (port) {
+		case 0x04:
+			memcpy (&vnet->guest_features, data,
+				io.size > 4 ? 4 : io.size);
+			/* Only the offered features can be enabled */
+			vnet->guest_features &= VIRTIO_NET_FEATURES;
+			break;
 		case 0x08:
+			q = &vnet->q[vnet->selected_queue & 1];
+			spinlock_lock (&q->lock);
+			virtio_net_unmap_queue (vnet,
+						vnet->selected_queue & 1);
 			memcpy (&vnet->queue[vnet->selected_queue & 1], data,
 				io.size);
+			spinlock_unlock (&q->lock);
 			break;
 		case 0x10:
 			if (!data->byte) {
@@ -364,6 +586,12 @@ virtio_net_iohandler (core_io_t io, union mem *data, void *arg)
 				vnet->dev_status = 0;
 				vnet->intr_disable (vnet->intr_param);
 				vnet->ready = false;
+				vnet->guest_features = 0;
+				for (i = 0; i < 2; i++) {
+					spinlock_lock (&vnet->q[i].lock);
+					virtio_net_unmap_queue (vnet, i);
+					spinlock_unlock (&vnet->q[i].lock);
+				}
 			}
 			break;
 		case 0x0E:
@@ -612,6 +840,11 @@ virtio_net_init (struct nicfunc **func, u8 *macaddr,
 				  unmask interrupts. */
 	vnet->queue[0] = 0;
 	vnet->queue[1] = 0;
+	memset (vnet->q, 0, sizeof vnet->q);
+	spinlock_init (&vnet->q[0].lock);
+	spinlock_init (&vnet->q[1].lock);
+	vnet->guest_features = 0;
+	vnet->recvbuf = alloc (VIRTIO_NET_RECV_BATCH * VIRTIO_NET_BUFSIZE);
 	vnet->ready = false;
 	vnet->macaddr = macaddr;
 	vnet->intr_clear = intr_clear;
@@ -222,6 +222,7 @@ usbmsc_code_buffers(struct usbmsc_device *mscdev,
 	access.rw = rw;
 	access.lba = mscunit->lba;
 	access.sector_size = block_len;
+	access.cache_gen = 0;
 
 	do {
 		if ((src_ub->len == 0) || (src_ub->pid != pid))
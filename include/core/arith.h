@@ -36,6 +36,27 @@
 asmlinkage void mpumul_64_64 (u64 m1, u64 m2, u64 ans[2]);
 asmlinkage u32 mpudiv_128_32 (u64 d1[2], u32 d2, u64 quotient[2]);
 asmlinkage u16 ipchecksum (void *buf, u32 len);
+asmlinkage u16 ipchecksum_lodsq (void *buf, u32 len);
 asmlinkage u32 crc32 (void *buf, u32 len);
+asmlinkage u32 crc32c (void *buf, u32 len);
+asmlinkage u32 crc32_bitwise (void *buf, u32 len);
+asmlinkage u32 crc32c_sse42 (void *buf, u32 len);
+
+/* Returns m1 * m2 / d for statistics such as counts per second.  d
+ * is taken as 1 if zero and as 0xFFFFFFFF if larger, and the result
+ * saturates. */
+static inline u64
+muldiv64 (u64 m1, u64 m2, u64 d)
+{
+	u64 tmp[2];
+
+	if (!d)
+		d = 1;
+	if (d > 0xFFFFFFFF)
+		d = 0xFFFFFFFF;
+	mpumul_64_64 (m1, m2, tmp);
+	mpudiv_128_32 (tmp, (u32)d, tmp);
+	return tmp[1] ? ~0ULL : tmp[0];
+}
 
 #endif
@@ -231,6 +231,9 @@ struct config_data_vmm {
 	int no_intr_intercept;
 	int ignore_tsc_invariant;
 	int unsafe_nested_virtualization;
+	int storage_crypt_split_min;
+	int storage_cache_size;
+	int io_str_coalesce;
 	char tty_mac_address[6];
 	int tty_pro1000;
 	int tty_rtl8169;
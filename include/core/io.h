@@ -47,8 +47,13 @@ enum ioact {
 };
 
 typedef enum ioact (*iofunc_t) (enum iotype type, u32 port, void *data);
+/* handles count elements of a string I/O instruction at once and
+   returns the number of elements processed */
+typedef u32 (*iofunc_str_t) (enum iotype type, u32 port, void *data,
+			     u32 count);
 enum ioact do_io_nothing (enum iotype type, u32 port, void *data);
 enum ioact do_iopass_default (enum iotype type, u32 port, void *data);
 iofunc_t set_iofunc (u32 port, iofunc_t func);
+void set_iofunc_str (iofunc_t func, iofunc_str_t func_str);
 
 #endif
@@ -43,10 +43,12 @@ struct mempool;
 
 int alloc_pages (void **virt, u64 *phys, int n);
 int alloc_page (void **virt, u64 *phys);
+int alloc_pages_batch (void **virt, u64 *phys, int n);
 void free_page (void *virt);
 void free_page_phys (phys_t phys);
 void *alloc (uint len);
 void *alloc2 (uint len, u64 *phys);
+void *alloc2_try (uint len, u64 *phys);
 u32 alloc_realmodemem (uint len);
 void *realloc (void *virt, uint len);
 void free (void *virt);
@@ -59,6 +61,10 @@ void mempool_freemem (struct mempool *mp, void *virt);
 void unmapmem (void *virt, uint len);
 void *mapmem (int flags, u64 physaddr, uint len);
 void *mapmem_hphys (u64 physaddr, uint len, int flags);
+void *mapmem_hphys_pages (u64 *pages, uint len, int flags);
 void *mapmem_gphys (u64 physaddr, uint len, int flags);
+bool gphys_to_hphys (u64 gphys, uint len, u64 *hphys);
+void mapmem_batch (int flags, u64 *physaddr, uint *len, void **virt, int n);
+void unmapmem_batch (void **virt, uint *len, int n);
 
 #endif
@@ -129,6 +129,23 @@ spinlock_unlock (spinlock_t *l)
 		      : "0" ((u8)0));
 }
 
+/* return value 0: lock succeeded */
+static inline spinlock_t
+spinlock_trylock (spinlock_t *l)
+{
+	spinlock_t ret;
+
+	asm volatile ("xchg %1, %0 \n"
+#ifdef __x86_64__
+		      : "=r" (ret)
+#else
+		      : "=abcd" (ret)
+#endif
+		      , "+m" (*l)
+		      : "0" ((u8)1));
+	return ret;
+}
+
 static inline void
 spinlock_init (spinlock_t *l)
 {
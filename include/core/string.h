@@ -34,6 +34,11 @@
 
 #define USE_BUILTIN_STRING
 
+/* Non-temporal stores: not for data the processor reads soon, such
+ * as page tables */
+void memzero_page (void *addr);
+void memcpy_nt (void *dest, void *src, unsigned long len);
+
 static inline void *
 memset_slow (void *addr, int val, int len)
 {
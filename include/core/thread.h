@@ -37,6 +37,8 @@ typedef u8 tid_t;
 tid_t thread_gettid (void);
 void schedule (void);
 tid_t thread_new (void (*func) (void *), void *arg, int stacksize);
+tid_t thread_new_cpu (void (*func) (void *), void *arg, int stacksize,
+		      int cpunum);
 void thread_exit (void);
 void thread_wakeup (tid_t tid);
 void thread_will_stop (void);
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2026 BitVisor contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __NET_NETBUF_H
+#define __NET_NETBUF_H
+
+#include <core/types.h>
+
+/* Reference counted packet buffers from a shared pool.  A stage
+ * hands a frame to the next one by passing the netbuf; the last
+ * netbuf_put() returns it to the pool.  NETBUF_HEADROOM bytes are
+ * reserved in front of the data for headers added later. */
+
+#define NETBUF_SIZE		2048
+#define NETBUF_HEADROOM		64
+#define NETBUF_MAXLEN		(NETBUF_SIZE - NETBUF_HEADROOM)
+
+struct netbuf {
+	struct netbuf *next;	/* pool free list */
+	u32 refcnt;
+	unsigned int len;
+	u8 *data;
+	u8 *head;		/* NETBUF_SIZE bytes */
+};
+
+/* Ring of netbufs between producers and one consumer.  Producers
+ * must hold a lock of their own against each other; the consumer
+ * does not take it. */
+struct netbuf_ring {
+	u32 head;		/* written by the consumer */
+	u32 tail;		/* written by the producer */
+	u32 mask;
+	struct netbuf **slot;
+};
+
+struct netbuf *netbuf_alloc (void);
+struct netbuf *netbuf_copy (void *data, unsigned int len);
+void netbuf_get (struct netbuf *nb);
+void netbuf_put (struct netbuf *nb);
+void netbuf_ring_init (struct netbuf_ring *r, unsigned int size);
+
+/* prepend len bytes using the headroom */
+static inline void *
+netbuf_push (struct netbuf *nb, unsigned int len)
+{
+	if (nb->data - nb->head < len)
+		return NULL;
+	nb->data -= len;
+	nb->len += len;
+	return nb->data;
+}
+
+/* remove len bytes from the front */
+static inline void *
+netbuf_pull (struct netbuf *nb, unsigned int len)
+{
+	if (nb->len < len)
+		return NULL;
+	nb->data += len;
+	nb->len -= len;
+	return nb->data;
+}
+
+/* producer side, called with the producer lock held */
+static inline bool
+netbuf_ring_put (struct netbuf_ring *r, struct netbuf *nb)
+{
+	u32 tail = r->tail;
+
+	if (tail - *(volatile u32 *)&r->head > r->mask)
+		return false;
+	r->slot[tail & r->mask] = nb;
+	/* Publish the slot before the index */
+	asm volatile ("" : : : "memory");
+	*(volatile u32 *)&r->tail = tail + 1;
+	return true;
+}
+
+/* consumer side */
+static inline bool
+netbuf_ring_empty (struct netbuf_ring *r)
+{
+	return r->head == *(volatile u32 *)&r->tail;
+}
+
+/* consumer side */
+static inline struct netbuf *
+netbuf_ring_get (struct netbuf_ring *r)
+{
+	u32 head = r->head;
+	struct netbuf *nb;
+
+	if (head == *(volatile u32 *)&r->tail)
+		return NULL;
+	asm volatile ("" : : : "memory");
+	nb = r->slot[head & r->mask];
+	asm volatile ("" : : : "memory");
+	*(volatile u32 *)&r->head = head + 1;
+	return nb;
+}
+
+#endif
@@ -50,6 +50,8 @@ struct storage_access {
 	count_t	count;
 	int	sector_size;
 	int	rw;
+	u32	cache_gen;	/* storage_cache_gen() when the read was
+				   issued, or 0 not to cache the data */
 };
 
 struct storage_extend {
@@ -57,6 +59,11 @@ struct storage_extend {
 	char *value;
 };
 
+struct storage_sg {
+	u8	*buf;
+	unsigned int len;
+};
+
 struct storage_device;
 
 int storage_handle_sectors(struct storage_device *device, struct storage_access *access, u8 *src, u8 *dst);
@@ -69,5 +76,14 @@ long storage_premap_buf (void *buf, unsigned int len);
 int storage_premap_handle_sectors (struct storage_device *storage,
 				   struct storage_access *access, u8 *src,
 				   u8 *dst, long premap_src, long premap_dst);
+int storage_handle_sectors_sg (struct storage_device *storage,
+			       struct storage_access *access, u8 *buf,
+			       unsigned int offset, struct storage_sg *sg,
+			       int sgnum);
+u32 storage_cache_gen (void);
+void storage_cache_write_start (struct storage_device *storage, lba_t lba,
+				count_t count);
+void storage_cache_write_done (struct storage_device *storage, lba_t lba,
+			       count_t count);
 
 #endif
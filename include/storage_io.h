@@ -63,6 +63,7 @@ struct storage_hc_addr {
 	enum storage_hc_type type; /* Host controller type */
 	int num_ports;		   /* Number of ports */
 	bool ncq;		   /* Native Command Queuing support */
+	bool sg;		   /* DMA to separate pages (buf_pages) */
 };
 
 struct storage_hc_dev_atacmd {
@@ -84,6 +85,7 @@ struct storage_hc_dev_atacmd {
 	void *buf;
 	phys_t buf_phys;
 	int buf_len;
+	phys_t *buf_pages;	/* DMA to these pages of buf (if sg) */
 	storage_hc_dev_atacommand_callback_t *callback;
 	void *data;
 	bool write;		/* Direction */
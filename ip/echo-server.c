@@ -43,7 +43,10 @@
 
 #include "lwip/debug.h"
 #include "lwip/stats.h"
+#include "lwip/sys.h"
 #include "lwip/tcp.h"
+#include "lwip/udp.h"
+#include "echo.h"
 
 #if LWIP_TCP
 
@@ -358,3 +361,68 @@ echo_close(struct tcp_pcb *tpcb, struct echo_state *es)
 }
 
 #endif /* LWIP_TCP */
+
+#if LWIP_UDP
+
+/* UDP echo server for throughput measurement.  Every datagram is
+ * sent back to its source; the counters cover the time between the
+ * first and the last echoed datagram. */
+
+static struct udp_pcb *echo_udp_pcb;
+static struct echo_udp_stat echo_udp_stat;
+
+static void
+echo_udp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+              ip_addr_t *addr, u16_t port)
+{
+  u32_t now;
+
+  now = sys_now();
+  if (echo_udp_stat.packets == 0)
+  {
+    echo_udp_stat.first_msec = now;
+  }
+  if (udp_sendto(pcb, p, addr, port) == ERR_OK)
+  {
+    echo_udp_stat.packets++;
+    echo_udp_stat.bytes += p->tot_len;
+    echo_udp_stat.last_msec = now;
+  }
+  else
+  {
+    echo_udp_stat.errors++;
+  }
+  pbuf_free(p);
+}
+
+void
+echo_udp_server_init (int port)
+{
+  memset(&echo_udp_stat, 0, sizeof echo_udp_stat);
+  if (echo_udp_pcb != NULL)
+  {
+    return;
+  }
+  echo_udp_pcb = udp_new();
+  if (echo_udp_pcb == NULL)
+  {
+    return;
+  }
+  if (udp_bind(echo_udp_pcb, IP_ADDR_ANY, port) != ERR_OK)
+  {
+    udp_remove(echo_udp_pcb);
+    echo_udp_pcb = NULL;
+    return;
+  }
+  udp_recv(echo_udp_pcb, echo_udp_recv, NULL);
+}
+
+/* Copy the counters and start a new measurement */
+void
+echo_udp_server_stat (struct echo_udp_stat *stat)
+{
+  *stat = echo_udp_stat;
+  memset(&echo_udp_stat, 0, sizeof echo_udp_stat);
+}
+
+#endif /* LWIP_UDP */
@@ -1,7 +1,16 @@
 #ifndef ECHO_H
 #define ECHO_H
 
+struct echo_udp_stat {
+	unsigned int packets;
+	unsigned int errors;
+	unsigned long long bytes;
+	unsigned int first_msec, last_msec;
+};
+
 void echo_server_init (int port);
+void echo_udp_server_init (int port);
+void echo_udp_server_stat (struct echo_udp_stat *stat);
 int echo_client_send (void);
 void echo_client_init (int *ipaddr, int port);
 
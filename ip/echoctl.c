@@ -1,4 +1,6 @@
+#include <core/arith.h>
 #include <core/mm.h>
+#include <core/printf.h>
 #include <core/process.h>
 #include <core/initfunc.h>
 #include "echo.h"
@@ -8,6 +10,8 @@ enum echo_command {
 	ECHO_CMD_CLIENT_CONNECT = 0,
 	ECHO_CMD_CLIENT_SEND = 1,
 	ECHO_CMD_SERVER_START = 2,
+	ECHO_CMD_UDP_SERVER_START = 3,
+	ECHO_CMD_UDP_SERVER_STAT = 4,
 };
 
 struct arg {
@@ -39,6 +43,42 @@ echoctl_echo_server_start (void *arg)
 	free (a);
 }
 
+static void
+echoctl_echo_udp_server_start (void *arg)
+{
+	struct arg *a = arg;
+
+	echo_udp_server_init (a->port);
+	free (a);
+}
+
+static u64
+echoctl_per_sec (u64 count, u32 msec)
+{
+	u64 tmp[2];
+
+	tmp[0] = count * 1000;
+	tmp[1] = 0;
+	mpudiv_128_32 (tmp, msec, tmp);
+	return tmp[0];
+}
+
+static void
+echoctl_echo_udp_server_stat (void *arg)
+{
+	struct echo_udp_stat stat;
+	u32 msec;
+
+	echo_udp_server_stat (&stat);
+	msec = stat.last_msec - stat.first_msec;
+	printf ("UDP echo: %u packets %llu bytes %u errors in %u ms\n",
+		stat.packets, stat.bytes, stat.errors, msec);
+	if (msec)
+		printf ("UDP echo: %llu packets/s %llu kbit/s\n",
+			echoctl_per_sec (stat.packets, msec),
+			echoctl_per_sec (stat.bytes * 8, msec) >> 10);
+}
+
 static int
 echoctl_sub (unsigned long (*array)[3], int len)
 {
@@ -85,6 +125,22 @@ echoctl_sub (unsigned long (*array)[3], int len)
 			ret = -1;
 		}
 		break;
+	case ECHO_CMD_UDP_SERVER_START:
+		/* Start UDP echo server. */
+		a = alloc (sizeof *a);
+		if (a) {
+			a->port = (int)port;
+			tcpip_begin (echoctl_echo_udp_server_start, a);
+			ret = 0;
+		} else {
+			ret = -1;
+		}
+		break;
+	case ECHO_CMD_UDP_SERVER_STAT:
+		/* Print and reset UDP echo counters. */
+		tcpip_begin (echoctl_echo_udp_server_stat, NULL);
+		ret = 0;
+		break;
 	default:
 		ret = -1;
 	}
@@ -69,12 +69,20 @@
 #include "tcpip.h"
 
 struct tcpip_context {
-	ip_addr_t *oldip_addr;
-	struct netif *netif;
+	ip_addr_t oldip_addr[IP_MAIN_NETIF_MAX];
+	struct netif *netif[IP_MAIN_NETIF_MAX];
 	int netif_num;
 };
 
+/* Wraps a received frame that lwIP references without copying */
+struct ip_input_pbuf {
+	struct pbuf_custom pc;
+	void *ref;
+	struct ip_input_pbuf *next;
+};
+
 static struct tcpip_context *tcpip_context;
+static struct ip_input_pbuf *ip_input_pbuf_free_list;
 
 static void
 tcpip_netif_ipaddr_check_sub (struct netif *netif, ip_addr_t *oldip_addr)
@@ -101,9 +109,8 @@ tcpip_netif_ipaddr_check (void)
 	int i;
 
 	LWIP_ASSERT ("tcpip_context", tcpip_context);
-	LWIP_ASSERT ("tcpip_context->netif", tcpip_context->netif);
 	for (i = 0; i < tcpip_context->netif_num; i++)
-		tcpip_netif_ipaddr_check_sub (&tcpip_context->netif[i],
+		tcpip_netif_ipaddr_check_sub (tcpip_context->netif[i],
 					      &tcpip_context->oldip_addr[i]);
 }
 
@@ -135,41 +142,53 @@ tcpip_netif_poll (void)
 	int i;
 
 	LWIP_ASSERT ("tcpip_context", tcpip_context);
-	LWIP_ASSERT ("tcpip_context->netif", tcpip_context->netif);
 	for (i = 0; i < tcpip_context->netif_num; i++)
-		net_main_poll (tcpip_context->netif[i].state);
+		net_main_poll (tcpip_context->netif[i]->state);
 }
 
+static void
+ip_input_pbuf_free (struct pbuf *p)
+{
+	struct ip_input_pbuf *q = (struct ip_input_pbuf *)p;
+
+	net_main_input_free (q->ref);
+	q->next = ip_input_pbuf_free_list;
+	ip_input_pbuf_free_list = q;
+}
+
+/* Pass a received frame to the stack without copying.  buf must stay
+ * valid until net_main_input_free (ref) is called, which happens
+ * when lwIP frees the pbuf. */
 void
-ip_main_input (void *arg, void *buf, unsigned int len)
+ip_main_input_ref (void *arg, void *buf, unsigned int len, void *ref)
 {
 	struct netif *netif = arg;
 	struct eth_hdr *ethhdr;
-	struct pbuf *p, *q;
-	int offset;
+	struct ip_input_pbuf *q;
+	struct pbuf *p;
 
 	ethhdr = buf;
 	switch (ntohs (ethhdr->type)) {
 	case ETHTYPE_IP:
 	case ETHTYPE_ARP:
-		p = pbuf_alloc (PBUF_RAW, len, PBUF_POOL);
-		offset = 0;
-		LWIP_ASSERT ("pbuf_alloc", p);
-		LWIP_ASSERT ("p->tot_len == len", p->tot_len == len);
-		for (q = p; q; q = q->next) {
-			LWIP_ASSERT ("q->payload", q->payload);
-			LWIP_ASSERT ("offset + q->len <= len",
-				     offset + q->len <= len);
-			memcpy (q->payload, buf + offset, q->len);
-			offset += q->len;
-		}
-		LWIP_ASSERT ("offset == len", offset == len);
-		LWIP_ASSERT ("offset > 12 + 4", offset > 12 + 4);
+		q = ip_input_pbuf_free_list;
+		if (q)
+			ip_input_pbuf_free_list = q->next;
+		else
+			q = mem_malloc (sizeof *q);
+		if (!q)
+			break;
+		p = pbuf_alloced_custom (PBUF_RAW, len, PBUF_REF, &q->pc, buf,
+					 len);
+		LWIP_ASSERT ("pbuf_alloced_custom", p);
+		q->pc.custom_free_function = ip_input_pbuf_free;
+		q->ref = ref;
 		LWIP_ASSERT ("p->len > 12 + 4", p->len > 12 + 4);
 		if (netif->input (p, netif) != ERR_OK)
 			printf ("IP/ARP Input Error.\n");
-		break;
+		return;
 	}
+	net_main_input_free (ref);
 }
 
 void
@@ -227,35 +246,41 @@ tcpip_netif_conf_sub (struct netif *netif, unsigned char *ipaddr_a,
 	}
 }
 
-static void
-tcpip_netif_conf (struct ip_main_netif *netif_arg, int netif_num)
+/* Add a network interface.  Routes are looked up by the subnets of
+ * the interfaces; packets to other networks go to the default
+ * interface. */
+void
+ip_main_add_netif (struct ip_main_netif *netif_arg)
 {
 	struct netif *netif;
 	int i;
 
-	/* Allocate network interface. */
-	netif = mem_malloc (sizeof *tcpip_context->netif * netif_num);
+	LWIP_ASSERT ("tcpip_context", tcpip_context);
+	i = tcpip_context->netif_num;
+	if (i >= IP_MAIN_NETIF_MAX) {
+		printf ("ip: too many network interfaces\n");
+		return;
+	}
+	netif = mem_malloc (sizeof *netif);
 	LWIP_ASSERT ("netif", netif);
-	tcpip_context->netif = netif;
-	tcpip_context->netif_num = netif_num;
-	tcpip_context->oldip_addr = mem_malloc (sizeof *tcpip_context->
-						oldip_addr * netif_num);
-	LWIP_ASSERT ("tcpip_context->oldip_addr", tcpip_context->oldip_addr);
-
-	for (i = 0; i < netif_num; i++)
-		tcpip_netif_conf_sub (&netif[i],
-				      netif_arg[i].ipaddr,
-				      netif_arg[i].netmask,
-				      netif_arg[i].gateway,
-				      netif_arg[i].use_as_default,
-				      netif_arg[i].use_dhcp,
-				      netif_arg[i].handle,
-				      &tcpip_context->oldip_addr[i]);
+	memset (netif, 0, sizeof *netif);
+	tcpip_context->netif[i] = netif;
+	tcpip_netif_conf_sub (netif,
+			      netif_arg->ipaddr,
+			      netif_arg->netmask,
+			      netif_arg->gateway,
+			      netif_arg->use_as_default,
+			      netif_arg->use_dhcp,
+			      netif_arg->handle,
+			      &tcpip_context->oldip_addr[i]);
+	tcpip_context->netif_num = i + 1;
 }
 
 void
 ip_main_init (struct ip_main_netif *netif_arg, int netif_num)
 {
+	int i;
+
 	/* Initialize TCP/IP Stack. */
 	lwip_init ();
 
@@ -265,7 +290,21 @@ ip_main_init (struct ip_main_netif *netif_arg, int netif_num)
 	memset (tcpip_context, 0, sizeof *tcpip_context);
 
 	/* Configure and add network interface. */
-	tcpip_netif_conf (netif_arg, netif_num);
+	for (i = 0; i < netif_num; i++)
+		ip_main_add_netif (&netif_arg[i]);
+}
+
+/* Microseconds until ip_main_task() has timer work to do, or ~0ULL
+ * if no timeout is pending */
+unsigned long long
+ip_main_sleeptime (void)
+{
+	u32_t msec;
+
+	msec = sys_timeouts_sleeptime ();
+	if (msec == SYS_TIMEOUTS_SLEEPTIME_INFINITE)
+		return ~0ULL;
+	return msec * 1000ULL;
 }
 
 void
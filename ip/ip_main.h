@@ -1,3 +1,5 @@
+#define IP_MAIN_NETIF_MAX	8
+
 struct ip_main_netif {
 	void *handle;
 	int use_as_default;
@@ -7,6 +9,8 @@ struct ip_main_netif {
 	unsigned char *gateway;
 };
 
-void ip_main_input (void *arg, void *buf, unsigned int len);
+void ip_main_input_ref (void *arg, void *buf, unsigned int len, void *ref);
 void ip_main_init (struct ip_main_netif *netif_arg, int netif_num);
+void ip_main_add_netif (struct ip_main_netif *netif_arg);
+unsigned long long ip_main_sleeptime (void);
 void ip_main_task (void);
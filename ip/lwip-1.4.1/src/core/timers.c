@@ -410,6 +410,26 @@ sys_restart_timeouts(void)
   timeouts_last_time = sys_now();
 }
 
+/** Return the time left before the next timeout is due, in
+ * milliseconds, or SYS_TIMEOUTS_SLEEPTIME_INFINITE if no timeout is
+ * pending.  Lets the main loop sleep instead of calling
+ * sys_check_timeouts() continuously.
+ */
+u32_t
+sys_timeouts_sleeptime(void)
+{
+  u32_t diff;
+
+  if (next_timeout == NULL) {
+    return SYS_TIMEOUTS_SLEEPTIME_INFINITE;
+  }
+  diff = sys_now() - timeouts_last_time;
+  if (diff >= next_timeout->time) {
+    return 0;
+  }
+  return next_timeout->time - diff;
+}
+
 #else /* NO_SYS */
 
 /**
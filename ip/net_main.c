@@ -28,17 +28,26 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <core/arith.h>
 #include <core/config.h>
 #include <core/initfunc.h>
 #include <core/list.h>
 #include <core/mm.h>
 #include <core/panic.h>
+#include <core/printf.h>
 #include <core/spinlock.h>
 #include <core/string.h>
 #include <core/thread.h>
+#include <core/time.h>
+#include <core/timer.h>
+#include <core/vmmcall_status.h>
 #include <net/netapi.h>
+#include <net/netbuf.h>
 #include "ip_main.h"
 
+#define NET_INPUT_RING_SIZE	256
+#define NET_POLL_USEC		1000	/* polling interval when idle */
+
 struct net_task {
 	LIST1_DEFINE (struct net_task);
 	void (*func) (void *arg);
@@ -46,35 +55,66 @@ struct net_task {
 };
 
 struct net_ip_data {
+	struct net_ip_data *next;
 	int pass;
 	void *phys_handle, *virt_handle;
 	struct nicfunc *phys_func, *virt_func;
 	bool input_ok;
 	void *input_arg;
-};
-
-struct net_ip_input_data {
-	struct net_ip_data *p;
-	void *buf;
-	unsigned int len;
+	struct netbuf_ring input_ring;
+	spinlock_t input_lock;	/* serializes producers */
+	unsigned int input_drops;
+	unsigned int input_oversize; /* dropped, longer than NETBUF_MAXLEN */
+	unsigned int input_packets;
+	u64 copy_cycles;	/* spent in net_main_input_queue() */
+	u64 stack_cycles;	/* spent in the network thread */
+	struct ip_main_netif netif_arg;
+	u8 ipaddr[4], netmask[4], gateway[4];
 };
 
 static LIST1_DEFINE_HEAD (struct net_task, net_task_list);
 static spinlock_t net_task_lock;
+static struct net_ip_data *net_ip_list; /* used by the network thread */
+static bool net_ip_poll;
+static bool net_ip_global_used;
+static spinlock_t net_wait_lock;
+static bool net_thread_started, net_thread_sleeping;
+static tid_t net_thread_tid;
+static void *net_wakeup_timer;
+
+static void
+net_main_wakeup (void)
+{
+	spinlock_lock (&net_wait_lock);
+	if (net_thread_sleeping) {
+		net_thread_sleeping = false;
+		thread_wakeup (net_thread_tid);
+	}
+	spinlock_unlock (&net_wait_lock);
+}
 
 static void
+net_main_wakeup_timer (void *handle, void *data)
+{
+	net_main_wakeup ();
+}
+
+static int
 net_task_call (void)
 {
 	struct net_task *p;
+	int n = 0;
 
 	spinlock_lock (&net_task_lock);
 	while ((p = LIST1_POP (net_task_list))) {
 		spinlock_unlock (&net_task_lock);
 		p->func (p->arg);
 		free (p);
+		n++;
 		spinlock_lock (&net_task_lock);
 	}
 	spinlock_unlock (&net_task_lock);
+	return n;
 }
 
 void
@@ -88,41 +128,209 @@ net_main_task_add (void (*func) (void *arg), void *arg)
 	spinlock_lock (&net_task_lock);
 	LIST1_ADD (net_task_list, p);
 	spinlock_unlock (&net_task_lock);
+	net_main_wakeup ();
+}
+
+static int
+net_main_input_drain (void)
+{
+	struct net_ip_data *p;
+	struct netbuf *nb;
+	u64 start;
+	int n = 0;
+
+	for (p = net_ip_list; p; p = p->next) {
+		while ((nb = netbuf_ring_get (&p->input_ring))) {
+			start = get_cpu_time_raw ();
+			/* lwIP references the netbuf and puts it with
+			 * net_main_input_free() when done. */
+			ip_main_input_ref (p->input_arg, nb->data, nb->len,
+					   nb);
+			p->stack_cycles += get_cpu_time_raw () - start;
+			n++;
+		}
+	}
+	return n;
+}
+
+static bool
+net_main_pending (void)
+{
+	struct net_ip_data *p;
+	bool ret;
+
+	for (p = net_ip_list; p; p = p->next)
+		if (!netbuf_ring_empty (&p->input_ring))
+			return true;
+	spinlock_lock (&net_task_lock);
+	ret = !!net_task_list.next;
+	spinlock_unlock (&net_task_lock);
+	return ret;
+}
+
+/* Sleep until a packet or a task is queued, a lwIP timeout is due,
+ * or the interfaces need to be polled. */
+static void
+net_main_sleep (void)
+{
+	u64 usec;
+
+	usec = ip_main_sleeptime ();
+	if (!usec)
+		return;
+	if (net_ip_poll && usec > NET_POLL_USEC)
+		usec = NET_POLL_USEC;
+	if (usec != ~0ULL)
+		timer_set (net_wakeup_timer, usec);
+	spinlock_lock (&net_wait_lock);
+	thread_will_stop ();
+	net_thread_sleeping = true;
+	spinlock_unlock (&net_wait_lock);
+	/* Producers wake the thread after queuing, so check again
+	 * after marking it sleeping. */
+	if (net_main_pending ())
+		net_main_wakeup ();
+	schedule ();
+}
+
+static void
+net_ip_add_netif (void *arg)
+{
+	struct net_ip_data *p = arg, **pp;
+
+	for (pp = &net_ip_list; *pp; pp = &(*pp)->next);
+	*pp = p;
+	if (p->phys_func->poll)
+		net_ip_poll = true;
+	ip_main_add_netif (&p->netif_arg);
 }
 
 static void
 net_thread (void *arg)
 {
-	struct net_ip_data *p = arg;
-	struct ip_main_netif netif_arg[1];
-
-	netif_arg[0].handle = p;
-	netif_arg[0].use_as_default = 1;
-	netif_arg[0].use_dhcp = config.ip.use_dhcp;
-	netif_arg[0].ipaddr = config.ip.ipaddr;
-	netif_arg[0].netmask = config.ip.netmask;
-	netif_arg[0].gateway = config.ip.gateway;
-	ip_main_init (netif_arg, 1);
+	int n;
+
+	net_thread_tid = thread_gettid ();
+	ip_main_init (NULL, 0);
+	net_ip_add_netif (arg);
 	for (;;) {
 		ip_main_task ();
-		net_task_call ();
-		schedule ();
+		n = net_main_input_drain ();
+		n += net_task_call ();
+		if (n)
+			schedule ();
+		else
+			net_main_sleep ();
 	}
 }
 
+static char *
+net_ip_parse_addr (char *s, u8 *addr)
+{
+	int i, n;
+
+	for (i = 0; i < 4; i++) {
+		if (i && *s++ != '.')
+			return NULL;
+		if (*s < '0' || *s > '9')
+			return NULL;
+		for (n = 0; *s >= '0' && *s <= '9'; s++) {
+			n = n * 10 + (*s - '0');
+			if (n > 255)
+				return NULL;
+		}
+		addr[i] = n;
+	}
+	return s;
+}
+
+/* arg: "dhcp" or "<address>/<netmask>[/<gateway>]" */
+static void
+net_ip_parse_arg (struct net_ip_data *p, char *arg)
+{
+	char *s;
+
+	memset (p->ipaddr, 0, sizeof p->ipaddr);
+	memset (p->netmask, 0, sizeof p->netmask);
+	memset (p->gateway, 0, sizeof p->gateway);
+	if (!strcmp (arg, "dhcp")) {
+		p->netif_arg.use_dhcp = 1;
+		return;
+	}
+	s = net_ip_parse_addr (arg, p->ipaddr);
+	if (!s || *s++ != '/')
+		goto err;
+	s = net_ip_parse_addr (s, p->netmask);
+	if (s && *s == '/')
+		s = net_ip_parse_addr (s + 1, p->gateway);
+	if (s && *s == '\0')
+		return;
+err:
+	panic ("net=ip: invalid argument \"%s\"."
+	       " Use <address>/<netmask>[/<gateway>] or dhcp", arg);
+}
+
+static char *
+net_main_status (void)
+{
+	static char buf[1024];
+	struct net_ip_data *p;
+	int i, len = 0;
+
+	for (p = net_ip_list, i = 0; p && len < sizeof buf; p = p->next, i++)
+		len += snprintf (buf + len, sizeof buf - len,
+				 "ip%d: packets %u drops %u oversize %u"
+				 " cycles/packet copy %llu stack %llu\n", i,
+				 p->input_packets, p->input_drops,
+				 p->input_oversize,
+				 muldiv64 (p->copy_cycles, 1,
+					   p->input_packets),
+				 muldiv64 (p->stack_cycles, 1,
+					   p->input_packets));
+	if (!len)
+		buf[0] = '\0';
+	return buf;
+}
+
 static void *
 net_ip_new_nic (char *arg, void *param)
 {
 	struct net_ip_data *p;
-	static int flag;
 
-	if (flag)
-		panic ("net=ip does not work with multiple network"
-		       " interfaces");
-	flag = 1;
 	p = alloc (sizeof *p);
+	p->next = NULL;
 	p->pass = !!param;
 	p->input_ok = false;
+	netbuf_ring_init (&p->input_ring, NET_INPUT_RING_SIZE);
+	spinlock_init (&p->input_lock);
+	p->input_drops = 0;
+	p->input_oversize = 0;
+	p->input_packets = 0;
+	p->copy_cycles = 0;
+	p->stack_cycles = 0;
+	p->netif_arg.handle = p;
+	p->netif_arg.use_dhcp = 0;
+	p->netif_arg.ipaddr = p->ipaddr;
+	p->netif_arg.netmask = p->netmask;
+	p->netif_arg.gateway = p->gateway;
+	if (arg && *arg) {
+		/* Additional interfaces have their own addresses
+		 * and are not used as the default route. */
+		net_ip_parse_arg (p, arg);
+		p->netif_arg.use_as_default = 0;
+	} else {
+		if (net_ip_global_used)
+			panic ("net=ip: the IP settings in the configuration"
+			       " are used by another interface."
+			       " Use net=ip:<address>/<netmask>"
+			       " or net=ip:dhcp");
+		net_ip_global_used = true;
+		memcpy (p->ipaddr, config.ip.ipaddr, sizeof p->ipaddr);
+		memcpy (p->netmask, config.ip.netmask, sizeof p->netmask);
+		memcpy (p->gateway, config.ip.gateway, sizeof p->gateway);
+		p->netif_arg.use_dhcp = config.ip.use_dhcp;
+		p->netif_arg.use_as_default = 1;
+	}
 	return p;
 }
 
@@ -152,35 +360,47 @@ net_ip_virt_recv (void *handle, unsigned int num_packets, void **packets,
 				    packet_sizes, true);
 }
 
-static void
-net_main_input_direct (void *arg)
+void
+net_main_input_free (void *ref)
 {
-	struct net_ip_input_data *data = arg;
-
-	ip_main_input (data->p->input_arg, data->buf, data->len);
-	free (data->buf);
-	free (data);
+	netbuf_put (ref);
 }
 
 static void
 net_main_input_queue (struct net_ip_data *p, void **packets,
 		      unsigned int *packet_sizes, unsigned int num_packets)
 {
-	struct net_ip_input_data *data;
+	struct netbuf *nb;
 	unsigned int i;
-
+	u64 start;
+
+	/* Note: pbuf_alloc() must be called in the network thread,
+	 * but this function is not.  The packets are copied to
+	 * netbufs here, which is the only copy: the network thread
+	 * drains the ring without taking input_lock and gives the
+	 * netbufs to lwIP as PBUF_REF pbufs. */
+	spinlock_lock (&p->input_lock);
+	start = get_cpu_time_raw ();
 	for (i = 0; i < num_packets; i++) {
-		/* Note: pbuf_alloc() must be called in the network
-		 * thread, but this function is not. */
-		/* FIXME: memcpy() is called twice for every input
-		 * packet. Copying to pbuf directly is better. */
-		data = alloc (sizeof *data);
-		data->p = p;
-		data->buf = alloc (packet_sizes[i]);
-		data->len = packet_sizes[i];
-		memcpy (data->buf, packets[i], packet_sizes[i]);
-		net_main_task_add (net_main_input_direct, data);
+		if (packet_sizes[i] > NETBUF_MAXLEN) {
+			p->input_oversize++;
+			continue;
+		}
+		nb = netbuf_copy (packets[i], packet_sizes[i]);
+		if (!nb) {
+			p->input_drops++;
+			continue;
+		}
+		if (!netbuf_ring_put (&p->input_ring, nb)) {
+			netbuf_put (nb);
+			p->input_drops++;
+			continue;
+		}
+		p->input_packets++;
 	}
+	p->copy_cycles += get_cpu_time_raw () - start;
+	spinlock_unlock (&p->input_lock);
+	net_main_wakeup ();
 }
 
 static void
@@ -238,12 +458,22 @@ static void
 net_ip_start (void *handle)
 {
 	struct net_ip_data *p = handle;
+	bool start;
 
 	p->phys_func->set_recv_callback (p->phys_handle, net_ip_phys_recv, p);
 	if (p->virt_func)
 		p->virt_func->set_recv_callback (p->virt_handle,
 						 net_ip_virt_recv, p);
-	thread_new (net_thread, p, VMM_STACKSIZE);
+	/* The lwIP stack is not reentrant, so one thread serves all
+	 * the interfaces. */
+	spinlock_lock (&net_wait_lock);
+	start = !net_thread_started;
+	net_thread_started = true;
+	spinlock_unlock (&net_wait_lock);
+	if (start)
+		thread_new (net_thread, p, VMM_STACKSIZE);
+	else
+		net_main_task_add (net_ip_add_netif, p);
 }
 
 static struct netfunc net_ip_func = {
@@ -257,6 +487,14 @@ net_main_init (void)
 {
 	spinlock_init (&net_task_lock);
 	LIST1_HEAD_INIT (net_task_list);
+	net_ip_list = NULL;
+	net_ip_poll = false;
+	net_ip_global_used = false;
+	spinlock_init (&net_wait_lock);
+	net_thread_started = false;
+	net_thread_sleeping = false;
+	net_wakeup_timer = timer_new (net_main_wakeup_timer, NULL);
+	register_status_callback (net_main_status);
 	net_register ("ip", &net_ip_func, NULL);
 	net_register ("ippass", &net_ip_func, "");
 }
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2026 BitVisor contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <core.h>
+#include <core/mm.h>
+#include <core/panic.h>
+#include <core/spinlock.h>
+#include <core/string.h>
+#include <core/initfunc.h>
+#include <net/netbuf.h>
+
+#define NETBUF_PER_PAGE		(PAGESIZE / NETBUF_SIZE)
+#define NETBUF_MAXNUM		2048	/* buffers in the pool */
+
+static struct netbuf *netbuf_free_list;
+static unsigned int netbuf_num;
+static spinlock_t netbuf_lock;
+
+static u32
+netbuf_xadd (u32 *d, u32 n)
+{
+	asm volatile ("lock xaddl %0,%1" : "+r" (n), "+m" (*d) : : "memory");
+	return n;
+}
+
+/* netbuf_lock must be locked */
+static bool
+netbuf_grow (void)
+{
+	struct netbuf *nb;
+	void *page;
+	int i;
+
+	if (netbuf_num >= NETBUF_MAXNUM)
+		return false;
+	if (alloc_page (&page, NULL) < 0)
+		return false;
+	nb = alloc (sizeof *nb * NETBUF_PER_PAGE);
+	for (i = 0; i < NETBUF_PER_PAGE; i++) {
+		nb[i].head = (u8 *)page + i * NETBUF_SIZE;
+		nb[i].next = netbuf_free_list;
+		netbuf_free_list = &nb[i];
+	}
+	netbuf_num += NETBUF_PER_PAGE;
+	return true;
+}
+
+/* return value: an empty netbuf with one reference, or NULL if the
+   pool is exhausted */
+struct netbuf *
+netbuf_alloc (void)
+{
+	struct netbuf *nb;
+
+	spinlock_lock (&netbuf_lock);
+	if (!netbuf_free_list && !netbuf_grow ()) {
+		spinlock_unlock (&netbuf_lock);
+		return NULL;
+	}
+	nb = netbuf_free_list;
+	netbuf_free_list = nb->next;
+	spinlock_unlock (&netbuf_lock);
+	nb->next = NULL;
+	nb->refcnt = 1;
+	nb->len = 0;
+	nb->data = nb->head + NETBUF_HEADROOM;
+	return nb;
+}
+
+struct netbuf *
+netbuf_copy (void *data, unsigned int len)
+{
+	struct netbuf *nb;
+
+	if (len > NETBUF_MAXLEN)
+		return NULL;
+	nb = netbuf_alloc ();
+	if (!nb)
+		return NULL;
+	memcpy (nb->data, data, len);
+	nb->len = len;
+	return nb;
+}
+
+void
+netbuf_get (struct netbuf *nb)
+{
+	netbuf_xadd (&nb->refcnt, 1);
+}
+
+void
+netbuf_put (struct netbuf *nb)
+{
+	u32 old;
+
+	old = netbuf_xadd (&nb->refcnt, -1);
+	if (old == 1) {
+		spinlock_lock (&netbuf_lock);
+		nb->next = netbuf_free_list;
+		netbuf_free_list = nb;
+		spinlock_unlock (&netbuf_lock);
+	} else if (!old) {
+		panic ("netbuf_put: refcnt underflow");
+	}
+}
+
+/* size must be a power of 2 */
+void
+netbuf_ring_init (struct netbuf_ring *r, unsigned int size)
+{
+	if (!size || (size & (size - 1)))
+		panic ("netbuf_ring_init: bad size %u", size);
+	r->head = 0;
+	r->tail = 0;
+	r->mask = size - 1;
+	r->slot = alloc (sizeof *r->slot * size);
+}
+
+static void
+netbuf_init (void)
+{
+	netbuf_free_list = NULL;
+	netbuf_num = 0;
+	spinlock_init (&netbuf_lock);
+}
+
+INITFUNC ("global3", netbuf_init);
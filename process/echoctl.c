@@ -57,7 +57,9 @@ usage (char *hoge)
 		"usage:\n"
 		"  client connect <ipaddr> <port>  Connect to echo server.\n"
 		"  client send                     Send a message to client.\n"
-		"  server start <port>             Start echo server.\n");
+		"  server start <port>             Start echo server.\n"
+		"  udpserver start <port>          Start UDP echo server.\n"
+		"  udpserver stat                  Print UDP echo throughput.\n");
 }
 
 static int
@@ -125,6 +127,25 @@ action (int d, int argc, char **argv)
 			usage (argv[0]);
 			return -1;
 		}
+	} else if (!strcmp (argv[1], "udpserver")) {
+		if (!strcmp (argv[2], "start")) {
+			if (argc != 4) {
+				usage (argv[0]);
+				return -1;
+			}
+			port = (int)strtol (argv[3], NULL, 0);
+			printf ("Starting UDP server (Port:%d)...\n", port);
+			cmd = 3;
+		} else if (!strcmp (argv[2], "stat")) {
+			if (argc != 3) {
+				usage (argv[0]);
+				return -1;
+			}
+			cmd = 4;
+		} else {
+			usage (argv[0]);
+			return -1;
+		}
 	} else {
 		usage (argv[0]);
 		return -1;
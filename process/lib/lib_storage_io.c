@@ -119,6 +119,32 @@ lib_storage_io_msghandler (int m, int c, struct msgbuf *buf, int bufcnt)
 			memcpy (arg->buf, buf[1].base, buf[1].len);
 		arg->callback (arg->data, arg->len);
 		return 0;
+	} else if (c == STORAGE_IO_RREADWRITEV) {
+		struct storage_io_msg_rreadwritev *arg;
+		struct storage_io_vec *v;
+		int i, j = 2;
+
+		if (bufcnt < 2)
+			return -1;
+		if (buf[0].len != sizeof *arg)
+			return -1;
+		arg = buf[0].base;
+		if (buf[1].len != arg->n * sizeof *v)
+			return -1;
+		v = buf[1].base;
+		for (i = 0; i < arg->n; i++) {
+			arg->vec[i].retval = v[i].retval;
+			if (arg->vec[i].write)
+				continue;
+			if (j < bufcnt && buf[j].len == arg->vec[i].len)
+				memcpy (arg->vec[i].buf, buf[j].base,
+					buf[j].len);
+			else
+				arg->vec[i].retval = -1;
+			j++;
+		}
+		arg->callback (arg->data, arg->vec, arg->n);
+		return 0;
 	} else {
 		return -1;
 	}
@@ -206,3 +232,56 @@ storage_io_awrite (int id, int devno, void *buf, int len, long long offset,
 	callsub (STORAGE_IO_AREADWRITE, mbuf, 2);
 	return arg.retval;
 }
+
+int
+storage_io_set_queue_depth (int id, int devno, int depth)
+{
+	struct storage_io_msg_set_queue_depth arg;
+	struct msgbuf buf[1];
+
+	arg.id = id;
+	arg.devno = devno;
+	arg.depth = depth;
+	setmsgbuf (&buf[0], &arg, sizeof arg, 1);
+	callsub (STORAGE_IO_SET_QUEUE_DEPTH, buf, 1);
+	return arg.retval;
+}
+
+/* Submit up to STORAGE_IO_MAXVEC reads and writes with one message.
+ * The callback is called once when all of them complete.
+ * STORAGE_IO_EBUSY is returned if the device has too many requests;
+ * submit again after a callback. */
+int
+storage_io_areadwritev (int id, int devno, struct storage_io_vec *vec,
+			int n, void (*callback) (void *data,
+						 struct storage_io_vec *vec,
+						 int n),
+			void *data)
+{
+	struct storage_io_msg_areadwritev arg;
+	struct msgbuf mbuf[STORAGE_IO_MAXVEC + 2];
+	int i;
+
+	if (n <= 0 || n > STORAGE_IO_MAXVEC)
+		return -1;
+	arg.id = id;
+	arg.devno = devno;
+	arg.n = n;
+	arg.callback = callback;
+	arg.data = data;
+	arg.vec = vec;
+	if (!registered) {
+		rdesc = msgregister ("lib_storage_io",
+				    lib_storage_io_msghandler);
+		if (rdesc < 0)
+			return -1;
+		registered = 1;
+	}
+	memcpy (arg.msgname, "lib_storage_io", 15);
+	setmsgbuf (&mbuf[0], &arg, sizeof arg, 1);
+	setmsgbuf (&mbuf[1], vec, n * sizeof *vec, 0);
+	for (i = 0; i < n; i++)
+		setmsgbuf (&mbuf[i + 2], vec[i].buf, vec[i].len, 0);
+	callsub (STORAGE_IO_AREADWRITEV, mbuf, n + 2);
+	return arg.retval;
+}
@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2026 BitVisor contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Spread large storage crypto requests over processors.  The
+ * requesting processor publishes a job and works on it.  A helper
+ * thread is bound to each processor, and the helpers of the other
+ * processors join when they get scheduled there.  The requesting
+ * thread sleeps until chunks taken by them are done.  Processors
+ * halted in the guest do not run helpers, so a request never waits
+ * for a processor which is not working on it. */
+
+#include <core.h>
+#include <core/arith.h>
+#include <core/cpu.h>
+#include <core/thread.h>
+#include <core/time.h>
+#include <storage.h>
+#include "lib/crypto/crypto.h"
+
+#ifndef STORAGE_PD
+
+#define CRYPT_SPLIT_CHUNK	(64 * 1024)
+#define CRYPT_SPLIT_MAXHELPERS	16
+
+struct crypt_split_job {
+	struct crypto *crypto;
+	int enc;
+	void *keyctx;
+	u8 *dst, *src;
+	lba_t lba;
+	int sector_size;
+	int count;
+	int chunk;		/* sectors per chunk */
+	int next;		/* first sector not taken */
+	int done;		/* number of sectors processed */
+	volatile bool waiting;	/* the requester is sleeping */
+	tid_t waiter;
+};
+
+static spinlock_t crypt_split_lock;
+static struct crypt_split_job *crypt_split_job; /* NULL if all taken */
+static uint crypt_split_min;	/* bytes */
+static int crypt_split_nhelpers;
+static tid_t crypt_split_helper[CRYPT_SPLIT_MAXHELPERS]; /* by processor */
+static bool crypt_split_idle[CRYPT_SPLIT_MAXHELPERS];
+
+static void
+crypt_split_crypt (struct crypto *crypto, int enc, void *keyctx, u8 *dst,
+		   u8 *src, lba_t lba, int sector_size, int count)
+{
+	void (*crypt) (void *dst, void *src, void *keyctx, lba_t lba,
+		       int sector_size);
+	void (*crypt_sectors) (void *dst, void *src, void *keyctx, lba_t lba,
+			       int sector_size, int count);
+
+	crypt_sectors = enc ? crypto->encrypt_sectors :
+		crypto->decrypt_sectors;
+	if (crypt_sectors) {
+		crypt_sectors (dst, src, keyctx, lba, sector_size, count);
+		return;
+	}
+	crypt = enc ? crypto->encrypt : crypto->decrypt;
+	while (count-- > 0) {
+		crypt (dst, src, keyctx, lba++, sector_size);
+		dst += sector_size;
+		src += sector_size;
+	}
+}
+
+/* crypt_split_lock must be locked.  Returns the number of sectors
+ * taken from the current job. */
+static int
+crypt_split_take (struct crypt_split_job **job, int *start)
+{
+	struct crypt_split_job *j = crypt_split_job;
+	int n;
+
+	if (!j)
+		return 0;
+	n = j->count - j->next;
+	if (n > j->chunk)
+		n = j->chunk;
+	*start = j->next;
+	j->next += n;
+	if (j->next == j->count)
+		crypt_split_job = NULL;
+	*job = j;
+	return n;
+}
+
+/* Process chunks until all of them are taken */
+static void
+crypt_split_work (void)
+{
+	struct crypt_split_job *job;
+	int start, n, off;
+
+	for (;;) {
+		spinlock_lock (&crypt_split_lock);
+		n = crypt_split_take (&job, &start);
+		spinlock_unlock (&crypt_split_lock);
+		if (!n)
+			break;
+		off = start * job->sector_size;
+		crypt_split_crypt (job->crypto, job->enc, job->keyctx,
+				   job->dst + off, job->src + off,
+				   job->lba + start, job->sector_size, n);
+		/* The job may be gone after done reaches count and
+		 * waiting is cleared */
+		spinlock_lock (&crypt_split_lock);
+		job->done += n;
+		if (job->done == job->count && job->waiting) {
+			thread_wakeup (job->waiter);
+			job->waiting = false;
+		}
+		spinlock_unlock (&crypt_split_lock);
+	}
+}
+
+static void
+crypt_split_helper_thread (void *arg)
+{
+	int i = (int)(ulong)arg;
+
+	for (;;) {
+		crypt_split_work ();
+		spinlock_lock (&crypt_split_lock);
+		if (crypt_split_job) {
+			spinlock_unlock (&crypt_split_lock);
+			continue;
+		}
+		crypt_split_idle[i] = true;
+		thread_will_stop ();
+		spinlock_unlock (&crypt_split_lock);
+		schedule ();
+	}
+}
+
+/* Returns false if another job is waiting for processors */
+static bool
+crypt_split_do (struct crypt_split_job *job)
+{
+	int i, self;
+
+	self = get_cpu_id ();
+	spinlock_lock (&crypt_split_lock);
+	if (crypt_split_job) {
+		spinlock_unlock (&crypt_split_lock);
+		return false;
+	}
+	crypt_split_job = job;
+	for (i = 0; i < crypt_split_nhelpers; i++) {
+		/* The helper of this processor would only run while
+		 * the requesting thread sleeps */
+		if (i != self && crypt_split_idle[i]) {
+			crypt_split_idle[i] = false;
+			thread_wakeup (crypt_split_helper[i]);
+		}
+	}
+	spinlock_unlock (&crypt_split_lock);
+	crypt_split_work ();
+	/* Sleep until the helper processing the last chunk wakes this
+	 * thread up, so that the processor can run other threads
+	 * meanwhile */
+	spinlock_lock (&crypt_split_lock);
+	if (job->done < job->count) {
+		job->waiter = thread_gettid ();
+		job->waiting = true;
+		thread_will_stop ();
+	}
+	spinlock_unlock (&crypt_split_lock);
+	while (job->waiting)
+		schedule ();
+	return true;
+}
+
+static int
+crypt_split_request (struct crypto *crypto, int enc, void *keyctx, u8 *dst,
+		     u8 *src, lba_t lba, int sector_size, int count,
+		     uint min)
+{
+	struct crypt_split_job job;
+	uint size = count * sector_size;
+
+	if (size < min || size < CRYPT_SPLIT_CHUNK * 2 || crypt_split_job)
+		return 0;
+	job.crypto = crypto;
+	job.enc = enc;
+	job.keyctx = keyctx;
+	job.dst = dst;
+	job.src = src;
+	job.lba = lba;
+	job.sector_size = sector_size;
+	job.count = count;
+	job.chunk = CRYPT_SPLIT_CHUNK / sector_size;
+	if (!job.chunk)
+		job.chunk = 1;
+	job.next = 0;
+	job.done = 0;
+	job.waiting = false;
+	return crypt_split_do (&job);
+}
+
+static int
+crypt_split_func (struct crypto *crypto, int enc, void *keyctx, void *dst,
+		  void *src, lba_t lba, int sector_size, int count)
+{
+	return crypt_split_request (crypto, enc, keyctx, dst, src, lba,
+				    sector_size, count, crypt_split_min);
+}
+
+#ifdef BENCHMARK
+#define CRYPT_SPLIT_BENCH_MAX	(4 * 1024 * 1024)
+#define CRYPT_SPLIT_BENCH_TOTAL	(16 * 1024 * 1024)
+
+/* Returns elapsed time in microseconds */
+static u64
+crypt_split_bench_run (struct crypto *crypto, void *keyctx, u8 *buf,
+		       int size, int loops, bool split)
+{
+	int i, count = size / 512;
+	u64 start;
+
+	start = get_time ();
+	for (i = 0; i < loops; i++) {
+		if (split && crypt_split_request (crypto, 1, keyctx, buf, buf,
+						  0, 512, count, 0))
+			continue;
+		crypt_split_crypt (crypto, 1, keyctx, buf, buf, 0, 512, count);
+	}
+	return get_time () - start;
+}
+
+static void
+crypt_split_bench (char *name)
+{
+	static const int sizes[] = { 4 * 1024, 128 * 1024,
+				     CRYPT_SPLIT_BENCH_MAX };
+	struct crypto *crypto;
+	u64 inline_time, split_time;
+	int i, loops, size;
+	void *keyctx;
+	u8 key[64];
+	u8 *buf;
+
+	crypto = crypto_find (name);
+	if (!crypto)
+		return;
+	for (i = 0; i < sizeof key; i++)
+		key[i] = i;
+	keyctx = crypto->setkey (key, 512);
+	buf = alloc (CRYPT_SPLIT_BENCH_MAX);
+	memset (buf, 0, CRYPT_SPLIT_BENCH_MAX);
+	for (i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+		size = sizes[i];
+		loops = CRYPT_SPLIT_BENCH_TOTAL / size;
+		inline_time = crypt_split_bench_run (crypto, keyctx, buf, size,
+						     loops, false);
+		split_time = crypt_split_bench_run (crypto, keyctx, buf, size,
+						    loops, true);
+		printf ("%s %d KB: inline %llu us %llu MB/s,"
+			" split %llu us %llu MB/s\n", name, size / 1024,
+			muldiv64 (inline_time, 1, loops),
+			muldiv64 (CRYPT_SPLIT_BENCH_TOTAL, 1000000,
+				  inline_time) >> 20,
+			muldiv64 (split_time, 1, loops),
+			muldiv64 (CRYPT_SPLIT_BENCH_TOTAL, 1000000,
+				  split_time) >> 20);
+	}
+	free (buf);
+}
+#endif
+
+static void
+crypt_split_init (void)
+{
+	int i;
+
+	spinlock_init (&crypt_split_lock);
+	crypt_split_job = NULL;
+	crypt_split_nhelpers = get_num_of_processors ();
+	if (crypt_split_nhelpers > CRYPT_SPLIT_MAXHELPERS)
+		crypt_split_nhelpers = CRYPT_SPLIT_MAXHELPERS;
+	if (!config.vmm.storage_crypt_split_min || crypt_split_nhelpers < 2)
+		crypt_split_nhelpers = 0;
+	for (i = 0; i < crypt_split_nhelpers; i++) {
+		crypt_split_idle[i] = false;
+		crypt_split_helper[i] =
+			thread_new_cpu (crypt_split_helper_thread,
+					(void *)(ulong)i, VMM_STACKSIZE, i);
+	}
+	if (crypt_split_nhelpers) {
+		crypt_split_min = config.vmm.storage_crypt_split_min * 1024;
+		crypto_split = crypt_split_func;
+		printf ("Storage crypto split: %d processors,"
+			" %u KB or larger\n", crypt_split_nhelpers,
+			config.vmm.storage_crypt_split_min);
+	}
+#ifdef BENCHMARK
+	crypt_split_bench ("aes-xts-ni");
+#endif
+}
+
+INITFUNC ("driver2", crypt_split_init);
+#endif /* STORAGE_PD */
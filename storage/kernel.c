@@ -28,8 +28,11 @@
  */
 
 #include <core.h>
+#include <core/arith.h>
 #include <core/process.h>
+#include <core/time.h>
 #include <storage.h>
+#include "lib/crypto/crypto.h"
 #include "lib/storage_msg.h"
 
 static int desc;
@@ -198,10 +201,152 @@ storage_premap_handle_sectors (struct storage_device *storage,
 	return storage_handle_sectors (storage, access, src, dst);
 }
 
+/* Handle sectors between buf and a scatter-gather list without an
+ * intermediate copy.  buf holds the whole access and sg[] continues
+ * from offset in buf, so a long list can be passed in several calls.
+ * Writes process sg[] into buf and reads process buf into sg[].  A
+ * sector split across entries is assembled in buf and processed in
+ * place.  Bytes past the access are copied as is. */
+int
+storage_handle_sectors_sg (struct storage_device *storage,
+			   struct storage_access *access, u8 *buf,
+			   unsigned int offset, struct storage_sg *sg,
+			   int sgnum)
+{
+	struct storage_access sub;
+	unsigned int ssiz = access->sector_size;
+	unsigned int end = access->count * ssiz;
+	unsigned int len, head, n;
+	bool wr = access->rw == STORAGE_WRITE;
+	u8 *p;
+	int i;
+
+	sub.rw = access->rw;
+	sub.sector_size = ssiz;
+	sub.cache_gen = access->cache_gen;
+	for (i = 0; i < sgnum; i++) {
+		p = sg[i].buf;
+		len = sg[i].len;
+		while (len > 0) {
+			if (offset >= end) {
+				if (wr)
+					memcpy (buf + offset, p, len);
+				else
+					memcpy (p, buf + offset, len);
+				offset += len;
+				break;
+			}
+			head = offset % ssiz;
+			sub.lba = access->lba + offset / ssiz;
+			if (!head && len >= ssiz) {
+				sub.count = len / ssiz;
+				if (sub.count > (end - offset) / ssiz)
+					sub.count = (end - offset) / ssiz;
+				if (wr)
+					storage_handle_sectors (storage, &sub, p,
+								buf + offset);
+				else
+					storage_handle_sectors (storage, &sub,
+								buf + offset,
+								p);
+				n = sub.count * ssiz;
+			} else {
+				n = ssiz - head;
+				if (n > len)
+					n = len;
+				sub.count = 1;
+				if (wr) {
+					memcpy (buf + offset, p, n);
+					if (head + n == ssiz)
+						storage_handle_sectors
+							(storage, &sub,
+							 buf + offset - head,
+							 buf + offset - head);
+				} else {
+					if (!head)
+						storage_handle_sectors
+							(storage, &sub,
+							 buf + offset,
+							 buf + offset);
+					memcpy (p, buf + offset, n);
+				}
+			}
+			p += n;
+			len -= n;
+			offset += n;
+		}
+	}
+	return 0;
+}
+
+#if defined (BENCHMARK) && !defined (STORAGE_PD)
+#define CRYPTO_BENCH_SECTORS	128
+#define CRYPTO_BENCH_LOOPS	64
+
+static u64
+crypto_bench_run (struct crypto *crypto, void *keyctx, u8 *buf, bool enc)
+{
+	void (*crypt)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size);
+	void (*crypt_sectors)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size, int count);
+	u64 start;
+	lba_t lba;
+	int i, j;
+
+	crypt = enc ? crypto->encrypt : crypto->decrypt;
+	crypt_sectors = enc ? crypto->encrypt_sectors : crypto->decrypt_sectors;
+	start = get_time ();
+	for (i = 0; i < CRYPTO_BENCH_LOOPS; i++) {
+		lba = i * CRYPTO_BENCH_SECTORS;
+		if (crypt_sectors) {
+			crypt_sectors (buf, buf, keyctx, lba, 512,
+				       CRYPTO_BENCH_SECTORS);
+			continue;
+		}
+		for (j = 0; j < CRYPTO_BENCH_SECTORS; j++)
+			crypt (buf + j * 512, buf + j * 512, keyctx, lba + j,
+			       512);
+	}
+	return get_time () - start;
+}
+
+/* single processor throughput of 512-byte sectors with a 512-bit
+ * XTS key */
+static void
+crypto_bench (char *name)
+{
+	u64 bytes = CRYPTO_BENCH_SECTORS * CRYPTO_BENCH_LOOPS * 512;
+	struct crypto *crypto;
+	u64 enc, dec;
+	void *keyctx;
+	u8 key[64];
+	u8 *buf;
+	int i;
+
+	crypto = crypto_find (name);
+	if (!crypto)
+		return;
+	for (i = 0; i < sizeof key; i++)
+		key[i] = i;
+	buf = alloc (CRYPTO_BENCH_SECTORS * 512);
+	memset (buf, 0, CRYPTO_BENCH_SECTORS * 512);
+	keyctx = crypto->setkey (key, 512);
+	enc = crypto_bench_run (crypto, keyctx, buf, true);
+	dec = crypto_bench_run (crypto, keyctx, buf, false);
+	printf ("%s: encrypt %llu MB/s, decrypt %llu MB/s\n", name,
+		muldiv64 (bytes, 1000000, enc) >> 20,
+		muldiv64 (bytes, 1000000, dec) >> 20);
+	free (buf);
+}
+#endif
+
 static void
 storage_kernel_init (void)
 {
 	storage_init (&config.storage);
+#if defined (BENCHMARK) && !defined (STORAGE_PD)
+	crypto_bench ("aes-xts");
+	crypto_bench ("aes-xts-ni");
+#endif
 	desc = msgopen ("storage");
 	if (desc < 0)
 		panic ("open storage");
@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2026 BitVisor contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* AES-XTS with the AES-NI instructions.  Eight blocks are processed
+ * at a time to hide the latency of AESENC/AESDEC.  Only XMM0-XMM7
+ * are used so that the same code runs on 32-bit and 64-bit VMM.
+ * The VMM does not save guest XMM registers on VM exit, so the
+ * registers are saved and restored around each request. */
+
+#include <core.h>
+#include "crypto.h"
+
+#define AES_NI_BLK_BYTES	16
+#define AES_NI_MAXNR		14
+#define AES_NI_GROUP		8
+#define CPUID_1_ECX_AES_BIT	0x2000000
+#define CR0_EM_BIT		0x4
+#define CR0_TS_BIT		0x8
+#define CR4_OSFXSR_BIT		0x200
+
+struct aes_ni_key {
+	u8 rk[AES_NI_MAXNR + 1][AES_NI_BLK_BYTES]
+		__attribute__ ((aligned (16)));
+	int nr;
+};
+
+struct aes_xts_ni_keyctx {
+	struct aes_ni_key tweak_key;
+	struct aes_ni_key encrypt_key;
+	struct aes_ni_key decrypt_key;
+};
+
+struct aes_ni_state {
+	u8 xmm[8][AES_NI_BLK_BYTES];
+	ulong cr0, cr4;
+};
+
+static u8 aes_ni_sbox[256];
+static struct crypto aes_xts_ni_fallback;
+
+static u8
+aes_ni_xtime (u8 x)
+{
+	return (x << 1) ^ (x & 0x80 ? 0x1B : 0);
+}
+
+static u8
+aes_ni_mul (u8 x, u8 y)
+{
+	u8 r = 0;
+
+	while (y) {
+		if (y & 1)
+			r ^= x;
+		x = aes_ni_xtime (x);
+		y >>= 1;
+	}
+	return r;
+}
+
+static u8
+aes_ni_rotl8 (u8 x, int n)
+{
+	return (x << n) | (x >> (8 - n));
+}
+
+static void
+aes_ni_sbox_init (void)
+{
+	u8 p = 1, q = 1, x;
+
+	/* p runs through the multiplicative group generated by 3
+	 * and q through its inverse */
+	do {
+		p ^= aes_ni_xtime (p);
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		if (q & 0x80)
+			q ^= 0x09;
+		x = q ^ aes_ni_rotl8 (q, 1) ^ aes_ni_rotl8 (q, 2) ^
+			aes_ni_rotl8 (q, 3) ^ aes_ni_rotl8 (q, 4);
+		aes_ni_sbox[p] = x ^ 0x63;
+	} while (p != 1);
+	aes_ni_sbox[0] = 0x63;
+}
+
+/* FIPS-197 key expansion.  The byte order of the round keys is the
+ * one AESENC expects. */
+static void
+aes_ni_setkey_enc (struct aes_ni_key *k, const u8 *key, int bits)
+{
+	int nk = bits / 32, i, j;
+	u8 *w = &k->rk[0][0], t[4], rcon = 1, tmp;
+
+	k->nr = nk + 6;
+	memcpy (w, (void *)key, nk * 4);
+	for (i = nk; i < 4 * (k->nr + 1); i++) {
+		for (j = 0; j < 4; j++)
+			t[j] = w[(i - 1) * 4 + j];
+		if (i % nk == 0) {
+			tmp = t[0];
+			t[0] = aes_ni_sbox[t[1]] ^ rcon;
+			t[1] = aes_ni_sbox[t[2]];
+			t[2] = aes_ni_sbox[t[3]];
+			t[3] = aes_ni_sbox[tmp];
+			rcon = aes_ni_xtime (rcon);
+		} else if (nk > 6 && i % nk == 4) {
+			for (j = 0; j < 4; j++)
+				t[j] = aes_ni_sbox[t[j]];
+		}
+		for (j = 0; j < 4; j++)
+			w[i * 4 + j] = w[(i - nk) * 4 + j] ^ t[j];
+	}
+}
+
+/* Round keys for the equivalent inverse cipher used by AESDEC */
+static void
+aes_ni_setkey_dec (struct aes_ni_key *k, struct aes_ni_key *e)
+{
+	int r, c;
+	u8 *s, *d;
+
+	k->nr = e->nr;
+	memcpy (k->rk[0], e->rk[e->nr], AES_NI_BLK_BYTES);
+	memcpy (k->rk[e->nr], e->rk[0], AES_NI_BLK_BYTES);
+	for (r = 1; r < e->nr; r++) {
+		s = e->rk[e->nr - r];
+		d = k->rk[r];
+		for (c = 0; c < 16; c += 4) {
+			d[c] = aes_ni_mul (s[c], 14) ^
+				aes_ni_mul (s[c + 1], 11) ^
+				aes_ni_mul (s[c + 2], 13) ^
+				aes_ni_mul (s[c + 3], 9);
+			d[c + 1] = aes_ni_mul (s[c], 9) ^
+				aes_ni_mul (s[c + 1], 14) ^
+				aes_ni_mul (s[c + 2], 11) ^
+				aes_ni_mul (s[c + 3], 13);
+			d[c + 2] = aes_ni_mul (s[c], 13) ^
+				aes_ni_mul (s[c + 1], 9) ^
+				aes_ni_mul (s[c + 2], 14) ^
+				aes_ni_mul (s[c + 3], 11);
+			d[c + 3] = aes_ni_mul (s[c], 11) ^
+				aes_ni_mul (s[c + 1], 13) ^
+				aes_ni_mul (s[c + 2], 9) ^
+				aes_ni_mul (s[c + 3], 14);
+		}
+	}
+}
+
+static void
+aes_ni_begin (struct aes_ni_state *s)
+{
+	ulong cr0, cr4;
+
+	asm volatile ("mov %%cr0,%0" : "=r" (cr0));
+	asm volatile ("mov %%cr4,%0" : "=r" (cr4));
+	s->cr0 = cr0;
+	s->cr4 = cr4;
+	if (cr0 & (CR0_EM_BIT | CR0_TS_BIT))
+		asm volatile ("mov %0,%%cr0"
+			      : : "r" (cr0 & ~(CR0_EM_BIT | CR0_TS_BIT)));
+	if (!(cr4 & CR4_OSFXSR_BIT))
+		asm volatile ("mov %0,%%cr4" : : "r" (cr4 | CR4_OSFXSR_BIT));
+	asm volatile ("movdqu %%xmm0,0x00(%0)\n"
+		      "movdqu %%xmm1,0x10(%0)\n"
+		      "movdqu %%xmm2,0x20(%0)\n"
+		      "movdqu %%xmm3,0x30(%0)\n"
+		      "movdqu %%xmm4,0x40(%0)\n"
+		      "movdqu %%xmm5,0x50(%0)\n"
+		      "movdqu %%xmm6,0x60(%0)\n"
+		      "movdqu %%xmm7,0x70(%0)\n"
+		      : : "r" (s->xmm) : "memory");
+}
+
+static void
+aes_ni_end (struct aes_ni_state *s)
+{
+	asm volatile ("movdqu 0x00(%0),%%xmm0\n"
+		      "movdqu 0x10(%0),%%xmm1\n"
+		      "movdqu 0x20(%0),%%xmm2\n"
+		      "movdqu 0x30(%0),%%xmm3\n"
+		      "movdqu 0x40(%0),%%xmm4\n"
+		      "movdqu 0x50(%0),%%xmm5\n"
+		      "movdqu 0x60(%0),%%xmm6\n"
+		      "movdqu 0x70(%0),%%xmm7\n"
+		      : : "r" (s->xmm) : "memory");
+	if (!(s->cr4 & CR4_OSFXSR_BIT))
+		asm volatile ("mov %0,%%cr4" : : "r" (s->cr4));
+	if (s->cr0 & (CR0_EM_BIT | CR0_TS_BIT))
+		asm volatile ("mov %0,%%cr0" : : "r" (s->cr0));
+}
+
+/* dst = crypt (src ^ tweak) ^ tweak for one block.  The tweak must
+ * be 16-byte aligned. */
+#define AES_NI_XTS1(name, round, lastround) \
+static void \
+name (struct aes_ni_key *k, u8 *dst, const u8 *src, const u64 *tweak) \
+{ \
+	u8 *rk = k->rk[0]; \
+	int n = k->nr - 1; \
+\
+	asm volatile ("movdqu (%[s]),%%xmm0\n" \
+		      "pxor (%[t]),%%xmm0\n" \
+		      "pxor (%[k]),%%xmm0\n" \
+		      "1:\n" \
+		      "add $16,%[k]\n" \
+		      round " (%[k]),%%xmm0\n" \
+		      "dec %[n]\n" \
+		      "jnz 1b\n" \
+		      lastround " 16(%[k]),%%xmm0\n" \
+		      "pxor (%[t]),%%xmm0\n" \
+		      "movdqu %%xmm0,(%[d])\n" \
+		      : [k] "+r" (rk), [n] "+r" (n) \
+		      : [s] "r" (src), [d] "r" (dst), [t] "r" (tweak) \
+		      : "memory", "cc"); \
+}
+
+/* Eight blocks at a time with tweak[0..15] */
+#define AES_NI_XTS8(name, round, lastround) \
+static void \
+name (struct aes_ni_key *k, u8 *dst, const u8 *src, const u64 *tweak) \
+{ \
+	u8 *rk = k->rk[0]; \
+	int n = k->nr - 1; \
+\
+	asm volatile ("movdqu 0x00(%[s]),%%xmm0\n" \
+		      "movdqu 0x10(%[s]),%%xmm1\n" \
+		      "movdqu 0x20(%[s]),%%xmm2\n" \
+		      "movdqu 0x30(%[s]),%%xmm3\n" \
+		      "movdqu 0x40(%[s]),%%xmm4\n" \
+		      "movdqu 0x50(%[s]),%%xmm5\n" \
+		      "movdqu 0x60(%[s]),%%xmm6\n" \
+		      "movdqu 0x70(%[s]),%%xmm7\n" \
+		      "pxor 0x00(%[t]),%%xmm0\n" \
+		      "pxor 0x10(%[t]),%%xmm1\n" \
+		      "pxor 0x20(%[t]),%%xmm2\n" \
+		      "pxor 0x30(%[t]),%%xmm3\n" \
+		      "pxor 0x40(%[t]),%%xmm4\n" \
+		      "pxor 0x50(%[t]),%%xmm5\n" \
+		      "pxor 0x60(%[t]),%%xmm6\n" \
+		      "pxor 0x70(%[t]),%%xmm7\n" \
+		      "pxor (%[k]),%%xmm0\n" \
+		      "pxor (%[k]),%%xmm1\n" \
+		      "pxor (%[k]),%%xmm2\n" \
+		      "pxor (%[k]),%%xmm3\n" \
+		      "pxor (%[k]),%%xmm4\n" \
+		      "pxor (%[k]),%%xmm5\n" \
+		      "pxor (%[k]),%%xmm6\n" \
+		      "pxor (%[k]),%%xmm7\n" \
+		      "1:\n" \
+		      "add $16,%[k]\n" \
+		      round " (%[k]),%%xmm0\n" \
+		      round " (%[k]),%%xmm1\n" \
+		      round " (%[k]),%%xmm2\n" \
+		      round " (%[k]),%%xmm3\n" \
+		      round " (%[k]),%%xmm4\n" \
+		      round " (%[k]),%%xmm5\n" \
+		      round " (%[k]),%%xmm6\n" \
+		      round " (%[k]),%%xmm7\n" \
+		      "dec %[n]\n" \
+		      "jnz 1b\n" \
+		      lastround " 16(%[k]),%%xmm0\n" \
+		      lastround " 16(%[k]),%%xmm1\n" \
+		      lastround " 16(%[k]),%%xmm2\n" \
+		      lastround " 16(%[k]),%%xmm3\n" \
+		      lastround " 16(%[k]),%%xmm4\n" \
+		      lastround " 16(%[k]),%%xmm5\n" \
+		      lastround " 16(%[k]),%%xmm6\n" \
+		      lastround " 16(%[k]),%%xmm7\n" \
+		      "pxor 0x00(%[t]),%%xmm0\n" \
+		      "pxor 0x10(%[t]),%%xmm1\n" \
+		      "pxor 0x20(%[t]),%%xmm2\n" \
+		      "pxor 0x30(%[t]),%%xmm3\n" \
+		      "pxor 0x40(%[t]),%%xmm4\n" \
+		      "pxor 0x50(%[t]),%%xmm5\n" \
+		      "pxor 0x60(%[t]),%%xmm6\n" \
+		      "pxor 0x70(%[t]),%%xmm7\n" \
+		      "movdqu %%xmm0,0x00(%[d])\n" \
+		      "movdqu %%xmm1,0x10(%[d])\n" \
+		      "movdqu %%xmm2,0x20(%[d])\n" \
+		      "movdqu %%xmm3,0x30(%[d])\n" \
+		      "movdqu %%xmm4,0x40(%[d])\n" \
+		      "movdqu %%xmm5,0x50(%[d])\n" \
+		      "movdqu %%xmm6,0x60(%[d])\n" \
+		      "movdqu %%xmm7,0x70(%[d])\n" \
+		      : [k] "+r" (rk), [n] "+r" (n) \
+		      : [s] "r" (src), [d] "r" (dst), [t] "r" (tweak) \
+		      : "memory", "cc"); \
+}
+
+AES_NI_XTS1 (aes_ni_enc1, "aesenc", "aesenclast")
+AES_NI_XTS1 (aes_ni_dec1, "aesdec", "aesdeclast")
+AES_NI_XTS8 (aes_ni_enc8, "aesenc", "aesenclast")
+AES_NI_XTS8 (aes_ni_dec8, "aesdec", "aesdeclast")
+
+/* Multiply the tweak by x in GF(2^128) */
+static void
+aes_ni_tweak_next (u64 *dst, const u64 *src)
+{
+	u64 carry = src[1] >> 63;
+
+	dst[1] = src[1] << 1 | src[0] >> 63;
+	dst[0] = src[0] << 1 ^ (carry ? 0x87 : 0);
+}
+
+static void
+aes_xts_ni_crypt (u8 *dst, u8 *src, struct aes_xts_ni_keyctx *k, bool enc,
+		  lba_t lba, int sector_size, int count)
+{
+	u64 tweak[AES_NI_GROUP * 2] __attribute__ ((aligned (16)));
+	u64 zero[2] __attribute__ ((aligned (16)));
+	struct aes_ni_key *ck;
+	struct aes_ni_state s;
+	int i, j;
+
+	ASSERT (sector_size % AES_NI_BLK_BYTES == 0);
+	ck = enc ? &k->encrypt_key : &k->decrypt_key;
+	zero[0] = 0;
+	zero[1] = 0;
+	aes_ni_begin (&s);
+	while (count-- > 0) {
+		tweak[0] = lba++;
+		tweak[1] = 0;
+		aes_ni_enc1 (&k->tweak_key, (u8 *)tweak, (u8 *)tweak, zero);
+		for (i = sector_size; i >= AES_NI_BLK_BYTES * AES_NI_GROUP;
+		     i -= AES_NI_BLK_BYTES * AES_NI_GROUP) {
+			for (j = 2; j < AES_NI_GROUP * 2; j += 2)
+				aes_ni_tweak_next (&tweak[j], &tweak[j - 2]);
+			if (enc)
+				aes_ni_enc8 (ck, dst, src, tweak);
+			else
+				aes_ni_dec8 (ck, dst, src, tweak);
+			aes_ni_tweak_next (&tweak[0],
+					   &tweak[AES_NI_GROUP * 2 - 2]);
+			dst += AES_NI_BLK_BYTES * AES_NI_GROUP;
+			src += AES_NI_BLK_BYTES * AES_NI_GROUP;
+		}
+		for (; i > 0; i -= AES_NI_BLK_BYTES) {
+			if (enc)
+				aes_ni_enc1 (ck, dst, src, tweak);
+			else
+				aes_ni_dec1 (ck, dst, src, tweak);
+			aes_ni_tweak_next (&tweak[0], &tweak[0]);
+			dst += AES_NI_BLK_BYTES;
+			src += AES_NI_BLK_BYTES;
+		}
+	}
+	aes_ni_end (&s);
+}
+
+static void
+aes_xts_ni_encrypt_sectors (void *dst, void *src, void *keyctx, lba_t lba,
+			    int sector_size, int count)
+{
+	aes_xts_ni_crypt (dst, src, keyctx, true, lba, sector_size, count);
+}
+
+static void
+aes_xts_ni_decrypt_sectors (void *dst, void *src, void *keyctx, lba_t lba,
+			    int sector_size, int count)
+{
+	aes_xts_ni_crypt (dst, src, keyctx, false, lba, sector_size, count);
+}
+
+static void
+aes_xts_ni_encrypt (void *dst, void *src, void *keyctx, lba_t lba,
+		    int sector_size)
+{
+	aes_xts_ni_crypt (dst, src, keyctx, true, lba, sector_size, 1);
+}
+
+static void
+aes_xts_ni_decrypt (void *dst, void *src, void *keyctx, lba_t lba,
+		    int sector_size)
+{
+	aes_xts_ni_crypt (dst, src, keyctx, false, lba, sector_size, 1);
+}
+
+static void *
+aes_xts_ni_setkey (const u8 *key, int bits)
+{
+	struct aes_xts_ni_keyctx *k;
+	int keybit = bits / 2;
+	int keylen = keybit / 8;
+	ulong p;
+
+	/* The round keys are used as memory operands of SSE
+	 * instructions which require 16-byte alignment.  The
+	 * context is never freed. */
+	p = (ulong)alloc (sizeof *k + 15);
+	k = (struct aes_xts_ni_keyctx *)((p + 15) & ~15UL);
+	aes_ni_setkey_enc (&k->tweak_key, key + keylen, keybit);
+	aes_ni_setkey_enc (&k->encrypt_key, key, keybit);
+	aes_ni_setkey_dec (&k->decrypt_key, &k->encrypt_key);
+	return k;
+}
+
+static struct crypto aes_xts_ni_crypto = {
+	.name = 	"aes-xts-ni",
+	.block_size =	AES_NI_BLK_BYTES,
+	.keyctx_size =	sizeof (struct aes_xts_ni_keyctx),
+	.encrypt =	aes_xts_ni_encrypt,
+	.decrypt =	aes_xts_ni_decrypt,
+	.setkey =	aes_xts_ni_setkey,
+	.encrypt_sectors = aes_xts_ni_encrypt_sectors,
+	.decrypt_sectors = aes_xts_ni_decrypt_sectors,
+};
+
+static bool
+aes_ni_available (void)
+{
+#ifdef STORAGE_PD
+	/* Control registers are not accessible in a protection
+	 * domain */
+	return false;
+#else
+	u32 a, b, c, d;
+
+	asm volatile ("cpuid"
+		      : "=a" (a), "=b" (b), "=c" (c), "=d" (d)
+		      : "a" (1), "c" (0));
+	return !!(c & CPUID_1_ECX_AES_BIT);
+#endif
+}
+
+/* Must be called after aes_xts_init().  If AES-NI is not available,
+ * "aes-xts-ni" is an alias of "aes-xts" so that configurations
+ * naming it still work. */
+void
+aes_xts_ni_init (void)
+{
+	struct crypto *generic;
+
+	if (aes_ni_available ()) {
+		aes_ni_sbox_init ();
+		printf ("AES-XTS AES-NI Encryption Engine initialized\n");
+		crypto_register (&aes_xts_ni_crypto);
+		return;
+	}
+	generic = crypto_find ("aes-xts");
+	if (!generic)
+		return;
+	aes_xts_ni_fallback = *generic;
+	aes_xts_ni_fallback.name = "aes-xts-ni";
+	crypto_register (&aes_xts_ni_fallback);
+}
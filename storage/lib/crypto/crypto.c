@@ -37,6 +37,8 @@ struct crypto_list {
 
 static struct crypto_list *crypto_list;
 
+int (*crypto_split)(struct crypto *crypto, int enc, void *keyctx, void *dst, void *src, lba_t lba, int sector_size, int count);
+
 struct crypto *crypto_find(char *name)
 {
 	struct crypto_list *p;
@@ -62,9 +64,11 @@ void
 crypto_init (void)
 {
 	void aes_xts_init (void);
+	void aes_xts_ni_init (void);
 	void crypto_none_init (void);
 
 	crypto_list = NULL;
 	aes_xts_init ();
+	aes_xts_ni_init ();
 	crypto_none_init ();
 }
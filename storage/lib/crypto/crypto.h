@@ -44,9 +44,26 @@ struct crypto {
 	int	block_size;
 	int	keyctx_size;
 	char	*name;
+	/* optional: crypt count consecutive sectors at once */
+	void	(*encrypt_sectors)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size, int count);
+	void	(*decrypt_sectors)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size, int count);
 };
 
 void crypto_register(struct crypto *crypto);
 struct crypto *crypto_find(char *name);
 
+/* Set by the VMM to spread large requests over processors.  Returns
+ * non-zero if the sectors have been processed. */
+extern int (*crypto_split)(struct crypto *crypto, int enc, void *keyctx, void *dst, void *src, lba_t lba, int sector_size, int count);
+
+/* Set by the VMM to cache decrypted sectors.  crypt returns non-zero
+ * if the sectors have been processed; gen is the cache_gen of the
+ * access.  drop forgets a device. */
+struct storage_cache_func {
+	int	(*crypt)(struct storage_device *storage, struct crypto *crypto, int enc, void *keyctx, void *dst, void *src, lba_t lba, int sector_size, int count, u32 gen);
+	void	(*drop)(struct storage_device *storage);
+};
+
+extern struct storage_cache_func *storage_cache;
+
 #endif
@@ -45,6 +45,8 @@ static struct guid anyguid = STORAGE_GUID_ANY;
 static struct config_data_storage *cfg;
 static int storage_desc;
 
+struct storage_cache_func *storage_cache;
+
 struct storage_keys {
 	lba_t		lba_low, lba_high;
 	struct crypto	*crypto;
@@ -128,10 +130,28 @@ storage_match_extend (struct storage_init *init,
 	return 1;
 }
 
+/* crypto of each keys_conf entry, looked up when first used */
+static struct crypto *
+storage_keys_conf_crypto (struct storage_keys_conf *keys_conf)
+{
+	static struct crypto *crypto[NUM_OF_STORAGE_KEYS_CONF];
+	int i = keys_conf - cfg->keys_conf;
+
+	if (!crypto[i]) {
+		crypto[i] = crypto_find (keys_conf->crypto_name);
+		if (crypto[i] == NULL)
+			panic ("unknown crypto name: %s\n",
+			       keys_conf->crypto_name);
+	}
+	return crypto[i];
+}
+
+/* keys[] is sorted by LBA and the ranges do not overlap, so that
+ * storage_handle_sectors can search it and walk it in order */
 static void
 storage_set_keys (struct storage_device *storage, struct storage_init *init)
 {
-	int i, keyindex = 0;
+	int i, j, keyindex = 0;
 	struct crypto *crypto;
 	struct storage_keys_conf *keys_conf;
 	u8 *key;
@@ -144,70 +164,115 @@ storage_set_keys (struct storage_device *storage, struct storage_init *init)
 			continue;
 		if (!storage_match_extend (init, keys_conf))
 			continue;
-		crypto = crypto_find (keys_conf->crypto_name);
+		crypto = storage_keys_conf_crypto (keys_conf);
 		key = cfg->keys[keys_conf->keyindex];
 		bits = keys_conf->keybits;
-		if (crypto == NULL)
-			panic ("unknown crypto name: %s\n",
-			       keys_conf->crypto_name);
-		storage->keys[keyindex].lba_low = keys_conf->lba_low;
-		storage->keys[keyindex].lba_high = keys_conf->lba_high;
-		storage->keys[keyindex].crypto = crypto;
-		storage->keys[keyindex].keyctx = crypto->setkey (key, bits);
+		if (keys_conf->lba_low > keys_conf->lba_high)
+			panic ("storage key range %llu-%llu is empty",
+			       keys_conf->lba_low, keys_conf->lba_high);
+		if (keyindex >= STORAGE_MAX_KEYS_PER_DEVICE)
+			panic ("too many storage keys for a device");
+		for (j = keyindex; j > 0 &&
+		     storage->keys[j - 1].lba_low > keys_conf->lba_low; j--)
+			storage->keys[j] = storage->keys[j - 1];
+		storage->keys[j].lba_low = keys_conf->lba_low;
+		storage->keys[j].lba_high = keys_conf->lba_high;
+		storage->keys[j].crypto = crypto;
+		storage->keys[j].keyctx = crypto->setkey (key, bits);
 		keyindex++;
 	}
+	for (j = 1; j < keyindex; j++)
+		if (storage->keys[j - 1].lba_high >= storage->keys[j].lba_low)
+			panic ("storage key ranges %llu-%llu and %llu-%llu"
+			       " overlap", storage->keys[j - 1].lba_low,
+			       storage->keys[j - 1].lba_high,
+			       storage->keys[j].lba_low,
+			       storage->keys[j].lba_high);
 	storage->keynum = keyindex;
 }
 
+/* index of the first key range which ends at or after lba */
+static int
+storage_find_key (struct storage_device *storage, lba_t lba)
+{
+	int low = 0, high = storage->keynum, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (storage->keys[mid].lba_high < lba)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static void
+storage_crypt (struct storage_device *storage, struct storage_keys *keys,
+	       int enc, u8 *dst, u8 *src, lba_t lba, int sector_size,
+	       int count, u32 gen)
+{
+	struct crypto *crypto = keys->crypto;
+	void *keyctx = keys->keyctx;
+	void (*crypt)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size);
+	void (*crypt_sectors)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size, int count);
+
+	if (storage_cache && storage_cache->crypt(storage, crypto, enc, keyctx, dst, src, lba, sector_size, count, gen))
+		return;
+	if (crypto_split && crypto_split(crypto, enc, keyctx, dst, src, lba, sector_size, count))
+		return;
+	crypt_sectors = enc ? crypto->encrypt_sectors : crypto->decrypt_sectors;
+	if (crypt_sectors) {
+		crypt_sectors(dst, src, keyctx, lba, sector_size, count);
+		return;
+	}
+	crypt = enc ? crypto->encrypt : crypto->decrypt;
+	while (count-- > 0) {
+		crypt(dst, src, keyctx, lba++, sector_size);
+		src += sector_size;
+		dst += sector_size;
+	}
+}
+
 int
 storage_handle_sectors (struct storage_device *storage,
 			 struct storage_access *access, u8 *src, u8 *dst)
 {
-	int i, sub_count;
-	unsigned long long int sub_count2;
-	lba_t lba = access->lba;
-	count_t	count = access->count, size;
+	int i;
+	lba_t lba = access->lba, rest;
+	count_t	count = access->count, sub_count, size;
 	int sector_size = access->sector_size;
-	struct crypto *crypto;
-	void (*crypt)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size);
-	void *keyctx;
+	int enc = access->rw == STORAGE_WRITE;
+	struct storage_keys *keys;
 
-	for (i = 0; count > 0 && i < storage->keynum; i++) {
+	for (i = storage_find_key (storage, lba);
+	     count > 0 && i < storage->keynum; i++) {
+		keys = &storage->keys[i];
 		// if lba < low then memcpy
-		while (count > 0 && storage->keys[i].lba_low > lba) {
-			sub_count2 = storage->keys[i].lba_low - lba;
-			if (sub_count2 > 65535)
-				sub_count = 65535;
-			else
-				sub_count = sub_count2;
-			sub_count = min(count, sub_count);
-			count -= sub_count;
+		if (keys->lba_low > lba) {
+			rest = keys->lba_low - lba;
+			sub_count = rest < count ? rest : count;
 			size = sub_count * sector_size;
 			if (dst != src)
 				memcpy(dst, src, size);
+			count -= sub_count;
 			lba += sub_count;
 			src += size;
 			dst += size;
+			if (!count)
+				break;
 		}
 
 		// if low <= lba <= high then crypt
-		while (count > 0 && storage->keys[i].lba_high >= lba) {
-			sub_count2 = storage->keys[i].lba_high - lba;
-			if (sub_count2 >= 65535)
-				sub_count = 65535;
-			else
-				sub_count = sub_count2 + 1;
-			keyctx = storage->keys[i].keyctx;
-			crypto = storage->keys[i].crypto;
-			crypt = (access->rw == STORAGE_READ) ? crypto->decrypt : crypto->encrypt;
-			sub_count = min(count, sub_count);
-			count -= sub_count;
-			while (sub_count-- > 0) {
-				crypt(dst, src, keyctx, lba++, sector_size);
-				src += sector_size;
-				dst += sector_size;
-			}
-		}
+		rest = keys->lba_high - lba;
+		sub_count = rest < count ? rest + 1 : count;
+		storage_crypt (storage, keys, enc, dst, src, lba, sector_size,
+			       sub_count, access->cache_gen);
+		size = sub_count * sector_size;
+		count -= sub_count;
+		lba += sub_count;
+		src += size;
+		dst += size;
 	}
 	if (count > 0 && dst != src)
 		memcpy(dst, src, count * sector_size);
@@ -243,6 +308,8 @@ storage_new (int type, int host_id, int device_id, struct guid *guid,
 void
 storage_free (struct storage_device *storage)
 {
+	if (storage_cache)
+		storage_cache->drop (storage);
 	free (storage);
 }
 
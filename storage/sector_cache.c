@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2026 BitVisor contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Plaintext cache of sectors in encrypted ranges.  Small reads are
+ * looked up by (device, LBA) and only missing sectors are decrypted
+ * and inserted; writes invalidate the sectors before they are
+ * encrypted.  Entries are evicted by the CLOCK algorithm: a hit sets
+ * the reference bit, and new entries start without it so that a
+ * sequential scan does not push out sectors read repeatedly.
+ *
+ * A read in flight while a write is submitted or completes may have
+ * read the old data.  The generation is advanced at both points, and
+ * data of a read issued in an older generation is not inserted.  A
+ * read issued while an overlapping write is in flight may complete
+ * first with the old data, so sectors of writes in flight are not
+ * inserted either. */
+
+#include <core.h>
+#include <core/arith.h>
+#include <core/vmmcall_status.h>
+#include <storage.h>
+#include "lib/crypto/crypto.h"
+
+#ifndef STORAGE_PD
+
+#define SECTOR_CACHE_SECTOR_SIZE	512
+#define SECTOR_CACHE_MAX_COUNT		16 /* sectors per cached read */
+#define SECTOR_CACHE_MAX_SIZE		16384 /* KiB */
+#define SECTOR_CACHE_PER_PAGE		(PAGESIZE / SECTOR_CACHE_SECTOR_SIZE)
+#define SECTOR_CACHE_MAX_WRITES		64 /* tracked writes in flight */
+
+struct sector_cache_entry {
+	struct storage_device *storage;	/* NULL if free */
+	lba_t lba;
+	int next;		/* next entry in the hash chain or -1 */
+	bool ref;		/* referenced since the hand passed */
+	u8 *data;
+};
+
+struct sector_cache_write {
+	struct storage_device *storage;
+	lba_t lba;
+	count_t count;
+};
+
+static spinlock_t sector_cache_lock;
+static struct sector_cache_entry *sector_cache_entries;
+static int *sector_cache_hash;
+static u32 sector_cache_hash_mask;
+static int sector_cache_num, sector_cache_used, sector_cache_hand;
+static u32 sector_cache_hits, sector_cache_misses, sector_cache_evictions;
+static u32 sector_cache_invalidations, sector_cache_stale;
+static u32 sector_cache_generation = 1; /* never 0 */
+static struct sector_cache_write sector_cache_writes[SECTOR_CACHE_MAX_WRITES];
+static int sector_cache_nwrites;
+static int sector_cache_untracked; /* writes in flight not in the table */
+
+static int *
+sector_cache_bucket (struct storage_device *storage, lba_t lba)
+{
+	u32 h;
+
+	h = (u32)lba ^ (u32)(lba >> 32) ^ (u32)((ulong)storage >> 4);
+	h *= 2654435761U;
+	return &sector_cache_hash[(h >> 8) & sector_cache_hash_mask];
+}
+
+/* sector_cache_lock must be locked */
+static int
+sector_cache_find (struct storage_device *storage, lba_t lba)
+{
+	int i;
+
+	for (i = *sector_cache_bucket (storage, lba); i >= 0;
+	     i = sector_cache_entries[i].next)
+		if (sector_cache_entries[i].storage == storage &&
+		    sector_cache_entries[i].lba == lba)
+			return i;
+	return -1;
+}
+
+/* sector_cache_lock must be locked */
+static void
+sector_cache_unlink (int i)
+{
+	struct sector_cache_entry *e = &sector_cache_entries[i];
+	int *p;
+
+	for (p = sector_cache_bucket (e->storage, e->lba); *p != i;
+	     p = &sector_cache_entries[*p].next);
+	*p = e->next;
+	e->storage = NULL;
+	sector_cache_used--;
+}
+
+static bool
+sector_cache_get (struct storage_device *storage, lba_t lba, u8 *dst)
+{
+	int i;
+
+	spinlock_lock (&sector_cache_lock);
+	i = sector_cache_find (storage, lba);
+	if (i >= 0) {
+		memcpy (dst, sector_cache_entries[i].data,
+			SECTOR_CACHE_SECTOR_SIZE);
+		sector_cache_entries[i].ref = true;
+		sector_cache_hits++;
+	} else {
+		sector_cache_misses++;
+	}
+	spinlock_unlock (&sector_cache_lock);
+	return i >= 0;
+}
+
+/* sector_cache_lock must be locked */
+static void
+sector_cache_next_gen (void)
+{
+	if (!++sector_cache_generation)
+		sector_cache_generation++;
+}
+
+/* sector_cache_lock must be locked */
+static bool
+sector_cache_writing (struct storage_device *storage, lba_t lba)
+{
+	struct sector_cache_write *w;
+	int i;
+
+	if (sector_cache_untracked)
+		return true;
+	for (i = 0; i < sector_cache_nwrites; i++) {
+		w = &sector_cache_writes[i];
+		if (w->storage == storage && w->lba <= lba &&
+		    lba - w->lba < w->count)
+			return true;
+	}
+	return false;
+}
+
+static void
+sector_cache_put (struct storage_device *storage, lba_t lba, u8 *src,
+		  u32 gen)
+{
+	struct sector_cache_entry *e;
+	int i, *p;
+
+	spinlock_lock (&sector_cache_lock);
+	if (gen != sector_cache_generation ||
+	    sector_cache_writing (storage, lba)) {
+		sector_cache_stale++;
+		spinlock_unlock (&sector_cache_lock);
+		return;
+	}
+	i = sector_cache_find (storage, lba);
+	if (i >= 0)
+		goto copy;
+	for (;;) {
+		i = sector_cache_hand++;
+		if (sector_cache_hand == sector_cache_num)
+			sector_cache_hand = 0;
+		e = &sector_cache_entries[i];
+		if (!e->storage)
+			break;
+		if (!e->ref) {
+			sector_cache_unlink (i);
+			sector_cache_evictions++;
+			break;
+		}
+		e->ref = false;
+	}
+	p = sector_cache_bucket (storage, lba);
+	e->storage = storage;
+	e->lba = lba;
+	e->ref = false;
+	e->next = *p;
+	*p = i;
+	sector_cache_used++;
+copy:
+	memcpy (sector_cache_entries[i].data, src, SECTOR_CACHE_SECTOR_SIZE);
+	spinlock_unlock (&sector_cache_lock);
+}
+
+static void
+sector_cache_invalidate (struct storage_device *storage, lba_t lba,
+			 int count)
+{
+	int i;
+
+	spinlock_lock (&sector_cache_lock);
+	sector_cache_next_gen ();
+	while (count-- > 0 && sector_cache_used) {
+		i = sector_cache_find (storage, lba++);
+		if (i >= 0) {
+			sector_cache_unlink (i);
+			sector_cache_invalidations++;
+		}
+	}
+	spinlock_unlock (&sector_cache_lock);
+}
+
+static void
+sector_cache_decrypt (struct crypto *crypto, void *keyctx, u8 *dst, u8 *src,
+		      lba_t lba, int count)
+{
+	if (crypto->decrypt_sectors) {
+		crypto->decrypt_sectors (dst, src, keyctx, lba,
+					 SECTOR_CACHE_SECTOR_SIZE, count);
+		return;
+	}
+	while (count-- > 0) {
+		crypto->decrypt (dst, src, keyctx, lba++,
+				 SECTOR_CACHE_SECTOR_SIZE);
+		dst += SECTOR_CACHE_SECTOR_SIZE;
+		src += SECTOR_CACHE_SECTOR_SIZE;
+	}
+}
+
+static int
+sector_cache_crypt (struct storage_device *storage, struct crypto *crypto,
+		    int enc, void *keyctx, void *dst, void *src, lba_t lba,
+		    int sector_size, int count, u32 gen)
+{
+	u8 *d = dst, *s = src;
+	int i, j, k, off;
+
+	if (sector_size != SECTOR_CACHE_SECTOR_SIZE)
+		return 0;
+	if (enc) {
+		sector_cache_invalidate (storage, lba, count);
+		return 0;
+	}
+	if (count > SECTOR_CACHE_MAX_COUNT)
+		return 0;
+	/* Copy hits and decrypt each run of misses at once */
+	for (i = 0; i < count; i = j + 1) {
+		for (j = i; j < count; j++)
+			if (sector_cache_get (storage, lba + j,
+					      d + j * sector_size))
+				break;
+		if (j == i)
+			continue;
+		off = i * sector_size;
+		sector_cache_decrypt (crypto, keyctx, d + off, s + off,
+				      lba + i, j - i);
+		if (!gen)
+			continue;
+		for (k = i; k < j; k++)
+			sector_cache_put (storage, lba + k,
+					  d + k * sector_size, gen);
+	}
+	return 1;
+}
+
+static void
+sector_cache_drop (struct storage_device *storage)
+{
+	int i;
+
+	spinlock_lock (&sector_cache_lock);
+	for (i = 0; i < sector_cache_num; i++)
+		if (sector_cache_entries[i].storage == storage)
+			sector_cache_unlink (i);
+	for (i = 0; i < sector_cache_nwrites; i++)
+		if (sector_cache_writes[i].storage == storage)
+			sector_cache_writes[i--] =
+				sector_cache_writes[--sector_cache_nwrites];
+	spinlock_unlock (&sector_cache_lock);
+}
+
+/* Returns the generation to be passed as cache_gen of a read access
+ * issued now */
+u32
+storage_cache_gen (void)
+{
+	u32 gen;
+
+	spinlock_lock (&sector_cache_lock);
+	gen = sector_cache_generation;
+	spinlock_unlock (&sector_cache_lock);
+	return gen;
+}
+
+/* Called before a write to an encrypted range is submitted */
+void
+storage_cache_write_start (struct storage_device *storage, lba_t lba,
+			   count_t count)
+{
+	struct sector_cache_write *w;
+
+	spinlock_lock (&sector_cache_lock);
+	if (sector_cache_nwrites < SECTOR_CACHE_MAX_WRITES) {
+		w = &sector_cache_writes[sector_cache_nwrites++];
+		w->storage = storage;
+		w->lba = lba;
+		w->count = count;
+	} else {
+		sector_cache_untracked++;
+	}
+	spinlock_unlock (&sector_cache_lock);
+}
+
+/* Called when a write to an encrypted range completes, with the same
+ * arguments as storage_cache_write_start() */
+void
+storage_cache_write_done (struct storage_device *storage, lba_t lba,
+			  count_t count)
+{
+	struct sector_cache_write *w;
+	int i;
+
+	spinlock_lock (&sector_cache_lock);
+	sector_cache_next_gen ();
+	for (i = 0; i < sector_cache_nwrites; i++) {
+		w = &sector_cache_writes[i];
+		if (w->storage == storage && w->lba == lba &&
+		    w->count == count)
+			break;
+	}
+	if (i < sector_cache_nwrites)
+		*w = sector_cache_writes[--sector_cache_nwrites];
+	else if (sector_cache_untracked)
+		sector_cache_untracked--;
+	spinlock_unlock (&sector_cache_lock);
+}
+
+static struct storage_cache_func sector_cache_func = {
+	sector_cache_crypt,
+	sector_cache_drop,
+};
+
+static char *
+sector_cache_status (void)
+{
+	static char buf[256];
+	u32 total, rate;
+
+	spinlock_lock (&sector_cache_lock);
+	total = sector_cache_hits + sector_cache_misses;
+	rate = muldiv64 (sector_cache_hits, 100, total);
+	snprintf (buf, sizeof buf,
+		  "Storage sector cache: %d/%d sectors\n"
+		  " Hits: %u Misses: %u (%u%% hit)\n"
+		  " Evictions: %u Invalidations: %u Stale: %u\n",
+		  sector_cache_used, sector_cache_num, sector_cache_hits,
+		  sector_cache_misses, rate, sector_cache_evictions,
+		  sector_cache_invalidations, sector_cache_stale);
+	spinlock_unlock (&sector_cache_lock);
+	return buf;
+}
+
+static void
+sector_cache_init (void)
+{
+	int i, nbuckets;
+	u8 *page = NULL;
+	uint size;
+
+	spinlock_init (&sector_cache_lock);
+	size = config.vmm.storage_cache_size;
+	if (!size)
+		return;
+	if (size > SECTOR_CACHE_MAX_SIZE)
+		size = SECTOR_CACHE_MAX_SIZE;
+	sector_cache_num = size * 1024 / SECTOR_CACHE_SECTOR_SIZE;
+	sector_cache_entries = alloc (sector_cache_num *
+				      sizeof *sector_cache_entries);
+	for (i = 0; i < sector_cache_num; i++) {
+		if (!(i % SECTOR_CACHE_PER_PAGE))
+			page = alloc (PAGESIZE);
+		sector_cache_entries[i].storage = NULL;
+		sector_cache_entries[i].ref = false;
+		sector_cache_entries[i].data = page +
+			(i % SECTOR_CACHE_PER_PAGE) * SECTOR_CACHE_SECTOR_SIZE;
+	}
+	for (nbuckets = 1; nbuckets < sector_cache_num; nbuckets <<= 1);
+	sector_cache_hash = alloc (nbuckets * sizeof *sector_cache_hash);
+	for (i = 0; i < nbuckets; i++)
+		sector_cache_hash[i] = -1;
+	sector_cache_hash_mask = nbuckets - 1;
+	sector_cache_used = 0;
+	sector_cache_hand = 0;
+	storage_cache = &sector_cache_func;
+	register_status_callback (sector_cache_status);
+	printf ("Storage sector cache: %u KB\n", size);
+}
+
+INITFUNC ("driver2", sector_cache_init);
+#else  /* STORAGE_PD */
+u32
+storage_cache_gen (void)
+{
+	return 0;
+}
+
+void
+storage_cache_write_start (struct storage_device *storage, lba_t lba,
+			   count_t count)
+{
+}
+
+void
+storage_cache_write_done (struct storage_device *storage, lba_t lba,
+			  count_t count)
+{
+}
+#endif /* STORAGE_PD */
@@ -33,6 +33,17 @@
 #include <core/process.h>
 #include "storage_io_msg.h"
 
+/* Buffers of requests from processes are made of separate pages if
+ * the host controller can do DMA to them.  Otherwise they are
+ * physically contiguous and bounded like the 8-bit sector count. */
+#define STORAGE_IO_MAXLEN	(128 * PAGESIZE)
+#define STORAGE_IO_MAXLEN_CONTIG	(255 * 512)
+#define STORAGE_IO_MAXPAGES	(STORAGE_IO_MAXLEN / PAGESIZE)
+#define STORAGE_IO_QUEUE_DEPTH	32
+/* Buffers of request objects up to this length are kept for later
+ * requests */
+#define STORAGE_IO_KEEPLEN	(16 * PAGESIZE)
+
 struct storage_hc {
 	LIST1_DEFINE (struct storage_hc);
 	struct storage_hc_driver *driver;
@@ -59,16 +70,69 @@ struct storage_hc_hook {
 	void *data;
 };
 
+struct storage_io_devices;
+struct storage_io_batch;
+
+/* a buffer of a request from a process, mapped to contiguous
+ * virtual addresses */
+struct storage_io_buf {
+	void *virt;		/* NULL: not allocated */
+	int len;		/* allocated length */
+	int npages;		/* 0: physically contiguous at phys */
+	phys_t phys;
+	phys_t pages[STORAGE_IO_MAXPAGES];
+};
+
+/* a preallocated request object for vectored I/O */
+struct storage_io_req {
+	LIST1_DEFINE (struct storage_io_req);
+	struct storage_hc_dev_atacmd cmd;
+	struct storage_io_devices *d;
+	struct storage_io_batch *batch;
+	struct storage_io_vec *vec;
+	struct storage_io_buf buf; /* for requests from processes */
+};
+
+/* a preallocated batch object; msg and msgvec are copies of a
+ * request from a process and rmsg is the reply */
+struct storage_io_batch {
+	LIST1_DEFINE (struct storage_io_batch);
+	struct storage_io_devices *d;
+	void (*callback) (void *data, struct storage_io_vec *vec, int n);
+	void *data;
+	struct storage_io_vec *vec;
+	int n;
+	int remaining;
+	struct storage_io_req *req[STORAGE_IO_QUEUE_DEPTH];
+	struct storage_io_msg_areadwritev msg;
+	struct storage_io_vec msgvec[STORAGE_IO_MAXVEC];
+	struct storage_io_msg_rreadwritev rmsg;
+};
+
 struct storage_io_devices {
 	LIST1_DEFINE (struct storage_io_devices);
 	int devno;
 	struct storage_hc *hc;
 	struct storage_hc_dev *dev;
+	bool hc_ncq;		/* host controller supports NCQ */
+	bool hc_sg;		/* host controller supports page lists */
+	int ncq;		/* NCQ queue depth of the device (0: no NCQ) */
+	spinlock_t req_lock;
+	int depth;		/* maximum number of requests in flight */
+	int inflight;
+	int nreq;		/* number of allocated request objects */
+	int nbusy;		/* number of request objects in use */
+	int nbatch;		/* number of allocated batch objects */
+	LIST1_DEFINE_HEAD (struct storage_io_req, req_free);
+	LIST1_DEFINE_HEAD (struct storage_io_req, req_pending);
+	LIST1_DEFINE_HEAD (struct storage_io_batch, batch_free);
 };
 
 struct storage_io_get_num_devices_data {
 	int *r;
 	struct storage_hc *hc;
+	bool ncq;
+	bool sg;
 	int port_no;
 	int n;
 };
@@ -76,7 +140,9 @@ struct storage_io_get_num_devices_data {
 struct storage_io_aget_size_data {
 	void (*callback) (void *data, long long size);
 	void *data;
-	struct storage_hc_dev *dev;
+	struct storage_io_devices *d;
+	long long size;
+	u16 *identify;
 };
 
 struct storage_io_areadwrite_data {
@@ -308,10 +374,116 @@ storage_hc_dev_close (struct storage_hc_dev *dev)
 	spinlock_unlock (&dev_lock);
 }
 
+static void
+storage_io_buf_init (struct storage_io_buf *b)
+{
+	b->virt = NULL;
+	b->len = 0;
+	b->npages = 0;
+}
+
+static void
+storage_io_buf_free (struct storage_io_buf *b)
+{
+	int i;
+
+	if (!b->virt)
+		return;
+	if (!b->npages) {
+		free (b->virt);
+	} else {
+		unmapmem (b->virt, b->len);
+		for (i = 0; i < b->npages; i++)
+			free_page_phys (b->pages[i]);
+	}
+	storage_io_buf_init (b);
+}
+
+/* Make a buffer for a request from a process hold len bytes.  The
+ * buffer is reused if it is large enough.  It is made of separate
+ * pages if the host controller supports page lists, so that large
+ * requests do not need physically contiguous memory.  Returns false
+ * if out of memory. */
+static bool
+storage_io_buf_alloc (struct storage_io_devices *d, struct storage_io_buf *b,
+		      int len)
+{
+	int i, n;
+
+	if (b->virt && len <= b->len)
+		return true;
+	if (!d->hc_sg || len <= PAGESIZE) {
+		if (len > STORAGE_IO_MAXLEN_CONTIG)
+			return false;
+		storage_io_buf_free (b);
+		b->virt = alloc2_try (len, &b->phys);
+		if (!b->virt)
+			return false;
+		b->len = len;
+		return true;
+	}
+	if (len > STORAGE_IO_MAXLEN)
+		return false;
+	/* Keep the pages already allocated and map them again with
+	 * new ones */
+	if (!b->npages)
+		storage_io_buf_free (b);
+	else
+		unmapmem (b->virt, b->len);
+	n = (len + PAGESIZE - 1) / PAGESIZE;
+	for (i = b->npages; i < n; i++)
+		if (!alloc2_try (PAGESIZE, &b->pages[i]))
+			break;
+	b->npages = i;
+	b->len = i * PAGESIZE;
+	b->virt = i ? mapmem_hphys_pages (b->pages, b->len, MAPMEM_WRITE) :
+		NULL;
+	return i == n;
+}
+
+static struct storage_io_req *
+storage_io_req_new (struct storage_io_devices *d)
+{
+	struct storage_io_req *r;
+
+	r = alloc (sizeof *r);
+	r->d = d;
+	storage_io_buf_init (&r->buf);
+	return r;
+}
+
+static struct storage_io_batch *
+storage_io_batch_new (struct storage_io_devices *d)
+{
+	struct storage_io_batch *b;
+
+	b = alloc (sizeof *b);
+	b->d = d;
+	return b;
+}
+
+static void
+storage_io_req_prealloc (struct storage_io_devices *d)
+{
+	spinlock_lock (&d->req_lock);
+	while (d->nreq < d->depth) {
+		LIST1_PUSH (d->req_free, storage_io_req_new (d));
+		d->nreq++;
+	}
+	while (d->nbatch < d->depth) {
+		LIST1_PUSH (d->batch_free, storage_io_batch_new (d));
+		d->nbatch++;
+	}
+	spinlock_unlock (&d->req_lock);
+}
+
+
 static void
 storage_io_closeall (void)
 {
 	struct storage_io_devices *d;
+	struct storage_io_batch *b;
+	struct storage_io_req *r;
 	struct storage_hc *hc;
 
 	LIST1_FOREACH (io_dev_list, d)
@@ -322,6 +494,12 @@ storage_io_closeall (void)
 			storage_hc_close (d->hc);
 			hc = d->hc;
 		}
+		while ((r = LIST1_POP (d->req_free))) {
+			storage_io_buf_free (&r->buf);
+			free (r);
+		}
+		while ((b = LIST1_POP (d->batch_free)))
+			free (b);
 		free (d);
 	}
 }
@@ -352,6 +530,19 @@ storage_io_get_num_devices_sub (void *data, int dev_no)
 		p->devno = (*d->r)++;
 		p->hc = d->hc;
 		p->dev = dev;
+		p->hc_ncq = d->ncq;
+		p->hc_sg = d->sg;
+		p->ncq = 0;
+		spinlock_init (&p->req_lock);
+		p->depth = STORAGE_IO_QUEUE_DEPTH;
+		p->inflight = 0;
+		p->nreq = 0;
+		p->nbusy = 0;
+		p->nbatch = 0;
+		LIST1_HEAD_INIT (p->req_free);
+		LIST1_HEAD_INIT (p->req_pending);
+		LIST1_HEAD_INIT (p->batch_free);
+		storage_io_req_prealloc (p);
 		LIST1_ADD (io_dev_list, p);
 		d->n++;
 	}
@@ -376,6 +567,8 @@ storage_io_get_num_devices (int id)
 		if (!hc)
 			continue;
 		data.hc = hc;
+		data.ncq = addr.ncq;
+		data.sg = addr.sg;
 		data.r = &r;
 		data.n = 0;
 		for (j = 0; j < addr.num_ports; j++) {
@@ -390,6 +583,36 @@ storage_io_get_num_devices (int id)
 	return r;
 }
 
+static void
+storage_io_aget_size_done (struct storage_io_aget_size_data *arg,
+			   struct storage_hc_dev_atacmd *cmd, long long size)
+{
+	arg->callback (arg->data, size);
+	if (arg->identify)
+		free (arg->identify);
+	free (arg);
+	free (cmd);
+}
+
+static void
+storage_io_aget_size_sub3 (void *data, struct storage_hc_dev_atacmd *cmd)
+{
+	struct storage_io_aget_size_data *arg;
+	u16 *id;
+	int depth;
+
+	arg = data;
+	id = arg->identify;
+	if (cmd->timeout_ready >= 0 && cmd->timeout_complete >= 0 &&
+	    (id[76] & 0x100)) {	/* Serial ATA Capabilities: NCQ */
+		depth = (id[75] & 0x1F) + 1;
+		if (depth > 32)
+			depth = 32;
+		arg->d->ncq = depth;
+	}
+	storage_io_aget_size_done (arg, cmd, arg->size);
+}
+
 static void
 storage_io_aget_size_sub2 (void *data, struct storage_hc_dev_atacmd *cmd)
 {
@@ -398,9 +621,7 @@ storage_io_aget_size_sub2 (void *data, struct storage_hc_dev_atacmd *cmd)
 
 	arg = data;
 	if (cmd->timeout_ready < 0 || cmd->timeout_complete < 0) {
-		arg->callback (arg->data, -1);
-		free (arg);
-		free (cmd);
+		storage_io_aget_size_done (arg, cmd, -1);
 		return;
 	}
 	size = cmd->cyl_high_exp;
@@ -410,9 +631,24 @@ storage_io_aget_size_sub2 (void *data, struct storage_hc_dev_atacmd *cmd)
 	size = (size << 8) | cmd->cyl_low;
 	size = (size << 8) | cmd->sector_number;
 	size = (size + 1) * 512;
-	arg->callback (arg->data, size);
-	free (arg);
-	free (cmd);
+	if (!arg->d->hc_ncq) {
+		storage_io_aget_size_done (arg, cmd, size);
+		return;
+	}
+	/* Check NCQ support of the device with IDENTIFY DEVICE */
+	arg->size = size;
+	arg->identify = alloc (512);
+	memset (cmd, 0, sizeof *cmd);
+	cmd->command_status = 0xEC; /* IDENTIFY DEVICE */
+	cmd->pio = true;
+	cmd->callback = storage_io_aget_size_sub3;
+	cmd->data = arg;
+	cmd->buf = arg->identify;
+	cmd->buf_len = 512;
+	cmd->timeout_ready = 1000000;
+	cmd->timeout_complete = 1000000;
+	if (!storage_hc_dev_atacommand (arg->d->dev, cmd, sizeof *cmd))
+		storage_io_aget_size_done (arg, cmd, size);
 }
 
 static void
@@ -434,7 +670,8 @@ storage_io_aget_size_sub1 (void *data, struct storage_hc_dev_atacmd *cmd)
 		cmd->dev_head = 0x40;
 		cmd->timeout_ready = 1000000;
 		cmd->timeout_complete = 1000000;
-		if (!storage_hc_dev_atacommand (arg->dev, cmd, sizeof *cmd)) {
+		if (!storage_hc_dev_atacommand (arg->d->dev, cmd,
+						sizeof *cmd)) {
 			arg->callback (arg->data, -1);
 			free (arg);
 			free (cmd);
@@ -471,7 +708,8 @@ storage_io_aget_size (int id, int devno,
 	arg = alloc (sizeof *arg);
 	arg->callback = callback;
 	arg->data = data;
-	arg->dev = d->dev;
+	arg->d = d;
+	arg->identify = NULL;
 	memset (cmd, 0, sizeof *cmd);
 	cmd->command_status = 0x90; /* EXECUTE DEVICE DIAGNOSTIC */
 	cmd->pio = true;
@@ -505,37 +743,60 @@ storage_io_areadwrite_sub (void *data, struct storage_hc_dev_atacmd *cmd)
 	free (cmd);
 }
 
-int
-storage_io_aread (int id, int devno, void *buf, int len, long long offset,
-		  void (*callback) (void *data, int len), void *data)
+static struct storage_io_devices *
+storage_io_find_device (int id, int devno)
 {
 	struct storage_io_devices *d;
-	struct storage_hc_dev_atacmd *cmd;
-	struct storage_io_areadwrite_data *arg;
 
 	if (storage_io_id != id)
-		return -1;
-	if (offset & 511)
-		return -1;
-	if (len & 511)
-		return -1;
-	if (len <= 511)
-		return -1;
-	if (len >= 512 * 256)
-		return -1;
+		return NULL;
 	LIST1_FOREACH (io_dev_list, d) {
 		if (d->devno == devno)
 			break;
 	}
-	if (!d)
-		return -1;
-	cmd = alloc (sizeof *cmd);
-	arg = alloc (sizeof *arg);
-	arg->callback = callback;
-	arg->data = data;
+	return d;
+}
+
+/* Buffers of a list of pages may be up to STORAGE_IO_MAXLEN bytes.
+ * Other buffers may need a physically contiguous shadow buffer. */
+static bool
+storage_io_check_range (int len, long long offset, bool pages)
+{
+	if (offset & 511)
+		return false;
+	if (len & 511)
+		return false;
+	if (len <= 511)
+		return false;
+	if (len > (pages ? STORAGE_IO_MAXLEN : STORAGE_IO_MAXLEN_CONTIG))
+		return false;
+	return true;
+}
+
+static void
+storage_io_fill_cmd (struct storage_io_devices *d,
+		     struct storage_hc_dev_atacmd *cmd, void *buf,
+		     phys_t buf_phys, phys_t *buf_pages, int len,
+		     long long offset, bool write)
+{
+	int nsec;
+
 	memset (cmd, 0, sizeof *cmd);
-	cmd->command_status = 0x25; /* READ DMA EXT */
-	cmd->sector_count = len / 512;
+	nsec = len / 512;
+	if (d->ncq) {
+		/* READ/WRITE FPDMA QUEUED: the count is in the features
+		 * registers and the tag is filled by the host controller
+		 * driver */
+		cmd->command_status = write ? 0x61 : 0x60;
+		cmd->features_error = nsec & 255;
+		cmd->features_exp = (nsec >> 8) & 255;
+		cmd->ncq = d->ncq;
+	} else {
+		/* WRITE DMA EXT or READ DMA EXT */
+		cmd->command_status = write ? 0x35 : 0x25;
+		cmd->sector_count = nsec & 255;
+		cmd->sector_count_exp = (nsec >> 8) & 255;
+	}
 	offset /= 512;
 	cmd->sector_number = (offset >> 0) & 255;
 	cmd->cyl_low = (offset >> 8) & 255;
@@ -545,67 +806,43 @@ storage_io_aread (int id, int devno, void *buf, int len, long long offset,
 	cmd->cyl_high_exp = (offset >> 40) & 255;
 	cmd->dev_head = 0x40;
 	cmd->pio = false;
-	cmd->callback = storage_io_areadwrite_sub;
-	cmd->data = arg;
 	cmd->buf = buf;
+	cmd->buf_phys = buf_phys;
+	cmd->buf_pages = buf_pages;
 	cmd->buf_len = len;
+	cmd->write = write;
 	cmd->timeout_ready = 1000000;
 	cmd->timeout_complete = 1000000;
-	if (!storage_hc_dev_atacommand (d->dev, cmd, sizeof *cmd)) {
-		free (arg);
-		free (cmd);
-		return -1;
-	}
-	return 0;
 }
 
-int
-storage_io_awrite (int id, int devno, void *buf, int len, long long offset,
-		   void (*callback) (void *data, int len), void *data)
+/* b is a buffer from storage_io_buf_alloc() or NULL */
+static int
+storage_io_areadwrite (int id, int devno, void *buf, struct storage_io_buf *b,
+		       int len, long long offset, bool write,
+		       void (*callback) (void *data, int len), void *data)
 {
 	struct storage_io_devices *d;
 	struct storage_hc_dev_atacmd *cmd;
 	struct storage_io_areadwrite_data *arg;
 
-	if (storage_io_id != id)
-		return -1;
-	if (offset & 511)
-		return -1;
-	if (len & 511)
+	if (!storage_io_check_range (len, offset, b && b->npages))
 		return -1;
-	if (len <= 511)
-		return -1;
-	if (len >= 512 * 256)
-		return -1;
-	LIST1_FOREACH (io_dev_list, d) {
-		if (d->devno == devno)
-			break;
-	}
+	d = storage_io_find_device (id, devno);
 	if (!d)
 		return -1;
 	cmd = alloc (sizeof *cmd);
 	arg = alloc (sizeof *arg);
 	arg->callback = callback;
 	arg->data = data;
-	memset (cmd, 0, sizeof *cmd);
-	cmd->command_status = 0x35; /* WRITE DMA EXT */
-	cmd->sector_count = len / 512;
-	offset /= 512;
-	cmd->sector_number = (offset >> 0) & 255;
-	cmd->cyl_low = (offset >> 8) & 255;
-	cmd->cyl_high = (offset >> 16) & 255;
-	cmd->sector_number_exp = (offset >> 24) & 255;
-	cmd->cyl_low_exp = (offset >> 32) & 255;
-	cmd->cyl_high_exp = (offset >> 40) & 255;
-	cmd->dev_head = 0x40;
-	cmd->pio = false;
+	if (b)
+		storage_io_fill_cmd (d, cmd, b->virt, b->phys,
+				     b->npages ? b->pages : NULL, len, offset,
+				     write);
+	else
+		storage_io_fill_cmd (d, cmd, buf, 0, NULL, len, offset,
+				     write);
 	cmd->callback = storage_io_areadwrite_sub;
 	cmd->data = arg;
-	cmd->buf = buf;
-	cmd->buf_len = len;
-	cmd->write = true;
-	cmd->timeout_ready = 1000000;
-	cmd->timeout_complete = 1000000;
 	if (!storage_hc_dev_atacommand (d->dev, cmd, sizeof *cmd)) {
 		free (arg);
 		free (cmd);
@@ -614,6 +851,235 @@ storage_io_awrite (int id, int devno, void *buf, int len, long long offset,
 	return 0;
 }
 
+int
+storage_io_aread (int id, int devno, void *buf, int len, long long offset,
+		  void (*callback) (void *data, int len), void *data)
+{
+	return storage_io_areadwrite (id, devno, buf, NULL, len, offset, false,
+				      callback, data);
+}
+
+int
+storage_io_awrite (int id, int devno, void *buf, int len, long long offset,
+		   void (*callback) (void *data, int len), void *data)
+{
+	return storage_io_areadwrite (id, devno, buf, NULL, len, offset, true,
+				      callback, data);
+}
+
+/* Limit the number of vectored requests in flight on the device.
+ * Request objects up to the depth are allocated in advance. */
+int
+storage_io_set_queue_depth (int id, int devno, int depth)
+{
+	struct storage_io_devices *d;
+
+	if (depth <= 0 || depth > STORAGE_IO_QUEUE_DEPTH)
+		return -1;
+	d = storage_io_find_device (id, devno);
+	if (!d)
+		return -1;
+	spinlock_lock (&d->req_lock);
+	d->depth = depth;
+	spinlock_unlock (&d->req_lock);
+	storage_io_req_prealloc (d);
+	return 0;
+}
+
+/* Get a batch object and n request objects of the device.  Request
+ * objects in use are limited to STORAGE_IO_QUEUE_DEPTH per device, so
+ * that the pools do not grow without bound.  Returns NULL if the
+ * device has too many requests. */
+static struct storage_io_batch *
+storage_io_batch_get (struct storage_io_devices *d, int n)
+{
+	struct storage_io_batch *b;
+	struct storage_io_req *r;
+	int i;
+
+	spinlock_lock (&d->req_lock);
+	if (d->nbusy + n > STORAGE_IO_QUEUE_DEPTH) {
+		spinlock_unlock (&d->req_lock);
+		return NULL;
+	}
+	d->nbusy += n;
+	b = LIST1_POP (d->batch_free);
+	if (!b)
+		d->nbatch++;
+	spinlock_unlock (&d->req_lock);
+	if (!b)
+		b = storage_io_batch_new (d);
+	for (i = 0; i < n; i++) {
+		spinlock_lock (&d->req_lock);
+		r = LIST1_POP (d->req_free);
+		if (!r)
+			d->nreq++;
+		spinlock_unlock (&d->req_lock);
+		b->req[i] = r ? r : storage_io_req_new (d);
+	}
+	b->n = n;
+	b->remaining = n;
+	return b;
+}
+
+/* Put the batch object and its request objects back.  Large buffers
+ * are freed. */
+static void
+storage_io_batch_put (struct storage_io_batch *b)
+{
+	struct storage_io_devices *d;
+	int i;
+
+	d = b->d;
+	for (i = 0; i < b->n; i++)
+		if (b->req[i]->buf.len > STORAGE_IO_KEEPLEN)
+			storage_io_buf_free (&b->req[i]->buf);
+	spinlock_lock (&d->req_lock);
+	for (i = 0; i < b->n; i++)
+		LIST1_PUSH (d->req_free, b->req[i]);
+	LIST1_PUSH (d->batch_free, b);
+	d->nbusy -= b->n;
+	spinlock_unlock (&d->req_lock);
+}
+
+/* Complete a request: call the batch callback and put the objects
+ * back when it was the last request of the batch.  The buffers of the
+ * request objects are valid until the callback returns. */
+static void
+storage_io_req_finish (struct storage_io_req *r, int retval)
+{
+	struct storage_io_devices *d;
+	struct storage_io_batch *b;
+	bool done;
+
+	d = r->d;
+	b = r->batch;
+	r->vec->retval = retval;
+	spinlock_lock (&d->req_lock);
+	done = !--b->remaining;
+	spinlock_unlock (&d->req_lock);
+	if (done) {
+		b->callback (b->data, b->vec, b->n);
+		storage_io_batch_put (b);
+	}
+}
+
+/* Issue pending requests while the queue depth allows */
+static void
+storage_io_req_kick (struct storage_io_devices *d)
+{
+	struct storage_io_req *r;
+
+	for (;;) {
+		spinlock_lock (&d->req_lock);
+		if (d->inflight >= d->depth) {
+			spinlock_unlock (&d->req_lock);
+			break;
+		}
+		r = LIST1_POP (d->req_pending);
+		if (r)
+			d->inflight++;
+		spinlock_unlock (&d->req_lock);
+		if (!r)
+			break;
+		if (!storage_hc_dev_atacommand (d->dev, &r->cmd,
+						sizeof r->cmd)) {
+			spinlock_lock (&d->req_lock);
+			d->inflight--;
+			spinlock_unlock (&d->req_lock);
+			storage_io_req_finish (r, -1);
+		}
+	}
+}
+
+static void
+storage_io_req_sub (void *data, struct storage_hc_dev_atacmd *cmd)
+{
+	struct storage_io_req *r;
+	struct storage_io_devices *d;
+
+	r = data;
+	d = r->d;
+	spinlock_lock (&d->req_lock);
+	d->inflight--;
+	spinlock_unlock (&d->req_lock);
+	if (cmd->timeout_ready < 0 || cmd->timeout_complete < 0)
+		storage_io_req_finish (r, -1);
+	else
+		storage_io_req_finish (r, cmd->buf_len);
+	storage_io_req_kick (d);
+}
+
+/* Fill the request objects of the batch with b->vec and queue them.
+ * The buffers of the request objects are used if bufs is true. */
+static void
+storage_io_batch_submit (struct storage_io_batch *b, bool bufs)
+{
+	struct storage_io_devices *d;
+	struct storage_io_vec *vec;
+	struct storage_io_req *r;
+	int i;
+
+	d = b->d;
+	vec = b->vec;
+	for (i = 0; i < b->n; i++) {
+		r = b->req[i];
+		if (bufs)
+			storage_io_fill_cmd (d, &r->cmd, r->buf.virt,
+					     r->buf.phys, r->buf.npages ?
+					     r->buf.pages : NULL,
+					     vec[i].len, vec[i].offset,
+					     !!vec[i].write);
+		else
+			storage_io_fill_cmd (d, &r->cmd, vec[i].buf, 0, NULL,
+					     vec[i].len, vec[i].offset,
+					     !!vec[i].write);
+		r->cmd.callback = storage_io_req_sub;
+		r->cmd.data = r;
+		r->batch = b;
+		r->vec = &vec[i];
+		spinlock_lock (&d->req_lock);
+		LIST1_ADD (d->req_pending, r);
+		spinlock_unlock (&d->req_lock);
+	}
+	storage_io_req_kick (d);
+}
+
+/* Submit a batch of reads and writes to one device.  The callback is
+ * called once after all of them complete, with the retval member of
+ * each vector set to the transferred length or -1.  The vectors and
+ * the buffers must be valid until then.  Returns STORAGE_IO_EBUSY
+ * without submitting anything if the device has too many requests. */
+int
+storage_io_areadwritev (int id, int devno, struct storage_io_vec *vec,
+			int n, void (*callback) (void *data,
+						 struct storage_io_vec *vec,
+						 int n),
+			void *data)
+{
+	struct storage_io_devices *d;
+	struct storage_io_batch *b;
+	int i;
+
+	if (n <= 0 || n > STORAGE_IO_QUEUE_DEPTH)
+		return -1;
+	for (i = 0; i < n; i++)
+		if (!storage_io_check_range (vec[i].len, vec[i].offset,
+					     false))
+			return -1;
+	d = storage_io_find_device (id, devno);
+	if (!d)
+		return -1;
+	b = storage_io_batch_get (d, n);
+	if (!b)
+		return STORAGE_IO_EBUSY;
+	b->callback = callback;
+	b->data = data;
+	b->vec = vec;
+	storage_io_batch_submit (b, false);
+	return 0;
+}
+
 static void
 aget_size_callback (void *data, long long size)
 {
@@ -641,10 +1107,12 @@ areadwrite_callback (void *data, int len)
 {
 	struct storage_io_msg_areadwrite *arg;
 	struct storage_io_msg_rreadwrite *buf;
+	struct storage_io_buf *b;
 	struct msgbuf m[2];
 	int d, n = 1;
 
 	arg = data;
+	b = arg->tmpbuf;
 	buf = alloc (sizeof *buf);
 	buf->callback = arg->callback;
 	buf->data = arg->data;
@@ -652,7 +1120,7 @@ areadwrite_callback (void *data, int len)
 	buf->buf = arg->buf;
 	setmsgbuf (&m[0], buf, sizeof *buf, 0);
 	if (!arg->write) {
-		setmsgbuf (&m[1], arg->tmpbuf, arg->len, 0);
+		setmsgbuf (&m[1], b->virt, arg->len, 0);
 		n = 2;
 	}
 	d = msgopen (arg->msgname);
@@ -660,9 +1128,37 @@ areadwrite_callback (void *data, int len)
 		msgsendbuf (d, STORAGE_IO_RREADWRITE, m, n);
 	msgclose (d);
 	free (buf);
+	storage_io_buf_free (b);
+	free (b);
 	free (arg);
 }
 
+static void
+areadwritev_callback (void *data, struct storage_io_vec *vec, int n)
+{
+	struct storage_io_batch *b;
+	struct storage_io_msg_rreadwritev *buf;
+	struct msgbuf m[STORAGE_IO_MAXVEC + 2];
+	int d, i, j = 2;
+
+	b = data;
+	buf = &b->rmsg;
+	buf->callback = b->msg.callback;
+	buf->data = b->msg.data;
+	buf->vec = b->msg.vec;
+	buf->n = n;
+	setmsgbuf (&m[0], buf, sizeof *buf, 0);
+	setmsgbuf (&m[1], vec, n * sizeof *vec, 0);
+	for (i = 0; i < n; i++)
+		if (!vec[i].write)
+			setmsgbuf (&m[j++], b->req[i]->buf.virt, vec[i].len,
+				   0);
+	d = msgopen (b->msg.msgname);
+	if (d >= 0)
+		msgsendbuf (d, STORAGE_IO_RREADWRITEV, m, j);
+	msgclose (d);
+}
+
 static int
 storage_io_msghandler (int m, int c, struct msgbuf *buf, int bufcnt)
 {
@@ -715,34 +1211,116 @@ storage_io_msghandler (int m, int c, struct msgbuf *buf, int bufcnt)
 		return 0;
 	} else if (c == STORAGE_IO_AREADWRITE) {
 		struct storage_io_msg_areadwrite *arg, *a;
+		struct storage_io_devices *d;
+		struct storage_io_buf *b;
 
 		if (bufcnt != 2)
 			return -1;
 		if (buf[0].len != sizeof *arg)
 			return -1;
 		a = buf[0].base;
+		d = storage_io_find_device (a->id, a->devno);
+		if (!d || a->len <= 0 || a->len > STORAGE_IO_MAXLEN ||
+		    buf[1].len < a->len) {
+			a->retval = -1;
+			return 0;
+		}
+		/* The host controller does DMA to the temporary buffer
+		 * directly without a shadow buffer */
+		b = alloc (sizeof *b);
+		storage_io_buf_init (b);
+		if (!storage_io_buf_alloc (d, b, a->len)) {
+			storage_io_buf_free (b);
+			free (b);
+			a->retval = -1;
+			return 0;
+		}
 		arg = alloc (sizeof *arg);
 		memcpy (arg, a, sizeof *arg);
-		arg->tmpbuf = alloc (arg->len);
-		if (arg->write) {
-			memcpy (arg->tmpbuf, buf[1].base, arg->len);
-			a->retval = storage_io_awrite (arg->id, arg->devno,
-						       arg->tmpbuf, arg->len,
-						       arg->offset,
-						       areadwrite_callback,
-						       arg);
-		 } else {
-			a->retval = storage_io_aread (arg->id, arg->devno,
-						      arg->tmpbuf, arg->len,
-						      arg->offset,
-						      areadwrite_callback,
-						      arg);
-		}
+		arg->tmpbuf = b;
+		if (arg->write)
+			memcpy (b->virt, buf[1].base, arg->len);
+		a->retval = storage_io_areadwrite (arg->id, arg->devno, NULL,
+						   b, arg->len, arg->offset,
+						   !!arg->write,
+						   areadwrite_callback, arg);
 		if (a->retval < 0) {
-			free (arg->tmpbuf);
+			storage_io_buf_free (b);
+			free (b);
 			free (arg);
 		}
 		return 0;
+	} else if (c == STORAGE_IO_SET_QUEUE_DEPTH) {
+		struct storage_io_msg_set_queue_depth *arg;
+
+		if (bufcnt != 1)
+			return -1;
+		if (buf[0].len != sizeof *arg)
+			return -1;
+		arg = buf[0].base;
+		arg->retval = storage_io_set_queue_depth (arg->id, arg->devno,
+							  arg->depth);
+		return 0;
+	} else if (c == STORAGE_IO_AREADWRITEV) {
+		struct storage_io_msg_areadwritev *a;
+		struct storage_io_devices *d;
+		struct storage_io_batch *b;
+		struct storage_io_vec *vec;
+		struct storage_io_buf *tmp;
+		int i, n;
+
+		if (bufcnt < 3)
+			return -1;
+		if (buf[0].len != sizeof *a)
+			return -1;
+		a = buf[0].base;
+		n = a->n;
+		d = storage_io_find_device (a->id, a->devno);
+		if (!d || n <= 0 || n > STORAGE_IO_MAXVEC ||
+		    bufcnt != n + 2 || buf[1].len != n * sizeof *vec) {
+			a->retval = -1;
+			return 0;
+		}
+		/* Request objects and their buffers are reserved before
+		 * copying, so that a busy device costs nothing */
+		b = storage_io_batch_get (d, n);
+		if (!b) {
+			a->retval = STORAGE_IO_EBUSY;
+			return 0;
+		}
+		memcpy (&b->msg, a, sizeof *a);
+		vec = b->msgvec;
+		memcpy (vec, buf[1].base, n * sizeof *vec);
+		for (i = 0; i < n; i++) {
+			/* The buffer pointers are addresses in the
+			 * process, which are not used by the VMM and
+			 * are returned as NULL */
+			vec[i].buf = NULL;
+			if (!storage_io_check_range (vec[i].len,
+						     vec[i].offset,
+						     d->hc_sg) ||
+			    buf[i + 2].len < vec[i].len)
+				break;
+			/* the host controller does DMA to the
+			 * temporary buffers directly */
+			tmp = &b->req[i]->buf;
+			if (!storage_io_buf_alloc (d, tmp, vec[i].len))
+				break;
+			if (vec[i].write)
+				memcpy (tmp->virt, buf[i + 2].base,
+					vec[i].len);
+		}
+		if (i < n) {
+			storage_io_batch_put (b);
+			a->retval = -1;
+			return 0;
+		}
+		b->callback = areadwritev_callback;
+		b->data = b;
+		b->vec = vec;
+		storage_io_batch_submit (b, true);
+		a->retval = 0;
+		return 0;
 	} else {
 		return -1;
 	}
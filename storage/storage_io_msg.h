@@ -33,11 +33,30 @@ enum {
 	STORAGE_IO_GET_NUM_DEVICES,
 	STORAGE_IO_AGET_SIZE,
 	STORAGE_IO_AREADWRITE,
+	STORAGE_IO_SET_QUEUE_DEPTH,
+	STORAGE_IO_AREADWRITEV,
 };
 
 enum {
 	STORAGE_IO_RGET_SIZE,
 	STORAGE_IO_RREADWRITE,
+	STORAGE_IO_RREADWRITEV,
+};
+
+/* maximum number of vectors in a batch submitted by a process: two
+   message buffers are used by the arguments and the vector array */
+#define STORAGE_IO_MAXVEC	30
+
+/* returned by storage_io_areadwritev() while too many requests of the
+   device are in use; retry after a completion */
+#define STORAGE_IO_EBUSY	(-2)
+
+struct storage_io_vec {
+	void *buf;
+	int len;
+	int write;
+	long long offset;
+	int retval;		/* length or -1, set on completion */
 };
 
 struct storage_io_msg_init {
@@ -76,6 +95,24 @@ struct storage_io_msg_areadwrite {
 	void *tmpbuf;
 };
 
+struct storage_io_msg_set_queue_depth {
+	int id;
+	int devno;
+	int depth;
+	int retval;
+};
+
+struct storage_io_msg_areadwritev {
+	int id;
+	int devno;
+	int n;
+	void *callback;
+	void *data;
+	char msgname[32];
+	int retval;
+	struct storage_io_vec *vec;
+};
+
 struct storage_io_msg_rget_size {
 	void (*callback) (void *data, long long size);
 	void *data;
@@ -89,6 +126,13 @@ struct storage_io_msg_rreadwrite {
 	void *buf;
 };
 
+struct storage_io_msg_rreadwritev {
+	void (*callback) (void *data, struct storage_io_vec *vec, int n);
+	void *data;
+	struct storage_io_vec *vec;
+	int n;
+};
+
 int storage_io_init (void);
 void storage_io_deinit (int id);
 int storage_io_get_num_devices (int id);
@@ -99,3 +143,9 @@ int storage_io_aread (int id, int devno, void *buf, int len, long long offset,
 		      void (*callback) (void *data, int len), void *data);
 int storage_io_awrite (int id, int devno, void *buf, int len, long long offset,
 		       void (*callback) (void *data, int len), void *data);
+int storage_io_set_queue_depth (int id, int devno, int depth);
+int storage_io_areadwritev (int id, int devno, struct storage_io_vec *vec,
+			    int n, void (*callback) (void *data,
+						     struct storage_io_vec
+						     *vec, int n),
+			    void *data);
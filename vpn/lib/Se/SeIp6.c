@@ -1273,10 +1273,8 @@ void Se6SendEthPacket(SE_IPV6 *p, UCHAR *dest_mac, USHORT protocol, void *data,
 	// データ
 	SeCopy(buf + sizeof(SE_MAC_HEADER), data, data_size);
 
-	// 送信
-	SeVpnSendEtherPacket(p->Vpn, p->Eth, buf, sizeof(SE_MAC_HEADER) + data_size);
-
-	SeFree(buf);
+	// 送信 (buf は送信キューに渡されて送信後に解放される)
+	SeVpnSendEtherPacketNoCopy(p->Vpn, p->Eth, buf);
 }
 
 // Ethernet パケットの受信
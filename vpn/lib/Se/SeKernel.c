@@ -474,6 +474,20 @@ void SeEthSendAdd(SE_ETH *e, void *packet, UINT packet_size)
 	SeInsertQueue(e->SendQueue, SeClone(packet, packet_size));
 }
 
+// NIC の送信キューにパケットを追加 (コピーせずに所有権を移す)
+// packet は SeMalloc で確保したちょうど packet_size バイトのメモリであること
+void SeEthSendAddNoCopy(SE_ETH *e, void *packet)
+{
+	// 引数チェック
+	if (e == NULL || packet == NULL)
+	{
+		SeFree(packet);
+		return;
+	}
+
+	SeInsertQueue(e->SendQueue, packet);
+}
+
 // NIC の送信キューに溜まっているパケットを全部送信
 UINT SeEthSendAll(SE_ETH *e)
 {
@@ -118,6 +118,7 @@ void SeEthFree(SE_ETH *e);
 void SeEthNicCallback(SE_HANDLE nic_handle, UINT num_packets, void **packets, UINT *packet_sizes, void *param);
 void SeEthSend(SE_ETH *e, UINT num_packets, void **packets, UINT *packet_sizes);
 void SeEthSendAdd(SE_ETH *e, void *packet, UINT packet_size);
+void SeEthSendAddNoCopy(SE_ETH *e, void *packet);
 UINT SeEthSendAll(SE_ETH *e);
 void SeEthGetInfo(SE_ETH *e, SE_NICINFO *info);
 void SeEthDeleteOldSenderMacList(SE_ETH *e);
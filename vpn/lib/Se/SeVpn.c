@@ -480,6 +480,19 @@ void SeVpnSendEtherPacket(SE_VPN *v, SE_ETH *e, void *packet, UINT packet_size)
 	SeEthSendAdd(e, packet, packet_size);
 }
 
+// Ethernet パケットの送信 (packet の所有権を移す)
+void SeVpnSendEtherPacketNoCopy(SE_VPN *v, SE_ETH *e, void *packet)
+{
+	// 引数チェック
+	if (v == NULL || e == NULL || packet == NULL)
+	{
+		SeFree(packet);
+		return;
+	}
+
+	SeEthSendAddNoCopy(e, packet);
+}
+
 // メインプロセス内で状態が変化した場合に呼び出す関数
 void SeVpnStatusChanged(SE_VPN *v)
 {
@@ -177,6 +177,7 @@ void SeVpnMainProcess(SE_VPN *v);
 void SeVpnAddTimer(SE_VPN *v, UINT interval);
 void SeVpnStatusChanged(SE_VPN *v);
 void SeVpnSendEtherPacket(SE_VPN *v, SE_ETH *e, void *packet, UINT packet_size);
+void SeVpnSendEtherPacketNoCopy(SE_VPN *v, SE_ETH *e, void *packet);
 void *SeVpnRecvEtherPacket(SE_VPN *v, SE_ETH *e);
 void SeVpnMainProcRecvEtherPacket(SE_VPN *v, bool physical, void *packet, UINT packet_size);
 UINT64 SeVpnTick(SE_VPN *v);